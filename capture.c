@@ -0,0 +1,720 @@
+/*
+ * Compressed capture files of USB/hidraw reports.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Long captures are mostly mouse movement, null reports and polling of the
+ * same registers. A capture file is the header "LTCAP1\n\0" followed by
+ * blocks that can each be decoded on their own:
+ *
+ *   "LTCB", body length (u32 BE), record count (u32 BE),
+ *   time of the first and last record (u64 BE, us since the epoch), body
+ *
+ * Every record in the body is:
+ *
+ *   time since the previous record (us, varint)
+ *   direction (bit 7, 1 for sent) and the index of the header in the
+ *   dictionary of the block (bits 0-6). 0x7F means that the header follows:
+ *   bus (u16 BE), device address, report ID, device index, sub ID, length.
+ *   New headers are added to the dictionary until it has 127 entries.
+ *   the bytes after the header XOR-ed with those of the previous report with
+ *   the same header (zero if none), as runs: n < 0x80 is followed by n + 1
+ *   literal bytes, n >= 0x80 stands for (n & 0x7F) + 1 zero bytes.
+ *
+ * A repeated report takes three bytes. The writer keeps one block in memory
+ * and writes it when it is full or after CAPTURE_BLOCK_SECONDS.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h> /* localtime */
+
+#include "capture.h"
+
+#define DICT_MAX	127
+#define DICT_LITERAL	0x7F
+#define RECORD_ENCODED_MAX	256 // varint, header and worst-case payload
+#define CAPTURE_BLOCK_SECONDS	10
+
+struct dict_entry {
+	uint16_t busnum;
+	u8 devnum;
+	u8 head[3]; // report ID, device index, sub ID
+	u8 length;
+	u8 prev[CAPTURE_REPORT_MAX]; // payload of the previous report
+};
+
+struct capture_writer {
+	FILE *fp;
+	struct capture_block blk;
+	unsigned body_length;
+	long long unsigned last_us;
+	unsigned dict_count;
+	struct dict_entry dict[DICT_MAX];
+	u8 body[CAPTURE_BLOCK_MAX];
+};
+
+static void put_u32(u8 *p, uint32_t value) {
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static uint32_t get_u32(const u8 *p) {
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_u64(u8 *p, long long unsigned value) {
+	put_u32(p, value >> 32);
+	put_u32(p + 4, value);
+}
+
+static long long unsigned get_u64(const u8 *p) {
+	return (long long unsigned) get_u32(p) << 32 | get_u32(p + 4);
+}
+
+struct capture_writer *capture_create(const char *path) {
+	struct capture_writer *w = calloc(1, sizeof *w);
+
+	if (!w) {
+		perror("calloc");
+		return NULL;
+	}
+	w->fp = fopen(path, "wb");
+	if (!w->fp || fwrite(CAPTURE_MAGIC, CAPTURE_HEADER_LEN, 1, w->fp) != 1) {
+		perror(path);
+		if (w->fp) {
+			fclose(w->fp);
+		}
+		free(w);
+		return NULL;
+	}
+	return w;
+}
+
+static bool flush_block(struct capture_writer *w) {
+	u8 header[CAPTURE_BLOCK_HEADER_LEN];
+
+	if (!w->blk.count) {
+		return true;
+	}
+	memcpy(header, CAPTURE_BLOCK_MAGIC, 4);
+	put_u32(&header[4], w->body_length);
+	put_u32(&header[8], w->blk.count);
+	put_u64(&header[12], w->blk.first_us);
+	put_u64(&header[20], w->blk.last_us);
+	w->blk.count = 0;
+	w->dict_count = 0;
+	if (fwrite(header, sizeof header, 1, w->fp) != 1 ||
+		fwrite(w->body, w->body_length, 1, w->fp) != 1 ||
+		fflush(w->fp)) {
+		w->body_length = 0;
+		perror("capture");
+		return false;
+	}
+	w->body_length = 0;
+	return true;
+}
+
+static struct dict_entry *dict_find(struct capture_writer *w,
+	const struct dict_entry *key, unsigned *index) {
+	unsigned i;
+
+	for (i = 0; i < w->dict_count; i++) {
+		struct dict_entry *e = &w->dict[i];
+		if (e->busnum == key->busnum && e->devnum == key->devnum &&
+			!memcmp(e->head, key->head, 3) &&
+			e->length == key->length) {
+			*index = i;
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void encode_runs(struct capture_writer *w, const u8 *xor, unsigned n) {
+	u8 *out = w->body + w->body_length;
+	unsigned i = 0;
+
+	while (i < n) {
+		unsigned run = 0;
+
+		if (!xor[i]) {
+			while (i + run < n && !xor[i + run] && run < 0x80) {
+				run++;
+			}
+			*out++ = 0x80 | (run - 1);
+		} else {
+			// a single zero is cheaper inside a literal run
+			while (i + run < n && run < 0x80 && (xor[i + run] ||
+				(i + run + 1 < n && xor[i + run + 1]))) {
+				run++;
+			}
+			*out++ = run - 1;
+			memcpy(out, &xor[i], run);
+			out += run;
+		}
+		i += run;
+	}
+	w->body_length = out - w->body;
+}
+
+bool capture_add(struct capture_writer *w, const struct capture_record *rec) {
+	struct dict_entry key, *e;
+	u8 xor[CAPTURE_REPORT_MAX];
+	long long unsigned time_us = rec->time_us, delta;
+	unsigned index, n, i, length = rec->length;
+	u8 *out;
+
+	if (length > CAPTURE_REPORT_MAX) {
+		length = CAPTURE_REPORT_MAX;
+	}
+	if (w->blk.count && (w->body_length + RECORD_ENCODED_MAX >
+		CAPTURE_BLOCK_MAX || time_us > w->blk.first_us +
+		CAPTURE_BLOCK_SECONDS * 1000000ULL)) {
+		if (!flush_block(w)) {
+			return false;
+		}
+	}
+	if (time_us < w->last_us) {
+		// keep the capture ordered if the clock goes back
+		time_us = w->last_us;
+	}
+	if (!w->blk.count) {
+		w->blk.first_us = w->last_us = time_us;
+	}
+	delta = time_us - w->last_us;
+	w->last_us = w->blk.last_us = time_us;
+	w->blk.count++;
+
+	out = w->body + w->body_length;
+	do {
+		*out++ = (delta & 0x7F) | (delta > 0x7F ? 0x80 : 0);
+		delta >>= 7;
+	} while (delta);
+
+	memset(&key, 0, sizeof key);
+	key.busnum = rec->busnum;
+	key.devnum = rec->devnum;
+	memcpy(key.head, rec->data, length < 3 ? length : 3);
+	key.length = length;
+	e = dict_find(w, &key, &index);
+	if (e) {
+		*out++ = (rec->is_write ? 0x80 : 0) | index;
+	} else {
+		*out++ = (rec->is_write ? 0x80 : 0) | DICT_LITERAL;
+		*out++ = key.busnum >> 8;
+		*out++ = key.busnum;
+		*out++ = key.devnum;
+		memcpy(out, key.head, 3);
+		out += 3;
+		*out++ = key.length;
+		if (w->dict_count < DICT_MAX) {
+			e = &w->dict[w->dict_count++];
+			*e = key;
+		}
+	}
+	w->body_length = out - w->body;
+
+	n = length > 3 ? length - 3 : 0;
+	for (i = 0; i < n; i++) {
+		xor[i] = rec->data[3 + i] ^ (e ? e->prev[i] : 0);
+	}
+	if (e) {
+		memcpy(e->prev, &rec->data[3], n);
+	}
+	encode_runs(w, xor, n);
+	return true;
+}
+
+bool capture_close(struct capture_writer *w) {
+	bool ok = flush_block(w);
+
+	if (fclose(w->fp)) {
+		perror("capture");
+		ok = false;
+	}
+	free(w);
+	return ok;
+}
+
+// Whether path is a regular file that starts with the capture header.
+bool capture_is_capture(const char *path) {
+	char header[CAPTURE_HEADER_LEN];
+	struct stat st;
+	FILE *fp;
+	bool ok;
+
+	if (stat(path, &st) || !S_ISREG(st.st_mode) || !(fp = fopen(path, "rb"))) {
+		return false;
+	}
+	ok = fread(header, sizeof header, 1, fp) == 1 &&
+		!memcmp(header, CAPTURE_MAGIC, CAPTURE_HEADER_LEN);
+	fclose(fp);
+	return ok;
+}
+
+bool capture_parse_block_header(const u8 *header, struct capture_block *blk) {
+	if (memcmp(header, CAPTURE_BLOCK_MAGIC, 4)) {
+		return false;
+	}
+	blk->body_length = get_u32(&header[4]);
+	blk->count = get_u32(&header[8]);
+	blk->first_us = get_u64(&header[12]);
+	blk->last_us = get_u64(&header[20]);
+	return blk->body_length <= CAPTURE_BLOCK_MAX;
+}
+
+// Decodes the records of a block. Returns false if it is corrupt or fn
+// stopped.
+bool capture_decode_block(const struct capture_block *blk, const u8 *body,
+	capture_callback fn, void *data) {
+	struct dict_entry dict[DICT_MAX];
+	unsigned dict_count = 0, pos = 0, i;
+	const unsigned end = blk->body_length;
+	long long unsigned time_us = blk->first_us;
+
+	for (i = 0; i < blk->count; i++) {
+		struct capture_record rec;
+		struct dict_entry key, *e;
+		long long unsigned delta = 0;
+		unsigned shift = 0, n, j;
+		u8 h;
+
+		do {
+			if (pos >= end || shift > 63) {
+				return false;
+			}
+			delta |= (long long unsigned) (body[pos] & 0x7F) << shift;
+			shift += 7;
+		} while (body[pos++] & 0x80);
+		time_us += delta;
+
+		if (pos >= end) {
+			return false;
+		}
+		h = body[pos++];
+		if ((h & 0x7F) == DICT_LITERAL) {
+			if (pos + 7 > end) {
+				return false;
+			}
+			memset(&key, 0, sizeof key);
+			key.busnum = body[pos] << 8 | body[pos + 1];
+			key.devnum = body[pos + 2];
+			memcpy(key.head, &body[pos + 3], 3);
+			key.length = body[pos + 6];
+			pos += 7;
+			if (key.length > CAPTURE_REPORT_MAX) {
+				return false;
+			}
+			e = NULL;
+			if (dict_count < DICT_MAX) {
+				e = &dict[dict_count++];
+				*e = key;
+			}
+		} else if ((h & 0x7F) < dict_count) {
+			e = &dict[h & 0x7F];
+			key = *e;
+		} else {
+			return false;
+		}
+
+		rec.time_us = time_us;
+		rec.busnum = key.busnum;
+		rec.devnum = key.devnum;
+		rec.is_write = h & 0x80;
+		rec.length = key.length;
+		memcpy(rec.data, key.head, 3);
+		n = key.length > 3 ? key.length - 3 : 0;
+		for (j = 0; j < n; ) {
+			unsigned run;
+
+			if (pos >= end) {
+				return false;
+			}
+			run = (body[pos] & 0x7F) + 1;
+			if (j + run > n) {
+				return false;
+			}
+			if (body[pos++] & 0x80) {
+				memset(&rec.data[3 + j], 0, run);
+			} else {
+				if (pos + run > end) {
+					return false;
+				}
+				memcpy(&rec.data[3 + j], &body[pos], run);
+				pos += run;
+			}
+			j += run;
+		}
+		for (j = 0; j < n; j++) {
+			rec.data[3 + j] ^= e ? e->prev[j] : 0;
+		}
+		if (e) {
+			memcpy(e->prev, &rec.data[3], n);
+		}
+		if (!fn(&rec, data)) {
+			return false;
+		}
+	}
+	return pos == end;
+}
+
+// Reads all blocks of a capture from fp. A block that was cut off (the
+// recording was killed) ends the capture.
+bool capture_read(FILE *fp, capture_callback fn, void *data) {
+	static u8 body[CAPTURE_BLOCK_MAX];
+	u8 header[CAPTURE_BLOCK_HEADER_LEN];
+	struct capture_block blk;
+
+	if (fread(header, CAPTURE_HEADER_LEN, 1, fp) != 1 ||
+		memcmp(header, CAPTURE_MAGIC, CAPTURE_HEADER_LEN)) {
+		fprintf(stderr, "Not a capture file\n");
+		return false;
+	}
+	while (fread(header, sizeof header, 1, fp) == 1) {
+		if (!capture_parse_block_header(header, &blk)) {
+			fprintf(stderr, "Invalid capture block\n");
+			return false;
+		}
+		if (fread(body, blk.body_length, 1, fp) != 1) {
+			fprintf(stderr, "Capture ends in an incomplete block\n");
+			break;
+		}
+		if (!capture_decode_block(&blk, body, fn, data)) {
+			return false;
+		}
+	}
+	return !ferror(fp);
+}
+
+/* Index building, keys are bus << 24 | address << 16 | index << 8 | sub ID */
+struct index_key {
+	uint64_t key;
+	uint32_t *blocks;
+	unsigned count, alloc;
+};
+
+struct index_builder {
+	struct capture_index_block *blocks;
+	unsigned block_count, block_alloc;
+	struct index_key *table; // open addressing
+	unsigned table_size, key_count;
+	unsigned block; // being decoded
+	bool failed;
+};
+
+static uint64_t pack_key(uint16_t busnum, u8 devnum, u8 device_index,
+	u8 sub_id) {
+	return (uint64_t) busnum << 24 | devnum << 16 | device_index << 8 |
+		sub_id;
+}
+
+static struct index_key *index_slot(struct index_key *table, unsigned size,
+	uint64_t key) {
+	unsigned i = (key * 0x9E3779B1u) & (size - 1);
+
+	while (table[i].blocks && table[i].key != key) {
+		i = (i + 1) & (size - 1);
+	}
+	return &table[i];
+}
+
+static bool index_grow(struct index_builder *ib) {
+	unsigned size = ib->table_size ? 2 * ib->table_size : 256, i;
+	struct index_key *table = calloc(size, sizeof *table);
+
+	if (!table) {
+		return false;
+	}
+	for (i = 0; i < ib->table_size; i++) {
+		if (ib->table[i].blocks) {
+			*index_slot(table, size, ib->table[i].key) = ib->table[i];
+		}
+	}
+	free(ib->table);
+	ib->table = table;
+	ib->table_size = size;
+	return true;
+}
+
+static bool index_record(const struct capture_record *rec, void *data) {
+	struct index_builder *ib = data;
+	struct index_key *k;
+	uint64_t key = pack_key(rec->busnum, rec->devnum,
+		rec->length > 1 ? rec->data[1] : 0,
+		rec->length > 2 ? rec->data[2] : 0);
+
+	if (2 * (ib->key_count + 1) > ib->table_size && !index_grow(ib)) {
+		ib->failed = true;
+		return false;
+	}
+	k = index_slot(ib->table, ib->table_size, key);
+	if (!k->blocks) {
+		k->key = key;
+		k->alloc = 4;
+		k->blocks = malloc(k->alloc * sizeof *k->blocks);
+		if (!k->blocks) {
+			ib->failed = true;
+			return false;
+		}
+		ib->key_count++;
+	} else if (k->blocks[k->count - 1] == ib->block) {
+		return true;
+	} else if (k->count == k->alloc) {
+		uint32_t *blocks = realloc(k->blocks,
+			2 * k->alloc * sizeof *blocks);
+		if (!blocks) {
+			ib->failed = true;
+			return false;
+		}
+		k->blocks = blocks;
+		k->alloc *= 2;
+	}
+	k->blocks[k->count++] = ib->block;
+	return true;
+}
+
+static int compare_keys(const void *a, const void *b) {
+	const struct index_key *x = a, *y = b;
+
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+// Reads all blocks of the capture and writes the index to path.
+static bool index_build(const u8 *map, size_t size, const struct stat *st,
+	const char *path) {
+	struct index_builder ib;
+	struct capture_index_header hdr;
+	size_t pos = CAPTURE_HEADER_LEN;
+	unsigned i, n, postings = 0;
+	FILE *fp;
+	bool ok;
+
+	memset(&ib, 0, sizeof ib);
+	while (pos + CAPTURE_BLOCK_HEADER_LEN <= size && !ib.failed) {
+		struct capture_block blk;
+		struct capture_index_block *ent;
+
+		if (!capture_parse_block_header(map + pos, &blk) ||
+			pos + CAPTURE_BLOCK_HEADER_LEN + blk.body_length > size) {
+			break; // corrupt or still being written
+		}
+		if (ib.block_count == ib.block_alloc) {
+			unsigned alloc = ib.block_alloc ? 2 * ib.block_alloc : 1024;
+			ent = realloc(ib.blocks, alloc * sizeof *ent);
+			if (!ent) {
+				ib.failed = true;
+				break;
+			}
+			ib.blocks = ent;
+			ib.block_alloc = alloc;
+		}
+		ent = &ib.blocks[ib.block_count];
+		memset(ent, 0, sizeof *ent);
+		ent->offset = pos;
+		ent->first_us = blk.first_us;
+		ent->last_us = blk.last_us;
+		ent->count = blk.count;
+		ib.block = ib.block_count++;
+		if (!capture_decode_block(&blk, map + pos +
+			CAPTURE_BLOCK_HEADER_LEN, index_record, &ib)) {
+			ib.block_count--;
+			break;
+		}
+		pos += CAPTURE_BLOCK_HEADER_LEN + blk.body_length;
+	}
+
+	// keep the used slots, sorted
+	for (i = 0, n = 0; i < ib.table_size; i++) {
+		if (ib.table[i].blocks) {
+			ib.table[n++] = ib.table[i];
+			postings += ib.table[i].count;
+		}
+	}
+	qsort(ib.table, n, sizeof *ib.table, compare_keys);
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, CAPTURE_INDEX_MAGIC, sizeof hdr.magic);
+	hdr.blocks = ib.block_count;
+	hdr.keys = n;
+	hdr.postings = postings;
+	hdr.capture_size = st->st_size;
+	hdr.capture_mtime = st->st_mtime;
+	ok = !ib.failed;
+	fp = ok ? fopen(path, "wb") : NULL;
+	if (fp) {
+		uint32_t first = 0;
+
+		fwrite(&hdr, sizeof hdr, 1, fp);
+		fwrite(ib.blocks, sizeof *ib.blocks, ib.block_count, fp);
+		for (i = 0; i < n; i++) {
+			struct capture_index_key key;
+			uint64_t k = ib.table[i].key;
+
+			memset(&key, 0, sizeof key);
+			key.busnum = k >> 24;
+			key.devnum = k >> 16;
+			key.device_index = k >> 8;
+			key.sub_id = k;
+			key.first = first;
+			key.count = ib.table[i].count;
+			first += key.count;
+			fwrite(&key, sizeof key, 1, fp);
+		}
+		for (i = 0; i < n; i++) {
+			fwrite(ib.table[i].blocks, sizeof (uint32_t),
+				ib.table[i].count, fp);
+		}
+		ok = !ferror(fp);
+		ok = !fclose(fp) && ok;
+	}
+	if (!ok) {
+		perror(path);
+	}
+	for (i = 0; i < n; i++) {
+		free(ib.table[i].blocks);
+	}
+	free(ib.table);
+	free(ib.blocks);
+	return ok;
+}
+
+static bool index_map(const char *path, const struct stat *st,
+	struct capture_index *idx) {
+	const struct capture_index_header *hdr;
+	struct stat ist;
+	size_t need;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	if (fstat(fd, &ist) || (size_t) ist.st_size < sizeof *hdr) {
+		close(fd);
+		return false;
+	}
+	idx->map_size = ist.st_size;
+	idx->map = mmap(NULL, idx->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (idx->map == MAP_FAILED) {
+		idx->map = NULL;
+		return false;
+	}
+	hdr = idx->map;
+	need = sizeof *hdr + (size_t) hdr->blocks * sizeof *idx->blocks +
+		(size_t) hdr->keys * sizeof *idx->keys +
+		(size_t) hdr->postings * sizeof *idx->postings;
+	if (memcmp(hdr->magic, CAPTURE_INDEX_MAGIC, sizeof hdr->magic) ||
+		hdr->capture_size != (uint64_t) st->st_size ||
+		hdr->capture_mtime != (uint64_t) st->st_mtime ||
+		need != idx->map_size) {
+		capture_index_close(idx);
+		return false;
+	}
+	idx->hdr = hdr;
+	idx->blocks = (const void *) (hdr + 1);
+	idx->keys = (const void *) (idx->blocks + hdr->blocks);
+	idx->postings = (const void *) (idx->keys + hdr->keys);
+	return true;
+}
+
+// Maps the index of a capture, which is (re)built if it is missing or the
+// capture changed since.
+bool capture_index_open(const char *capture_path, struct capture_index *idx) {
+	char path[4096];
+	struct stat st;
+	void *map;
+	bool ok;
+	int fd;
+
+	memset(idx, 0, sizeof *idx);
+	if (snprintf(path, sizeof path, "%s.idx", capture_path) >=
+		(int) sizeof path) {
+		fprintf(stderr, "%s: name too long\n", capture_path);
+		return false;
+	}
+	fd = open(capture_path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(capture_path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+	if (index_map(path, &st, idx)) {
+		close(fd);
+		return true;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(capture_path);
+		return false;
+	}
+	ok = index_build(map, st.st_size, &st, path);
+	munmap(map, st.st_size);
+	return ok && index_map(path, &st, idx);
+}
+
+void capture_index_close(struct capture_index *idx) {
+	if (idx->map) {
+		munmap(idx->map, idx->map_size);
+	}
+	memset(idx, 0, sizeof *idx);
+}
+
+#define COLOR(c, cstr) "\033[" c "m" cstr "\033[m"
+
+void capture_fmt_record(struct fmt_buf *b, const struct capture_record *rec,
+	bool hex) {
+	static __thread time_t last_sec = -1; // per decode thread
+	static __thread struct tm tm;
+	time_t sec = rec->time_us / 1000000;
+
+	if (hex) {
+		fmt_str(b, rec->is_write ? "Type=S\n" : "Type=C\n");
+		fmt_hex_bytes(b, rec->data, rec->length);
+		fmt_char(b, '\n');
+		return;
+	}
+	if (rec->length < 3) {
+		return;
+	}
+	if (sec != last_sec) {
+		localtime_r(&sec, &tm);
+		last_sec = sec;
+	}
+	fmt_dec(b, tm.tm_hour, 2);
+	fmt_char(b, ':');
+	fmt_dec(b, tm.tm_min, 2);
+	fmt_char(b, ':');
+	fmt_dec(b, tm.tm_sec, 2);
+	fmt_char(b, '.');
+	fmt_dec(b, rec->time_us / 1000 % 1000, 3);
+	fmt_char(b, ' ');
+	fmt_str(b, rec->is_write ? COLOR("1;31", "Send\t") :
+		COLOR("1;32", "Recv\t"));
+	fmt_msg(b, (const struct report *) rec->data, rec->length);
+}
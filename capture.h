@@ -0,0 +1,110 @@
+/*
+ * Compressed capture files of USB/hidraw reports.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LTUNIFY_CAPTURE_H
+#define LTUNIFY_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "decode.h"
+
+#define CAPTURE_MAGIC		"LTCAP1\n" // with NUL, 8 bytes
+#define CAPTURE_HEADER_LEN	8
+#define CAPTURE_BLOCK_MAGIC	"LTCB"
+#define CAPTURE_BLOCK_HEADER_LEN	28
+#define CAPTURE_BLOCK_MAX	(64 * 1024) // encoded records of a block
+#define CAPTURE_REPORT_MAX	64 // longer reports are cut off
+
+struct capture_record {
+	long long unsigned time_us; // since the epoch
+	uint16_t busnum; // USB bus and device address, 0 for hidraw
+	u8 devnum;
+	bool is_write; // sent to the device (usbmon 'S' event)
+	u8 length;
+	u8 data[CAPTURE_REPORT_MAX];
+};
+
+/* Block header, followed by body_length bytes of records. */
+struct capture_block {
+	uint32_t body_length;
+	uint32_t count; // records
+	long long unsigned first_us, last_us;
+};
+
+// Invoked for every record, returning false stops reading.
+typedef bool (*capture_callback)(const struct capture_record *rec,
+	void *data);
+
+struct capture_writer;
+
+struct capture_writer *capture_create(const char *path);
+bool capture_add(struct capture_writer *w, const struct capture_record *rec);
+bool capture_close(struct capture_writer *w);
+
+bool capture_is_capture(const char *path);
+bool capture_parse_block_header(const u8 *header, struct capture_block *blk);
+bool capture_decode_block(const struct capture_block *blk, const u8 *body,
+	capture_callback fn, void *data);
+bool capture_read(FILE *fp, capture_callback fn, void *data);
+
+/*
+ * Sidecar index of a capture (file name with ".idx" appended), used through
+ * mmap. Host byte order, it is rebuilt when the capture changed.
+ */
+#define CAPTURE_INDEX_MAGIC	"LTIDX1\n"
+
+struct capture_index_header {
+	char magic[8];
+	uint32_t blocks, keys, postings, reserved;
+	uint64_t capture_size, capture_mtime;
+};
+
+// time -> offset, sorted by time
+struct capture_index_block {
+	uint64_t offset; // of the block header in the capture
+	uint64_t first_us, last_us;
+	uint32_t count, reserved;
+};
+
+// blocks with reports of a receiver, device index and sub ID, sorted by key
+struct capture_index_key {
+	uint16_t busnum;
+	u8 devnum, device_index, sub_id, reserved[3];
+	uint32_t first, count; // range of postings (block numbers)
+};
+
+struct capture_index {
+	void *map;
+	size_t map_size;
+	const struct capture_index_header *hdr;
+	const struct capture_index_block *blocks;
+	const struct capture_index_key *keys;
+	const uint32_t *postings;
+};
+
+bool capture_index_open(const char *capture_path, struct capture_index *idx);
+void capture_index_close(struct capture_index *idx);
+
+// Appends a record as read-dev-usbmon prints it (decoded, or with hex)
+void capture_fmt_record(struct fmt_buf *b, const struct capture_record *rec,
+	bool hex);
+
+#endif /* LTUNIFY_CAPTURE_H */
@@ -0,0 +1,314 @@
+/*
+ * Decoder for HID++ and DJ reports of the Logitech Unifying Receiver, shared
+ * by hidraw and read-dev-usbmon.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "decode.h"
+#include "protocol.h"
+
+bool report_type_is_hidpp(u8 report_id) {
+	return report_id == SHORT_MSG || report_id == LONG_MSG;
+}
+bool report_type_is_dj(u8 report_id) {
+	return report_id == DJ_SHORT || report_id == DJ_LONG;
+}
+
+const char * report_type_str(u8 report_id, u8 type) {
+	const char *str = NULL;
+	if (report_type_is_hidpp(report_id))
+		str = proto_report_types[type];
+	else if (report_type_is_dj(report_id))
+		str = proto_dj_report_types[type];
+	return str ? str : "";
+}
+const char * device_index_str(u8 index) {
+	const char * str = proto_device_indexes[index];
+	return str ? str : "";
+}
+const char *error_str(u8 er) {
+	const char * str = proto_hidpp10_errors[er];
+	return str ? str : "";
+}
+const char *error_str_hidpp20(u8 er) {
+	const char * str = proto_hidpp20_errors[er];
+	return str ? str : "";
+}
+const char *register_str(u8 reg) {
+	const char * str = proto_registers[reg];
+	return str ? str : "";
+}
+
+#define HEX_ROW(h) h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" \
+	h "8" h "9" h "A" h "B" h "C" h "D" h "E" h "F"
+// two hex digits for every byte value
+static const char hex_pairs[] =
+	HEX_ROW("0") HEX_ROW("1") HEX_ROW("2") HEX_ROW("3")
+	HEX_ROW("4") HEX_ROW("5") HEX_ROW("6") HEX_ROW("7")
+	HEX_ROW("8") HEX_ROW("9") HEX_ROW("A") HEX_ROW("B")
+	HEX_ROW("C") HEX_ROW("D") HEX_ROW("E") HEX_ROW("F");
+
+void fmt_init(struct fmt_buf *b, int fd, char *data, size_t size) {
+	b->fd = fd;
+	b->data = data;
+	b->size = size;
+	b->length = 0;
+}
+
+bool fmt_flush(struct fmt_buf *b) {
+	size_t done = 0;
+
+	while (b->fd >= 0 && done < b->length) {
+		ssize_t r = write(b->fd, b->data + done, b->length - done);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			b->length = 0;
+			return false;
+		}
+		done += r;
+	}
+	b->length = 0;
+	return true;
+}
+
+// Makes room for n bytes, returns how many of them fit.
+static size_t fmt_reserve(struct fmt_buf *b, size_t n) {
+	if (b->length + n > b->size && b->fd >= 0) {
+		fmt_flush(b);
+	}
+	return b->length + n > b->size ? b->size - b->length : n;
+}
+
+void fmt_mem(struct fmt_buf *b, const char *str, size_t n) {
+	n = fmt_reserve(b, n);
+	memcpy(b->data + b->length, str, n);
+	b->length += n;
+}
+
+void fmt_str(struct fmt_buf *b, const char *str) {
+	fmt_mem(b, str, strlen(str));
+}
+
+void fmt_char(struct fmt_buf *b, char c) {
+	fmt_mem(b, &c, 1);
+}
+
+// Left-aligned str, padded with spaces to width (like "%-*s").
+void fmt_field(struct fmt_buf *b, const char *str, unsigned width) {
+	size_t n = strlen(str);
+
+	fmt_mem(b, str, n);
+	for (; n < width; n++) {
+		fmt_char(b, ' ');
+	}
+}
+
+void fmt_hex(struct fmt_buf *b, u8 value) {
+	fmt_mem(b, &hex_pairs[value * 2], 2);
+}
+
+// Without a leading zero (like "%X").
+static void fmt_hex_short(struct fmt_buf *b, u8 value) {
+	if (value < 0x10) {
+		fmt_char(b, hex_pairs[value * 2 + 1]);
+	} else {
+		fmt_hex(b, value);
+	}
+}
+
+// Bytes separated by spaces.
+void fmt_hex_bytes(struct fmt_buf *b, const u8 *data, size_t length) {
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		if (i) {
+			fmt_char(b, ' ');
+		}
+		fmt_hex(b, data[i]);
+	}
+}
+
+// Decimal number, zero-padded to width.
+void fmt_dec(struct fmt_buf *b, long long unsigned n, unsigned width) {
+	char digits[20];
+	unsigned i = sizeof digits;
+
+	do {
+		digits[--i] = '0' + n % 10;
+		n /= 10;
+	} while (n && i);
+	while (sizeof digits - i < width && i) {
+		digits[--i] = '0';
+	}
+	fmt_mem(b, &digits[i], sizeof digits - i);
+}
+
+static void fmt_msg_payload(struct fmt_buf *b, const struct report *r,
+	u8 data_len) {
+	u8 pos, i;
+	const u8 *bytes = (const u8 *) &r->s;
+
+	pos = 0; // nothing has been processed
+
+	if (report_type_is_hidpp(r->report_id))
+	switch (r->sub_id) {
+	case 0x00: // assume HID++ 2.0 request/response for feature IRoot
+		if (data_len == 4 || data_len == 17) {
+			fmt_str(b, "func=");
+			fmt_hex_short(b, bytes[0] >> 4);
+			fmt_str(b, "  swId=");
+			fmt_hex_short(b, bytes[0] & 0xF);
+			fmt_str(b, "  ");
+			pos = 1;
+		}
+		break;
+	case 0xFF: // assume HID++ 2.0 error
+		if (data_len == 17) {
+			fmt_str(b, "feat=");
+			fmt_hex_short(b, bytes[0]);
+			fmt_str(b, "  func=");
+			fmt_hex_short(b, bytes[1] >> 4);
+			fmt_str(b, "  swId=");
+			fmt_hex_short(b, bytes[1] & 0xF);
+			fmt_str(b, "  err=");
+			fmt_hex(b, bytes[2]);
+			fmt_char(b, ' ');
+			fmt_str(b, error_str_hidpp20(bytes[2]));
+			fmt_str(b, "  ");
+			pos = 3;
+		}
+		break;
+	case 0x8F: // error
+		// TODO: length check
+		fmt_str(b, "SubID=");
+		fmt_hex(b, bytes[0]);
+		fmt_char(b, ' ');
+		fmt_str(b, report_type_str(r->report_id, bytes[0]));
+		fmt_str(b, "  reg=");
+		fmt_hex(b, bytes[1]);
+		fmt_char(b, ' ');
+		fmt_str(b, register_str(bytes[1]));
+		fmt_str(b, "  err=");
+		fmt_hex(b, bytes[2]);
+		fmt_char(b, ' ');
+		fmt_str(b, error_str(bytes[2]));
+		fmt_str(b, "  ");
+		pos = 4; // everything is processed
+		break;
+	case 0x80:
+	case 0x81:
+	case 0x82: /* long */
+	case 0x83: /* long */
+		fmt_str(b, "reg=");
+		fmt_hex(b, bytes[0]);
+		fmt_char(b, ' ');
+		fmt_str(b, register_str(bytes[0]));
+		fmt_str(b, "  ");
+		pos = 1;
+		break;
+	}
+
+	if (pos < data_len) {
+		fmt_str(b, "params=");
+	}
+	for (i = 0; pos < data_len; pos++, i++) {
+		fmt_hex(b, bytes[pos]);
+		fmt_char(b, ' ');
+		if (i % 4 == 3 && pos + 1 < data_len) {
+			fmt_char(b, ' ');
+		}
+	}
+}
+
+void fmt_msg(struct fmt_buf *b, const struct report *report, ssize_t size) {
+	const char * report_type;
+
+	switch (report->report_id) {
+	case SHORT_MSG:
+		report_type = "short";
+		if (size != SHORT_MSG_LEN) {
+			fprintf(stderr, "Invalid short msg len %zi\n", size);
+			return;
+		}
+		break;
+	case LONG_MSG:
+		report_type = "long";
+		if (size != LONG_MSG_LEN) {
+			fprintf(stderr, "Invalid long msg len %zi\n", size);
+			return;
+		}
+		break;
+	case DJ_SHORT:
+		report_type = "dj_s";
+		if (size != DJ_SHORT_LEN) {
+			fprintf(stderr, "Invalid DJ short msg len %zi\n", size);
+			return;
+		}
+		break;
+	case DJ_LONG:
+		report_type = "dj_l";
+		if (size != DJ_LONG_LEN) {
+			fprintf(stderr, "Invalid DJ long msg len %zi\n", size);
+			return;
+		}
+		break;
+	default:
+		report_type = "unkn";
+		//fprintf(stderr, "Unknown report ID %02x, len=%zi\n", report->report_id, size);
+		if (size < 3) {
+			return;
+		}
+		break;
+	}
+
+	fmt_str(b, "report_id=");
+	fmt_hex(b, report->report_id);
+	fmt_char(b, ' ');
+	fmt_field(b, report_type, 5);
+	fmt_char(b, ' ');
+	fmt_str(b, "device=");
+	fmt_hex(b, report->device_index);
+	fmt_char(b, ' ');
+	fmt_field(b, device_index_str(report->device_index), 4);
+	fmt_char(b, ' ');
+	fmt_str(b, "type=");
+	fmt_hex(b, report->sub_id);
+	fmt_char(b, ' ');
+	fmt_field(b, report_type_str(report->report_id, report->sub_id), 23);
+	fmt_char(b, ' ');
+
+	if (size > 3) {
+		fmt_msg_payload(b, report, size - 3);
+	}
+	fmt_char(b, '\n');
+}
+
+void process_msg(struct report *report, ssize_t size) {
+	char line[FMT_LINE_MAX];
+	struct fmt_buf b;
+
+	fmt_init(&b, -1, line, sizeof line);
+	fmt_msg(&b, report, size);
+	fwrite(line, 1, b.length, stdout);
+}
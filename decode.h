@@ -0,0 +1,92 @@
+/*
+ * Decoder for HID++ and DJ reports of the Logitech Unifying Receiver.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LTUNIFY_DECODE_H
+#define LTUNIFY_DECODE_H
+
+#include <stdbool.h>
+#include <sys/types.h> /* ssize_t */
+
+typedef unsigned char u8;
+
+#define SHORT_MSG	0x10
+#define SHORT_MSG_LEN	7
+#define DJ_SHORT	0x20
+#define DJ_SHORT_LEN	15
+#define DJ_LONG		0x21
+#define DJ_LONG_LEN	32
+#define LONG_MSG	0x11
+#define LONG_MSG_LEN	20
+
+struct payload_short {
+	u8 address;
+	u8 value[3];
+};
+struct payload_long {
+	u8 address;
+	u8 str[16];
+};
+struct report {
+	u8 report_id;
+	u8 device_index;
+	u8 sub_id;
+	union {
+		struct payload_long l;
+		struct payload_short s;
+	};
+} __attribute__((__packed__));
+
+bool report_type_is_hidpp(u8 report_id);
+bool report_type_is_dj(u8 report_id);
+const char * report_type_str(u8 report_id, u8 type);
+const char * device_index_str(u8 index);
+const char *error_str(u8 er);
+const char *error_str_hidpp20(u8 er);
+const char *register_str(u8 reg);
+
+#define FMT_LINE_MAX	512 // longest line of fmt_msg
+
+/*
+ * Output buffer for the formatters below, which use lookup tables instead of
+ * stdio and are safe in signal handlers. If fd is not negative, the buffer is
+ * written to it once it is full and by fmt_flush, otherwise output that does
+ * not fit is cut off.
+ */
+struct fmt_buf {
+	int fd;
+	char *data;
+	size_t size, length;
+};
+
+void fmt_init(struct fmt_buf *b, int fd, char *data, size_t size);
+bool fmt_flush(struct fmt_buf *b);
+void fmt_mem(struct fmt_buf *b, const char *str, size_t n);
+void fmt_str(struct fmt_buf *b, const char *str);
+void fmt_char(struct fmt_buf *b, char c);
+void fmt_field(struct fmt_buf *b, const char *str, unsigned width);
+void fmt_hex(struct fmt_buf *b, u8 value);
+void fmt_hex_bytes(struct fmt_buf *b, const u8 *data, size_t length);
+void fmt_dec(struct fmt_buf *b, long long unsigned n, unsigned width);
+// Appends the decoded report as a single line
+void fmt_msg(struct fmt_buf *b, const struct report *report, ssize_t size);
+
+// Prints the decoded report on a single line to stdout
+void process_msg(struct report *report, ssize_t size);
+
+#endif /* LTUNIFY_DECODE_H */
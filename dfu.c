@@ -0,0 +1,327 @@
+/*
+ * Firmware transfer engine for the HID++ 2.0 DFU feature of libltunify.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * DFU (0x00D0) functions:
+ *
+ *   0..3 dfuCmdData0..3(data[16]) -> packet (u32), status
+ *   4    dfuStart(entity, size (u32), crc32 (u32)) -> packet (u32), status
+ *   5    restart(entity)
+ *
+ * Packet n of the image is sent with function n % 4, so up to four packets can
+ * be in flight and the device can detect lost packets. Every packet is
+ * acknowledged with its number and a status (see dfu_status in protocol.def).
+ * "wait for event" means that the packet was accepted but the device is busy
+ * (e.g. erasing flash). It rejects further packets with "command in progress"
+ * until it sends an event (swId 0) with the packet number and final status.
+ * Rejections carry the number of the packet the device expects next, sending
+ * continues from there. The last packet is answered with "DFU
+ * success" if the image matches the CRC-32 from dfuStart.
+ *
+ * The dfuStart parameters above are only those of the simulator (simulate.c).
+ * Real devices start with entity, encrypt and magic parameters and expect the
+ * image to carry its own header, which is not implemented, so ltunify refuses
+ * to run a transfer against real receivers.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "internal.h"
+#include "protocol.h"
+
+#define DFU_FUNC_START		4
+#define DFU_FUNC_RESTART	5
+// time to wait for the event after "wait for event"
+#define DFU_EVENT_TIMEOUT	5000
+
+const char *lt_dfu_status_str(u8 status) {
+	const char *str = proto_dfu_status[status];
+	return str ? str : "unknown";
+}
+
+// CRC-32 (IEEE 802.3) of the image, sent with dfuStart
+uint32_t lt_dfu_crc32(const u8 *data, size_t length) {
+	uint32_t crc = 0xFFFFFFFF;
+	size_t i;
+	int bit;
+
+	for (i = 0; i < length; i++) {
+		crc ^= data[i];
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+static uint32_t get_u32(const u8 *p) {
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_u32(u8 *p, uint32_t value) {
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static void finish(struct lt_dfu *dfu, bool failed) {
+	if (dfu->finished) {
+		return;
+	}
+	dfu->finished = true;
+	dfu->failed = failed;
+	dfu->end_time = get_timestamp_ms();
+	if (dfu->done) {
+		dfu->done(dfu, dfu->done_data);
+	}
+}
+
+static void fail(struct lt_dfu *dfu, u8 status, const char *reason) {
+	dfu->status = status;
+	DPRINTF(dfu->rcv, "DFU of %#04x failed at packet %u: %s\n",
+		dfu->device_index, dfu->acked, reason);
+	finish(dfu, true);
+}
+
+static void restart_done(struct lt_receiver *rcv, struct lt_request *req,
+	void *data) {
+	struct lt_dfu *dfu = data;
+
+	(void) rcv;
+	(void) req;
+	// the device may reboot before it answers
+	finish(dfu, false);
+}
+
+static void data_done(struct lt_receiver *rcv, struct lt_request *req,
+	void *data);
+
+// Sends packets while the window and the device allow it.
+static void send_packets(struct lt_dfu *dfu) {
+	if (dfu->draining) {
+		// packets sent during the wait may still be rejected
+		if (dfu->in_flight) {
+			return;
+		}
+		dfu->draining = false;
+	}
+	while (!dfu->finished && !dfu->waiting &&
+		dfu->in_flight < dfu->window && dfu->sent < dfu->packets) {
+		unsigned packet = dfu->sent;
+		unsigned slot = packet % DFU_WINDOW_MAX;
+		struct lt_request *req = &dfu->reqs[slot];
+		struct hidpp2_message *msg;
+
+		if (dfu->queued[slot]) {
+			// a rejected packet is still waiting for its response
+			break;
+		}
+		dfu->sent++;
+		msg = hidpp20_init_req(req, dfu->device_index,
+			dfu->feature_index, packet % 4); // dfuCmdDataN
+		msg->report_id = LONG_MESSAGE;
+		memcpy(msg->params, dfu->image + packet * DFU_PACKET_SIZE,
+			DFU_PACKET_SIZE);
+		dfu->req_packet[slot] = packet;
+		dfu->queued[slot] = true;
+		dfu->in_flight++;
+		lt_submit(dfu->rcv, req, DFU_PACKET_TIMEOUT, data_done, dfu);
+	}
+}
+
+// Handles the status of a packet from a response or an event.
+static void packet_status(struct lt_dfu *dfu, unsigned packet, u8 status) {
+	dfu->status = status;
+	switch (status) {
+	case DFU_STATUS_PACKET_SUCCESS:
+	case DFU_STATUS_SUCCESS:
+		if (packet != dfu->acked) {
+			fail(dfu, status, "acknowledgement out of order");
+			return;
+		}
+		dfu->acked++;
+		if (dfu->acked == dfu->packets) {
+			if (status != DFU_STATUS_SUCCESS) {
+				fail(dfu, status, "image was not accepted");
+				return;
+			}
+			hidpp20_init_req(&dfu->restart_req, dfu->device_index,
+				dfu->feature_index, DFU_FUNC_RESTART);
+			lt_submit(dfu->rcv, &dfu->restart_req, 1000,
+				restart_done, dfu);
+			return;
+		}
+		break;
+	case DFU_STATUS_WAIT:
+		if (packet != dfu->acked) {
+			fail(dfu, status, "acknowledgement out of order");
+			return;
+		}
+		dfu->waiting = dfu->draining = true;
+		dfu->wait_deadline = get_timestamp_ms() + DFU_EVENT_TIMEOUT;
+		dfu->waits++;
+		return;
+	case DFU_STATUS_BUSY:
+		// not accepted, send it again after the event
+		if (packet >= dfu->acked && packet < dfu->sent) {
+			dfu->retransmits += dfu->sent - packet;
+			dfu->sent = packet;
+		}
+		break;
+	default:
+		fail(dfu, status, lt_dfu_status_str(status));
+		return;
+	}
+	send_packets(dfu);
+}
+
+static void data_done(struct lt_receiver *rcv, struct lt_request *req,
+	void *data) {
+	struct lt_dfu *dfu = data;
+	struct hidpp2_message *msg = REQ_MSG20(req);
+	unsigned slot = req - dfu->reqs;
+	unsigned packet = dfu->req_packet[slot];
+
+	(void) rcv;
+	dfu->queued[slot] = false;
+	dfu->in_flight--;
+	if (dfu->finished) {
+		return;
+	}
+	if (!req->done) {
+		fail(dfu, 0, "no response");
+	} else if (req->error_type) {
+		fail(dfu, 0, req->error_type == SUB_ERROR_MSG ?
+			hidpp10_error_str(req->error_code) :
+			hidpp20_error_str(req->error_code));
+	} else if (msg->params[4] == DFU_STATUS_BUSY) {
+		// carries the number of the packet the device expects next
+		packet_status(dfu, get_u32(msg->params), DFU_STATUS_BUSY);
+	} else if (get_u32(msg->params) != packet) {
+		fail(dfu, msg->params[4], "unexpected packet number");
+	} else {
+		packet_status(dfu, packet, msg->params[4]);
+	}
+}
+
+static void start_done(struct lt_receiver *rcv, struct lt_request *req,
+	void *data) {
+	struct lt_dfu *dfu = data;
+	u8 status = REQ_MSG20(req)->params[4];
+
+	(void) rcv;
+	if (!req->done) {
+		fail(dfu, 0, "no response to dfuStart");
+	} else if (req->error_type) {
+		fail(dfu, 0, hidpp20_error_str(req->error_code));
+	} else if (status != DFU_STATUS_PACKET_SUCCESS) {
+		fail(dfu, status, lt_dfu_status_str(status));
+	} else {
+		send_packets(dfu);
+	}
+}
+
+// Starts the transfer of image (size bytes, a multiple of DFU_PACKET_SIZE) to
+// a device. The caller sets rcv, device_index, image, size and optionally
+// window (default DFU_WINDOW_MAX) and done. Once the transfer finished (see
+// dfu->failed), done is called. Events must be passed to
+// lt_dfu_process_notification.
+bool lt_dfu_start(struct lt_dfu *dfu) {
+	static const uint16_t featureId = FID_DFU;
+	struct hidpp2_message *msg;
+
+	if (!dfu->size || dfu->size % DFU_PACKET_SIZE) {
+		fprintf(stderr, "Image size must be a multiple of %u bytes\n",
+			DFU_PACKET_SIZE);
+		return false;
+	}
+	if (!dfu->window || dfu->window > DFU_WINDOW_MAX) {
+		dfu->window = DFU_WINDOW_MAX;
+	}
+	dfu->packets = dfu->size / DFU_PACKET_SIZE;
+	dfu->sent = dfu->acked = dfu->in_flight = 0;
+	dfu->retransmits = dfu->waits = 0;
+	dfu->waiting = dfu->finished = dfu->failed = false;
+	dfu->draining = false;
+	memset(dfu->queued, 0, sizeof dfu->queued);
+	dfu->status = 0;
+	dfu->start_time = get_timestamp_ms();
+
+	if (!hidpp20_resolve_features(dfu->rcv, dfu->device_index, &featureId, 1)) {
+		return false;
+	}
+	dfu->feature_index = hidpp20_feature_index(dfu->rcv, dfu->device_index,
+		FID_DFU);
+	if (!dfu->feature_index) {
+		fprintf(stderr, "Device %#04x does not support DFU\n",
+			dfu->device_index);
+		return false;
+	}
+
+	msg = hidpp20_init_req(&dfu->start_req, dfu->device_index,
+		dfu->feature_index, DFU_FUNC_START);
+	msg->report_id = LONG_MESSAGE;
+	msg->params[0] = 0; // entity: main application
+	put_u32(&msg->params[1], dfu->size);
+	put_u32(&msg->params[5], lt_dfu_crc32(dfu->image, dfu->size));
+	return lt_submit(dfu->rcv, &dfu->start_req, DFU_PACKET_TIMEOUT,
+		start_done, dfu);
+}
+
+// Handles the event that ends "wait for event". Returns true if the report
+// belonged to this transfer.
+bool lt_dfu_process_notification(struct lt_dfu *dfu, struct hidpp_message *msg) {
+	struct hidpp2_message *msg20 = (struct hidpp2_message *) msg;
+
+	if (msg->report_id != LONG_MESSAGE ||
+		msg->device_index != dfu->device_index ||
+		msg20->feature_index != dfu->feature_index ||
+		(msg20->func_swId & 0x0F) != 0) {
+		return false;
+	}
+	if (dfu->finished || !dfu->waiting) {
+		return true;
+	}
+	if (get_u32(msg20->params) != dfu->acked) {
+		fail(dfu, msg20->params[4], "event for unexpected packet");
+		return true;
+	}
+	dfu->waiting = false;
+	packet_status(dfu, dfu->acked, msg20->params[4]);
+	return true;
+}
+
+// Stops sending packets, e.g. when interrupted. The device is left in DFU mode.
+void lt_dfu_cancel(struct lt_dfu *dfu) {
+	if (!dfu->finished) {
+		fail(dfu, 0, "cancelled");
+	}
+}
+
+// Fails the transfer if the device did not send the awaited event in time.
+void lt_dfu_expire(struct lt_dfu *dfu) {
+	if (!dfu->finished && dfu->waiting &&
+		get_timestamp_ms() >= dfu->wait_deadline) {
+		fail(dfu, DFU_STATUS_WAIT, "no event after wait");
+	}
+}
@@ -0,0 +1,161 @@
+#!/usr/bin/awk -f
+# Generates the lookup tables of protocol.def as C source (protocol-tables.c).
+# Dense tables become arrays indexed by the code, hashed tables get a
+# collision-free multiplicative hash: (uint32_t) (code * mult) >> (32 - bits)
+# for a table of 2^bits entries.
+#
+# Usage: awk -f gen-tables.awk protocol.def > protocol-tables.c
+
+function hex(s,    i, n, c) {
+	n = 0;
+	s = toupper(s);
+	for (i = 1; i <= length(s); i++) {
+		c = index("0123456789ABCDEF", substr(s, i, 1));
+		if (!c) {
+			error("invalid hex number " s);
+		}
+		n = n * 16 + c - 1;
+	}
+	return n;
+}
+
+function error(msg) {
+	printf("%s:%d: %s\n", FILENAME, FNR, msg) > "/dev/stderr";
+	failed = 1;
+	exit 1;
+}
+
+function cstr(s) {
+	gsub(/\\/, "\\\\", s);
+	gsub(/"/, "\\\"", s);
+	return "\"" s "\"";
+}
+
+function end_table() {
+	if (mode == "table") {
+		print "};\n";
+	} else if (mode == "hash") {
+		emit_hash();
+	}
+	mode = "";
+}
+
+function emit_hash(    bits, size, mult, tries, i, h, used, ok) {
+	bits = 1;
+	while (2 ^ bits < 2 * nkeys) {
+		bits++;
+	}
+	# start at the golden ratio, try more slots if no multiplier fits
+	for (ok = 0; !ok && bits <= 16; ) {
+		size = 2 ^ bits;
+		mult = 2654435769;
+		for (tries = 0; tries < 100000; tries++) {
+			split("", used);
+			ok = 1;
+			for (i = 0; i < nkeys; i++) {
+				h = int((keys[i] * mult) % 4294967296 / 2 ^ (32 - bits));
+				if (h in used) {
+					ok = 0;
+					break;
+				}
+				used[h] = i;
+			}
+			if (ok) {
+				break;
+			}
+			mult += 2;
+		}
+		if (!ok) {
+			bits++;
+		}
+	}
+	if (!ok) {
+		error("no perfect hash found for " name);
+	}
+
+	printf("#define %s_SIZE\t%d\n", toupper(name), size);
+	printf("#define %s_MULT\t%.0fu\n", toupper(name), mult);
+	printf("#define %s_BITS\t%d\n", toupper(name), bits);
+	printf("static const uint16_t %s_keys[%s_SIZE] = {\n", name, toupper(name));
+	for (h = 0; h < size; h++) {
+		if (h in used) {
+			printf("\t[%d] = 0x%04X,\n", h, keys[used[h]]);
+		}
+	}
+	print "};";
+	printf("static const char *const %s_names[%s_SIZE] = {\n", name, toupper(name));
+	for (h = 0; h < size; h++) {
+		if (h in used) {
+			printf("\t[%d] = %s,\n", h, cstr(names[used[h]]));
+		}
+	}
+	print "};";
+	printf("const char *proto_%s(uint16_t code) {\n", name);
+	printf("\tunsigned h = (uint32_t) (code * %s_MULT) >> (32 - %s_BITS);\n",
+		toupper(name), toupper(name));
+	# empty slots have key 0 and no name
+	printf("\treturn %s_keys[h] == code ? %s_names[h] : NULL;\n", name, name);
+	print "}\n";
+}
+
+BEGIN {
+	print "/* Generated from protocol.def by gen-tables.awk, do not edit. */\n";
+	print "#include <stddef.h>";
+	print "#include <stdint.h>";
+	print "#include \"protocol.h\"\n";
+}
+
+/^[ \t]*(#|$)/ {
+	next;
+}
+
+$1 == "table" {
+	end_table();
+	if (NF != 3) {
+		error("expected: table NAME SIZE");
+	}
+	mode = "table";
+	name = $2;
+	size = $3 ~ /^0[xX]/ ? hex(substr($3, 3)) : $3 + 0;
+	printf("const char *const proto_%s[%s] = {\n", name, $3);
+	next;
+}
+
+$1 == "hash" {
+	end_table();
+	if (NF != 2) {
+		error("expected: hash NAME");
+	}
+	mode = "hash";
+	name = $2;
+	nkeys = 0;
+	split("", keys);
+	split("", names);
+	next;
+}
+
+{
+	code = hex($1);
+	text = $0;
+	sub(/^[ \t]*[^ \t]+[ \t]+/, "", text);
+	if (mode == "table") {
+		if (code >= size) {
+			error("code " $1 " exceeds size of " name);
+		}
+		printf("\t[0x%02X] = %s,\n", code, cstr(text));
+	} else if (mode == "hash") {
+		if (code > 65535) {
+			error("code " $1 " does not fit in 16 bits");
+		}
+		keys[nkeys] = code;
+		names[nkeys++] = text;
+	} else {
+		error("entry outside of a table");
+	}
+}
+
+END {
+	if (!failed) {
+		end_table();
+	}
+}
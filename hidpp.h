@@ -0,0 +1,585 @@
+/*
+ * libltunify - HID++ protocol library for the Logitech® Unifying receiver.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * All state is kept in a struct lt_receiver, one for every receiver. Requests
+ * are asynchronous: lt_submit() queues a request and the completion callback
+ * is invoked from lt_process_events() when the response arrives. Callers with
+ * an event loop poll lt_receiver_fd() for POLLIN and call lt_process_events()
+ * when it is readable or when lt_next_timeout() expires. The blocking helpers
+ * (get_short_register, hidpp20_call, ...) are built on top of this and run the event
+ * loop of a single receiver until their request completes.
+ */
+
+#ifndef LTUNIFY_HIDPP_H
+#define LTUNIFY_HIDPP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define ARRAY_SIZE(a) (sizeof (a) / sizeof *(a))
+
+typedef unsigned char u8;
+
+#define VID_LOGITECH		0x046d
+#define PID_NANO_RECEIVER	0xc52f
+
+#define HEADER_SIZE		3
+#define SHORT_MESSAGE           0x10
+#define SHORT_MESSAGE_LEN       7
+#define LONG_MESSAGE            0x11
+#define LONG_MESSAGE_LEN        20
+
+#define DEVICE_RECEIVER         0xFF
+
+#define SUB_SET_REGISTER        0x80
+#define SUB_GET_REGISTER        0x81
+#define SUB_SET_LONG_REGISTER   0x82
+#define SUB_GET_LONG_REGISTER   0x83
+#define SUB_ERROR_MSG           0x8F
+#define HIDPP20_ERROR_MSG       0xFF
+
+#define NOTIF_DEV_DISCONNECT	0x40 /* Device Disconnection */
+#define NOTIF_DEV_CONNECT	0x41 /* Device Connection */
+#define NOTIF_RECV_LOCK_CHANGE	0x4A /* Unifying Receiver Locking Change information */
+
+#define REG_ENABLED_NOTIFS      0x00
+#define REG_CONNECTION_STATE    0x02
+#define REG_BATTERY             0x07 /* undocumented, see registers.txt */
+#define REG_FN_KEY_SWAP         0x09 /* undocumented */
+#define REG_ILLUMINATION        0x17 /* undocumented */
+/* Device Connection and Disconnection (Pairing) */
+#define REG_DEVICE_PAIRING      0xB2
+#define REG_DEVICE_ACTIVITY     0xB3
+#define REG_PAIRING_INFO        0xB5
+#define REG_VERSION_INFO	0xF1 /* undocumented */
+
+// Used for: {GET,SET}_REGISTER_{REQ,RSP}, SET_LONG_REGISTER_RSP, GET_LONG_REGISTER_REQ
+struct msg_short {
+        u8 address;
+        u8 value[3];
+};
+// Used for: SET_LONG_REGISTER_REQ, GET_LONG_REGISTER_RSP
+struct msg_long {
+        u8 address;
+        u8 str[16];
+};
+// Used for: ERROR_MSG
+struct msg_error {
+        u8 sub_id;
+        u8 address;
+        u8 error_code;
+        u8 padding; /* set to 0 */
+};
+
+// 0x00 Enable HID++ Notifications
+struct msg_enable_notifs {
+	u8 reporting_flags_devices; // bit 4 Battery status
+	u8 reporting_flags_receiver; // bit 0 Wireless notifications, 3 Software Present
+	u8 reporting_flags_receiver2; // (reserved)
+};
+
+// long receiver resp - 0xB5 Pairing information, 0x03 - "Receiver information"? (undocumented)
+struct msg_receiver_info {
+	u8 _dunno1; // always 0x03 for receiver?
+	u8 serial_number[4];
+	u8 _dunno2; // 06 - Max Device Capability? (not sure, but it is six)
+	u8 _dunno3;
+	u8 padding[8]; // 00 00 00 00  00 00 00 00 - ??
+};
+
+// 0xB5 Pairing information, 0x20..0x2F - Unifying Device pairing information
+struct msg_dev_pair_info {
+	u8 requested_field; // 0x20..0x25
+	u8 dest_id;
+	u8 report_interval; // ms
+	u8 pid_msb;
+	u8 pid_lsb;
+	u8 _reserved1[2];
+	u8 device_type;
+	u8 _reserved2[6];
+};
+// 0xB5 Pairing information, 0x30..0x3F - Unifying Device extended pairing info
+struct msg_dev_ext_pair_info {
+	u8 requested_field; // 0x30..0x35
+	u8 serial_number[4]; // index 0 is MSB
+	u8 report_types[4]; // index 0 is MSB
+	u8 usability_info; // bits 0..3 is location of power switch
+};
+// 0xB5 Pairing information, 0x40..0x4F - Unifying Device name
+#define DEVICE_NAME_MAXLEN 14
+struct msg_dev_name {
+	u8 requested_field; // 0x40..0x45
+	u8 length;
+	char str[DEVICE_NAME_MAXLEN]; // UTF-8 encoding
+};
+
+struct notif_devcon {
+#define DEVCON_PROT_UNIFYING	0x04
+	u8 prot_type; // bits 0..2 is protocol type (4 for unifying), 3..7 is reserved
+#define DEVCON_DEV_TYPE_MASK	0x0f
+// Link status: 0 is established (in range), 1 is not established (out of range)
+#define DEVCON_LINK_STATUS_FLAG	0x40
+	u8 device_info;
+	// wireless product id:
+	u8 pid_lsb;
+	u8 pid_msb;
+};
+
+// Register 0x02 Connection State
+struct val_reg_connection_state {
+// 0x02 triggers a 0x41 notification for all known devices
+#define CONSTATE_ACTION_LIST_DEVICES	0x02
+	u8 action; // always 0 for read
+	u8 connected_devices_count;
+	u8 _undocumented2;
+};
+
+// Register 0xB2 Device Connection and Disconnection (Pairing)
+struct val_reg_devpair {
+#define DEVPAIR_KEEP_LOCK	0
+#define DEVPAIR_OPEN_LOCK	1
+#define DEVPAIR_CLOSE_LOCK	2
+#define DEVPAIR_DISCONNECT	3
+	u8 action;
+	u8 device_number; // same as device index from 0x41 notif
+	u8 open_lock_timeout; // timeout in seconds, 0 = default (30s)
+};
+
+// Long register 0xB3 Device Activity, the number of reports received from each
+// device. The counters wrap around.
+struct val_reg_activity {
+	u8 counters[6]; // index 0 is device 1
+	u8 _reserved[10];
+};
+
+// Register 0xF1 Version Info (undocumented)
+struct val_reg_version {
+// v1.v2.xxx
+#define VERSION_FIRMWARE	1
+// x.x.v1v2
+#define VERSION_FW_BUILD	2
+// value 3 is invalid for receiver, but returns 00 07 for keyboard
+// BL.v1.v2
+#define VERSION_BOOTLOADER	4
+	u8 select_field;
+	u8 v1;
+	u8 v2;
+};
+
+struct hidpp_message {
+        u8 report_id;
+        u8 device_index;
+        u8 sub_id;
+        union {
+                struct msg_short msg_short;
+                struct msg_long msg_long;
+                struct msg_error msg_error;
+        };
+};
+
+struct hidpp2_message {
+	u8 report_id;
+	u8 device_index;
+	u8 feature_index;
+#define HIDPP_SET_FUNC(msg, func) ((msg)->func_swId |= ((func) << 4))
+	u8 func_swId;
+	u8 params[16]; // 3 or 16 params
+} __attribute__((__packed__));
+
+struct hidpp_version {
+	u8 major;
+	u8 minor;
+};
+// devices speaking HID++ 2.0 or newer (e.g. 4.1) use the feature-based protocol
+#define HIDPP_VERSION_IS_20(ver)	((ver)->major >= 2)
+
+struct version {
+	u8 fw_major;
+	u8 fw_minor;
+	uint16_t fw_build;
+	u8 bl_major;
+	u8 bl_minor;
+};
+
+// HID++ 2.0 firmware entity as reported by DeviceFwVersion (0x0003)
+#define FW_ENTITIES_MAX		4
+struct fw_entity {
+#define FW_TYPE_MAIN		0
+#define FW_TYPE_BOOTLOADER	1
+#define FW_TYPE_HARDWARE	2
+	u8 type;
+	char prefix[4]; // e.g. "RQK", NUL-terminated
+	u8 number; // BCD
+	u8 revision; // BCD
+	uint16_t build; // BCD
+};
+
+// HID++ 2.0 feature indexes, resolved once per session
+#define FEATURE_CACHE_MAX	8
+struct feature_index_cache {
+	uint16_t featureId;
+	u8 feature_index; // 0 if the device does not support the feature
+};
+
+// names from the HID++ 2.0 DeviceName feature can be longer than the 0xB5 one
+#define DEVICE_NAME_LONG_MAXLEN	64
+#define DEVICES_MAX	6u
+struct device {
+	bool device_present; // whether the device is paired
+	bool device_available; // whether the device is connected
+	u8 device_type;
+	uint16_t wireless_pid;
+	u8 report_interval; // ms, from the pairing information
+	char name[DEVICE_NAME_LONG_MAXLEN + 1]; // include NUL byte
+	uint32_t serial_number;
+	u8 power_switch_location;
+	struct hidpp_version hidpp_version;
+	struct version version;
+	// only for HID++ 2.0 devices
+	u8 fw_entities_count;
+	struct fw_entity fw_entities[FW_ENTITIES_MAX];
+	u8 features_count; // at most FEATURE_CACHE_MAX
+	u8 features_oldest; // replaced next when the cache is full
+	struct feature_index_cache features[FEATURE_CACHE_MAX];
+};
+
+struct receiver_info {
+	uint32_t serial_number;
+	struct version version;
+};
+
+struct lt_receiver;
+struct lt_request;
+struct lt_trace;
+struct lt_rate;
+struct lt_ring;
+struct lt_uring;
+struct lt_serial_index;
+
+// Invoked when a request completes, req->done tells whether it got a reply.
+typedef void (*lt_callback)(struct lt_receiver *rcv, struct lt_request *req,
+	void *data);
+// Invoked for reports which are no response to a request (notifications).
+typedef void (*lt_notify_callback)(struct lt_receiver *rcv,
+	struct hidpp_message *msg, void *data);
+// Invoked for every report that is read, including DJ reports and responses.
+typedef void (*lt_report_callback)(struct lt_receiver *rcv, const u8 *report,
+	size_t length, void *data);
+
+// Invoked for every report of a trace or usbmon capture, times are in
+// microseconds since the first report.
+typedef void (*lt_capture_callback)(bool is_write, const u8 *report,
+	size_t length, long long unsigned time_us, void *data);
+
+/* A request, allocated by the caller and owned by the library while queued. */
+struct lt_request {
+	struct hidpp_message msg; // the request, replaced by the response
+	bool hidpp20; // HID++ 2.0 request, the swId is assigned when sending
+	bool done; // a response or error was received
+	u8 error_type; // 0 on success, SUB_ERROR_MSG or HIDPP20_ERROR_MSG
+	u8 error_code;
+	// private to the library
+	lt_callback callback;
+	void *data;
+	long long unsigned deadline;
+	bool sent;
+	struct lt_request *next;
+};
+
+/* Context of one receiver. Fields are read-only for library users. */
+struct lt_receiver {
+	int fd;
+	char path[32];
+	bool debug; // print details and dump the ring to stderr when closed
+	struct receiver_info info;
+	struct device devices[DEVICES_MAX];
+	// pending requests in the order they were submitted
+	struct lt_request *queue;
+	unsigned queue_length;
+	u8 next_swId;
+	lt_notify_callback notify;
+	void *notify_data;
+	lt_report_callback report_hook;
+	void *report_data;
+	struct lt_trace *trace; // recording of all reports, see lt_trace_record
+	struct lt_ring *ring; // recent reports in memory, see lt_ring_dump
+	struct lt_uring *uring; // I/O through io_uring, see lt_uring_new
+	unsigned uring_slot;
+	pid_t child_pid; // process serving a replay or simulation
+	struct lt_serial_index *serials; // see lt_serial_index_track
+};
+
+/* Location of a device in the serial number index. */
+struct lt_serial_entry {
+	uint32_t serial;
+	uint32_t receiver_serial; // 0 if unknown
+	u8 device_index; // 1..6
+	uint16_t wireless_pid;
+	char path[32]; // hidraw device when the entry was recorded
+};
+
+/* Counters of the transport, see lt_get_io_stats. */
+struct lt_io_stats {
+	long long unsigned syscalls; // poll, read, write and io_uring_enter
+	long long unsigned reports; // written and read
+};
+
+/* receiver.c - context, transport and event loop */
+long long unsigned get_timestamp_ms(void);
+struct lt_receiver *lt_receiver_new(int fd, const char *path);
+struct lt_receiver *lt_receiver_open(const char *path);
+unsigned lt_receiver_open_all(struct lt_receiver **rcvs, unsigned max_rcvs);
+void lt_receiver_close(struct lt_receiver *rcv);
+int lt_receiver_fd(struct lt_receiver *rcv);
+void lt_set_notify_callback(struct lt_receiver *rcv, lt_notify_callback notify,
+	void *data);
+void lt_set_report_callback(struct lt_receiver *rcv, lt_report_callback hook,
+	void *data);
+bool lt_write_report(struct lt_receiver *rcv, const u8 *report, size_t length);
+bool lt_submit(struct lt_receiver *rcv, struct lt_request *req, int timeout,
+	lt_callback callback, void *data);
+void lt_process_events(struct lt_receiver *rcv);
+int lt_next_timeout(struct lt_receiver *rcv);
+bool lt_poll(struct lt_receiver *rcv, int timeout);
+bool lt_run(struct lt_receiver **rcvs, unsigned count, int timeout);
+bool lt_wait(struct lt_receiver *rcv, struct lt_request *req);
+bool lt_execute(struct lt_receiver *rcv, struct lt_request *req, int timeout);
+void lt_get_io_stats(struct lt_io_stats *stats, bool reset);
+void lt_process_notification(struct lt_receiver *rcv, struct hidpp_message *msg);
+bool process_notif_dev_connect(struct lt_receiver *rcv,
+	struct hidpp_message *msg, u8 *device_index, bool *is_new_device);
+
+/* uring.c - io_uring transport */
+#define URING_RECEIVERS_MAX	64
+struct lt_uring *lt_uring_new(struct lt_receiver **rcvs, unsigned count);
+void lt_uring_free(struct lt_uring *uring);
+
+/* ring.c - recent reports for debugging */
+void lt_ring_dump(struct lt_receiver *rcv, int fd);
+void lt_ring_dump_all(int fd);
+
+/* trace.c - recording and replaying reports */
+bool lt_trace_record(struct lt_receiver *rcv, const char *path);
+struct lt_receiver *lt_receiver_replay(const char *path, bool realtime,
+	bool debug);
+bool lt_trace_import_usbmon(const char *capture, const char *path);
+bool lt_trace_read(const char *path, lt_capture_callback fn, void *data);
+int lt_usbmon_read(const char *capture, lt_capture_callback fn, void *data);
+
+/* rate.c - input report rate and jitter per device */
+struct lt_rate *lt_rate_new(void);
+void lt_rate_free(struct lt_rate *rate);
+void lt_rate_add(struct lt_rate *rate, const u8 *report, size_t length,
+	long long unsigned time_us);
+void lt_rate_set_interval(struct lt_rate *rate, u8 device_index,
+	unsigned interval_ms);
+void lt_rate_print(const struct lt_rate *rate, const char *source);
+
+/* serials.c - persistent index of device serial numbers */
+struct lt_serial_index *lt_serial_index_open(const char *path, bool readonly);
+bool lt_serial_index_save(struct lt_serial_index *idx);
+void lt_serial_index_free(struct lt_serial_index *idx);
+const struct lt_serial_entry *lt_serial_index_find(struct lt_serial_index *idx,
+	uint32_t serial);
+void lt_serial_index_set(struct lt_serial_index *idx,
+	const struct lt_serial_entry *entry);
+void lt_serial_index_track(struct lt_receiver *rcv, struct lt_serial_index *idx);
+void lt_serial_index_update(struct lt_receiver *rcv, u8 device_index,
+	uint32_t serial);
+
+/* hidpp10.c - registers and receiver functions */
+const char *hidpp10_error_str(u8 error_code);
+const char *hidpp10_register_str(u8 address);
+const char *device_type_str(u8 type);
+int device_type_from_str(const char *str);
+const char *device_type_name(unsigned type);
+void init_register_req(struct lt_request *req, u8 device_index, u8 sub_id,
+	u8 address, const u8 *params);
+void init_ping_req(struct lt_request *req, u8 device_index);
+bool set_short_register(struct lt_receiver *rcv, u8 device_index, u8 address,
+	u8 *params, struct hidpp_message *res);
+bool set_long_register(struct lt_receiver *rcv, u8 device_index, u8 address,
+	u8 *params, struct hidpp_message *res);
+bool get_short_register(struct lt_receiver *rcv, u8 device_index, u8 address,
+	u8 *params, struct hidpp_message *out);
+bool get_long_register(struct lt_receiver *rcv, u8 device_index, u8 address,
+	u8 *params, struct hidpp_message *out);
+bool get_notifications(struct lt_receiver *rcv, u8 device_index,
+	struct msg_enable_notifs *params);
+bool set_notifications(struct lt_receiver *rcv, u8 device_index,
+	struct msg_enable_notifs *params);
+bool get_connected_devices(struct lt_receiver *rcv, u8 *devices_count);
+bool pair_start(struct lt_receiver *rcv, u8 timeout);
+bool pair_cancel(struct lt_receiver *rcv);
+bool device_unpair(struct lt_receiver *rcv, u8 device_index);
+bool get_all_devices(struct lt_receiver *rcv);
+bool get_receiver_info(struct lt_receiver *rcv, struct receiver_info *rinfo);
+bool get_device_pair_info(struct lt_receiver *rcv, u8 device_index);
+bool get_device_ext_pair_info(struct lt_receiver *rcv, u8 device_index);
+bool get_device_name(struct lt_receiver *rcv, u8 device_index);
+bool get_hidpp_version(struct lt_receiver *rcv, u8 device_index,
+	struct hidpp_version *version);
+bool get_device_version(struct lt_receiver *rcv, u8 device_index,
+	u8 version_type, struct val_reg_version *ver);
+bool get_device_versions(struct lt_receiver *rcv, u8 device_index,
+	struct version *version);
+/* Parts of the device information, a request is only made for those needed */
+#define GATHER_PAIR_INFO	0x01 // device type, wireless PID, report interval
+#define GATHER_SERIAL		0x02 // extended pairing information
+#define GATHER_NAME		0x04 // and the long name of HID++ 2.0 devices
+#define GATHER_HIDPP_VERSION	0x08
+#define GATHER_FIRMWARE		0x10 // all firmware entities for HID++ 2.0
+#define GATHER_BOOTLOADER	0x20
+#define GATHER_ALL		0x3F
+void gather_device_fields(struct lt_receiver *rcv, u8 device_index,
+	unsigned what);
+void gather_device_info(struct lt_receiver *rcv, u8 device_index);
+
+/* hidpp20.c - HID++ 2.0 features */
+struct feature {
+	uint16_t featureId;
+#define FEAT_TYPE_MASK          0xe0
+#define FEAT_TYPE_OBSOLETE      0x80
+#define FEAT_TYPE_SWHIDDEN      0x40
+#define FEAT_TYPE_RSVD_INTERNAL 0x20
+	u8 featureType;
+};
+
+#define FEATURE_INDEX_IROOT 0x00
+
+#define FID_IFEATURESET 0x0001
+#define FID_DEVICE_FW_VERSION 0x0003
+#define FID_DEVICE_NAME 0x0005
+#define FID_DFU 0x00D0
+#define FID_BATTERY_STATUS 0x1000
+#define FID_LEFT_RIGHT_SWAP 0x2001
+#define FID_HIRES_SCROLLING 0x2120
+#define FID_FN_INVERSION 0x40A0
+#define FID_NEW_FN_INVERSION 0x40A2
+
+/* HID++ 2.0 view of the message in a request. */
+#define REQ_MSG20(req) ((struct hidpp2_message *) &(req)->msg)
+
+#define HIDPP20_CALL_FAILED		-1 // no response or invalid arguments
+#define HIDPP20_CALL_UNSUPPORTED	-2 // the feature is not supported
+
+const char *get_feature_name(uint16_t featureId);
+const char *hidpp20_error_str(u8 error_code);
+const char *hidpp20_battery_status_str(u8 status);
+struct hidpp2_message *hidpp20_init_req(struct lt_request *req,
+	u8 device_index, u8 feature_index, u8 func);
+unsigned hidpp20_submit_features(struct lt_receiver *rcv, u8 device_index,
+	const uint16_t *featureIds, unsigned count, struct lt_request *reqs);
+bool hidpp20_resolve_features(struct lt_receiver *rcv, u8 device_index,
+	const uint16_t *featureIds, unsigned count);
+u8 hidpp20_feature_index(struct lt_receiver *rcv, u8 device_index,
+	uint16_t featureId);
+bool hidpp20_feature_resolved(struct lt_receiver *rcv, u8 device_index,
+	uint16_t featureId);
+int hidpp20_call(struct lt_receiver *rcv, u8 device_index, uint16_t featureId,
+	u8 func, const u8 *params, unsigned params_count,
+	struct hidpp2_message *response);
+bool hidpp20_get_device_info(struct lt_receiver *rcv, u8 device_index,
+	unsigned what);
+
+/* dfu.c - firmware transfer (DFU feature 0x00D0) */
+#define DFU_PACKET_SIZE		16u
+#define DFU_WINDOW_MAX		4u // one packet per dfuCmdData function
+#define DFU_PACKET_TIMEOUT	3000
+
+#define DFU_STATUS_PACKET_SUCCESS	0x01
+#define DFU_STATUS_SUCCESS		0x02
+#define DFU_STATUS_WAIT			0x03
+#define DFU_STATUS_BUSY			0x17 // command in progress
+
+struct lt_dfu;
+typedef void (*lt_dfu_callback)(struct lt_dfu *dfu, void *data);
+
+/* A firmware transfer to one device, see lt_dfu_start. */
+struct lt_dfu {
+	struct lt_receiver *rcv;
+	u8 device_index;
+	const u8 *image;
+	size_t size;
+	unsigned window; // packets in flight, 1..DFU_WINDOW_MAX
+	lt_dfu_callback done;
+	void *done_data;
+	// progress, read-only
+	u8 feature_index;
+	unsigned packets; // packets of the image
+	unsigned sent; // next packet to send
+	unsigned acked; // packets acknowledged in order
+	unsigned in_flight;
+	unsigned retransmits;
+	unsigned waits; // number of "wait for event" statuses
+	bool waiting;
+	bool finished;
+	bool failed;
+	u8 status; // last DFU status
+	long long unsigned start_time, end_time, wait_deadline;
+	// private
+	struct lt_request start_req;
+	struct lt_request restart_req;
+	struct lt_request reqs[DFU_WINDOW_MAX];
+	unsigned req_packet[DFU_WINDOW_MAX];
+	bool queued[DFU_WINDOW_MAX];
+	bool draining; // no new packets until all in flight were answered
+};
+
+const char *lt_dfu_status_str(u8 status);
+uint32_t lt_dfu_crc32(const u8 *data, size_t length);
+bool lt_dfu_start(struct lt_dfu *dfu);
+bool lt_dfu_process_notification(struct lt_dfu *dfu, struct hidpp_message *msg);
+void lt_dfu_expire(struct lt_dfu *dfu);
+void lt_dfu_cancel(struct lt_dfu *dfu);
+
+/* simulate.c - simulated receiver for testing */
+struct lt_receiver *lt_receiver_simulate(unsigned number, bool debug);
+
+/* scan.c - register space scanner */
+#define SCAN_REGISTERS	0x100
+
+enum lt_scan_status {
+	SCAN_NOT_READ,
+	SCAN_PRESENT,
+	SCAN_INVALID_ADDRESS,
+	SCAN_ERROR, // see error_code
+	SCAN_NO_RESPONSE,
+};
+struct lt_scan_entry {
+	u8 status;
+	u8 error_code;
+	u8 value[16]; // 3 bytes for short registers
+} __attribute__((__packed__));
+/* Result of reading all registers of a receiver or device, see lt_scan_registers. */
+struct lt_scan {
+	u8 device_index;
+	uint32_t serial; // of the receiver or device, 0 if unknown
+	struct lt_scan_entry short_regs[SCAN_REGISTERS];
+	struct lt_scan_entry long_regs[SCAN_REGISTERS];
+};
+
+bool lt_scan_registers(struct lt_receiver *rcv, u8 device_index,
+	struct lt_scan *scan);
+bool lt_scan_save(const struct lt_scan *scan, const char *path);
+bool lt_scan_load(struct lt_scan *scan, const char *path);
+
+#endif /* LTUNIFY_HIDPP_H */
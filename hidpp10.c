@@ -0,0 +1,436 @@
+/*
+ * HID++ 1.0 registers and receiver functions of libltunify.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <strings.h> /* strcasecmp */
+#include <arpa/inet.h> /* ntohs, ntohl */
+
+#include "internal.h"
+#include "protocol.h"
+
+const char *hidpp10_error_str(u8 error_code) {
+	const char *str = proto_hidpp10_errors[error_code];
+	return str ? str : "unknown";
+}
+
+// Returns the name of a register or NULL if unknown.
+const char *hidpp10_register_str(u8 address) {
+	return proto_registers[address];
+}
+
+const char *device_type_str(u8 type) {
+	if (type > 0x0F) {
+		return "(invalid)";
+	}
+	if (proto_device_types[type]) {
+		return proto_device_types[type];
+	}
+	return "(reserved)";
+}
+
+// returns device type index or -1 if the string is invalid
+int device_type_from_str(const char *str) {
+	unsigned i;
+
+	// skip "Unknown" type
+	for (i = 1; i < ARRAY_SIZE(proto_device_types); i++) {
+		if (proto_device_types[i] && !strcasecmp(proto_device_types[i], str)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// returns the name of a defined device type or NULL (for listing types)
+const char *device_type_name(unsigned type) {
+	return type < ARRAY_SIZE(proto_device_types) ? proto_device_types[type] : NULL;
+}
+
+// Prepares a HID++ 1.0 (register) request, params may be NULL.
+void init_register_req(struct lt_request *req, u8 device_index, u8 sub_id,
+	u8 address, const u8 *params) {
+	struct hidpp_message *msg = &req->msg;
+
+	memset(req, 0, sizeof *req);
+	msg->report_id = SHORT_MESSAGE;
+	msg->device_index = device_index;
+	msg->sub_id = sub_id;
+	msg->msg_short.address = address;
+	if (params) {
+		memcpy(msg->msg_short.value, params, sizeof msg->msg_short.value);
+	}
+}
+
+// Prepares a HID++ 2.0 ping (IRoot function 1), HID++ 1.0 devices reject it
+// with ERR_INVALID_SUBID.
+void init_ping_req(struct lt_request *req, u8 device_index) {
+	struct hidpp_message *msg = &req->msg;
+
+	memset(req, 0, sizeof *req);
+	req->hidpp20 = true;
+	msg->report_id = SHORT_MESSAGE;
+	msg->device_index = device_index;
+	msg->sub_id = 0x00; // Root feature index
+	msg->msg_short.address = 0x10; // swId is assigned when sending
+	msg->msg_short.value[2] = 0x00; // ping data, can be any value
+}
+
+static bool set_register(struct lt_receiver *rcv, u8 device_index, u8 address,
+	u8 *params, struct hidpp_message *res, bool is_long_req) {
+	struct lt_request req;
+	struct hidpp_message *msg = &req.msg;
+
+	if (is_long_req) {
+		init_register_req(&req, device_index, SUB_SET_LONG_REGISTER,
+			address, NULL);
+		msg->report_id = LONG_MESSAGE;
+		memcpy(&msg->msg_long.str, params, sizeof msg->msg_long.str);
+	} else {
+		init_register_req(&req, device_index, SUB_SET_REGISTER,
+			address, params);
+	}
+
+	if (!lt_execute(rcv, &req, 2000) || req.error_type) {
+		return false;
+	}
+	memcpy(res, msg, sizeof *msg);
+	return true;
+}
+
+bool set_short_register(struct lt_receiver *rcv, u8 device_index, u8 address,
+	u8 *params, struct hidpp_message *res) {
+	return set_register(rcv, device_index, address, params, res, false);
+}
+bool set_long_register(struct lt_receiver *rcv, u8 device_index, u8 address,
+	u8 *params, struct hidpp_message *res) {
+	return set_register(rcv, device_index, address, params, res, true);
+}
+
+static bool get_register(struct lt_receiver *rcv, u8 device_index, u8 address,
+	struct hidpp_message *out, u8 *params, bool is_long_resp) {
+	struct lt_request req;
+
+	init_register_req(&req, device_index,
+		is_long_resp ? SUB_GET_LONG_REGISTER : SUB_GET_REGISTER,
+		address, params);
+	if (!lt_execute(rcv, &req, 2000) || req.error_type) {
+		return false;
+	}
+	memcpy(out, &req.msg, sizeof req.msg);
+	return true;
+}
+
+bool get_short_register(struct lt_receiver *rcv, u8 device_index, u8 address,
+	u8 *params, struct hidpp_message *out) {
+	return get_register(rcv, device_index, address, out, params, false);
+}
+bool get_long_register(struct lt_receiver *rcv, u8 device_index, u8 address,
+	u8 *params, struct hidpp_message *out) {
+	return get_register(rcv, device_index, address, out, params, true);
+}
+
+// begin directly-usable functions
+bool get_notifications(struct lt_receiver *rcv, u8 device_index,
+	struct msg_enable_notifs *params) {
+	struct hidpp_message msg;
+	if (!get_short_register(rcv, device_index, REG_ENABLED_NOTIFS, NULL, &msg)) {
+		return false;
+	}
+	memcpy((u8 *) params, &msg.msg_short.value, sizeof *params);
+	return true;
+}
+bool set_notifications(struct lt_receiver *rcv, u8 device_index,
+	struct msg_enable_notifs *params) {
+	struct hidpp_message msg;
+	if (!set_short_register(rcv, device_index, REG_ENABLED_NOTIFS, (u8 *) params, &msg)) {
+		return false;
+	}
+	return true;
+}
+
+bool get_connected_devices(struct lt_receiver *rcv, u8 *devices_count) {
+	struct hidpp_message msg;
+	struct val_reg_connection_state *cval;
+	if (!get_short_register(rcv, DEVICE_RECEIVER, REG_CONNECTION_STATE, NULL, &msg)) {
+		return false;
+	}
+	cval = (struct val_reg_connection_state *) msg.msg_short.value;
+	*devices_count = cval->connected_devices_count;
+	return true;
+}
+
+bool pair_start(struct lt_receiver *rcv, u8 timeout) {
+	struct hidpp_message msg;
+	struct val_reg_devpair cmd;
+	cmd.action = DEVPAIR_OPEN_LOCK;
+	// device_index is 1..6 for a specific device, 0x53 is seen for "any
+	// device".  Not sure if this is a special value or randomly chosen
+	cmd.device_number = 0;
+	cmd.open_lock_timeout = timeout;
+	if (!set_short_register(rcv, DEVICE_RECEIVER, REG_DEVICE_PAIRING, (u8 *) &cmd, &msg)) {
+		return false;
+	}
+	return true;
+}
+
+bool pair_cancel(struct lt_receiver *rcv) {
+	struct hidpp_message msg;
+	struct val_reg_devpair cmd;
+	cmd.action = DEVPAIR_CLOSE_LOCK;
+	// see discussion at pair_start, why did logitech use 0x53? Confusion?
+	cmd.device_number = 0;
+	// timeout applies to open lock, not sure why I saw 0x94 (148 sec)
+	cmd.open_lock_timeout = 0;
+	if (!set_short_register(rcv, DEVICE_RECEIVER, REG_DEVICE_PAIRING, (u8 *) &cmd, &msg)) {
+		return false;
+	}
+	return true;
+}
+
+bool device_unpair(struct lt_receiver *rcv, u8 device_index) {
+	struct hidpp_message msg;
+	struct val_reg_devpair cmd;
+	cmd.action = DEVPAIR_DISCONNECT;
+	cmd.device_number = device_index;
+	cmd.open_lock_timeout = 0;
+	if (!set_short_register(rcv, DEVICE_RECEIVER, REG_DEVICE_PAIRING, (u8 *) &cmd, &msg)) {
+		return false;
+	}
+	return true;
+}
+
+// triggers a notification that updates the list of paired devices
+bool get_all_devices(struct lt_receiver *rcv) {
+	struct hidpp_message msg;
+	struct val_reg_connection_state cval;
+	memset(&cval, 0, sizeof cval);
+	cval.action = CONSTATE_ACTION_LIST_DEVICES;
+	if (!set_short_register(rcv, DEVICE_RECEIVER, REG_CONNECTION_STATE, (u8 *) &cval, &msg)) {
+		return false;
+	}
+	return true;
+}
+bool get_receiver_info(struct lt_receiver *rcv, struct receiver_info *rinfo) {
+	struct hidpp_message msg;
+	u8 params[3] = {0};
+
+	params[0] = 0x03; // undocumented
+	if (get_long_register(rcv, DEVICE_RECEIVER, REG_PAIRING_INFO, params, &msg)) {
+		struct msg_receiver_info *info = (struct msg_receiver_info *) &msg.msg_long.str;
+		uint32_t *serial_numberp;
+
+		serial_numberp = (uint32_t *) &info->serial_number;
+
+		rinfo->serial_number = ntohl(*serial_numberp);
+		return true;
+	}
+	return false;
+}
+bool get_device_pair_info(struct lt_receiver *rcv, u8 device_index) {
+	struct device *dev = &rcv->devices[device_index - 1];
+	struct hidpp_message msg;
+	u8 params[3] = {0};
+
+	params[0] = 0x20 | (device_index - 1); // 0x20..0x2F Unifying Device pairing info
+	if (get_long_register(rcv, DEVICE_RECEIVER, REG_PAIRING_INFO, params, &msg)) {
+		struct msg_dev_pair_info *info = (struct msg_dev_pair_info *) &msg.msg_long.str;
+
+		dev->wireless_pid = (info->pid_msb << 8) | info->pid_lsb;
+		dev->device_type = info->device_type;
+		dev->report_interval = info->report_interval;
+		return true;
+	}
+	return false;
+}
+bool get_device_ext_pair_info(struct lt_receiver *rcv, u8 device_index) {
+	struct device *dev = &rcv->devices[device_index - 1];
+	struct hidpp_message msg;
+	u8 params[3] = {0};
+
+	params[0] = 0x30 | (device_index - 1); // 0x30..0x3F Unifying Device extended pairing info
+	if (get_long_register(rcv, DEVICE_RECEIVER, REG_PAIRING_INFO, params, &msg)) {
+		struct msg_dev_ext_pair_info *info;
+		uint32_t *serial_numberp;
+
+		info = (struct msg_dev_ext_pair_info *) &msg.msg_long.str;
+		serial_numberp = (uint32_t *) &info->serial_number;
+
+		dev->serial_number = ntohl(*serial_numberp);
+		dev->power_switch_location = info->usability_info & 0x0F;
+		lt_serial_index_update(rcv, device_index, dev->serial_number);
+		return true;
+	}
+	return false;
+}
+bool get_device_name(struct lt_receiver *rcv, u8 device_index) {
+	struct device *dev = &rcv->devices[device_index - 1];
+	struct hidpp_message msg;
+	u8 params[3] = {0};
+
+	params[0] = 0x40 | (device_index - 1); // 0x40..0x4F Unifying Device Name
+	if (get_long_register(rcv, DEVICE_RECEIVER, REG_PAIRING_INFO, params, &msg)) {
+		struct msg_dev_name *name = (struct msg_dev_name *) &msg.msg_long.str;
+		if (name->length > DEVICE_NAME_MAXLEN) {
+			fprintf(stderr, "Invalid name length %#04x for idx=%i\n", name->length, device_index);
+			return false;
+		}
+
+		memcpy(&dev->name, name->str, name->length);
+		dev->name[name->length] = 0;
+		return true;
+	}
+	return false;
+}
+
+bool get_hidpp_version(struct lt_receiver *rcv, u8 device_index,
+	struct hidpp_version *version) {
+	struct lt_request req;
+
+	init_ping_req(&req, device_index);
+	if (!lt_execute(rcv, &req, 3000)) {
+		DPRINTF(rcv, "Failed to read HID++ version, device does not respond!\n");
+		return false;
+	}
+	if (req.error_type == SUB_ERROR_MSG && req.error_code == 0x01) {
+		// if error is ERR_INVALID_SUBID (0x01), then HID++ 1.0
+		version->major = 1;
+		version->minor = 0;
+		return true;
+	} else if (req.error_type) {
+		// fatal error - is device connected?
+		DPRINTF(rcv, "Failed to retrieve version: %#04x (%s)\n",
+			req.error_code, hidpp10_error_str(req.error_code));
+		return false;
+	}
+
+	version->major = req.msg.msg_short.value[0];
+	version->minor = req.msg.msg_short.value[1];
+	return true;
+}
+
+// device_index can also be 0xFF for receiver
+bool get_device_version(struct lt_receiver *rcv, u8 device_index,
+	u8 version_type, struct val_reg_version *ver) {
+	struct hidpp_message msg;
+	// TODO: not 100% reliable for wireless devices, it may return MSG_ERR
+	// (err=SUCCESS, wtf). Perhaps we need to send another msg type=00
+	// (whatever the undocumented params are).
+
+	memset(ver, 0, sizeof *ver);
+	ver->select_field = version_type;
+	if (get_short_register(rcv, device_index, REG_VERSION_INFO, (u8 *) ver, &msg)) {
+		memcpy(ver, msg.msg_short.value, sizeof *ver);
+		return true;
+	}
+	return false;
+}
+
+// Reads the firmware (two registers) and/or bootloader version.
+static bool get_device_versions_part(struct lt_receiver *rcv, u8 device_index,
+	struct version *version, unsigned what) {
+	struct val_reg_version ver;
+	bool ok = false;
+
+	memset(version, 0, sizeof *version);
+
+	if (what & GATHER_FIRMWARE) {
+		if (!get_device_version(rcv, device_index, VERSION_FIRMWARE, &ver)) {
+			// assume that other versions will fail too
+			return false;
+		}
+		version->fw_major = ver.v1;
+		version->fw_minor = ver.v2;
+		ok = true;
+		if (get_device_version(rcv, device_index, VERSION_FW_BUILD, &ver)) {
+			version->fw_build = (ver.v1 << 8) | ver.v2;
+		}
+	}
+	//if (get_device_version(rcv, device_index, 3, &ver)) puts("No idea what this is useful for");
+	if ((what & GATHER_BOOTLOADER) &&
+		get_device_version(rcv, device_index, VERSION_BOOTLOADER, &ver)) {
+		version->bl_major = ver.v1;
+		version->bl_minor = ver.v2;
+		ok = true;
+	}
+	return ok;
+}
+
+bool get_device_versions(struct lt_receiver *rcv, u8 device_index,
+	struct version *version) {
+	return get_device_versions_part(rcv, device_index, version,
+		GATHER_FIRMWARE | GATHER_BOOTLOADER);
+}
+
+// device index is 1..6, only the parts in what (GATHER_*) are read
+void gather_device_fields(struct lt_receiver *rcv, u8 device_index,
+	unsigned what) {
+	struct device *dev = &rcv->devices[device_index - 1];
+	bool paired = true, answered = false;
+
+	if ((what & GATHER_PAIR_INFO) && !get_device_pair_info(rcv, device_index)) {
+		// retrieve some information from notifier
+		get_all_devices(rcv);
+		return;
+	}
+	// versions are read differently for HID++ 1.0 and 2.0, and HID++ 2.0
+	// devices have a longer name than the receiver knows
+	if (what & (GATHER_FIRMWARE | GATHER_BOOTLOADER | GATHER_NAME)) {
+		what |= GATHER_HIDPP_VERSION;
+	}
+	if (what & GATHER_HIDPP_VERSION) {
+		answered = get_hidpp_version(rcv, device_index,
+			&dev->hidpp_version);
+	}
+	if (what & GATHER_SERIAL) {
+		paired = get_device_ext_pair_info(rcv, device_index) && paired;
+	}
+	if (what & GATHER_NAME) {
+		paired = get_device_name(rcv, device_index) && paired;
+	}
+	// without any 0xB5 read, a device that answers the ping is paired, else
+	// the receiver is asked (a sleeping device does not answer the ping)
+	if (!(what & (GATHER_PAIR_INFO | GATHER_SERIAL | GATHER_NAME)) &&
+		!answered) {
+		paired = get_device_pair_info(rcv, device_index);
+	}
+	dev->device_present = paired;
+	if (!paired) {
+		return;
+	}
+	if (dev->hidpp_version.major == 1 && dev->hidpp_version.minor == 0 &&
+		(what & (GATHER_FIRMWARE | GATHER_BOOTLOADER))) {
+		if (get_device_versions_part(rcv, device_index, &dev->version,
+			what)) {
+			dev->device_available = true;
+		}
+	} else if (HIDPP_VERSION_IS_20(&dev->hidpp_version)) {
+		// it answered the ping, firmware information is optional
+		dev->device_available = true;
+		if (what & (GATHER_FIRMWARE | GATHER_BOOTLOADER | GATHER_NAME)) {
+			hidpp20_get_device_info(rcv, device_index, what);
+		}
+	}
+}
+
+void gather_device_info(struct lt_receiver *rcv, u8 device_index) {
+	gather_device_fields(rcv, device_index, GATHER_ALL);
+}
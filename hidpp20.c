@@ -1,193 +1,366 @@
+/*
+ * HID++ 2.0 features of libltunify.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
 #include <stdio.h>
-#include <unistd.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
-#define SHORT_MESSAGE           0x10
-#define LONG_MESSAGE            0x11
-
-struct hidpp2_message {
-	u8 report_id;
-	u8 device_index;
-	u8 feature_index;
-#define HIDPP_SET_FUNC(msg, func) ((msg)->func_swId |= ((func) << 4))
-	u8 func_swId;
-	u8 params[16]; // 3 or 16 params
-} __attribute__((__packed__));
-
-struct feature {
-	uint16_t featureId;
-#define FEAT_TYPE_MASK          0xe0
-#define FEAT_TYPE_OBSOLETE      0x80
-#define FEAT_TYPE_SWHIDDEN      0x40
-#define FEAT_TYPE_RSVD_INTERNAL 0x20
-	u8 featureType;
-};
-
-#define SOFTWARE_ID 0x04 /* getRandom() -- guaranteed to be random. */
-
-#define FEATURE_INDEX_IROOT 0x00
-
-#define FID_IFEATURESET 0x0001
-static
+#include "internal.h"
+#include "protocol.h"
+
 const char *
 get_feature_name(uint16_t featureId) {
-	/* With '?' prefix are taken from SetPointP/KEMUI.xml */
-	switch (featureId) {
-	case 0x0000: return "Root";
-	case 0x0001: return "FeatureSet";
-	case 0x0002: return "FeatureInfo";
-	case 0x0003: return "DeviceFwVersion";
-	case 0x0005: return "DeviceName";
-	case 0x0006: return "DeviceGroups";
-	case 0x00C0: return "Dfucontrol";           /* Firmware Update */
-	case 0x1000: return "BatteryStatus";
-	case 0x1900: return "?SoundNotif";          /* Sound Notification */
-	case 0x1920: return "?AudioControls";       /* Audio Controls */
-	case 0x1940: return "?VOIP";                /* Internet Telephony */
-	case 0x1960: return "?VideoCalling";
-	case 0x1980: return "?Backlighting";
-	case 0x1981: return "Backlight";
-	case 0x1B00: return "ReprogControls";
-	case 0x1B01: return "ReprogControlsV2";
-	case 0x1B03: return "ReprogControlsV3";
-	case 0x1D4B: return "WirelessDeviceStatus"; /* Wireless Update */
-	case 0x2000: return "?MouseFeature";        /* Pointing Device Feature */
-	case 0x2001: return "LeftRightSwap";
-	case 0x2100: return "VerticalScrolling";
-	case 0x2120: return "HiResScrolling";
-	case 0x2200: return "MousePointer";
-	case 0x2510: return "?ProfileMgmt";         /* Profile Management */
-	case 0x4000: return "?KeyboardFeature";
-	case 0x40A0: return "FnInversion";
-	case 0x40A2: return "NewFnInversion";
-	case 0x4100: return "Encryption";
-	case 0x4301: return "SolarDashboard";
-	case 0x4400: return "?DisplayFeature";
-	case 0x4520: return "KeyboardLayout";       /* Inactive key */
-	case 0x5500: return "?SliderControls";
-	case 0x6000: return "?TouchpadFeature";
-	case 0x6010: return "TouchpadFwItems";      /* Basic Touchpad settings */
-	case 0x6011: return "TouchpadSwItems";      /* Enhanced Touchpad settings */
-	case 0x6012: return "TouchpadWin8FwItems";
-	case 0x6020: return "?TouchpadTapSelect";   /* Tap to select */
-	case 0x6030: return "?DisablePointerAccel"; /* Disable pointer acceleration */
-	case 0x6100: return "TouchpadRawXy";
-	case 0x6110: return "TouchmouseRawPoints";
-	case 0x6120: return "Touchmouse6120";
-	case 0x6300: return "?HandwritingRecog";    /* Handwriting recognition" */
-	default: return "unknown";
-	}
+	const char *name = proto_feature_name(featureId);
+	return name ? name : "unknown";
 }
 
 /**
- * Initialize common values of a HID++ 2.0 message: report_id, device_index and
- * software ID. Remaining fields: feature_index, func, params.
+ * Initialize common values of a HID++ 2.0 message: report_id and device_index.
+ * Remaining fields: feature_index, func, params. The software ID is assigned
+ * by lt_submit for every outstanding request.
  */
 #define INIT_HIDPP_SHORT(msg, dev_index) \
 	memset((msg), 0, sizeof *(msg)); \
 	(msg)->report_id = SHORT_MESSAGE; \
-	(msg)->device_index = dev_index; \
-	(msg)->func_swId = SOFTWARE_ID
+	(msg)->device_index = dev_index
 
-static
-bool
-do_hidpp2_request(int fd, struct hidpp2_message *msg) {
-	struct hidpp_message *hid10_message = (struct hidpp_message *) msg;
+// Prepares a request for function func of a feature, params are zeroed.
+struct hidpp2_message *
+hidpp20_init_req(struct lt_request *req, u8 device_index, u8 feature_index,
+	u8 func) {
+	struct hidpp2_message *msg = REQ_MSG20(req);
 
-        if (!do_write(fd, hid10_message)) {
-                return false;
-        }
+	memset(req, 0, sizeof *req);
+	req->hidpp20 = true;
+	INIT_HIDPP_SHORT(msg, device_index);
+	msg->feature_index = feature_index;
+	HIDPP_SET_FUNC(msg, func);
+	return msg;
+}
 
-	// use do_read_skippy in case there are interleaving notifications
-	// sub id is feature index in HID++ 2.0
-	if (!do_read_skippy(fd, hid10_message, 0x11, hid10_message->sub_id)) {
-		puts("WTF");
-		return false;
+// Submits the requests back to back and waits for all of them. Returns false
+// if a response did not arrive in time.
+static bool
+hidpp20_batch(struct lt_receiver *rcv, struct lt_request *reqs, unsigned count) {
+	unsigned i;
+
+	bool done = true;
+
+	for (i = 0; i < count; i++) {
+		lt_submit(rcv, &reqs[i], 2000, NULL, NULL);
+	}
+	for (i = 0; i < count; i++) {
+		done &= lt_wait(rcv, &reqs[i]);
 	}
+	return done;
+}
+
+static struct feature_index_cache *
+feature_cache_lookup(struct device *dev, uint16_t featureId) {
+	unsigned i;
 
-	return true;
+	for (i = 0; i < dev->features_count; i++) {
+		if (dev->features[i].featureId == featureId) {
+			return &dev->features[i];
+		}
+	}
+	return NULL;
 }
 
-// Returns feature index for featureId
-static
-u8
-get_feature(int fd, u8 device_index, uint16_t featureId) {
-	struct hidpp2_message msg;
-	INIT_HIDPP_SHORT(&msg, device_index);
-	msg.feature_index = FEATURE_INDEX_IROOT;
-	HIDPP_SET_FUNC(&msg, 0); // GetFeature(featureId)
-	msg.params[0] = featureId >> 8;
-	msg.params[1] = featureId & 0xFF;
-	if (!do_hidpp2_request(fd, &msg)) {
-		return 0;
-	}
-	return msg.params[0];
+static void
+feature_cache_store(struct device *dev, uint16_t featureId, u8 feature_index) {
+	struct feature_index_cache *entry;
+
+	if (dev->features_count < FEATURE_CACHE_MAX) {
+		entry = &dev->features[dev->features_count++];
+	} else {
+		// when full, replace the oldest entry
+		entry = &dev->features[dev->features_oldest];
+		dev->features_oldest = (dev->features_oldest + 1) % FEATURE_CACHE_MAX;
+	}
+	entry->featureId = featureId;
+	entry->feature_index = feature_index;
 }
 
-// Returns number of features or 0 on error.
-static
+// Caches the answer of a GetFeature request, data is the featureId.
+static void
+feature_lookup_done(struct lt_receiver *rcv, struct lt_request *req,
+	void *data) {
+	u8 device_index = req->msg.device_index;
+
+	// errors (an 0x8F of the receiver if the device is asleep or out of
+	// range) are not cached, the next lookup asks again
+	if (!req->done || req->error_type ||
+		device_index < 1 || device_index > DEVICES_MAX) {
+		return;
+	}
+	// index 0 (IRoot) means that the feature is not supported
+	feature_cache_store(&rcv->devices[device_index - 1],
+		(uint16_t) (uintptr_t) data, REQ_MSG20(req)->params[0]);
+}
+
+// Submits IRoot GetFeature requests (into reqs, at most count) for the
+// featureIds that are not cached yet, the answers are cached when they arrive.
+// Returns the number of submitted requests, the caller runs them (e.g. with
+// lt_run) so that the lookups of many devices can share one round-trip.
+unsigned
+hidpp20_submit_features(struct lt_receiver *rcv, u8 device_index,
+	const uint16_t *featureIds, unsigned count, struct lt_request *reqs) {
+	struct device *dev = &rcv->devices[device_index - 1];
+	struct hidpp2_message *msg;
+	unsigned i, j, n = 0;
+
+	for (i = 0; i < count; i++) {
+		if (feature_cache_lookup(dev, featureIds[i])) {
+			continue;
+		}
+		for (j = 0; j < i && featureIds[j] != featureIds[i]; j++)
+			;
+		if (j < i) { // asked for twice
+			continue;
+		}
+		msg = hidpp20_init_req(&reqs[n], device_index,
+			FEATURE_INDEX_IROOT, 0); // GetFeature(featureId)
+		msg->params[0] = featureIds[i] >> 8;
+		msg->params[1] = featureIds[i] & 0xFF;
+		lt_submit(rcv, &reqs[n++], 2000, feature_lookup_done,
+			(void *) (uintptr_t) featureIds[i]);
+	}
+	return n;
+}
+
+// Looks up the feature indexes for featureIds which are not cached yet. The
+// IRoot GetFeature requests are sent back to back. Only answers are cached.
+// Returns false if any request failed or timed out.
+bool
+hidpp20_resolve_features(struct lt_receiver *rcv, u8 device_index,
+	const uint16_t *featureIds, unsigned count) {
+	struct lt_request reqs[FEATURE_CACHE_MAX];
+	unsigned i, n;
+	bool ok = true;
+
+	if (count > ARRAY_SIZE(reqs)) {
+		count = ARRAY_SIZE(reqs);
+	}
+	n = hidpp20_submit_features(rcv, device_index, featureIds, count, reqs);
+	for (i = 0; i < n; i++) {
+		if (!lt_wait(rcv, &reqs[i]) || reqs[i].error_type) {
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// Returns the cached feature index or 0 if unknown or not supported.
 u8
-get_feature_count(int fd, u8 device_index, u8 ifeatIndex) {
-	struct hidpp2_message msg;
-	INIT_HIDPP_SHORT(&msg, device_index);
-	// XXX: is this variable? Can't it be hard-coded to 0x01?
-	msg.feature_index = ifeatIndex;
-	HIDPP_SET_FUNC(&msg, 0); // GetCount()
-	if (!do_hidpp2_request(fd, &msg)) {
-		fprintf(stderr, "Failed to request features count\n");
-		return 0;
-	}
-	return msg.params[0];
+hidpp20_feature_index(struct lt_receiver *rcv, u8 device_index,
+	uint16_t featureId) {
+	struct feature_index_cache *entry;
+
+	entry = feature_cache_lookup(&rcv->devices[device_index - 1], featureId);
+	return entry ? entry->feature_index : 0;
 }
 
-// Get featureId and type for a given featureIndex.
-static
+// Returns whether the device answered the lookup of featureId, supported or
+// not.
 bool
-get_featureId(int fd, u8 device_index, u8 ifeatIndex, u8 featureIndex, struct feature *feat) {
-	struct hidpp2_message msg;
-	INIT_HIDPP_SHORT(&msg, device_index);
-	// XXX: is this variable? Can't it be hard-coded to 0x01?
-	msg.feature_index = ifeatIndex;
-	HIDPP_SET_FUNC(&msg, 1); // GetFeatureId(featureIndex)
-	msg.params[0] = featureIndex;
-	if (!do_hidpp2_request(fd, &msg)) {
-		return false;
+hidpp20_feature_resolved(struct lt_receiver *rcv, u8 device_index,
+	uint16_t featureId) {
+	return feature_cache_lookup(&rcv->devices[device_index - 1],
+		featureId) != NULL;
+}
+
+// Returns a description for a HID++ 2.0 error code.
+const char *
+hidpp20_error_str(u8 error_code) {
+	const char *str = proto_hidpp20_errors[error_code];
+	return str ? str : "unknown";
+}
+
+// Calls function func (0..15) of feature featureId with the given params (at
+// most 16). The feature index is resolved through the per-device cache, so
+// only the first call for a feature needs an extra round-trip. Requests with
+// more than three params are sent as long report. On success, the response is
+// stored in response (if non-NULL) and 0 is returned. Otherwise a HID++ 2.0
+// error code or one of HIDPP20_CALL_* (negative) is returned.
+int
+hidpp20_call(struct lt_receiver *rcv, u8 device_index, uint16_t featureId, u8 func,
+	const u8 *params, unsigned params_count,
+	struct hidpp2_message *response) {
+	struct lt_request req;
+	struct hidpp2_message *msg;
+	u8 feature_index = FEATURE_INDEX_IROOT;
+
+	if (device_index < 1 || device_index > DEVICES_MAX || func > 0x0F ||
+		params_count > sizeof msg->params) {
+		return HIDPP20_CALL_FAILED;
+	}
+	if (featureId != 0x0000) {
+		if (!hidpp20_resolve_features(rcv, device_index, &featureId, 1)) {
+			return HIDPP20_CALL_FAILED;
+		}
+		feature_index = hidpp20_feature_index(rcv, device_index, featureId);
+		if (!feature_index) {
+			return HIDPP20_CALL_UNSUPPORTED;
+		}
+	}
+
+	msg = hidpp20_init_req(&req, device_index, feature_index, func);
+	if (params_count > 3) {
+		msg->report_id = LONG_MESSAGE;
+	}
+	if (params_count) {
+		memcpy(msg->params, params, params_count);
 	}
-	feat->featureId = (msg.params[0] << 8) | msg.params[1];
-	feat->featureType = msg.params[2];
-	return true;
+	if (!hidpp20_batch(rcv, &req, 1)) {
+		return HIDPP20_CALL_FAILED;
+	}
+	if (req.error_type == SUB_ERROR_MSG) {
+		DPRINTF(rcv, "Receiver error %#04x for feature %04X\n",
+			req.error_code, featureId);
+		return HIDPP20_CALL_FAILED;
+	} else if (req.error_type) {
+		return req.error_code ? req.error_code : HIDPP20_CALL_FAILED;
+	}
+	if (response) {
+		memcpy(response, msg, sizeof *response);
+	}
+	return 0;
 }
 
-void
-hidpp20_print_features(int fd, u8 device_index) {
-	u8 i, count, ifeatIndex;
+// Retrieves the firmware versions (GATHER_FIRMWARE or GATHER_BOOTLOADER in
+// what) and the name (GATHER_NAME) using the DeviceFwVersion (0x0003) and
+// DeviceName (0x0005) features, in the same round-trips. Returns true if
+// firmware information is available.
+bool
+hidpp20_get_device_info(struct lt_receiver *rcv, u8 device_index,
+	unsigned what) {
+	static const uint16_t featureIds[] = {
+		FID_DEVICE_FW_VERSION, FID_DEVICE_NAME
+	};
+	struct device *dev = &rcv->devices[device_index - 1];
+	struct lt_request reqs[DEVICE_NAME_LONG_MAXLEN / 16 + FW_ENTITIES_MAX];
+	struct hidpp2_message *msg;
+	char name[DEVICE_NAME_LONG_MAXLEN];
+	u8 name_index, fw_index;
+	unsigned i, n, name_len = 0, name_chunks, fw_count = 0;
 
-	ifeatIndex = get_feature(fd, device_index, FID_IFEATURESET);
-	if (!ifeatIndex) {
-		fprintf(stderr, "Failed to get feature information\n");
-		return;
+	bool want_fw = what & (GATHER_FIRMWARE | GATHER_BOOTLOADER);
+
+	dev->fw_entities_count = 0;
+	// only answered lookups are cached, so a failed lookup of one feature
+	// leaves its index 0 and does not keep the other feature from being read
+	hidpp20_resolve_features(rcv, device_index,
+		want_fw ? featureIds : featureIds + 1,
+		(want_fw ? 1 : 0) + (what & GATHER_NAME ? 1 : 0));
+	name_index = what & GATHER_NAME ?
+		hidpp20_feature_index(rcv, device_index, FID_DEVICE_NAME) : 0;
+	fw_index = want_fw ?
+		hidpp20_feature_index(rcv, device_index, FID_DEVICE_FW_VERSION) : 0;
+
+	n = 0;
+	if (name_index) {
+		msg = hidpp20_init_req(&reqs[n++], device_index,
+			name_index, 0); // GetDeviceNameCount()
+		msg->report_id = LONG_MESSAGE;
+	}
+	if (fw_index) {
+		msg = hidpp20_init_req(&reqs[n++], device_index,
+			fw_index, 0); // GetEntityCount()
+		msg->report_id = LONG_MESSAGE;
+	}
+	if (n == 0) {
+		return false;
 	}
-	count = get_feature_count(fd, device_index, ifeatIndex);
-
-	printf("Total number of HID++ 2.0 features: %i\n", count);
-	for (i = 0; i <= count; i++) {
-		struct feature feat;
-		if (get_featureId(fd, device_index, ifeatIndex, i, &feat)) {
-			printf(" %2i: [%04X] %c%c%c %s\n", i, feat.featureId,
-				feat.featureType & FEAT_TYPE_OBSOLETE ? 'O' : ' ',
-				feat.featureType & FEAT_TYPE_SWHIDDEN ? 'H' : ' ',
-				feat.featureType & FEAT_TYPE_RSVD_INTERNAL ? 'I' : ' ',
-				get_feature_name(feat.featureId));
-			if (feat.featureType & ~FEAT_TYPE_MASK) {
-				printf("Warning: unrecognized feature flags: %#04x\n",
-					feat.featureType & ~FEAT_TYPE_MASK);
-			}
-		} else {
-			fprintf(stderr, "Failed to get feature, is device connected?\n");
+	// a timeout of one request does not discard the other responses
+	hidpp20_batch(rcv, reqs, n);
+	n = 0;
+	if (name_index) {
+		if (reqs[n].done && !reqs[n].error_type) {
+			name_len = REQ_MSG20(&reqs[n])->params[0];
 		}
+		n++;
+	}
+	if (fw_index && reqs[n].done && !reqs[n].error_type) {
+		fw_count = REQ_MSG20(&reqs[n])->params[0];
+	}
+	if (name_len > DEVICE_NAME_LONG_MAXLEN) {
+		name_len = DEVICE_NAME_LONG_MAXLEN;
+	}
+	if (fw_count > FW_ENTITIES_MAX) {
+		fw_count = FW_ENTITIES_MAX;
+	}
+
+	n = 0;
+	for (i = 0; i < name_len; i += 16) {
+		msg = hidpp20_init_req(&reqs[n++], device_index,
+			name_index, 1); // GetDeviceName(charIndex)
+		msg->report_id = LONG_MESSAGE;
+		msg->params[0] = i;
+	}
+	name_chunks = n;
+	for (i = 0; i < fw_count; i++) {
+		msg = hidpp20_init_req(&reqs[n++], device_index,
+			fw_index, 1); // GetFwInfo(entityIndex)
+		msg->report_id = LONG_MESSAGE;
+		msg->params[0] = i;
+	}
+	if (n == 0) {
+		return false;
+	}
+	hidpp20_batch(rcv, reqs, n);
+
+	// the name is only replaced if all parts arrived
+	for (i = 0; i < name_chunks && reqs[i].done && !reqs[i].error_type; i++) {
+		unsigned len = name_len - i * 16;
+		memcpy(name + i * 16, REQ_MSG20(&reqs[i])->params,
+			len > 16 ? 16 : len);
+	}
+	if (i == name_chunks && name_len > 0) {
+		memcpy(dev->name, name, name_len);
+		dev->name[name_len] = 0;
+	}
+
+	for (i = name_chunks; i < n; i++) {
+		u8 *params = REQ_MSG20(&reqs[i])->params;
+		struct fw_entity *fw;
+
+		if (!reqs[i].done || reqs[i].error_type) {
+			continue;
+		}
+		fw = &dev->fw_entities[dev->fw_entities_count++];
+		fw->type = params[0] & 0x0F;
+		memcpy(fw->prefix, &params[1], 3);
+		fw->prefix[3] = 0;
+		fw->number = params[4];
+		fw->revision = params[5];
+		fw->build = (params[6] << 8) | params[7];
+	}
+	return dev->fw_entities_count > 0;
+}
+
+// Charging status for BatteryStatus (0x1000) GetBatteryLevelStatus
+const char *
+hidpp20_battery_status_str(u8 status) {
+	if (status < ARRAY_SIZE(proto_battery_status)) {
+		return proto_battery_status[status];
 	}
-	puts("(O = obsolete feature; H = SW hidden feature;\n"
-		" I = reserved for internal use)");
+	return "unknown";
 }
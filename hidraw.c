@@ -2,7 +2,8 @@
  * Displays a more human-readable interpretation of the USB data payload
  * for Logitech Unifying Receiver.
  *
- * Example usage: read-dev-usbmon /dev/usbmon0 | hidraw
+ * Example usage: hidraw /dev/hidraw0
+ * hidraw /dev/hidraw0 file.ltcap records a capture, hidraw file.ltcap shows it.
  *
  * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
  *
@@ -24,298 +25,117 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
-#include <stdbool.h>
+#include <stdlib.h> /* getenv */
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/time.h> /* gettimeofday */
 
-typedef unsigned char u8;
+#include "decode.h"
+#include "capture.h"
 
-#define SHORT_MSG	0x10
-#define SHORT_MSG_LEN	7
-#define DJ_SHORT	0x20
-#define DJ_SHORT_LEN	15
-#define DJ_LONG		0x21
-#define DJ_LONG_LEN	32
-#define LONG_MSG	0x11
-#define LONG_MSG_LEN	20
+#define OUT_SIZE	(64 * 1024)
 
-struct payload_short {
-	u8 address;
-	u8 value[3];
-};
-struct payload_long {
-	u8 address;
-	u8 str[16];
-};
-struct report {
-	u8 report_id;
-	u8 device_index;
-	u8 sub_id;
-	union {
-		struct payload_long l;
-		struct payload_short s;
-	};
-} __attribute__((__packed__));
+static struct fmt_buf out;
 
-/* types for HID++ report IDs 0x10 and 0x11 */
-static const char * report_types[0x100] = {
-	[0x00] = "_HIDPP20", // fake type
-	// 0x00 - 0x3F HID reports
-	[0x01] = "KEYBOARD",
-	[0x02] = "MOUSE",
-	[0x03] = "CONSUMER_CONTROL",
-	[0x04] = "SYSTEM_CONTROL",
+static volatile sig_atomic_t stop;
 
-	[0x08] = "MEDIA_CENTER",
-
-	[0x0E] = "LEDS",
-
-	// 0x40 - 0x7F enumerator notifications
-	[0x40] = "NOTIF_DEVICE_UNPAIRED",
-	[0x41] = "NOTIF_DEVICE_PAIRED",
-	[0x42] = "NOTIF_CONNECTION_STATUS",
-	[0x4A] = "NOTIF_RECV_LOCK_CHANGED",
-	[0x4B] = "?NOTIF_PAIR_ACCEPTED",
-
-	[0x7F] = "NOTIF_ERROR",
-
-	// 0x80 - 0xFF enumerator commands; Register Access
-	[0x80] = "SET_REG", // was CMD_SWITCH
-	[0x81] = "GET_REG", // was CMD_GET_PAIRED_DEVICES
-	[0x82] = "SET_LONG_REG",
-	[0x83] = "GET_LONG_REG",
-	[0x8F] = "_ERROR_MSG",
-	[0xFF] = "_HIDPP20_ERROR_MSG",
-};
-
-/* types for DJ report IDS 0x20 and 0x21 */
-static const char *dj_report_types[0x100] = {
-	/* 0x00 - 0x3F: RF reports */
-	[0x01] = "KEYBOARD",
-	[0x02] = "MOUSE",
-	[0x03] = "CONSUMER_CONTROL",
-	[0x04] = "SYSTEM_CONTROL",
-	[0x08] = "MEDIA_CENTER",
-	[0x0E] = "KEYBOARD_LEDS",
-
-	/* 0x40 - 0x7F: DJ notifications */
-	[0x40] = "NOTIF_DEVICE_UNPAIRED",
-	[0x41] = "NOTIF_DEVICE_PAIRED",
-	[0x42] = "NOTIF_CONNECTION_STATUS",
-
-	[0x7F] = "NOTIF_ERROR",
-
-	/* 0x80 - 0xFF: DJ commands */
-	[0x80] = "CMD_SWITCH_N_KEEPALIVE",
-	[0x81] = "CMD_GET_PAIRED_DEVICES"
-};
-
-static const char * error_messages[0x100] = {
-	// error messages for type=8F (ERROR_MSG)
-	[0x00] = "SUCCESS",
-	[0x01] = "INVALID_SUBID",
-	[0x02] = "INVALID_ADDRESS",
-	[0x03] = "INVALID_VALUE",
-	[0x04] = "CONNECT_FAIL",
-	[0x05] = "TOO_MANY_DEVICES",
-	[0x06] = "ALREADY_EXISTS",
-	[0x07] = "BUSY",
-	[0x08] = "UNKNOWN_DEVICE",
-	[0x09] = "RESOURCE_ERROR",
-	[0x0A] = "REQUEST_UNAVAILABLE",
-	[0x0B] = "INVALID_PARAM_VALUE",
-	[0x0C] = "WRONG_PIN_CODE",
-};
-
-// I don't know the upper bound, perhaps 0x10 is enough
-static const char * error_messages_hidpp20[0x100] = {
-	[0x00] = "NoError",
-	[0x01] = "Unknown",
-	[0x02] = "InvalidArgument",
-	[0x03] = "OutOfRange",
-	[0x04] = "HWError",
-	[0x05] = "Logitech internal",
-	[0x06] = "INVALID_FEATURE_INDEX",
-	[0x07] = "INVALID_FUNCTION_ID",
-	[0x08] = "Busy",
-	[0x09] = "Unsupported",
-};
-
-// everything with a '?' is guessed
-static const char * registers[0x100] = {
-	[0x00] = "ENABLED_NOTIFS",
-	[0x01] = "KBD_HAND_DETECT?",
-	[0x02] = "CONNECTION_STATE",
-	[0x07] = "BATTERY?",
-	[0x09] = "FN_KEY_SWAP?",
-	[0x17] = "ILLUMINATION_INFO?",
-	[0xb2] = "DEVICE_PAIRING",
-	[0xb3] = "DEVICE_ACTIVITY",
-	[0xb5] = "PAIRING_INFO",
-	[0xf1] = "VERSION_INFO?",
-};
-
-bool report_type_is_hidpp(u8 report_id) {
-	return report_id == SHORT_MSG || report_id == LONG_MSG;
-}
-bool report_type_is_dj(u8 report_id) {
-	return report_id == DJ_SHORT || report_id == DJ_LONG;
+static void handle_stop(int sig) {
+	(void) sig;
+	stop = 1;
 }
 
-const char * report_type_str(u8 report_id, u8 type) {
-	const char *str = NULL;
-	if (report_type_is_hidpp(report_id))
-		str = report_types[type];
-	else if (report_type_is_dj(report_id))
-		str = dj_report_types[type];
-	return str ? str : "";
-}
-const char * device_type_str(u8 type) {
-	switch (type) {
-	case 0x01: return "DEV1";
-	case 0x02: return "DEV2";
-	case 0x03: return "DEV3";
-	case 0x04: return "DEV4";
-	case 0x05: return "DEV5";
-	case 0x06: return "DEV6";
-	case 0xFF: return "RECV";
-	default: return "";
-	}
-}
-const char *error_str(u8 er) {
-	const char * str = error_messages[er];
-	return str ? str : "";
-}
-const char *error_str_hidpp20(u8 er) {
-	const char * str = error_messages_hidpp20[er];
-	return str ? str : "";
-}
-const char *register_str(u8 reg) {
-	const char * str = registers[reg];
-	return str ? str : "";
+static bool print_record(const struct capture_record *rec, void *data) {
+	capture_fmt_record(&out, rec, *(bool *) data);
+	return true;
 }
 
-void process_msg_payload(struct report *r, u8 data_len) {
-	u8 pos, i;
-	u8 * bytes = (u8 *) &r->s;
+// Decodes a capture that was written by "hidraw /dev/hidrawN file".
+static int read_capture(const char *path) {
+	FILE *fp = fopen(path, "rb");
+	bool use_hex = getenv("HEX") != NULL, ok;
 
-	pos = 0; // nothing has been processed
-
-	if (report_type_is_hidpp(r->report_id))
-	switch (r->sub_id) {
-	case 0x00: // assume HID++ 2.0 request/response for feature IRoot
-		if (data_len == 4 || data_len == 17) {
-			printf("func=%X  ", bytes[0] >> 4);
-			printf("swId=%X  ", bytes[0] & 0xF);
-			pos = 1;
-		}
-		break;
-	case 0xFF: // assume HID++ 2.0 error
-		if (data_len == 17) {
-			printf("feat=%X  ", bytes[0]);
-			printf("func=%X  ", bytes[1] >> 4);
-			printf("swId=%X  ", bytes[1] & 0xF);
-			printf("err=%02X %s  ", bytes[2], error_str_hidpp20(bytes[2]));
-			pos = 3;
-		}
-		break;
-	case 0x8F: // error
-		// TODO: length check
-		printf("SubID=%02X %s  ", bytes[0], report_type_str(r->report_id, bytes[0]));
-		printf("reg=%02X %s  ", bytes[1], register_str(bytes[1]));
-		printf("err=%02X %s  ", bytes[2], error_str(bytes[2]));
-		pos = 4; // everything is processed
-		break;
-	case 0x80:
-	case 0x81:
-	case 0x82: /* long */
-	case 0x83: /* long */
-		printf("reg=%02X %s  ", bytes[0], register_str(bytes[0]));
-		pos = 1;
-		break;
-	}
-
-	if (pos < data_len) {
-		printf("params=");
-		//printf("params(len=%02X)=", data_len);
-	}
-	for (i = 0; pos < data_len; pos++, i++) {
-		printf("%02X ", bytes[pos]);
-		if (i % 4 == 3 && pos + 1 < data_len) {
-			putchar(' ');
-		}
+	if (!fp) {
+		perror(path);
+		return 1;
 	}
+	ok = capture_read(fp, print_record, &use_hex);
+	fclose(fp);
+	return fmt_flush(&out) && ok ? 0 : 1;
 }
 
-void process_msg(struct report *report, ssize_t size) {
-	const char * report_type;
+// Stores the reports of fd in a capture until interrupted.
+static int record_capture(int fd, const char *path) {
+	struct capture_writer *writer = capture_create(path);
+	struct sigaction sa;
+	ssize_t r;
 
-	switch (report->report_id) {
-	case SHORT_MSG:
-		report_type = "short";
-		if (size != SHORT_MSG_LEN) {
-			fprintf(stderr, "Invalid short msg len %zi\n", size);
-			return;
-		}
-		break;
-	case LONG_MSG:
-		report_type = "long";
-		if (size != LONG_MSG_LEN) {
-			fprintf(stderr, "Invalid long msg len %zi\n", size);
-			return;
-		}
-		break;
-	case DJ_SHORT:
-		report_type = "dj_s";
-		if (size != DJ_SHORT_LEN) {
-			fprintf(stderr, "Invalid DJ short msg len %zi\n", size);
-			return;
+	if (!writer) {
+		return 1;
+	}
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = handle_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	while (!stop) {
+		struct capture_record rec;
+		struct timeval tval;
+
+		r = read(fd, rec.data, sizeof rec.data);
+		if (r < 0 && errno == EINTR) {
+			continue;
 		}
-		break;
-	case DJ_LONG:
-		report_type = "dj_l";
-		if (size != DJ_LONG_LEN) {
-			fprintf(stderr, "Invalid DJ long msg len %zi\n", size);
-			return;
+		if (r <= 0) {
+			if (r < 0) {
+				perror("read");
+			}
+			break;
 		}
-		break;
-	default:
-		report_type = "unkn";
-		//fprintf(stderr, "Unknown report ID %02x, len=%zi\n", report->report_id, size);
-		if (size < 3) {
-			return;
+		gettimeofday(&tval, NULL);
+		rec.time_us = tval.tv_sec * 1000000ULL + tval.tv_usec;
+		rec.busnum = rec.devnum = 0;
+		rec.is_write = false;
+		rec.length = r;
+		if (!capture_add(writer, &rec)) {
+			break;
 		}
-		break;
 	}
-
-	printf("report_id=%02X %-5s ", report->report_id, report_type);
-	printf("device=%02X %-4s ", report->device_index,
-			device_type_str(report->device_index));
-	printf("type=%02X %-23s ", report->sub_id,
-			report_type_str(report->report_id, report->sub_id));
-
-	if (size > 3) {
-		process_msg_payload(report, size - 3);
-	}
-	putchar('\n');
+	close(fd);
+	return capture_close(writer) ? 0 : 1;
 }
 
-#ifndef NO_MAIN
 int main(int argc, char ** argv) {
+	static char out_data[OUT_SIZE];
 	int fd = STDIN_FILENO;
 	ssize_t r;
 	struct report report;
 
+	fmt_init(&out, STDOUT_FILENO, out_data, sizeof out_data);
+	if (argc >= 2 && capture_is_capture(argv[1])) {
+		return read_capture(argv[1]);
+	}
 	if (argc >= 2 && (fd = open(argv[1], O_RDONLY)) < 0) {
 		perror(argv[1]);
 		return 1;
 	}
+	if (argc >= 3) {
+		return record_capture(fd, argv[2]);
+	}
 
 	do {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
 		memset(&report, 0xCC, sizeof report); // for debugging purposes
 		r = read(fd, &report, sizeof report);
 		if (r > 0) {
-			process_msg(&report, r);
+			fmt_msg(&out, &report, r);
+		}
+		// write the output once no more reports are pending
+		if (poll(&pfd, 1, 0) == 0) {
+			fmt_flush(&out);
 		}
-	} while (r >= 0);
+	} while (r > 0);
+	fmt_flush(&out);
 
 	if (r < 0) {
 		perror("read");
@@ -325,4 +145,3 @@ int main(int argc, char ** argv) {
 
 	return 0;
 }
-#endif /* ! NO_MAIN */
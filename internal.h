@@ -0,0 +1,61 @@
+/*
+ * Private helpers shared by the libltunify sources.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LTUNIFY_INTERNAL_H
+#define LTUNIFY_INTERNAL_H
+
+#include <stdio.h>
+#include "hidpp.h"
+
+// set rcv->debug to print very verbose details, the reports are in the ring
+#define DPRINTF(rcv, ...) if ((rcv)->debug) { fprintf(stderr, __VA_ARGS__); }
+
+extern struct lt_io_stats lt_io_stats;
+
+void lt_process_report(struct lt_receiver *rcv, const void *data, size_t length);
+void lt_expire_requests(struct lt_receiver *rcv);
+
+bool lt_uring_process(struct lt_uring *uring, int timeout);
+bool lt_uring_write(struct lt_receiver *rcv, const void *report, size_t length);
+void lt_uring_detach(struct lt_receiver *rcv);
+int lt_uring_fd(struct lt_uring *uring);
+
+/* Entries of the report ring, see ring.c */
+enum lt_ring_kind {
+	RING_WRITE,
+	RING_READ, // replaced by one of the following once it is processed
+	RING_RESPONSE,
+	RING_ERROR,
+	RING_NOTIFICATION,
+	RING_IGNORED,
+	RING_TIMEOUT, // data is the request
+};
+
+struct lt_ring *lt_ring_new(struct lt_receiver *rcv);
+void lt_ring_free(struct lt_ring *ring);
+void lt_ring_add(struct lt_ring *ring, enum lt_ring_kind kind,
+	const void *data, size_t length);
+void lt_ring_mark(struct lt_ring *ring, enum lt_ring_kind kind);
+void lt_trace_add(struct lt_trace *trace, bool is_write, const void *data,
+	size_t length);
+void lt_trace_close(struct lt_trace *trace);
+void lt_serial_index_process_notification(struct lt_receiver *rcv,
+	struct hidpp_message *msg);
+
+#endif /* LTUNIFY_INTERNAL_H */
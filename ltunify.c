@@ -18,1248 +18,3499 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h> /* strcasecmp */
 #include <stdbool.h>
-#include <errno.h>
 #include <stdlib.h> /* strtoul */
 #include <stdint.h> /* uint16_t */
-#include <arpa/inet.h> /* ntohs, ntohl */
-#include <glob.h> /* for /dev/hidrawX discovery */
 #include <getopt.h> /* for getopt_long */
 #include <poll.h>
-#include <libgen.h> /* for basename, used during discovery */
-#include <time.h> /* needs -lrt, for clock_gettime as timeout helper */
+#include <errno.h>
+#include <signal.h>
+#include <arpa/inet.h> /* ntohl */
+#include <sys/resource.h> /* getrusage */
+#include <time.h> /* clock_gettime */
+
+#include "hidpp.h"
+#include "decode.h"
+#include "capture.h"
 
 #ifndef PACKAGE_VERSION
 #	define PACKAGE_VERSION "0.2"
 #endif
 
-#define ARRAY_SIZE(a) (sizeof (a) / sizeof *(a))
-
 // pass -D option to print very verbose details like protocol communication
 static bool debug_enabled;
 #define DPRINTF(...) if (debug_enabled) { fprintf(stderr, __VA_ARGS__); }
 
-typedef unsigned char u8;
-
-#define VID_LOGITECH		0x046d
-#define PID_NANO_RECEIVER	0xc52f
-
-#define HEADER_SIZE		3
-#define SHORT_MESSAGE           0x10
-#define SHORT_MESSAGE_LEN       7
-#define LONG_MESSAGE            0x11
-#define LONG_MESSAGE_LEN        20
-
-#define DEVICE_RECEIVER         0xFF
-
-#define SUB_SET_REGISTER        0x80
-#define SUB_GET_REGISTER        0x81
-#define SUB_SET_LONG_REGISTER   0x82
-#define SUB_GET_LONG_REGISTER   0x83
-#define SUB_ERROR_MSG           0x8F
-
-#define NOTIF_DEV_DISCONNECT	0x40 /* Device Disconnection */
-#define NOTIF_DEV_CONNECT	0x41 /* Device Connection */
-#define NOTIF_RECV_LOCK_CHANGE	0x4A /* Unifying Receiver Locking Change information */
-
-#define REG_ENABLED_NOTIFS      0x00
-#define REG_CONNECTION_STATE    0x02
-/* Device Connection and Disconnection (Pairing) */
-#define REG_DEVICE_PAIRING      0xB2
-#define REG_DEVICE_ACTIVITY     0xB3
-#define REG_PAIRING_INFO        0xB5
-#define REG_VERSION_INFO	0xF1 /* undocumented */
-
-// Used for: {GET,SET}_REGISTER_{REQ,RSP}, SET_LONG_REGISTER_RSP, GET_LONG_REGISTER_REQ
-struct msg_short {
-        u8 address;
-        u8 value[3];
-};
-// Used for: SET_LONG_REGISTER_REQ, GET_LONG_REGISTER_RSP
-struct msg_long {
-        u8 address;
-        u8 str[16];
-};
-// Used for: ERROR_MSG
-struct msg_error {
-        u8 sub_id;
-        u8 address;
-        u8 error_code;
-        u8 padding; /* set to 0 */
-};
-
-// 0x00 Enable HID++ Notifications
-struct msg_enable_notifs {
-	u8 reporting_flags_devices; // bit 4 Battery status
-	u8 reporting_flags_receiver; // bit 0 Wireless notifications, 3 Software Present
-	u8 reporting_flags_receiver2; // (reserved)
-};
+// --record and --replay traces, see trace.c
+static const char *record_path;
+static const char *replay_path;
+static bool replay_realtime;
+// --simulate, number of simulated receivers (see simulate.c)
+static unsigned simulate_count;
+// --io-uring, see uring.c
+static bool use_uring;
+// --keep-notifs, wireless notifications that were enabled are not disabled
+static bool keep_notifs;
+// --fields, the device information that info and list fetch and print
+#define FIELDS_MAX	16
+static unsigned fields[FIELDS_MAX], fields_count;
+
+// serial number index, see serials.c
+static struct lt_serial_index *serial_index;
+
+#define RECEIVERS_MAX	64
+#define SERIALS_MAX	(RECEIVERS_MAX * DEVICES_MAX)
 
-// long receiver resp - 0xB5 Pairing information, 0x03 - "Receiver information"? (undocumented)
-struct msg_receiver_info {
-	u8 _dunno1; // always 0x03 for receiver?
-	u8 serial_number[4];
-	u8 _dunno2; // 06 - Max Device Capability? (not sure, but it is six)
-	u8 _dunno3;
-	u8 padding[8]; // 00 00 00 00  00 00 00 00 - ??
-};
+static void print_device_types(void) {
+	unsigned i;
 
-// 0xB5 Pairing information, 0x20..0x2F - Unifying Device pairing information
-struct msg_dev_pair_info {
-	u8 requested_field; // 0x20..0x25
-	u8 dest_id;
-	u8 report_interval; // ms
-	u8 pid_msb;
-	u8 pid_lsb;
-	u8 _reserved1[2];
-	u8 device_type;
-	u8 _reserved2[6];
-};
-// 0xB5 Pairing information, 0x30..0x3F - Unifying Device extended pairing info
-struct msg_dev_ext_pair_info {
-	u8 requested_field; // 0x30..0x35
-	u8 serial_number[4]; // index 0 is MSB
-	u8 report_types[4]; // index 0 is MSB
-	u8 usability_info; // bits 0..3 is location of power switch
-};
-// 0xB5 Pairing information, 0x40..0x4F - Unifying Device name
-#define DEVICE_NAME_MAXLEN 14
-struct msg_dev_name {
-	u8 requested_field; // 0x40..0x45
-	u8 length;
-	char str[DEVICE_NAME_MAXLEN]; // UTF-8 encoding
-};
+	// skip "Unknown" type
+	for (i = 1; i < 0x10; i++) {
+		if (device_type_name(i)) {
+			fprintf(stderr, " %s", device_type_name(i));
+		}
+	}
+	putchar('\n');
+}
 
-struct notif_devcon {
-#define DEVCON_PROT_UNIFYING	0x04
-	u8 prot_type; // bits 0..2 is protocol type (4 for unifying), 3..7 is reserved
-#define DEVCON_DEV_TYPE_MASK	0x0f
-// Link status: 0 is established (in range), 1 is not established (out of range)
-#define DEVCON_LINK_STATUS_FLAG	0x40
-	u8 device_info;
-	// wireless product id:
-	u8 pid_lsb;
-	u8 pid_msb;
-};
+static void print_notifications(const struct msg_enable_notifs *notifs) {
+	u8 flags = notifs->reporting_flags_receiver;
 
-// Register 0x02 Connection State
-struct val_reg_connection_state {
-// 0x02 triggers a 0x41 notification for all known devices
-#define CONSTATE_ACTION_LIST_DEVICES	0x02
-	u8 action; // always 0 for read
-	u8 connected_devices_count;
-	u8 _undocumented2;
-};
+	putchar('\n');
+	printf("Reporting Flags (Receiver) = %02x\n", flags & 0xFF);
+	printf("Wireless notifications     = %s\n", flags & 1 ? "yes" : "no");
+	printf("Software Present           = %s\n", flags & 4 ? "yes" : "no");
+}
 
-// Register 0xB2 Device Connection and Disconnection (Pairing)
-struct val_reg_devpair {
-#define DEVPAIR_KEEP_LOCK	0
-#define DEVPAIR_OPEN_LOCK	1
-#define DEVPAIR_CLOSE_LOCK	2
-#define DEVPAIR_DISCONNECT	3
-	u8 action;
-	u8 device_number; // same as device index from 0x41 notif
-	u8 open_lock_timeout; // timeout in seconds, 0 = default (30s)
-};
+bool get_and_print_notifications(struct lt_receiver *rcv, u8 device_index,
+	struct msg_enable_notifs *notifsp) {
+	if (get_notifications(rcv, device_index, notifsp)) {
+		print_notifications(notifsp);
+		return true;
+	} else {
+		putchar('\n');
+		fprintf(stderr, "Failed to get HID++ Notification status\n");
+		return false;
+	}
+}
 
-// Register 0xF1 Version Info (undocumented)
-struct val_reg_version {
-// v1.v2.xxx
-#define VERSION_FIRMWARE	1
-// x.x.v1v2
-#define VERSION_FW_BUILD	2
-// value 3 is invalid for receiver, but returns 00 07 for keyboard
-// BL.v1.v2
-#define VERSION_BOOTLOADER	4
-	u8 select_field;
-	u8 v1;
-	u8 v2;
+struct pair_state {
+	bool done;
+	u8 new_device; // index of the paired device
+	bool was_present[DEVICES_MAX];
 };
 
-struct hidpp_message {
-        u8 report_id;
-        u8 device_index;
-        u8 sub_id;
-        union {
-                struct msg_short msg_short;
-                struct msg_long msg_long;
-                struct msg_error msg_error;
-        };
-};
+// Called after the library has updated the device list.
+static void pair_notif(struct lt_receiver *rcv, struct hidpp_message *msg,
+	void *data) {
+	struct pair_state *state = data;
 
-struct hidpp_version {
-	u8 major;
-	u8 minor;
-};
+	if (state->done) {
+		return;
+	}
+	if (msg->sub_id == NOTIF_RECV_LOCK_CHANGE) {
+		u8 *bytes = (u8 *) &msg->msg_short;
+		if (msg->report_id != SHORT_MESSAGE || msg->device_index != DEVICE_RECEIVER) {
+			// error message is already emitted
+			return;
+		}
+		if (!(bytes[0] & 1)) { // locking closed
+			const char *result;
+			switch (bytes[1]) {
+			case 0x00:
+				result = "Success";
+				break;
+			case 0x01:
+				result = "Timeout";
+				break;
+			default:
+				result = "Failure";
+			}
+			printf("Pairing result: %s (%i)\n", result, bytes[1]);
+			state->done = true;
+		}
+	} else if (msg->sub_id == NOTIF_DEV_CONNECT) {
+		u8 device_index = msg->device_index;
+		struct device *dev;
 
-struct version {
-	u8 fw_major;
-	u8 fw_minor;
-	uint16_t fw_build;
-	u8 bl_major;
-	u8 bl_minor;
-};
+		if (device_index < 1 || device_index > DEVICES_MAX) {
+			fprintf(stderr, "Invalid device index %#04x\n", device_index);
+			return;
+		}
+		dev = &rcv->devices[device_index - 1];
+		if (!dev->device_present) {
+			// error message is already emitted
+		} else if (!state->was_present[device_index - 1]) {
+			printf("Found new device, id=%#04x %s\n",
+				device_index,
+				device_type_str(dev->device_type));
+			state->new_device = device_index;
+			state->done = true;
+		} else {
+			printf("Ignoring existent device id=%#04x\n", device_index);
+		}
+	}
+}
 
-#define DEVICES_MAX	6u
-struct device {
-	bool device_present; // whether the device is paired
-	bool device_available; // whether the device is connected
-	u8 device_type;
-	uint16_t wireless_pid;
-	char name[DEVICE_NAME_MAXLEN + 1]; // include NUL byte
-	uint32_t serial_number;
-	u8 power_switch_location;
-	struct hidpp_version hidpp_version;
-	struct version version;
-};
-struct device devices[DEVICES_MAX];
+void perform_pair(struct lt_receiver *rcv, u8 timeout) {
+	struct pair_state state;
+	long long unsigned deadline;
+	unsigned i;
 
-struct receiver_info {
-	uint32_t serial_number;
-	struct version version;
-};
+	if (timeout == 0) {
+		timeout = 30;
+	}
+	memset(&state, 0, sizeof state);
+	for (i = 0; i < DEVICES_MAX; i++) {
+		state.was_present[i] = rcv->devices[i].device_present;
+	}
+	if (!pair_start(rcv, timeout)) {
+		fprintf(stderr, "Failed to send pair request\n");
+		return;
+	}
+	puts("Please turn your wireless device off and on to start pairing.");
+	lt_set_notify_callback(rcv, pair_notif, &state);
+	deadline = get_timestamp_ms() + timeout * 1000 + 2000;
+	while (!state.done) {
+		long long unsigned now = get_timestamp_ms();
+		if (now >= deadline) {
+			fprintf(stderr, "Failed to read short message\n");
+			break;
+		}
+		if (!lt_poll(rcv, deadline - now)) {
+			break;
+		}
+	}
+	lt_set_notify_callback(rcv, NULL, NULL);
+	if (!pair_cancel(rcv)) {
+		fprintf(stderr, "Failed to cancel pair visibility\n");
+	}
+	if (state.new_device) {
+		// adds the device to the serial number index
+		get_device_ext_pair_info(rcv, state.new_device);
+	}
+}
+void perform_unpair(struct lt_receiver *rcv, u8 device_index) {
+	struct device *dev = &rcv->devices[device_index - 1];
+	u8 dev_device_type = dev->device_type; // will be overwritten, therefore store it
+	if (!dev->device_present) {
+		printf("Device %#04x does not appear to be paired\n", device_index);
+		return;
+	}
+	if (device_unpair(rcv, device_index)) {
+		if (!dev->device_present) {
+			printf("Device %#04x %s successfully unpaired\n", device_index,
+				device_type_str(dev_device_type));
+		} else {
+			fprintf(stderr, "Unpairing of %#04x possibly failed\n", device_index);
+		}
+	} else {
+		fprintf(stderr, "Failed to send unpair %#04x request\n", device_index);
+	}
+}
 
-struct receiver_info receiver;
-
-// error messages for type=8F (ERROR_MSG)
-static const char * error_messages[0x100] = {
-	[0x00] = "SUCCESS",
-	[0x01] = "INVALID_SUBID",
-	[0x02] = "INVALID_ADDRESS",
-	[0x03] = "INVALID_VALUE",
-	[0x04] = "CONNECT_FAIL",
-	[0x05] = "TOO_MANY_DEVICES",
-	[0x06] = "ALREADY_EXISTS",
-	[0x07] = "BUSY",
-	[0x08] = "UNKNOWN_DEVICE",
-	[0x09] = "RESOURCE_ERROR",
-	[0x0A] = "REQUEST_UNAVAILABLE",
-	[0x0B] = "INVALID_PARAM_VALUE",
-	[0x0C] = "WRONG_PIN_CODE",
-};
+void print_versions(struct version *ver) {
+	// versions are shown as hex. Probably a mistake given that the length
+	// is 3 which can fit 255 instead of FF (and 65535 instead of FF)
+	printf("Firmware version: %03x.%03x.%05x\n",
+			ver->fw_major, ver->fw_minor, ver->fw_build);
+	printf("Bootloader version: BL.%03x.%03x\n",
+			ver->bl_major, ver->bl_minor);
+}
 
-static const char * device_type[0x10] = {
-	[0x00] = "Unknown",
-	[0x01] = "Keyboard",
-	[0x02] = "Mouse",
-	[0x03] = "Numpad",
-	[0x04] = "Presenter",
-	// 0x05..0x07 Reserved for future
-	[0x08] = "Trackball",
-	[0x09] = "Touchpad",
-	// 0x0A..0x0F Reserved
-};
+void get_and_print_recv_info(struct lt_receiver *rcv) {
+	struct receiver_info *info = &rcv->info;
 
-const char *device_type_str(u8 type) {
-	if (type > 0x0F) {
-		return "(invalid)";
+	if (get_receiver_info(rcv, info)) {
+		printf("Serial number: %08X\n", info->serial_number);
 	}
-	if (device_type[type]) {
-		return device_type[type];
+	if (get_device_versions(rcv, DEVICE_RECEIVER, &info->version)) {
+		print_versions(&info->version);
 	}
-	return "(reserved)";
 }
 
-// returns device type index or -1 if the string is invalid
-int device_type_from_str(const char *str) {
-	unsigned i;
+static const char *
+fw_type_str(u8 type) {
+	switch (type) {
+	case FW_TYPE_MAIN: return "Firmware";
+	case FW_TYPE_BOOTLOADER: return "Bootloader";
+	case FW_TYPE_HARDWARE: return "Hardware";
+	default: return "Other";
+	}
+}
 
-	// skip "Unknown" type
-	for (i = 1; i < ARRAY_SIZE(device_type); i++) {
-		if (device_type[i] && !strcasecmp(device_type[i], str)) {
-			return i;
+void
+hidpp20_print_fw_entities(struct device *dev) {
+	u8 i;
+
+	for (i = 0; i < dev->fw_entities_count; i++) {
+		struct fw_entity *fw = &dev->fw_entities[i];
+		if (fw->type == FW_TYPE_HARDWARE) {
+			printf("%s version: %02x\n", fw_type_str(fw->type),
+				fw->number);
+			continue;
 		}
+		// versions are BCD-encoded
+		printf("%s version: %s %02x.%02x.B%04X\n", fw_type_str(fw->type),
+			fw->prefix, fw->number, fw->revision, fw->build);
 	}
+}
 
-	return -1;
+void
+hidpp20_print_features(struct lt_receiver *rcv, u8 device_index) {
+	struct hidpp2_message res;
+	u8 i, count;
+
+	// GetCount()
+	if (hidpp20_call(rcv, device_index, FID_IFEATURESET, 0, NULL, 0, &res)) {
+		fprintf(stderr, "Failed to get feature information\n");
+		return;
+	}
+	count = res.params[0];
+
+	printf("Total number of HID++ 2.0 features: %i\n", count);
+	for (i = 0; i <= count; i++) {
+		struct feature feat;
+		// GetFeatureId(featureIndex)
+		if (!hidpp20_call(rcv, device_index, FID_IFEATURESET, 1, &i, 1, &res)) {
+			feat.featureId = (res.params[0] << 8) | res.params[1];
+			feat.featureType = res.params[2];
+			printf(" %2i: [%04X] %c%c%c %s\n", i, feat.featureId,
+				feat.featureType & FEAT_TYPE_OBSOLETE ? 'O' : ' ',
+				feat.featureType & FEAT_TYPE_SWHIDDEN ? 'H' : ' ',
+				feat.featureType & FEAT_TYPE_RSVD_INTERNAL ? 'I' : ' ',
+				get_feature_name(feat.featureId));
+			if (feat.featureType & ~FEAT_TYPE_MASK) {
+				printf("Warning: unrecognized feature flags: %#04x\n",
+					feat.featureType & ~FEAT_TYPE_MASK);
+			}
+		} else {
+			fprintf(stderr, "Failed to get feature, is device connected?\n");
+		}
+	}
+	puts("(O = obsolete feature; H = SW hidden feature;\n"
+		" I = reserved for internal use)");
 }
-static void print_device_types(void) {
+
+// Performs a single call and prints the response or error.
+bool
+hidpp20_print_call(struct lt_receiver *rcv, u8 device_index, uint16_t featureId,
+	u8 func, const u8 *params, unsigned params_count) {
+	struct hidpp2_message res;
+	int r;
 	unsigned i;
 
-	// skip "Unknown" type
-	for (i = 1; i < ARRAY_SIZE(device_type); i++) {
-		if (device_type[i]) {
-			fprintf(stderr, " %s", device_type[i]);
-		}
+	r = hidpp20_call(rcv, device_index, featureId, func, params,
+		params_count, &res);
+	if (r == HIDPP20_CALL_UNSUPPORTED) {
+		fprintf(stderr, "Feature %04X (%s) is not supported\n",
+			featureId, get_feature_name(featureId));
+		return false;
+	} else if (r < 0) {
+		fprintf(stderr, "Failed to call feature %04X, is device connected?\n",
+			featureId);
+		return false;
+	} else if (r > 0) {
+		printf("Error: %#04x (%s)\n", r, hidpp20_error_str(r));
+		return false;
+	}
+
+	printf("Feature index: %#04x\n", res.feature_index);
+	printf("Response:");
+	for (i = 0; i < sizeof res.params; i++) {
+		printf(" %02x", res.params[i]);
 	}
 	putchar('\n');
+	return true;
 }
 
-static void dump_msg(struct hidpp_message *msg, size_t payload_size, const char *tag) {
-	size_t i;
+void print_detailed_device(struct lt_receiver *rcv, u8 device_index) {
+	struct device *dev = &rcv->devices[device_index - 1];
 
-	if (!debug_enabled) {
+	if (!dev->device_present) {
+		printf("Device %i is not paired\n", device_index);
 		return;
 	}
 
-	// HACK: do not mess with stderr colors
-	fflush(NULL);
-	printf("\033[34m");
-	printf("%s: ", tag);
-	for (i=0; i<payload_size; i++) {
-		printf("%02x%c", ((char *) msg)[i] & 0xFF,
-				i + 1 == payload_size ? '\n' : ' ');
+	if (dev->hidpp_version.major) {
+		printf("HID++ version: %i.%i\n", dev->hidpp_version.major, dev->hidpp_version.minor);
+	} else {
+		puts("HID++ version: unknown");
+	}
+	printf("Device index %i\n", device_index);
+	printf("%s\n", device_type_str(dev->device_type));
+	printf("Name: %s\n", dev->name);
+	printf("Wireless Product ID: %04X\n", dev->wireless_pid);
+	printf("Serial number: %08X\n", dev->serial_number);
+	if (dev->report_interval) {
+		printf("Report interval: %i ms\n", dev->report_interval);
+	}
+	if (dev->device_available && HIDPP_VERSION_IS_20(&dev->hidpp_version)) {
+		if (dev->fw_entities_count) {
+			hidpp20_print_fw_entities(dev);
+		} else if (hidpp20_feature_resolved(rcv, device_index,
+			FID_DEVICE_FW_VERSION) && !hidpp20_feature_index(rcv,
+			device_index, FID_DEVICE_FW_VERSION)) {
+			puts("No firmware information (feature 0x0003 not supported)");
+		} else {
+			puts("No firmware information (no answer to feature 0x0003)");
+		}
+	} else if (dev->device_available) {
+		print_versions(&dev->version);
+	} else {
+		puts("Device was unavailable, version information not available.");
+	}
+}
+void get_device_names(struct lt_receiver *rcv) {
+	u8 i;
+
+	for (i=0; i<DEVICES_MAX; i++) {
+		struct device *dev = &rcv->devices[i];
+		if (!dev->device_present) {
+			continue;
+		}
+
+		if (!get_device_name(rcv, i + 1)) {
+			fprintf(stderr, "Failed to read device name for idx=%i\n", i + 1);
+		}
 	}
-	printf("\033[m");
-	fflush(NULL);
 }
 
-static long long unsigned get_timestamp_ms(void) {
-	struct timespec tp;
-	clock_gettime(CLOCK_MONOTONIC, &tp);
-	return tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+static void print_version(void) {
+	fprintf(stderr,
+"Logitech Unifying tool version " PACKAGE_VERSION "\n"
+"Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>\n");
 }
 
-#include <execinfo.h>
-static ssize_t do_read(int fd, struct hidpp_message *msg, u8 expected_report_id, int timeout) {
-	ssize_t r;
-	size_t payload_size = LONG_MESSAGE_LEN;
-	long long unsigned begin_ms, end_ms;
+void print_all_devices(struct lt_receiver *rcv) {
+	unsigned i;
+	puts("Connected devices:");
+	for (i=0; i<DEVICES_MAX; i++) {
+		struct device *dev = &rcv->devices[i];
+		if (!dev->device_present) {
+			continue;
+		}
 
-	if (expected_report_id == SHORT_MESSAGE) {
-		payload_size = SHORT_MESSAGE_LEN;
+		printf("idx=%i\t%s\t%s\n", i + 1,
+			device_type_str(dev->device_type), dev->name);
 	}
+}
 
-	begin_ms = get_timestamp_ms();
+/* Device information that can be selected with --fields. */
+struct device_field {
+	const char *name;
+	const char *label; // in the output of info
+	unsigned gather; // parts to read, see gather_device_fields
+	bool listed; // known from the device list (0x41 notifications)
+};
 
-	while (timeout > 0) {
-		struct pollfd pollfd;
-		pollfd.fd = fd;
-		pollfd.events = POLLIN;
+enum {
+	FIELD_SERIAL, FIELD_NAME, FIELD_PID, FIELD_TYPE, FIELD_INTERVAL,
+	FIELD_HIDPP, FIELD_FIRMWARE, FIELD_BOOTLOADER, FIELD_FEATURES,
+};
 
-		r = poll(&pollfd, 1, timeout);
-		if (r < 0) {
-			perror("poll");
-			return 0;
-		} else if (r == 0) {
-			DPRINTF("poll timeout reached!\n");
-			// timeout
-			return 0;
+static const struct device_field device_fields[] = {
+	[FIELD_SERIAL] = { "serial", "Serial number", GATHER_SERIAL, false },
+	[FIELD_NAME] = { "name", "Name", GATHER_NAME, false },
+	[FIELD_PID] = { "pid", "Wireless Product ID", GATHER_PAIR_INFO, true },
+	[FIELD_TYPE] = { "type", "Type", GATHER_PAIR_INFO, true },
+	[FIELD_INTERVAL] = { "interval", "Report interval", GATHER_PAIR_INFO,
+		false },
+	[FIELD_HIDPP] = { "hidpp", "HID++ version", GATHER_HIDPP_VERSION,
+		false },
+	[FIELD_FIRMWARE] = { "firmware", "Firmware version", GATHER_FIRMWARE,
+		false },
+	[FIELD_BOOTLOADER] = { "bootloader", "Bootloader version",
+		GATHER_BOOTLOADER, false },
+	[FIELD_FEATURES] = { "features", "HID++ 2.0 features",
+		GATHER_HIDPP_VERSION, false },
+};
+
+// Parses a comma-separated list of field names into fields.
+static bool parse_fields(const char *str) {
+	char buf[256], *name, *saveptr;
+	unsigned i;
+
+	snprintf(buf, sizeof buf, "%s", str);
+	fields_count = 0;
+	for (name = strtok_r(buf, ",", &saveptr); name;
+		name = strtok_r(NULL, ",", &saveptr)) {
+		for (i = 0; i < ARRAY_SIZE(device_fields); i++) {
+			if (!strcasecmp(name, device_fields[i].name)) {
+				break;
+			}
 		}
+		if (i == ARRAY_SIZE(device_fields) || fields_count == FIELDS_MAX) {
+			fprintf(stderr, "Invalid field %s, choose from:", name);
+			for (i = 0; i < ARRAY_SIZE(device_fields); i++) {
+				fprintf(stderr, " %s", device_fields[i].name);
+			}
+			fputc('\n', stderr);
+			return false;
+		}
+		fields[fields_count++] = i;
+	}
+	return fields_count > 0;
+}
 
-		memset(msg, 0, payload_size);
-		r = read(fd, msg, payload_size);
-		if (r < 0) {
-			perror("read");
-			return 0;
-		} else if (r > 0) {
-			dump_msg(msg, r, "rd");
-			if (msg->report_id == expected_report_id) {
-				return r;
-			} else if (expected_report_id == 0 &&
-				(msg->report_id == SHORT_MESSAGE ||
-				msg->report_id == LONG_MESSAGE)) {
-				/* HACK: ping response for HID++ 2.0 is a LONG
-				 * message, but for HID++ 1.0 it is a SHORT one. */
-				return r;
-			} else {
-				DPRINTF("Skipping unexpected report ID %#x (want %#x)\n",
-					msg->report_id, expected_report_id);
+// The parts of the device information needed for the selected fields.
+static unsigned fields_gather(bool listed) {
+	unsigned i, what = 0;
+
+	for (i = 0; i < fields_count; i++) {
+		const struct device_field *field = &device_fields[fields[i]];
+		if (!listed || !field->listed) {
+			what |= field->gather;
+		}
+	}
+	return what;
+}
+
+static void format_field(struct lt_receiver *rcv, u8 device_index,
+	unsigned field, char *buf, size_t size) {
+	struct device *dev = &rcv->devices[device_index - 1];
+	struct hidpp2_message res;
+	u8 i, fw_type = field == FIELD_FIRMWARE ?
+		FW_TYPE_MAIN : FW_TYPE_BOOTLOADER;
+
+	snprintf(buf, size, "unknown");
+	switch (field) {
+	case FIELD_SERIAL:
+		snprintf(buf, size, "%08X", dev->serial_number);
+		break;
+	case FIELD_NAME:
+		snprintf(buf, size, "%s", dev->name);
+		break;
+	case FIELD_PID:
+		snprintf(buf, size, "%04X", dev->wireless_pid);
+		break;
+	case FIELD_TYPE:
+		snprintf(buf, size, "%s", device_type_str(dev->device_type));
+		break;
+	case FIELD_INTERVAL:
+		if (dev->report_interval) {
+			snprintf(buf, size, "%i ms", dev->report_interval);
+		}
+		break;
+	case FIELD_HIDPP:
+		if (dev->hidpp_version.major) {
+			snprintf(buf, size, "%i.%i", dev->hidpp_version.major,
+				dev->hidpp_version.minor);
+		}
+		break;
+	case FIELD_FIRMWARE:
+	case FIELD_BOOTLOADER:
+		if (!dev->device_available) {
+			break;
+		}
+		for (i = 0; HIDPP_VERSION_IS_20(&dev->hidpp_version) &&
+			i < dev->fw_entities_count; i++) {
+			struct fw_entity *fw = &dev->fw_entities[i];
+			if (fw->type == fw_type) {
+				snprintf(buf, size, "%s %02x.%02x.B%04X",
+					fw->prefix, fw->number, fw->revision,
+					fw->build);
+				return;
 			}
 		}
+		if (HIDPP_VERSION_IS_20(&dev->hidpp_version)) {
+			break;
+		} else if (field == FIELD_FIRMWARE) {
+			snprintf(buf, size, "%03x.%03x.%05x", dev->version.fw_major,
+				dev->version.fw_minor, dev->version.fw_build);
+		} else {
+			snprintf(buf, size, "BL.%03x.%03x", dev->version.bl_major,
+				dev->version.bl_minor);
+		}
+		break;
+	case FIELD_FEATURES:
+		// GetCount(), the feature list itself is only shown by info
+		if (HIDPP_VERSION_IS_20(&dev->hidpp_version) &&
+			!hidpp20_call(rcv, device_index, FID_IFEATURESET, 0, NULL,
+			0, &res)) {
+			snprintf(buf, size, "%i", res.params[0]);
+		} else if (dev->hidpp_version.major) {
+			snprintf(buf, size, "none");
+		}
+		break;
+	}
+}
+
+// info with --fields, only the selected fields are fetched and shown.
+static void print_device_fields(struct lt_receiver *rcv, u8 device_index) {
+	struct device *dev = &rcv->devices[device_index - 1];
+	char value[64];
+	unsigned i;
+
+	gather_device_fields(rcv, device_index, fields_gather(false));
+	if (!dev->device_present) {
+		printf("Device %i is not paired\n", device_index);
+		return;
+	}
+	for (i = 0; i < fields_count; i++) {
+		if (fields[i] == FIELD_FEATURES &&
+			HIDPP_VERSION_IS_20(&dev->hidpp_version)) {
+			hidpp20_print_features(rcv, device_index);
+			continue;
+		}
+		format_field(rcv, device_index, fields[i], value, sizeof value);
+		printf("%s: %s\n", device_fields[fields[i]].label, value);
+	}
+}
+
+// list with --fields, a line per paired device with the selected fields
+// separated by tabs. Type and PID come with the device list.
+static void print_all_device_fields(struct lt_receiver *rcv) {
+	unsigned what = fields_gather(true), i, j;
+	char value[64];
+
+	if (!get_all_devices(rcv)) {
+		fprintf(stderr, "Unable to request a list of paired devices\n");
+		return;
+	}
+	for (i = 0; i < DEVICES_MAX; i++) {
+		if (!rcv->devices[i].device_present) {
+			continue;
+		}
+		gather_device_fields(rcv, i + 1, what);
+		printf("idx=%i", i + 1);
+		for (j = 0; j < fields_count; j++) {
+			format_field(rcv, i + 1, fields[j], value, sizeof value);
+			printf("\t%s", value);
+		}
+		putchar('\n');
+	}
+}
+
+static void print_usage(const char *program_name) {
+	fprintf(stderr, "Usage: %s [options] cmd [cmd options]\n",
+		program_name);
+	print_version();
+	fprintf(stderr,
+"\n"
+"Generic options:\n"
+"  -d, --device path Bypass detection, specify custom hidraw device.\n"
+"  -D                Print debugging information and the recent reports of\n"
+"                    every receiver when it is closed (or on SIGUSR1)\n"
+"  -h, --help        Show this help message\n"
+"  --record file     Record all reports of the receiver to a trace file\n"
+"  --replay file     Use the reports from a trace instead of a receiver\n"
+"  --realtime        Replay with the recorded latency instead of none\n"
+"  --simulate n      Use n simulated receivers with DFU-capable devices\n"
+"  --io-uring        Use io_uring instead of poll and read/write if available\n"
+"  --keep-notifs     Leave wireless notifications enabled after a command\n"
+"                    (saves two requests on every following command)\n"
+"  --fields f[,f..]  Only fetch and show these fields in info and list:\n"
+"                    serial, name, pid, type, interval, hidpp, firmware,\n"
+"                    bootloader and features\n"
+"\n"
+"Commands:\n"
+"  list            - show all paired devices\n"
+"  pair [timeout]  - Try to pair within \"timeout\" seconds (1 to 255,\n"
+"                    default 0 which is an alias for 30s)\n"
+"  unpair idx      - Unpair device\n"
+"  unpair all      - Unpair all devices of all receivers\n"
+"  unpair --serial serial[,serial..]\n"
+"                  - Unpair the devices with the given (hexadecimal) serial\n"
+"                    numbers from any receiver\n"
+"  info idx        - Show more detailed information for a device\n"
+"  receiver-info   - Show information about the receiver\n"
+"  battery         - Show the battery status of all devices on all receivers\n"
+"  activity [interval [samples]]\n"
+"                  - Sample the activity of all devices every \"interval\"\n"
+"                    seconds (default 1), until interrupted if \"samples\"\n"
+"                    is 0 (default)\n"
+"  rate [seconds]  - Measure the input report rate and jitter of all devices\n"
+"                    for \"seconds\" (default 10, 0 until interrupted) and\n"
+"                    compare it with their report interval\n"
+"  rate --trace trace|--usbmon capture\n"
+"                  - Same for the reports of a trace or a capture of\n"
+"                    read-dev-usbmon or hidraw (per receiver). Decoded\n"
+"                    read-dev-usbmon output has no receiver address (the\n"
+"                    reports of all receivers on the bus are mixed) and only\n"
+"                    millisecond timestamps\n"
+"  feature idx featureId func [params..]\n"
+"                  - Call function \"func\" (0 to 15) of a HID++ 2.0 feature.\n"
+"                    featureId and params (at most 16) are hexadecimal\n"
+"  apply [--dry-run] profile\n"
+"                  - Change the settings of all devices on all receivers\n"
+"                    that differ from the profile (see README.txt)\n"
+"  scan receiver|idx [snapshot]\n"
+"                  - Read all short and long registers (nothing is written)\n"
+"                    and optionally save them to a snapshot\n"
+"  scan --diff old new\n"
+"                  - Show the registers that differ between two snapshots\n"
+"  dfu [--window n] image target [target..]\n"
+"                  - Transfer a firmware image to DFU-capable devices, all\n"
+"                    targets in parallel. At most n (1 to 4, default 4)\n"
+"                    packets are in flight per device. The dfuStart format\n"
+"                    is that of the simulator, not of real devices, so this\n"
+"                    only works with --simulate or --replay\n"
+"  shell [script]  - Send raw reports typed in or read from a script and show\n"
+"                    all reports decoded (type \"help\" in the shell)\n"
+"  bench [requests]\n"
+"                  - Read a register of all receivers \"requests\" times\n"
+"                    (default 1000) with poll and with io_uring and show the\n"
+"                    system calls and CPU time per report\n"
+"  import-usbmon capture trace\n"
+"                  - Convert read-dev-usbmon output into a trace for --replay\n"
+"In the above lines, \"idx\" refers to the device number shown in the\n"
+" first column of the list command (between 1 and 6). A device can also be\n"
+" selected on any receiver by its serial number as serial:XXXXXXXX.\n"
+" Alternatively, you can use the following names (case-insensitive):\n");
+	print_device_types();
+}
+
+// Parses a "serial:XXXXXXXX" device specifier.
+static bool parse_serial_spec(const char *str, uint32_t *serial) {
+	char *end;
+	unsigned long n;
+
+	if (strncmp(str, "serial:", 7)) {
+		return false;
+	}
+	str += 7;
+	n = strtoul(str, &end, 16);
+	if (!*str || *end || n > 0xFFFFFFFF) {
+		return false;
+	}
+	if (serial) {
+		*serial = n;
+	}
+	return true;
+}
+
+static bool is_numeric_device_index(const char *str) {
+	char *end;
+	unsigned long device_index = strtoul(str, &end, 0);
+
+	// if a number was found, there must be no other characters thereafter
+	return !*end &&
+		device_index >= 1 && device_index <= DEVICES_MAX;
+}
+
+static bool parse_hex_byte(const char *str, u8 *value) {
+	char *end;
+	unsigned long n = strtoul(str, &end, 16);
+
+	if (!*str || *end || n > 0xFF) {
+		return false;
+	}
+	if (value) {
+		*value = n;
+	}
+	return true;
+}
+
+// Parses a comma-separated list of hexadecimal serial numbers. Returns the
+// number of serials or -1 if the list is invalid.
+static int parse_serials(const char *str, uint32_t *serials, unsigned max) {
+	unsigned count = 0;
+
+	for (;;) {
+		char *end;
+		unsigned long n = strtoul(str, &end, 16);
+
+		if (end == str || n > 0xFFFFFFFF || (*end && *end != ',') ||
+			count >= max) {
+			return -1;
+		}
+		if (serials) {
+			serials[count] = n;
+		}
+		count++;
+		if (!*end) {
+			return count;
+		}
+		str = end + 1;
+	}
+}
+
+// feature idx featureId func [params..]
+static bool validate_feature_args(int args_count, char **args) {
+	char *end;
+	unsigned long n;
+	int i;
+
+	if (args_count < 3) {
+		fprintf(stderr, "feature requires a device index, featureId and function\n");
+		return false;
+	}
+	n = strtoul(args[2], &end, 16);
+	if (!*args[2] || *end || n > 0xFFFF) {
+		fprintf(stderr, "featureId must be a hexadecimal number up to FFFF\n");
+		return false;
+	}
+	n = strtoul(args[3], &end, 0);
+	if (!*args[3] || *end || n > 0x0F) {
+		fprintf(stderr, "Function must be a number between 0 and 15\n");
+		return false;
+	}
+	if (args_count - 3 > 16) {
+		fprintf(stderr, "At most 16 params are allowed\n");
+		return false;
+	}
+	for (i = 4; i <= args_count; i++) {
+		if (!parse_hex_byte(args[i], NULL)) {
+			fprintf(stderr, "Invalid param %s, must be a hexadecimal byte\n",
+				args[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Return number of commands and command arguments, -1 on error. If the program
+// should not run (--help), then 0 is returned and args is NULL.
+static int validate_args(int argc, char **argv, char ***argsp, char **hidraw_path) {
+	int args_count;
+	char *cmd;
+	int opt;
+	char **args;
+	struct option longopts[] = {
+		{ "device",     1, NULL, 'd' },
+		{ "help",       0, NULL, 'h' },
+		{ "version",	0, NULL, 'V' },
+		{ "record",     1, NULL, 'r' },
+		{ "replay",     1, NULL, 'R' },
+		{ "realtime",   0, NULL, 'T' },
+		{ "simulate",   1, NULL, 'S' },
+		{ "io-uring",   0, NULL, 'U' },
+		{ "fields",     1, NULL, 'F' },
+		{ "keep-notifs", 0, NULL, 'K' },
+		{ 0, 0, 0, 0 },
+	};
+
+	*argsp = NULL;
+
+	while ((opt = getopt_long(argc, argv, "+Dd:hV", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'D':
+			debug_enabled = true;
+			break;
+		case 'd':
+			*hidraw_path = optarg;
+			break;
+		case 'r':
+			record_path = optarg;
+			break;
+		case 'R':
+			replay_path = optarg;
+			break;
+		case 'T':
+			replay_realtime = true;
+			break;
+		case 'S': {
+			char *end;
+			simulate_count = strtoul(optarg, &end, 0);
+			if (*end || !simulate_count || simulate_count > RECEIVERS_MAX) {
+				fprintf(stderr, "--simulate requires a number between "
+					"1 and %u\n", RECEIVERS_MAX);
+				return -1;
+			}
+			break;
+		}
+		case 'U':
+			use_uring = true;
+			break;
+		case 'K':
+			keep_notifs = true;
+			break;
+		case 'F':
+			if (!parse_fields(optarg)) {
+				return -1;
+			}
+			break;
+		case 'V':
+			print_version();
+			return 0;
+		case 'h':
+			print_usage(*argv);
+			return 0;
+		default:
+			return -1;
+		}
+	}
+
+	if (optind >= argc) {
+		// missing command
+		print_usage(*argv);
+		return -1;
+	}
+	*argsp = args = &argv[optind];
+	args_count = argc - optind - 1;
+
+	cmd = args[0];
+	if (fields_count && strcmp(cmd, "list") && strcmp(cmd, "info")) {
+		fprintf(stderr, "--fields is only supported by info and list\n");
+		return -1;
+	}
+	if (!strcmp(cmd, "list") || !strcmp(cmd, "receiver-info") ||
+		!strcmp(cmd, "battery") || !strcmp(cmd, "shell")) {
+		/* nothing to check */
+	} else if (!strcmp(cmd, "pair")) {
+		if (args_count >= 1) {
+			char *end;
+			unsigned long int n;
+			n = strtoul(args[1], &end, 0);
+			if (*end != '\0' || n > 0xFF) {
+				fprintf(stderr, "Timeout must be a number between 0 and 255\n");
+				return -1;
+			}
+		}
+	} else if (!strcmp(cmd, "activity")) {
+		char *end;
+		if (args_count >= 1 && (strtoul(args[1], &end, 0) == 0 ||
+			*end || strtoul(args[1], NULL, 0) > 3600)) {
+			fprintf(stderr, "Interval must be a number between 1 and 3600\n");
+			return -1;
+		}
+		if (args_count >= 2 && (strtoul(args[2], &end, 0), *end)) {
+			fprintf(stderr, "Samples must be a number\n");
+			return -1;
+		}
+	} else if (!strcmp(cmd, "rate")) {
+		char *end;
+		if (args_count >= 1 && (!strcmp(args[1], "--trace") ||
+			!strcmp(args[1], "--usbmon"))) {
+			if (args_count < 2) {
+				fprintf(stderr, "%s requires a file\n", args[1]);
+				return -1;
+			}
+		} else if (args_count >= 1 && (strtoul(args[1], &end, 0), *end)) {
+			fprintf(stderr, "Seconds must be a number\n");
+			return -1;
+		}
+	} else if (!strcmp(cmd, "scan")) {
+		if (args_count >= 1 && !strcmp(args[1], "--diff")) {
+			if (args_count < 3) {
+				fprintf(stderr, "--diff requires two snapshots\n");
+				return -1;
+			}
+		} else if (args_count < 1 || (strcasecmp(args[1], "receiver") &&
+			!is_numeric_device_index(args[1]) &&
+			!parse_serial_spec(args[1], NULL) &&
+			device_type_from_str(args[1]) == -1)) {
+			fprintf(stderr, "%s requires \"receiver\" or a device index\n",
+				cmd);
+			return -1;
+		}
+	} else if (!strcmp(cmd, "bench")) {
+		char *end;
+		if (args_count >= 1 && (strtoul(args[1], &end, 0) == 0 || *end)) {
+			fprintf(stderr, "Requests must be a positive number\n");
+			return -1;
+		}
+	} else if (!strcmp(cmd, "apply")) {
+		if (args_count < 1 || (!strcmp(args[1], "--dry-run") &&
+			args_count < 2)) {
+			fprintf(stderr, "%s requires a profile\n", cmd);
+			return -1;
+		}
+	} else if (!strcmp(cmd, "dfu")) {
+		int i = 1;
+		if (args_count >= 1 && !strcmp(args[1], "--window")) {
+			char *end;
+			unsigned long n = args_count >= 2 ?
+				strtoul(args[2], &end, 0) : 0;
+			if (!n || *end || n > DFU_WINDOW_MAX) {
+				fprintf(stderr, "--window must be a number between "
+					"1 and %u\n", DFU_WINDOW_MAX);
+				return -1;
+			}
+			i = 3;
+		}
+		if (args_count < i + 1) {
+			fprintf(stderr, "%s requires an image and a device index\n",
+				cmd);
+			return -1;
+		}
+		for (i++; i <= args_count; i++) {
+			if (!is_numeric_device_index(args[i]) &&
+				!parse_serial_spec(args[i], NULL) &&
+				device_type_from_str(args[i]) == -1) {
+				fprintf(stderr, "Invalid device type, must be a "
+					"numeric index or:\n");
+				print_device_types();
+				return -1;
+			}
+		}
+	} else if (!strcmp(cmd, "import-usbmon")) {
+		if (args_count < 2) {
+			fprintf(stderr, "%s requires a capture and trace file\n", cmd);
+			return -1;
+		}
+	} else if (!strcmp(cmd, "unpair") && args_count >= 1 &&
+		(!strcmp(args[1], "all") || !strcmp(args[1], "--serial"))) {
+		if (!strcmp(args[1], "--serial") && (args_count < 2 ||
+			parse_serials(args[2], NULL, SERIALS_MAX) < 0)) {
+			fprintf(stderr, "--serial requires a comma-separated list of "
+				"at most %d hexadecimal serial numbers\n", SERIALS_MAX);
+			return -1;
+		}
+	} else if (!strcmp(cmd, "unpair") || !strcmp(cmd, "info") ||
+		!strcmp(cmd, "feature")) {
+		if (args_count < 1) {
+			fprintf(stderr, "%s requires a device index\n", cmd);
+			return -1;
+		}
+		if (!is_numeric_device_index(args[1]) &&
+			!parse_serial_spec(args[1], NULL) &&
+			device_type_from_str(args[1]) == -1) {
+			fprintf(stderr, "Invalid device type, must be a numeric index or:\n");
+			print_device_types();
+			return -1;
+		}
+		if (!strcmp(cmd, "feature") && !validate_feature_args(args_count, args)) {
+			return -1;
+		}
+	} else {
+		fprintf(stderr, "Unrecognized command: %s\n", cmd);
+		return -1;
+	}
+	return args_count;
+}
+
+// Moves the receivers to an io_uring if requested, see uring.c.
+static void attach_uring(struct lt_receiver **rcvs, unsigned count) {
+	if (use_uring && count && !lt_uring_new(rcvs, count)) {
+		fprintf(stderr, "io_uring is not available, using poll\n");
+	}
+}
+
+// Opens the receiver (or replayed trace) and starts recording if requested.
+static struct lt_receiver *open_receiver(const char *hidraw_path) {
+	struct lt_receiver *rcv;
+
+	if (replay_path) {
+		rcv = lt_receiver_replay(replay_path, replay_realtime, debug_enabled);
+	} else if (simulate_count) {
+		unsigned number = 0;
+		// "simN" paths come from the serial number index
+		if (hidraw_path && sscanf(hidraw_path, "sim%u", &number) == 1 &&
+			number >= simulate_count) {
+			number = 0;
+		}
+		rcv = lt_receiver_simulate(number, debug_enabled);
+	} else {
+		rcv = lt_receiver_open(hidraw_path);
+	}
+	if (!rcv) {
+		return NULL;
+	}
+	rcv->debug = debug_enabled;
+	if (record_path && !lt_trace_record(rcv, record_path)) {
+		lt_receiver_close(rcv);
+		return NULL;
+	}
+	if (serial_index) {
+		lt_serial_index_track(rcv, serial_index);
+	}
+	attach_uring(&rcv, 1);
+	return rcv;
+}
+
+// Opens the given receiver or all receivers if there is none. When recording,
+// every receiver gets its own trace: file, file.2, file.3, ...
+static unsigned open_receivers(const char *hidraw_path, struct lt_receiver **rcvs) {
+	unsigned i, count;
+
+	if (hidraw_path || replay_path) {
+		rcvs[0] = open_receiver(hidraw_path);
+		return rcvs[0] ? 1 : 0;
+	}
+	if (simulate_count) {
+		for (count = 0; count < simulate_count; count++) {
+			rcvs[count] = lt_receiver_simulate(count, debug_enabled);
+			if (!rcvs[count]) {
+				break;
+			}
+		}
+	} else {
+		count = lt_receiver_open_all(rcvs, RECEIVERS_MAX);
+	}
+	for (i = 0; i < count; i++) {
+		char path[1024];
+		rcvs[i]->debug = debug_enabled;
+		if (serial_index) {
+			lt_serial_index_track(rcvs[i], serial_index);
+		}
+		if (!record_path) {
+			continue;
+		}
+		if (i == 0) {
+			snprintf(path, sizeof path, "%s", record_path);
+		} else {
+			snprintf(path, sizeof path, "%s.%u", record_path, i + 1);
+		}
+		lt_trace_record(rcvs[i], path);
+	}
+	attach_uring(rcvs, count);
+	return count;
+}
+
+// Looks for a device in a slot of a receiver (updating the index).
+static bool has_serial(struct lt_receiver *rcv, u8 device_index, uint32_t serial) {
+	return get_device_ext_pair_info(rcv, device_index) &&
+		rcv->devices[device_index - 1].serial_number == serial;
+}
+
+// Opens the receiver of the device with the given serial number. The receiver
+// and slot from the index are tried first, the receivers are only searched if
+// the index is outdated.
+static struct lt_receiver *open_receiver_for_serial(const char *hidraw_path,
+	uint32_t serial) {
+	const struct lt_serial_entry *entry = NULL;
+	struct lt_receiver *rcvs[RECEIVERS_MAX], *found = NULL;
+	unsigned i, count;
+	u8 j;
+
+	if (serial_index) {
+		entry = lt_serial_index_find(serial_index, serial);
+	}
+	// a replay uses the slot from the index like the recording did
+	if (entry && (replay_path || (*entry->path &&
+		(!hidraw_path || !strcmp(hidraw_path, entry->path))))) {
+		u8 device_index = entry->device_index;
+		struct lt_receiver *rcv;
+
+		rcv = open_receiver(replay_path ? hidraw_path : entry->path);
+
+		if (rcv && has_serial(rcv, device_index, serial)) {
+			return rcv;
+		}
+		DPRINTF("Serial number index is outdated for %08X\n", serial);
+		lt_receiver_close(rcv);
+	}
+
+	count = open_receivers(hidraw_path, rcvs);
+	for (i = 0; i < count; i++) {
+		if (found) {
+			lt_receiver_close(rcvs[i]);
+			continue;
+		}
+		for (j = 1; j <= DEVICES_MAX && !found; j++) {
+			if (has_serial(rcvs[i], j, serial)) {
+				found = rcvs[i];
+			}
+		}
+		if (!found) {
+			lt_receiver_close(rcvs[i]);
+		}
+	}
+	if (!found) {
+		fprintf(stderr, "Device with serial %08X not found\n", serial);
+	}
+	return found;
+}
+
+// Runs the submitted requests of all receivers and reports unanswered ones
+// when debugging.
+static void run_requests(struct lt_receiver **rcvs, unsigned rcvs_count,
+	struct lt_request *reqs, unsigned count) {
+	unsigned i, missing = 0;
+
+	lt_run(rcvs, rcvs_count, -1);
+	for (i = 0; i < count; i++) {
+		if (!reqs[i].done) {
+			missing++;
+		}
+	}
+	DPRINTF("%u of %u requests unanswered\n", missing, count);
+}
+
+// Set by SIGINT for commands that run until they are interrupted.
+static volatile sig_atomic_t interrupted;
+
+static void handle_interrupt(int sig) {
+	(void) sig;
+	interrupted = 1;
+}
+
+// SIGUSR1 prints the recent reports of all receivers, see ring.c.
+static void handle_dump_ring(int sig) {
+	(void) sig;
+	lt_ring_dump_all(STDERR_FILENO);
+}
+
+// Processes the reports of all receivers for timeout milliseconds, or until
+// *waiting drops to zero (if non-NULL) or the program is interrupted.
+static void wait_events(struct lt_receiver **rcvs, unsigned count, int timeout,
+	const unsigned *waiting) {
+	struct pollfd pollfds[RECEIVERS_MAX];
+	long long unsigned deadline = get_timestamp_ms() + timeout;
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		pollfds[i].fd = lt_receiver_fd(rcvs[i]);
+		pollfds[i].events = POLLIN;
+	}
+	while ((!waiting || *waiting > 0) && !interrupted) {
+		long long unsigned now = get_timestamp_ms();
+		int wait;
+
+		if (now >= deadline) {
+			break;
+		}
+		wait = deadline - now;
+		for (i = 0; i < count; i++) {
+			int t = lt_next_timeout(rcvs[i]);
+			if (t >= 0 && t < wait) {
+				wait = t;
+			}
+		}
+		if (poll(pollfds, count, wait) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+		for (i = 0; i < count; i++) {
+			lt_process_events(rcvs[i]);
+		}
+	}
+}
+
+/* Notification flags of a receiver, restored after a command. */
+struct notif_state {
+	bool valid;
+	bool restore;
+	struct msg_enable_notifs notifs;
+};
+
+// Enables wireless notifications on all receivers, these are needed for
+// listing devices. reqs must have room for one request per receiver.
+static void enable_notifs_all(struct lt_receiver **rcvs, unsigned count,
+	struct notif_state *states, struct lt_request *reqs) {
+	unsigned i, n;
+
+	for (i = 0; i < count; i++) {
+		init_register_req(&reqs[i], DEVICE_RECEIVER,
+			SUB_GET_REGISTER, REG_ENABLED_NOTIFS, NULL);
+		lt_submit(rcvs[i], &reqs[i], 3000, NULL, NULL);
+	}
+	run_requests(rcvs, count, reqs, count);
+	for (i = 0; i < count; i++) {
+		if (!reqs[i].done || reqs[i].error_type) {
+			fprintf(stderr, "%s: failed to retrieve notification state\n",
+				rcvs[i]->path);
+			continue;
+		}
+		states[i].valid = true;
+		memcpy(&states[i].notifs, reqs[i].msg.msg_short.value,
+			sizeof states[i].notifs);
+	}
+	for (i = 0, n = 0; i < count; i++) {
+		struct notif_state *ns = &states[i];
+		if (ns->valid && !ns->notifs.reporting_flags_receiver) {
+			ns->restore = true;
+			ns->notifs.reporting_flags_receiver |= 1;
+			init_register_req(&reqs[n], DEVICE_RECEIVER,
+				SUB_SET_REGISTER, REG_ENABLED_NOTIFS, (u8 *) &ns->notifs);
+			lt_submit(rcvs[i], &reqs[n++], 3000, NULL, NULL);
+		}
+	}
+	run_requests(rcvs, count, reqs, n);
+}
+
+// Disables the notifications again that were enabled by enable_notifs_all.
+static void restore_notifs_all(struct lt_receiver **rcvs, unsigned count,
+	struct notif_state *states, struct lt_request *reqs) {
+	unsigned i, n;
+
+	for (i = 0, n = 0; i < count; i++) {
+		struct notif_state *ns = &states[i];
+		if (ns->restore && !keep_notifs) {
+			ns->notifs.reporting_flags_receiver &= ~1;
+			init_register_req(&reqs[n], DEVICE_RECEIVER,
+				SUB_SET_REGISTER, REG_ENABLED_NOTIFS, (u8 *) &ns->notifs);
+			lt_submit(rcvs[i], &reqs[n++], 3000, NULL, NULL);
+		}
+	}
+	run_requests(rcvs, count, reqs, n);
+}
+
+// Lists the paired devices of all receivers (the notifications update
+// rcv->devices before the responses arrive).
+static void list_devices_all(struct lt_receiver **rcvs, unsigned count,
+	struct lt_request *reqs) {
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		struct val_reg_connection_state cval;
+		memset(&cval, 0, sizeof cval);
+		cval.action = CONSTATE_ACTION_LIST_DEVICES;
+		init_register_req(&reqs[i], DEVICE_RECEIVER,
+			SUB_SET_REGISTER, REG_CONNECTION_STATE, (u8 *) &cval);
+		lt_submit(rcvs[i], &reqs[i], 3000, NULL, NULL);
+	}
+	run_requests(rcvs, count, reqs, count);
+}
+
+// Reads the names of the listed devices from the receiver and the HID++
+// version of online devices. reqs must have room for two requests per device.
+static void probe_devices_all(struct lt_receiver **rcvs, unsigned count,
+	struct lt_request *reqs) {
+	unsigned i, j, n;
+
+	for (i = 0, n = 0; i < count; i++) {
+		struct lt_receiver *rcv = rcvs[i];
+		for (j = 0; j < DEVICES_MAX; j++) {
+			struct device *dev = &rcv->devices[j];
+			u8 params[3] = { 0x40 | j };
+			if (!dev->device_present) {
+				continue;
+			}
+			init_register_req(&reqs[n], DEVICE_RECEIVER,
+				SUB_GET_LONG_REGISTER, REG_PAIRING_INFO, params);
+			lt_submit(rcv, &reqs[n++], 3000, NULL, NULL);
+			if (dev->device_available) {
+				init_ping_req(&reqs[n], j + 1);
+				lt_submit(rcv, &reqs[n++], 3000, NULL, NULL);
+			}
+		}
+	}
+	run_requests(rcvs, count, reqs, n);
+	for (i = 0, n = 0; i < count; i++) {
+		for (j = 0; j < DEVICES_MAX; j++) {
+			struct device *dev = &rcvs[i]->devices[j];
+			struct lt_request *req;
+			if (!dev->device_present) {
+				continue;
+			}
+			req = &reqs[n++];
+			if (req->done && !req->error_type) {
+				struct msg_dev_name *name;
+				name = (struct msg_dev_name *) &req->msg.msg_long.str;
+				if (name->length <= DEVICE_NAME_MAXLEN) {
+					memcpy(dev->name, name->str, name->length);
+					dev->name[name->length] = 0;
+				}
+			}
+			if (!dev->device_available) {
+				continue;
+			}
+			req = &reqs[n++];
+			if (!req->done) {
+				// the device did not respond
+				dev->device_available = false;
+			} else if (req->error_type == SUB_ERROR_MSG &&
+				req->error_code == 0x01) {
+				// ERR_INVALID_SUBID
+				dev->hidpp_version.major = 1;
+			} else if (!req->error_type) {
+				dev->hidpp_version.major = req->msg.msg_short.value[0];
+				dev->hidpp_version.minor = req->msg.msg_short.value[1];
+			} else {
+				dev->device_available = false;
+			}
+		}
+	}
+}
+
+/* Battery information of a device, collected during a battery sweep. */
+struct battery_slot {
+	u8 feature_index; // BatteryStatus feature (HID++ 2.0)
+	struct lt_request *req; // register read (HID++ 1.0)
+	bool has_level;
+	u8 level; // percentage (HID++ 2.0) or level 1..7 (HID++ 1.0)
+	u8 status;
+};
+struct battery_sweep {
+	unsigned receivers_count;
+	struct lt_receiver *rcvs[RECEIVERS_MAX];
+	struct notif_state notifs[RECEIVERS_MAX];
+	struct battery_slot slots[RECEIVERS_MAX][DEVICES_MAX];
+};
+
+static void battery_sweep_run(struct battery_sweep *sweep,
+	struct lt_request *reqs, unsigned count) {
+	run_requests(sweep->rcvs, sweep->receivers_count, reqs, count);
+}
+
+// Queries the battery of all paired devices on all receivers at once. Every
+// stage sends its requests to all devices before waiting, so the duration of
+// a sweep is limited by the slowest device.
+bool perform_battery_sweep(const char *hidraw_path) {
+	struct battery_sweep *sweep;
+	struct lt_request *reqs;
+	unsigned i, j, n, count;
+
+	sweep = calloc(1, sizeof *sweep);
+	reqs = calloc(RECEIVERS_MAX * DEVICES_MAX * 2, sizeof *reqs);
+	if (!sweep || !reqs) {
+		perror("calloc");
+		free(sweep);
+		free(reqs);
+		return false;
+	}
+
+	count = open_receivers(hidraw_path, sweep->rcvs);
+	sweep->receivers_count = count;
+
+	enable_notifs_all(sweep->rcvs, count, sweep->notifs, reqs);
+	list_devices_all(sweep->rcvs, count, reqs);
+
+	probe_devices_all(sweep->rcvs, count, reqs);
+
+	// HID++ 1.0: read the battery register, HID++ 2.0: look up the feature
+	// (unless cached)
+	for (i = 0, n = 0; i < count; i++) {
+		struct lt_receiver *rcv = sweep->rcvs[i];
+		for (j = 0; j < DEVICES_MAX; j++) {
+			struct device *dev = &rcv->devices[j];
+			if (!dev->device_available) {
+				continue;
+			}
+			if (HIDPP_VERSION_IS_20(&dev->hidpp_version)) {
+				static const uint16_t battery = FID_BATTERY_STATUS;
+				n += hidpp20_submit_features(rcv, j + 1, &battery, 1,
+					&reqs[n]);
+			} else {
+				init_register_req(&reqs[n], j + 1,
+					SUB_GET_REGISTER, REG_BATTERY, NULL);
+				sweep->slots[i][j].req = &reqs[n];
+				lt_submit(rcv, &reqs[n++], 3000, NULL, NULL);
+			}
+		}
+	}
+	battery_sweep_run(sweep, reqs, n);
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < DEVICES_MAX; j++) {
+			struct device *dev = &sweep->rcvs[i]->devices[j];
+			struct battery_slot *slot = &sweep->slots[i][j];
+			struct lt_request *req = slot->req;
+			if (!dev->device_available) {
+				continue;
+			}
+			if (HIDPP_VERSION_IS_20(&dev->hidpp_version)) {
+				slot->feature_index = hidpp20_feature_index(
+					sweep->rcvs[i], j + 1, FID_BATTERY_STATUS);
+			} else if (req->done && !req->error_type) {
+				slot->has_level = true;
+				slot->level = req->msg.msg_short.value[0];
+				slot->status = req->msg.msg_short.value[1];
+			}
+		}
+	}
+
+	// HID++ 2.0: GetBatteryLevelStatus
+	for (i = 0, n = 0; i < count; i++) {
+		for (j = 0; j < DEVICES_MAX; j++) {
+			struct device *dev = &sweep->rcvs[i]->devices[j];
+			struct battery_slot *slot = &sweep->slots[i][j];
+			if (dev->device_available && slot->feature_index) {
+				hidpp20_init_req(&reqs[n], j + 1,
+					slot->feature_index, 0);
+				lt_submit(sweep->rcvs[i], &reqs[n++], 3000, NULL, NULL);
+			}
+		}
+	}
+	battery_sweep_run(sweep, reqs, n);
+	for (i = 0, n = 0; i < count; i++) {
+		for (j = 0; j < DEVICES_MAX; j++) {
+			struct device *dev = &sweep->rcvs[i]->devices[j];
+			struct battery_slot *slot = &sweep->slots[i][j];
+			struct lt_request *req;
+			if (!dev->device_available || !slot->feature_index) {
+				continue;
+			}
+			req = &reqs[n++];
+			if (req->done && !req->error_type) {
+				slot->has_level = true;
+				slot->level = REQ_MSG20(req)->params[0];
+				slot->status = REQ_MSG20(req)->params[2];
+			}
+		}
+	}
+
+	restore_notifs_all(sweep->rcvs, count, sweep->notifs, reqs);
+
+	for (i = 0; i < count; i++) {
+		struct lt_receiver *rcv = sweep->rcvs[i];
+		for (j = 0; j < DEVICES_MAX; j++) {
+			struct device *dev = &rcv->devices[j];
+			struct battery_slot *slot = &sweep->slots[i][j];
+			if (!dev->device_present) {
+				continue;
+			}
+			printf("%s\tidx=%i\t%s\t%s\t", rcv->path, j + 1,
+				device_type_str(dev->device_type), dev->name);
+			if (!dev->device_available) {
+				puts("offline");
+			} else if (!slot->has_level) {
+				puts("unknown");
+			} else if (HIDPP_VERSION_IS_20(&dev->hidpp_version)) {
+				printf("%i%% (%s)\n", slot->level,
+					hidpp20_battery_status_str(slot->status));
+			} else {
+				printf("level %i/7\n", slot->level);
+			}
+		}
+		lt_receiver_close(rcv);
+	}
+
+	free(reqs);
+	free(sweep);
+	return count > 0;
+}
+
+/* State of a device during a bulk unpair. */
+struct unpair_slot {
+	bool selected;
+	bool pending; // waiting for the disconnect notification (0x40)
+	bool unpaired;
+	u8 device_type;
+	uint32_t serial_number;
+	char name[DEVICE_NAME_MAXLEN + 1];
+};
+struct unpair_receiver {
+	unsigned *pending_count;
+	struct unpair_slot slots[DEVICES_MAX];
+};
+struct unpair_sweep {
+	unsigned receivers_count;
+	unsigned pending_count;
+	struct lt_receiver *rcvs[RECEIVERS_MAX];
+	struct notif_state notifs[RECEIVERS_MAX];
+	struct unpair_receiver receivers[RECEIVERS_MAX];
+};
+
+// Confirms the disconnection of a device that was unpaired.
+static void unpair_notif(struct lt_receiver *rcv, struct hidpp_message *msg,
+	void *data) {
+	struct unpair_receiver *ur = data;
+	struct unpair_slot *slot;
+
+	(void) rcv;
+	if (msg->sub_id != NOTIF_DEV_DISCONNECT ||
+		msg->device_index < 1 || msg->device_index > DEVICES_MAX) {
+		return;
+	}
+	slot = &ur->slots[msg->device_index - 1];
+	if (slot->pending) {
+		slot->pending = false;
+		slot->unpaired = true;
+		--*ur->pending_count;
+	}
+}
+
+// A failed disconnect request will not be confirmed.
+static void unpair_done(struct lt_receiver *rcv, struct lt_request *req,
+	void *data) {
+	struct unpair_receiver *ur = data;
+	u8 device_index = req->msg.msg_short.value[1];
+	struct unpair_slot *slot = &ur->slots[device_index - 1];
+
+	if (req->done && !req->error_type) {
+		return;
+	}
+	fprintf(stderr, "%s: failed to unpair %#04x: %s\n", rcv->path,
+		device_index, !req->done ? "no response" :
+		hidpp10_error_str(req->error_code));
+	if (slot->pending) {
+		slot->pending = false;
+		--*ur->pending_count;
+	}
+}
+
+// Waits at most timeout milliseconds for all disconnections to be confirmed.
+static void unpair_sweep_wait(struct unpair_sweep *sweep, int timeout) {
+	wait_events(sweep->rcvs, sweep->receivers_count, timeout,
+		&sweep->pending_count);
+	// do not leave requests of this stack frame queued
+	lt_run(sweep->rcvs, sweep->receivers_count, -1);
+}
+
+// Unpairs all devices of all receivers or (if serials is non-NULL) the devices
+// with the given serial numbers. Disconnect requests are sent back to back and
+// the confirmations of all receivers are collected as they arrive.
+bool perform_unpair_sweep(const char *hidraw_path, const uint32_t *serials,
+	unsigned serials_count) {
+	struct unpair_sweep *sweep;
+	struct lt_request *reqs;
+	unsigned i, j, n, count, unpaired = 0;
+	bool ok = true;
+
+	sweep = calloc(1, sizeof *sweep);
+	reqs = calloc(RECEIVERS_MAX * DEVICES_MAX, sizeof *reqs);
+	if (!sweep || !reqs) {
+		perror("calloc");
+		free(sweep);
+		free(reqs);
+		return false;
+	}
+
+	count = open_receivers(hidraw_path, sweep->rcvs);
+	sweep->receivers_count = count;
+
+	enable_notifs_all(sweep->rcvs, count, sweep->notifs, reqs);
+	list_devices_all(sweep->rcvs, count, reqs);
+
+	// names and serial numbers (for output and selection)
+	for (i = 0, n = 0; i < count; i++) {
+		for (j = 0; j < DEVICES_MAX; j++) {
+			u8 name_params[3] = { 0x40 | j }, ext_params[3] = { 0x30 | j };
+			if (!sweep->rcvs[i]->devices[j].device_present) {
+				continue;
+			}
+			init_register_req(&reqs[n], DEVICE_RECEIVER,
+				SUB_GET_LONG_REGISTER, REG_PAIRING_INFO, name_params);
+			lt_submit(sweep->rcvs[i], &reqs[n++], 3000, NULL, NULL);
+			init_register_req(&reqs[n], DEVICE_RECEIVER,
+				SUB_GET_LONG_REGISTER, REG_PAIRING_INFO, ext_params);
+			lt_submit(sweep->rcvs[i], &reqs[n++], 3000, NULL, NULL);
+		}
+	}
+	run_requests(sweep->rcvs, count, reqs, n);
+	for (i = 0, n = 0; i < count; i++) {
+		struct unpair_receiver *ur = &sweep->receivers[i];
+		for (j = 0; j < DEVICES_MAX; j++) {
+			struct device *dev = &sweep->rcvs[i]->devices[j];
+			struct unpair_slot *slot = &ur->slots[j];
+			struct lt_request *req;
+			unsigned k;
+			if (!dev->device_present) {
+				continue;
+			}
+			slot->device_type = dev->device_type;
+			req = &reqs[n++];
+			if (req->done && !req->error_type) {
+				struct msg_dev_name *name;
+				name = (struct msg_dev_name *) &req->msg.msg_long.str;
+				if (name->length <= DEVICE_NAME_MAXLEN) {
+					memcpy(slot->name, name->str, name->length);
+				}
+			}
+			req = &reqs[n++];
+			if (req->done && !req->error_type) {
+				struct msg_dev_ext_pair_info *info;
+				info = (struct msg_dev_ext_pair_info *) &req->msg.msg_long.str;
+				slot->serial_number = ntohl(*(uint32_t *) info->serial_number);
+			} else if (serials) {
+				fprintf(stderr, "%s: failed to read serial number of %#04x\n",
+					sweep->rcvs[i]->path, j + 1);
+				continue;
+			}
+			slot->selected = !serials;
+			for (k = 0; k < serials_count; k++) {
+				if (serials[k] == slot->serial_number) {
+					slot->selected = true;
+				}
+			}
+		}
+	}
+
+	// send all disconnect requests at once
+	for (i = 0, n = 0; i < count; i++) {
+		struct unpair_receiver *ur = &sweep->receivers[i];
+		ur->pending_count = &sweep->pending_count;
+		lt_set_notify_callback(sweep->rcvs[i], unpair_notif, ur);
+		for (j = 0; j < DEVICES_MAX; j++) {
+			struct val_reg_devpair cmd;
+			if (!ur->slots[j].selected) {
+				continue;
+			}
+			ur->slots[j].pending = true;
+			sweep->pending_count++;
+			cmd.action = DEVPAIR_DISCONNECT;
+			cmd.device_number = j + 1;
+			cmd.open_lock_timeout = 0;
+			init_register_req(&reqs[n], DEVICE_RECEIVER,
+				SUB_SET_REGISTER, REG_DEVICE_PAIRING, (u8 *) &cmd);
+			lt_submit(sweep->rcvs[i], &reqs[n++], 3000, unpair_done, ur);
+		}
+	}
+	unpair_sweep_wait(sweep, 5000);
+	for (i = 0; i < count; i++) {
+		lt_set_notify_callback(sweep->rcvs[i], NULL, NULL);
+	}
+
+	restore_notifs_all(sweep->rcvs, count, sweep->notifs, reqs);
+
+	for (i = 0; i < count; i++) {
+		struct lt_receiver *rcv = sweep->rcvs[i];
+		for (j = 0; j < DEVICES_MAX; j++) {
+			struct unpair_slot *slot = &sweep->receivers[i].slots[j];
+			if (!slot->selected) {
+				continue;
+			}
+			printf("%s\tidx=%i\t%s\t%s\t%08X\t%s\n", rcv->path, j + 1,
+				device_type_str(slot->device_type), slot->name,
+				slot->serial_number,
+				slot->unpaired ? "unpaired" : "possibly failed");
+			if (slot->unpaired) {
+				unpaired++;
+			} else {
+				ok = false;
+			}
+		}
+		lt_receiver_close(rcv);
+	}
+	for (i = 0; i < serials_count; i++) {
+		bool found = false;
+		for (j = 0; j < count * DEVICES_MAX; j++) {
+			struct unpair_slot *slot;
+			slot = &sweep->receivers[j / DEVICES_MAX].slots[j % DEVICES_MAX];
+			if (slot->selected && slot->serial_number == serials[i]) {
+				found = true;
+			}
+		}
+		if (!found) {
+			fprintf(stderr, "Device with serial %08X not found\n", serials[i]);
+			ok = false;
+		}
+	}
+	if (!serials && !unpaired && ok) {
+		puts("No paired devices");
+	}
+
+	free(reqs);
+	free(sweep);
+	return count > 0 && ok;
+}
+
+#define ACTIVITY_WINDOW	8
+
+/* Rolling store of activity samples of a device. */
+struct activity_slot {
+	unsigned samples; // number of samples taken
+	u8 last_counter;
+	long long unsigned total; // reports since sampling started
+	long long unsigned last_active; // time of the last counter change
+	// the last ACTIVITY_WINDOW samples
+	long long unsigned times[ACTIVITY_WINDOW];
+	long long unsigned totals[ACTIVITY_WINDOW];
+};
+struct activity_sampler {
+	unsigned receivers_count;
+	long long unsigned start;
+	struct lt_receiver *rcvs[RECEIVERS_MAX];
+	struct notif_state notifs[RECEIVERS_MAX];
+	struct activity_slot slots[RECEIVERS_MAX][DEVICES_MAX];
+};
+
+// Adds a counter value of register 0xB3. The counter is 8 bits, so at most 255
+// reports per interval can be told apart.
+static void activity_add(struct activity_slot *slot, u8 counter,
+	long long unsigned now) {
+	unsigned pos = slot->samples % ACTIVITY_WINDOW;
+
+	if (slot->samples > 0 && counter != slot->last_counter) {
+		slot->total += (u8) (counter - slot->last_counter);
+		slot->last_active = now;
+	}
+	slot->last_counter = counter;
+	slot->times[pos] = now;
+	slot->totals[pos] = slot->total;
+	slot->samples++;
+}
+
+// Reports per second over the samples in the window.
+static double activity_rate(const struct activity_slot *slot) {
+	unsigned n = slot->samples < ACTIVITY_WINDOW ?
+		slot->samples : ACTIVITY_WINDOW;
+	unsigned last = (slot->samples - 1) % ACTIVITY_WINDOW;
+	unsigned first = (slot->samples - n) % ACTIVITY_WINDOW;
+	long long unsigned duration;
+
+	if (n < 2) {
+		return 0;
+	}
+	duration = slot->times[last] - slot->times[first];
+	if (!duration) {
+		return 0;
+	}
+	return (slot->totals[last] - slot->totals[first]) * 1000.0 / duration;
+}
+
+static void activity_print(struct activity_sampler *sampler,
+	long long unsigned now) {
+	unsigned i, j;
+
+	for (i = 0; i < sampler->receivers_count; i++) {
+		struct lt_receiver *rcv = sampler->rcvs[i];
+		double total_rate = 0;
+
+		for (j = 0; j < DEVICES_MAX; j++) {
+			struct device *dev = &rcv->devices[j];
+			struct activity_slot *slot = &sampler->slots[i][j];
+			double rate;
+			if (!dev->device_present || !slot->samples) {
+				continue;
+			}
+			rate = activity_rate(slot);
+			total_rate += rate;
+			printf("%.1f\t%s\tidx=%i\t%s\t%s\t%.1f/s\tidle %s%.1fs\n",
+				(now - sampler->start) / 1000.0, rcv->path, j + 1,
+				device_type_str(dev->device_type), dev->name, rate,
+				slot->last_active ? "" : ">",
+				(now - (slot->last_active ? slot->last_active :
+					sampler->start)) / 1000.0);
+		}
+		printf("%.1f\t%s\ttotal\t%.1f/s\n",
+			(now - sampler->start) / 1000.0, rcv->path, total_rate);
+	}
+	fflush(stdout);
+}
+
+// Samples the device activity register of all receivers every interval
+// seconds until samples were taken (0 for no limit) or SIGINT.
+bool perform_activity_sampler(const char *hidraw_path, unsigned interval,
+	unsigned samples) {
+	struct activity_sampler *sampler;
+	struct lt_request *reqs;
+	struct sigaction sa, old_sa;
+	unsigned i, j, n, count, taken;
+	long long unsigned next;
+
+	sampler = calloc(1, sizeof *sampler);
+	reqs = calloc(RECEIVERS_MAX * DEVICES_MAX, sizeof *reqs);
+	if (!sampler || !reqs) {
+		perror("calloc");
+		free(sampler);
+		free(reqs);
+		return false;
+	}
+
+	count = open_receivers(hidraw_path, sampler->rcvs);
+	sampler->receivers_count = count;
+
+	// notifications keep the device list current while sampling
+	enable_notifs_all(sampler->rcvs, count, sampler->notifs, reqs);
+	list_devices_all(sampler->rcvs, count, reqs);
+	for (i = 0, n = 0; i < count; i++) {
+		for (j = 0; j < DEVICES_MAX; j++) {
+			u8 params[3] = { 0x40 | j };
+			if (!sampler->rcvs[i]->devices[j].device_present) {
+				continue;
+			}
+			init_register_req(&reqs[n], DEVICE_RECEIVER,
+				SUB_GET_LONG_REGISTER, REG_PAIRING_INFO, params);
+			lt_submit(sampler->rcvs[i], &reqs[n++], 3000, NULL, NULL);
+		}
+	}
+	run_requests(sampler->rcvs, count, reqs, n);
+	for (i = 0, n = 0; i < count; i++) {
+		for (j = 0; j < DEVICES_MAX; j++) {
+			struct device *dev = &sampler->rcvs[i]->devices[j];
+			struct msg_dev_name *name;
+			if (!dev->device_present) {
+				continue;
+			}
+			name = (struct msg_dev_name *) &reqs[n].msg.msg_long.str;
+			if (reqs[n].done && !reqs[n].error_type &&
+				name->length <= DEVICE_NAME_MAXLEN) {
+				memcpy(dev->name, name->str, name->length);
+				dev->name[name->length] = 0;
+			}
+			n++;
+		}
+	}
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = handle_interrupt;
+	sigaction(SIGINT, &sa, &old_sa);
+
+	sampler->start = next = get_timestamp_ms();
+	for (taken = 0; !interrupted && (!samples || taken < samples); taken++) {
+		long long unsigned now;
+
+		for (i = 0; i < count; i++) {
+			init_register_req(&reqs[i], DEVICE_RECEIVER,
+				SUB_GET_LONG_REGISTER, REG_DEVICE_ACTIVITY, NULL);
+			lt_submit(sampler->rcvs[i], &reqs[i], 3000, NULL, NULL);
+		}
+		run_requests(sampler->rcvs, count, reqs, count);
+		now = get_timestamp_ms();
+		for (i = 0; i < count; i++) {
+			struct val_reg_activity *act;
+			if (!reqs[i].done || reqs[i].error_type) {
+				fprintf(stderr, "%s: failed to read device activity\n",
+					sampler->rcvs[i]->path);
+				continue;
+			}
+			act = (struct val_reg_activity *) &reqs[i].msg.msg_long.str;
+			for (j = 0; j < DEVICES_MAX; j++) {
+				activity_add(&sampler->slots[i][j], act->counters[j], now);
+			}
+		}
+		activity_print(sampler, now);
+
+		if (samples && taken + 1 >= samples) {
+			break;
+		}
+		next += interval * 1000;
+		now = get_timestamp_ms();
+		if (next > now) {
+			wait_events(sampler->rcvs, count, next - now, NULL);
+		}
+	}
+	sigaction(SIGINT, &old_sa, NULL);
+
+	restore_notifs_all(sampler->rcvs, count, sampler->notifs, reqs);
+	for (i = 0; i < count; i++) {
+		lt_receiver_close(sampler->rcvs[i]);
+	}
+	free(reqs);
+	free(sampler);
+	return count > 0;
+}
+
+static long long unsigned get_timestamp_us(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1000000ULL + tp.tv_nsec / 1000;
+}
+
+static void rate_report(struct lt_receiver *rcv, const u8 *report,
+	size_t length, void *data) {
+	(void) rcv;
+	lt_rate_add(data, report, length, get_timestamp_us());
+}
+
+// Measures the input report rate of all devices on all receivers for seconds
+// (0 for until SIGINT) and compares it with their report interval.
+bool perform_rate(const char *hidraw_path, unsigned seconds) {
+	struct lt_receiver *rcvs[RECEIVERS_MAX];
+	struct lt_rate *rates[RECEIVERS_MAX];
+	struct notif_state notifs[RECEIVERS_MAX];
+	struct lt_request *reqs;
+	struct sigaction sa, old_sa;
+	unsigned i, j, n, count;
+	bool ok = true;
+
+	reqs = calloc(RECEIVERS_MAX * DEVICES_MAX, sizeof *reqs);
+	if (!reqs) {
+		perror("calloc");
+		return false;
+	}
+	memset(notifs, 0, sizeof notifs);
+	count = open_receivers(hidraw_path, rcvs);
+	for (i = 0; i < count; i++) {
+		rates[i] = lt_rate_new();
+		if (!rates[i]) {
+			perror("calloc");
+			ok = false;
+			count = i;
+			break;
+		}
+		// also sees the pairing information responses below
+		lt_set_report_callback(rcvs[i], rate_report, rates[i]);
+	}
+
+	enable_notifs_all(rcvs, count, notifs, reqs);
+	list_devices_all(rcvs, count, reqs);
+	for (i = 0, n = 0; i < count; i++) {
+		for (j = 0; j < DEVICES_MAX; j++) {
+			u8 params[3] = { 0x20 | j };
+			if (!rcvs[i]->devices[j].device_present) {
+				continue;
+			}
+			init_register_req(&reqs[n], DEVICE_RECEIVER,
+				SUB_GET_LONG_REGISTER, REG_PAIRING_INFO, params);
+			lt_submit(rcvs[i], &reqs[n++], 3000, NULL, NULL);
+		}
+	}
+	run_requests(rcvs, count, reqs, n);
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = handle_interrupt;
+	sigaction(SIGINT, &sa, &old_sa);
+	if (count && seconds) {
+		fprintf(stderr, "Use the devices now, measuring for %u s...\n",
+			seconds);
+	} else if (count) {
+		fprintf(stderr, "Use the devices now, measuring until "
+			"interrupted...\n");
+	}
+	if (seconds) {
+		wait_events(rcvs, count, seconds * 1000, NULL);
+	} else {
+		while (!interrupted) {
+			wait_events(rcvs, count, 1000, NULL);
+		}
+	}
+	sigaction(SIGINT, &old_sa, NULL);
+
+	restore_notifs_all(rcvs, count, notifs, reqs);
+	for (i = 0; i < count; i++) {
+		lt_rate_print(rates[i], rcvs[i]->path);
+		lt_set_report_callback(rcvs[i], NULL, NULL);
+		lt_rate_free(rates[i]);
+		lt_receiver_close(rcvs[i]);
+	}
+	free(reqs);
+	return ok && count > 0;
+}
+
+#define RATE_RECEIVERS_MAX	16
+
+/* Reports of one receiver in a capture, by usbmon bus and address. */
+struct rate_receiver {
+	uint16_t busnum;
+	u8 devnum;
+	struct lt_rate *rate;
+};
+
+struct rate_capture {
+	struct lt_rate *rate;
+	long long unsigned last_us;
+	// only for captures (.ltcap) that tell the receivers apart
+	struct rate_receiver receivers[RATE_RECEIVERS_MAX];
+	unsigned receivers_count;
+	unsigned skipped; // reports of receivers beyond RATE_RECEIVERS_MAX
+};
+
+static void rate_capture_report(bool is_write, const u8 *report,
+	size_t length, long long unsigned time_us, void *data) {
+	struct rate_capture *rc = data;
+
+	if (!is_write) {
+		lt_rate_add(rc->rate, report, length, time_us);
+	}
+	rc->last_us = time_us;
+}
+
+static bool rate_capture_record(const struct capture_record *rec,
+	void *data) {
+	struct rate_capture *rc = data;
+	struct rate_receiver *r = NULL;
+	unsigned i;
+
+	for (i = 0; i < rc->receivers_count; i++) {
+		if (rc->receivers[i].busnum == rec->busnum &&
+			rc->receivers[i].devnum == rec->devnum) {
+			r = &rc->receivers[i];
+			break;
+		}
+	}
+	if (!r) {
+		if (rc->receivers_count == RATE_RECEIVERS_MAX) {
+			rc->skipped++;
+			return true;
+		}
+		r = &rc->receivers[rc->receivers_count];
+		r->rate = lt_rate_new();
+		if (!r->rate) {
+			perror("calloc");
+			return false;
+		}
+		r->busnum = rec->busnum;
+		r->devnum = rec->devnum;
+		rc->receivers_count++;
+	}
+	if (!rec->is_write) {
+		lt_rate_add(r->rate, rec->data, rec->length, rec->time_us);
+	}
+	rc->last_us = rec->time_us;
+	return true;
+}
+
+// Analyzes a capture of read-dev-usbmon or hidraw, every receiver (usbmon bus
+// and address) separately.
+static bool rate_capture_file(const char *path) {
+	struct rate_capture rc;
+	char source[300];
+	unsigned i;
+	FILE *fp;
+	bool ok;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		perror(path);
+		return false;
+	}
+	memset(&rc, 0, sizeof rc);
+	ok = capture_read(fp, rate_capture_record, &rc);
+	fclose(fp);
+	if (ok && !rc.receivers_count) {
+		fprintf(stderr, "%s: no reports found\n", path);
+		ok = false;
+	}
+	if (rc.skipped) {
+		fprintf(stderr, "%s: %u reports of more than %u receivers "
+			"ignored\n", path, rc.skipped, RATE_RECEIVERS_MAX);
+	}
+	for (i = 0; i < rc.receivers_count; i++) {
+		struct rate_receiver *r = &rc.receivers[i];
+		if (ok) {
+			if (r->busnum || r->devnum) {
+				snprintf(source, sizeof source, "%s receiver=%u:%u",
+					path, r->busnum, r->devnum);
+			} else { // hidraw capture
+				snprintf(source, sizeof source, "%s", path);
+			}
+			lt_rate_print(r->rate, source);
+		}
+		lt_rate_free(r->rate);
+	}
+	return ok;
+}
+
+// Analyzes the input reports of a trace (--trace), a capture or the output of
+// read-dev-usbmon (--usbmon) instead of a live receiver.
+bool perform_rate_capture(const char *type, const char *path) {
+	struct rate_capture rc;
+	bool ok;
+
+	if (!strcmp(type, "--usbmon") && capture_is_capture(path)) {
+		return rate_capture_file(path);
+	}
+	memset(&rc, 0, sizeof rc);
+	rc.rate = lt_rate_new();
+	if (!rc.rate) {
+		perror("calloc");
+		return false;
+	}
+	if (!strcmp(type, "--trace")) {
+		ok = lt_trace_read(path, rate_capture_report, &rc);
+	} else {
+		int count = lt_usbmon_read(path, rate_capture_report, &rc);
+		if (!count) {
+			fprintf(stderr, "%s: no reports found\n", path);
+		}
+		ok = count > 0;
+	}
+	if (ok && !rc.last_us) {
+		fprintf(stderr, "%s: no timestamps, captures made with HEX=1 "
+			"cannot be analyzed\n", path);
+		ok = false;
+	}
+	if (ok) {
+		lt_rate_print(rc.rate, path);
+	}
+	lt_rate_free(rc.rate);
+	return ok;
+}
+
+/* Names of setting values in profiles. */
+struct apply_value {
+	const char *name;
+	uint32_t value;
+};
+static const struct apply_value values_bool[] = {
+	{ "off", 0 }, { "on", 1 }, { "no", 0 }, { "yes", 1 }, { NULL, 0 }
+};
+static const struct apply_value values_illumination[] = {
+	{ "auto", 1 }, { "off", 2 }, { NULL, 0 }
+};
+
+/* A setting that can be applied, see keyboard.txt and registers.txt. */
+struct apply_setting {
+	const char *name;
+	// HID++ 1.0: short register and the bits of the setting in its value
+	u8 reg;
+	uint32_t reg_mask; // 0 if the setting has no register
+	// HID++ 2.0: features (the first supported one is used), functions and
+	// the bits of the setting in the first parameter
+	uint16_t features[2];
+	u8 get_func, set_func;
+	u8 feature_mask;
+	const struct apply_value *values;
+};
+static const struct apply_setting apply_settings[] = {
+	{ "fn-swap", REG_FN_KEY_SWAP, 0x000100,
+		{ FID_FN_INVERSION, FID_NEW_FN_INVERSION }, 0, 1, 0x01,
+		values_bool },
+	{ "illumination", REG_ILLUMINATION, 0x0000FF, { 0, 0 }, 0, 0, 0,
+		values_illumination },
+	{ "notifications", REG_ENABLED_NOTIFS, 0xFFFFFF, { 0, 0 }, 0, 0, 0,
+		NULL },
+	{ "left-right-swap", 0, 0, { FID_LEFT_RIGHT_SWAP, 0 }, 0, 1, 0x01,
+		values_bool },
+	{ "hires-scroll", 0, 0, { FID_HIRES_SCROLLING, 0 }, 1, 2, 0x01,
+		values_bool },
+};
+
+/* A "setting = value" line of a profile and the devices of its section. */
+struct apply_rule {
+	int device_type; // -1 for any
+	uint16_t wireless_pid; // 0 for any
+	const struct apply_setting *setting;
+	uint32_t value;
+};
+#define APPLY_RULES_MAX	256
+
+enum apply_state {
+	APPLY_OFFLINE,
+	APPLY_UNSUPPORTED,
+	APPLY_FAILED,
+	APPLY_UNCHANGED,
+	APPLY_DIFFERS, // not written (dry run)
+	APPLY_CHANGED,
+};
+
+/* A setting of a device, collected during apply. */
+struct apply_item {
+	struct lt_receiver *rcv;
+	u8 device_index;
+	const struct apply_setting *setting;
+	uint32_t value; // desired
+	uint32_t current;
+	uint32_t raw; // register value or first parameter, for writing back
+	u8 feature_index; // HID++ 2.0
+	enum apply_state state;
+	const char *error;
+	struct lt_request *reqs[2]; // of the current stage
+};
+
+static unsigned mask_shift(uint32_t mask) {
+	unsigned shift = 0;
+
+	while (mask && !(mask & 1)) {
+		mask >>= 1;
+		shift++;
+	}
+	return shift;
+}
+
+static bool parse_setting_value(const struct apply_setting *setting,
+	const char *str, uint32_t *value) {
+	uint32_t mask = setting->reg_mask ? setting->reg_mask :
+		setting->feature_mask;
+	const struct apply_value *v;
+	unsigned long n;
+	char *end;
+
+	for (v = setting->values; v && v->name; v++) {
+		if (!strcasecmp(v->name, str)) {
+			*value = v->value;
+			return true;
+		}
+	}
+	n = strtoul(str, &end, 16);
+	if (!*str || *end || n > mask >> mask_shift(mask)) {
+		return false;
+	}
+	*value = n;
+	return true;
+}
+
+static const char *setting_value_str(const struct apply_setting *setting,
+	uint32_t value, char *buf, size_t size) {
+	const struct apply_value *v;
+
+	for (v = setting->values; v && v->name; v++) {
+		if (v->value == value) {
+			return v->name;
+		}
+	}
+	snprintf(buf, size, "%X", value);
+	return buf;
+}
+
+static char *trim(char *str) {
+	char *end;
+
+	while (*str == ' ' || *str == '\t') {
+		str++;
+	}
+	end = str + strlen(str);
+	while (end > str && strchr(" \t\r\n", end[-1])) {
+		*--end = 0;
+	}
+	return str;
+}
+
+// Reads a profile with the desired settings per device type or wireless PID:
+//
+//   [keyboard]
+//   fn-swap = on
+//   [pid:4024]
+//   illumination = off
+//
+// Sections are device types, "pid:XXXX" or "*" for all devices. Later lines
+// take precedence. Returns the number of rules or -1 on error.
+static int load_profile(const char *path, struct apply_rule *rules,
+	unsigned max) {
+	struct apply_rule section = { -1, 0, NULL, 0 };
+	unsigned lineno = 0, count = 0, i;
+	char line[256];
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof line, fp)) {
+		char *p = trim(line), *value, *end;
+		struct apply_rule *rule;
+
+		lineno++;
+		if (!*p || *p == '#') {
+			continue;
+		}
+		if (*p == '[') {
+			end = strchr(p, ']');
+			if (!end || end[1]) {
+				goto bad_line;
+			}
+			*end = 0;
+			p = trim(p + 1);
+			section.device_type = -1;
+			section.wireless_pid = 0;
+			if (!strncasecmp(p, "pid:", 4)) {
+				unsigned long pid = strtoul(p + 4, &end, 16);
+				if (!p[4] || *end || !pid || pid > 0xFFFF) {
+					goto bad_line;
+				}
+				section.wireless_pid = pid;
+			} else if (strcmp(p, "*")) {
+				section.device_type = device_type_from_str(p);
+				if (section.device_type == -1) {
+					fprintf(stderr, "%s:%u: unknown device type "
+						"%s\n", path, lineno, p);
+					goto fail;
+				}
+			}
+			continue;
+		}
+
+		value = strchr(p, '=');
+		if (!value) {
+			goto bad_line;
+		}
+		*value++ = 0;
+		p = trim(p);
+		value = trim(value);
+		if (count == max) {
+			fprintf(stderr, "%s:%u: more than %u settings\n", path,
+				lineno, max);
+			goto fail;
+		}
+		rule = &rules[count];
+		*rule = section;
+		for (i = 0; i < ARRAY_SIZE(apply_settings); i++) {
+			if (!strcmp(apply_settings[i].name, p)) {
+				rule->setting = &apply_settings[i];
+			}
+		}
+		if (!rule->setting) {
+			fprintf(stderr, "%s:%u: unknown setting %s\n", path,
+				lineno, p);
+			goto fail;
+		}
+		if (!parse_setting_value(rule->setting, value, &rule->value)) {
+			fprintf(stderr, "%s:%u: invalid value for %s: %s\n", path,
+				lineno, p, value);
+			goto fail;
+		}
+		count++;
+		continue;
 
-		/* unexpected message, try again with updated timeout */
-		end_ms = get_timestamp_ms();
-		timeout -= end_ms - begin_ms;
-		begin_ms = end_ms;
+bad_line:
+		fprintf(stderr, "%s:%u: invalid line\n", path, lineno);
+		goto fail;
 	}
+	fclose(fp);
+	return count;
 
-	/* timeout expired, no report found unfortunately */
-	return 0;
+fail:
+	fclose(fp);
+	return -1;
 }
-static ssize_t do_write(int fd, struct hidpp_message *msg) {
-	ssize_t r, payload_size = SHORT_MESSAGE_LEN;
 
-	if (msg->report_id == LONG_MESSAGE) {
-		payload_size = LONG_MESSAGE_LEN;
-	}
+// Finds the desired value of a setting for a device, false if none is set.
+static bool profile_value(const struct apply_rule *rules, unsigned count,
+	const struct device *dev, const struct apply_setting *setting,
+	uint32_t *value) {
+	bool found = false;
+	unsigned i;
 
-	dump_msg(msg, payload_size, "wr");
-	r = write(fd, msg, payload_size);
-	if (r < 0) {
-		perror("write");
+	for (i = 0; i < count; i++) {
+		const struct apply_rule *rule = &rules[i];
+		if (rule->setting == setting &&
+			(rule->device_type == -1 ||
+			rule->device_type == dev->device_type) &&
+			(!rule->wireless_pid ||
+			rule->wireless_pid == dev->wireless_pid)) {
+			*value = rule->value;
+			found = true;
+		}
 	}
+	return found;
+}
 
-	return payload_size == r ? payload_size : 0;
+static uint32_t register_value(const struct lt_request *req) {
+	const u8 *v = req->msg.msg_short.value;
+	return (v[0] << 16) | (v[1] << 8) | v[2];
 }
 
-const char *get_report_id_str(u8 report_type) {
-	switch (report_type) {
-	case SHORT_MESSAGE:
-		return "short";
-	case LONG_MESSAGE:
-		return "long";
-	default:
-		return "unkn";
+static void apply_error(struct apply_item *item, const struct lt_request *req) {
+	item->state = APPLY_FAILED;
+	if (!req->done) {
+		item->error = "no response";
+	} else if (req->error_type == SUB_ERROR_MSG) {
+		item->error = hidpp10_error_str(req->error_code);
+	} else {
+		item->error = hidpp20_error_str(req->error_code);
 	}
 }
 
-bool process_notif_dev_connect(struct hidpp_message *msg, u8 *device_index,
-	bool *is_new_device) {
-	u8 dev_idx = msg->device_index;
-	struct notif_devcon *dcon = (struct notif_devcon *) &msg->msg_short;
-	struct device *dev;
-	if (msg->sub_id != NOTIF_DEV_CONNECT) {
-		fprintf(stderr, "Invalid msg type %#0x, expected dev conn notif\n",
-			msg->sub_id);
-		return false;
-	}
-	if (msg->report_id != SHORT_MESSAGE) {
-		fprintf(stderr, "Dev conn notif is expected to be short, got "
-			"%#04x instead\n", msg->report_id);
-		return false;
+static void apply_print(const struct apply_item *item) {
+	const struct apply_setting *setting = item->setting;
+	struct device *dev = &item->rcv->devices[item->device_index - 1];
+	char buf[2][16];
+
+	printf("%s\tidx=%u\t%s\t%s\t%s=%s\t", item->rcv->path,
+		item->device_index, device_type_str(dev->device_type),
+		dev->name, setting->name, setting_value_str(setting, item->value,
+			buf[0], sizeof buf[0]));
+	switch (item->state) {
+	case APPLY_OFFLINE:
+		printf("offline\n");
+		break;
+	case APPLY_UNSUPPORTED:
+		printf("unsupported\n");
+		break;
+	case APPLY_FAILED:
+		printf("failed (%s)\n", item->error);
+		break;
+	case APPLY_UNCHANGED:
+		printf("unchanged\n");
+		break;
+	case APPLY_DIFFERS:
+		printf("differs (is %s)\n", setting_value_str(setting,
+			item->current, buf[1], sizeof buf[1]));
+		break;
+	case APPLY_CHANGED:
+		printf("changed (was %s)\n", setting_value_str(setting,
+			item->current, buf[1], sizeof buf[1]));
+		break;
 	}
-	if (dcon->prot_type != DEVCON_PROT_UNIFYING) {
-		fprintf(stderr, "Unknown protocol %#04x in devcon notif\n",
-			dcon->prot_type);
+}
+
+// Brings the settings of all devices on all receivers to the values of a
+// profile. Current values are read first and only differing settings are
+// written (none if dry_run). Every stage is sent to all devices at once.
+bool perform_apply(const char *hidraw_path, const char *profile_path,
+	bool dry_run) {
+	struct apply_rule rules[APPLY_RULES_MAX];
+	struct lt_receiver *rcvs[RECEIVERS_MAX];
+	struct notif_state notifs[RECEIVERS_MAX];
+	struct apply_item *items;
+	struct lt_request *reqs;
+	unsigned i, j, k, n, count, items_count = 0, failures = 0;
+	int rules_count;
+
+	rules_count = load_profile(profile_path, rules, APPLY_RULES_MAX);
+	if (rules_count < 0) {
 		return false;
 	}
-	if (dev_idx < 1 || dev_idx > DEVICES_MAX) {
-		fprintf(stderr, "Disallowed device index %#04x\n", dev_idx);
+	items = calloc(RECEIVERS_MAX * DEVICES_MAX * ARRAY_SIZE(apply_settings),
+		sizeof *items);
+	reqs = calloc(RECEIVERS_MAX * DEVICES_MAX * ARRAY_SIZE(apply_settings) * 2,
+		sizeof *reqs);
+	if (!items || !reqs) {
+		perror("calloc");
+		free(items);
+		free(reqs);
 		return false;
 	}
 
-	dev = &devices[dev_idx - 1];
-	if (device_index) *device_index = dev_idx;
-	if (is_new_device) *is_new_device = !dev->device_present;
-
-	memset(&devices[dev_idx], 0, sizeof devices[dev_idx]);
-	dev->device_type = dcon->device_info & DEVCON_DEV_TYPE_MASK;
-	dev->wireless_pid = (dcon->pid_msb << 8) | dcon->pid_lsb;
-	dev->device_present = true;
-	dev->device_available = !(dcon->device_info & DEVCON_LINK_STATUS_FLAG);
-	return true;
-}
+	count = open_receivers(hidraw_path, rcvs);
+	memset(notifs, 0, sizeof notifs);
+	enable_notifs_all(rcvs, count, notifs, reqs);
+	list_devices_all(rcvs, count, reqs);
+	probe_devices_all(rcvs, count, reqs);
+
+	// HID++ 1.0: read the registers, HID++ 2.0: look up the features
+	for (i = 0, n = 0; i < count; i++) {
+		for (j = 0; j < DEVICES_MAX; j++) {
+			struct device *dev = &rcvs[i]->devices[j];
+			bool hidpp20 = HIDPP_VERSION_IS_20(&dev->hidpp_version);
+			uint16_t featureIds[ARRAY_SIZE(apply_settings) * 2];
+			unsigned f, features_count = 0;
+			if (!dev->device_present) {
+				continue;
+			}
+			for (k = 0; k < ARRAY_SIZE(apply_settings); k++) {
+				const struct apply_setting *setting = &apply_settings[k];
+				struct apply_item *item = &items[items_count];
 
-// use for reading registers and skipping notifications from return
-static bool do_read_skippy(int fd, struct hidpp_message *msg,
-	u8 exp_report_id, u8 exp_sub_id) {
-	for (;;) {
-		if (!do_read(fd, msg, exp_report_id, 2000)) {
-			return false;
+				if (!profile_value(rules, rules_count, dev, setting,
+					&item->value)) {
+					continue;
+				}
+				items_count++;
+				item->rcv = rcvs[i];
+				item->device_index = j + 1;
+				item->setting = setting;
+				item->state = APPLY_UNSUPPORTED;
+				if (!dev->device_available) {
+					item->state = APPLY_OFFLINE;
+				} else if (hidpp20) {
+					for (f = 0; f < 2 && setting->features[f]; f++) {
+						featureIds[features_count++] =
+							setting->features[f];
+					}
+				} else if (setting->reg_mask) {
+					init_register_req(&reqs[n], j + 1,
+						SUB_GET_REGISTER, setting->reg, NULL);
+					item->reqs[0] = &reqs[n];
+					lt_submit(rcvs[i], &reqs[n++], 3000, NULL, NULL);
+				}
+			}
+			// features that are not cached yet, for all settings at once
+			n += hidpp20_submit_features(rcvs[i], j + 1, featureIds,
+				features_count, &reqs[n]);
 		}
-		if (msg->report_id == exp_report_id && msg->sub_id == exp_sub_id) {
-			return true;
+	}
+	run_requests(rcvs, count, reqs, n);
+	for (i = 0; i < items_count; i++) {
+		struct apply_item *item = &items[i];
+		const struct apply_setting *setting = item->setting;
+		struct device *dev = &item->rcv->devices[item->device_index - 1];
+		struct lt_request *req;
+
+		if (item->state == APPLY_UNSUPPORTED &&
+			HIDPP_VERSION_IS_20(&dev->hidpp_version)) {
+			bool unknown = false;
+			for (j = 0; j < 2 && setting->features[j]; j++) {
+				item->feature_index = hidpp20_feature_index(item->rcv,
+					item->device_index, setting->features[j]);
+				if (item->feature_index) {
+					break;
+				}
+				unknown |= !hidpp20_feature_resolved(item->rcv,
+					item->device_index, setting->features[j]);
+			}
+			if (!item->feature_index && unknown) {
+				item->state = APPLY_FAILED;
+				item->error = "feature lookup failed";
+			}
 		}
+		req = item->reqs[0];
+		if (req) {
+			if (req->done && req->error_type == SUB_ERROR_MSG &&
+				(req->error_code == 0x01 || req->error_code == 0x02)) {
+				// ERR_INVALID_SUBID, ERR_INVALID_ADDRESS
+				item->state = APPLY_UNSUPPORTED;
+			} else if (!req->done || req->error_type) {
+				apply_error(item, req);
+			} else {
+				item->raw = register_value(req);
+				item->current = (item->raw & setting->reg_mask) >>
+					mask_shift(setting->reg_mask);
+				item->state = APPLY_UNCHANGED;
+			}
+		}
+		memset(item->reqs, 0, sizeof item->reqs);
+	}
 
-		/* ignore non-HID++ reports (e.g. DJ reports) */
-		if (msg->report_id != SHORT_MESSAGE && msg->report_id != LONG_MESSAGE) {
-			continue;
+	// HID++ 2.0: read the current values
+	for (i = 0, n = 0; i < items_count; i++) {
+		struct apply_item *item = &items[i];
+		if (item->feature_index && item->state == APPLY_UNSUPPORTED) {
+			hidpp20_init_req(&reqs[n], item->device_index,
+				item->feature_index, item->setting->get_func);
+			item->reqs[0] = &reqs[n];
+			lt_submit(item->rcv, &reqs[n++], 3000, NULL, NULL);
 		}
+	}
+	run_requests(rcvs, count, reqs, n);
+	for (i = 0; i < items_count; i++) {
+		struct apply_item *item = &items[i];
+		struct lt_request *req = item->reqs[0];
+		u8 mask = item->setting->feature_mask;
 
-		// guess: 0xFF is error message in HID++ 2.0?
-		if (msg->report_id == LONG_MESSAGE && msg->sub_id == 0xFF) {
-			if (debug_enabled) {
-				fprintf(stderr, "HID++ 2.0 error %#04x\n",
-					msg->msg_long.str[2]);
-			}
-			return false;
+		if (!req) {
+			continue;
+		} else if (!req->done || req->error_type) {
+			apply_error(item, req);
+		} else {
+			item->raw = REQ_MSG20(req)->params[0];
+			item->current = (item->raw & mask) >> mask_shift(mask);
+			item->state = APPLY_UNCHANGED;
 		}
-		if (msg->report_id == SHORT_MESSAGE && msg->sub_id == SUB_ERROR_MSG
-			&& msg->msg_error.sub_id == exp_sub_id) {
-			struct msg_error *error = &msg->msg_error;
-			// TODO: consider address (register)?
-			u8 error_code = error->error_code;
-			const char *err_str = error_messages[error_code];
-			if (debug_enabled) {
-				fprintf(stderr, "Received error for subid=%#04x,"
-					" reg=%#04x: %#04x (%s)\n", error->sub_id,
-					error->address, error_code, err_str);
-			}
-			return false;
+		item->reqs[0] = NULL;
+	}
+
+	// write the differing values
+	for (i = 0, n = 0; i < items_count; i++) {
+		struct apply_item *item = &items[i];
+		const struct apply_setting *setting = item->setting;
+		uint32_t mask, raw;
+
+		if (item->state != APPLY_UNCHANGED || item->current == item->value) {
+			continue;
 		}
-		if (msg->sub_id == NOTIF_DEV_CONNECT) {
-			process_notif_dev_connect(msg, NULL, NULL);
+		item->state = APPLY_DIFFERS;
+		if (dry_run) {
 			continue;
-		} else if (msg->sub_id == NOTIF_DEV_DISCONNECT) {
-			u8 device_index = msg->device_index;
-			u8 disconnect_type = *(u8 *) &msg->msg_short;
-			if (device_index < 1 || device_index > DEVICES_MAX) {
-				fprintf(stderr, "Invalid device index %#04x\n", device_index);
-			} else if (disconnect_type & 0x02) {
-				memset(&devices[device_index - 1], 0, sizeof *devices);
+		}
+		mask = item->feature_index ? setting->feature_mask :
+			setting->reg_mask;
+		raw = (item->raw & ~mask) | (item->value << mask_shift(mask));
+		if (item->feature_index) {
+			struct hidpp2_message *msg;
+			msg = hidpp20_init_req(&reqs[n], item->device_index,
+				item->feature_index, setting->set_func);
+			msg->params[0] = raw;
+		} else {
+			u8 params[3] = { raw >> 16, raw >> 8, raw };
+			init_register_req(&reqs[n], item->device_index,
+				SUB_SET_REGISTER, setting->reg, params);
+		}
+		item->reqs[0] = &reqs[n];
+		lt_submit(item->rcv, &reqs[n++], 3000, NULL, NULL);
+	}
+	run_requests(rcvs, count, reqs, n);
+	for (i = 0; i < items_count; i++) {
+		struct apply_item *item = &items[i];
+		struct lt_request *req = item->reqs[0];
+
+		if (req) {
+			if (!req->done || req->error_type) {
+				apply_error(item, req);
 			} else {
-				fprintf(stderr, "Unexpected disconnection type %#04x\n", disconnect_type);
-			}
-		} else if (msg->sub_id == NOTIF_RECV_LOCK_CHANGE) {
-			if (msg->report_id != SHORT_MESSAGE || msg->device_index != DEVICE_RECEIVER) {
-				fprintf(stderr, "Received invalid Unifying Receiver Locking Change notification (0x4A)\n");
-				continue;
-			}
-			// TODO: this can be used to make an application aware
-			// that pairing is (not) possible (anymore)
-			if (debug_enabled) {
-				fprintf(stderr, "Receiver lock state is now %s\n",
-					(*(u8 *)&msg->msg_short) & 1 ? "open" : "closed");
+				item->state = APPLY_CHANGED;
 			}
 		}
-		if (debug_enabled &&
-			(msg->report_id != exp_report_id || msg->sub_id != exp_sub_id)) {
-			fprintf(stderr, "Expected %s msg %#02x, got %s msg %#02x\n",
-				get_report_id_str(exp_report_id), exp_sub_id,
-				get_report_id_str(msg->report_id), msg->sub_id);
+		if (item->state == APPLY_FAILED) {
+			failures++;
 		}
-		// let's try reading another message...
+		apply_print(item);
 	}
-	return true;
-}
 
-// TODO: separate files
-#include "hidpp20.c"
+	restore_notifs_all(rcvs, count, notifs, reqs);
+	for (i = 0; i < count; i++) {
+		lt_receiver_close(rcvs[i]);
+	}
+	free(items);
+	free(reqs);
+	return count > 0 && !failures;
+}
 
-static bool set_register(int fd, u8 device_index, u8 address,
-	u8 *params, struct hidpp_message *res, bool is_long_req) {
-	u8 exp_sub_id;
-        struct hidpp_message msg;
+// returns device index starting at 1 or 0 on failure
+static u8 find_device_index_for_type(struct lt_receiver *rcv, const char *str,
+	bool *fetched_devices) {
+	char *end;
+	u8 device_index;
+	uint32_t serial;
 
-        msg.device_index = device_index;
-	if (is_long_req) {
-		msg.report_id = LONG_MESSAGE;
-		exp_sub_id = SUB_SET_LONG_REGISTER;
-		msg.msg_long.address = address;
-		memcpy(&msg.msg_long.str, params, sizeof msg.msg_long.str);
-	} else {
-		msg.report_id = SHORT_MESSAGE;
-		exp_sub_id = SUB_SET_REGISTER;
-		msg.msg_short.address = address;
-		memcpy(&msg.msg_short.value, params, sizeof msg.msg_short.value);
+	device_index = strtoul(str, &end, 0);
+	if (*end == '\0') {
+		return device_index;
+	}
+	if (parse_serial_spec(str, &serial)) {
+		// read by open_receiver_for_serial
+		for (device_index = 1; device_index <= DEVICES_MAX; device_index++) {
+			if (rcv->devices[device_index - 1].serial_number == serial) {
+				return device_index;
+			}
+		}
+		return 0;
 	}
-	msg.sub_id = exp_sub_id;
 
-        if (!do_write(fd, &msg)) {
-                return false;
-        }
+	if (get_all_devices(rcv)) {
+		u8 i;
+		int device_type_n;
 
-        msg.report_id = SHORT_MESSAGE;
-        if (!do_read_skippy(fd, &msg, SHORT_MESSAGE, exp_sub_id)) {
-                return false;
-        }
-        memcpy(res, &msg, sizeof msg);
-        return true;
-}
+		device_type_n = device_type_from_str(str);
+		if (fetched_devices) {
+			*fetched_devices = true;
+		}
 
-bool set_short_register(int fd, u8 device_index, u8 address, u8 *params, struct hidpp_message *res) {
-        return set_register(fd, device_index, address, params, res, false);
-}
-bool set_long_register(int fd, u8 device_index, u8 address, u8 *params, struct hidpp_message *res) {
-	return set_register(fd, device_index, address, params, res, true);
+		for (i = 0; i < DEVICES_MAX; i++) {
+			if (rcv->devices[i].device_type == device_type_n) {
+				return i + 1;
+			}
+		}
+	} else {
+		fprintf(stderr, "Unable to request a list of paired devices");
+	}
+	return 0;
 }
 
-static bool get_register(int fd, u8 device_index, u8 address,
-	struct hidpp_message *out, u8 *params, bool is_long_resp) {
-	u8 exp_report_id, exp_sub_id;
-        struct hidpp_message msg;
-
-	exp_report_id = is_long_resp ? LONG_MESSAGE : SHORT_MESSAGE;
-	exp_sub_id = is_long_resp ? SUB_GET_LONG_REGISTER : SUB_GET_REGISTER;
-
-        msg.report_id = SHORT_MESSAGE;
-        msg.device_index = device_index;
-        msg.sub_id = exp_sub_id;
-        memset(msg.msg_short.value, 0, sizeof msg.msg_short.value);
-	msg.msg_short.address = address;
-	if (params) {
-		memcpy(&msg.msg_short.value, params, sizeof msg.msg_short.value);
-	}
+/* Firmware transfers to several devices, possibly on different receivers. */
+struct dfu_session {
+	unsigned receivers_count;
+	unsigned jobs_count;
+	unsigned pending;
+	struct lt_receiver *rcvs[RECEIVERS_MAX];
+	struct notif_state notifs[RECEIVERS_MAX];
+	struct lt_dfu *jobs;
+};
 
-        if (!do_write(fd, &msg)) {
-                return false;
-        }
+// Passes events to the transfers of a receiver.
+static void dfu_notif(struct lt_receiver *rcv, struct hidpp_message *msg,
+	void *data) {
+	struct dfu_session *session = data;
+	unsigned i;
 
-        if (!do_read_skippy(fd, &msg, exp_report_id, exp_sub_id)) {
-                return false;
+	for (i = 0; i < session->jobs_count; i++) {
+		struct lt_dfu *dfu = &session->jobs[i];
+		if (dfu->rcv == rcv && lt_dfu_process_notification(dfu, msg)) {
+			break;
+		}
 	}
-        memcpy(out, &msg, sizeof msg);
-        return true;
 }
 
-bool get_short_register(int fd, u8 device_index, u8 address, u8 *params, struct hidpp_message *out) {
-	return get_register(fd, device_index, address, out, params, false);
-}
-bool get_long_register(int fd, u8 device_index, u8 address, u8 *params, struct hidpp_message *out) {
-	return get_register(fd, device_index, address, out, params, true);
-}
+static void dfu_done(struct lt_dfu *dfu, void *data) {
+	struct dfu_session *session = data;
 
-bool get_info(int fd, struct hidpp_message *msg) {
-        if (!get_long_register(fd, DEVICE_RECEIVER, REG_DEVICE_ACTIVITY, NULL, msg)) {
-                return false;
-        }
-        return true;
+	(void) dfu;
+	session->pending--;
 }
 
-// begin directly-usable functions
-bool get_notifications(int fd, u8 device_index, struct msg_enable_notifs *params) {
-	struct hidpp_message msg;
-        if (!get_short_register(fd, device_index, REG_ENABLED_NOTIFS, NULL, &msg)) {
-                return false;
-        }
-	memcpy((u8 *) params, &msg.msg_short.value, sizeof *params);
-        return true;
-}
-bool set_notifications(int fd, u8 device_index, struct msg_enable_notifs *params) {
-	struct hidpp_message msg;
-        if (!set_short_register(fd, device_index, REG_ENABLED_NOTIFS, (u8 *) params, &msg)) {
-                return false;
-        }
-        return true;
-}
-bool get_and_print_notifications(int fd, u8 device_index, struct msg_enable_notifs *notifsp) {
-	putchar('\n');
-	if (get_notifications(fd, device_index, notifsp)) {
-		u8 flags = notifsp->reporting_flags_receiver;
-		printf("Reporting Flags (Receiver) = %02x\n", flags & 0xFF);
-		printf("Wireless notifications     = %s\n", flags & 1 ? "yes" : "no");
-		printf("Software Present           = %s\n", flags & 4 ? "yes" : "no");
+// Finds the receiver and slot of a target. Serial numbers are looked up on all
+// receivers (the slot from the index first), other targets need one receiver.
+static bool dfu_find_target(struct dfu_session *session, const char *str,
+	struct lt_dfu *dfu) {
+	const struct lt_serial_entry *entry = NULL;
+	uint32_t serial;
+	unsigned i;
+	u8 j;
+
+	if (!parse_serial_spec(str, &serial)) {
+		if (session->receivers_count != 1) {
+			fprintf(stderr, "%s: select the receiver with -d or use "
+				"serial:XXXXXXXX\n", str);
+			return false;
+		}
+		dfu->rcv = session->rcvs[0];
+		dfu->device_index = find_device_index_for_type(dfu->rcv, str, NULL);
+		if (dfu->device_index < 1 || dfu->device_index > DEVICES_MAX) {
+			fprintf(stderr, "Device %s not found\n", str);
+			return false;
+		}
 		return true;
-	} else {
-		fprintf(stderr, "Failed to get HID++ Notification status\n");
-		return false;
 	}
-}
 
-bool get_connected_devices(int fd, u8 *devices_count) {
-	struct hidpp_message msg;
-	struct val_reg_connection_state *cval;
-	if (!get_short_register(fd, DEVICE_RECEIVER, REG_CONNECTION_STATE, NULL, &msg)) {
-		return false;
+	if (serial_index) {
+		entry = lt_serial_index_find(serial_index, serial);
 	}
-	cval = (struct val_reg_connection_state *) msg.msg_short.value;
-	*devices_count = cval->connected_devices_count;
-	return true;
-}
-
-bool pair_start(int fd, u8 timeout) {
-	struct hidpp_message msg;
-	struct val_reg_devpair cmd;
-	cmd.action = DEVPAIR_OPEN_LOCK;
-	// device_index is 1..6 for a specific device, 0x53 is seen for "any
-	// device".  Not sure if this is a special value or randomly chosen
-	cmd.device_number = 0;
-	cmd.open_lock_timeout = timeout;
-	if (!set_short_register(fd, DEVICE_RECEIVER, REG_DEVICE_PAIRING, (u8 *) &cmd, &msg)) {
-		return false;
+	for (i = 0; entry && i < session->receivers_count; i++) {
+		struct lt_receiver *rcv = session->rcvs[i];
+		if (!strcmp(rcv->path, entry->path) &&
+			has_serial(rcv, entry->device_index, serial)) {
+			dfu->rcv = rcv;
+			dfu->device_index = entry->device_index;
+			return true;
+		}
 	}
-	return true;
+	for (i = 0; i < session->receivers_count; i++) {
+		for (j = 1; j <= DEVICES_MAX; j++) {
+			if (has_serial(session->rcvs[i], j, serial)) {
+				dfu->rcv = session->rcvs[i];
+				dfu->device_index = j;
+				return true;
+			}
+		}
+	}
+	fprintf(stderr, "Device with serial %08X not found\n", serial);
+	return false;
 }
 
-bool pair_cancel(int fd) {
-	struct hidpp_message msg;
-	struct val_reg_devpair cmd;
-	cmd.action = DEVPAIR_CLOSE_LOCK;
-	// see discussion at pair_start, why did logitech use 0x53? Confusion?
-	cmd.device_number = 0;
-	// timeout applies to open lock, not sure why I saw 0x94 (148 sec)
-	cmd.open_lock_timeout = 0;
-	if (!set_short_register(fd, DEVICE_RECEIVER, REG_DEVICE_PAIRING, (u8 *) &cmd, &msg)) {
-		return false;
+static u8 *read_image(const char *path, size_t *size) {
+	FILE *fp = fopen(path, "rb");
+	u8 *image = NULL;
+	long length;
+
+	if (!fp) {
+		perror(path);
+		return NULL;
 	}
-	return true;
+	if (fseek(fp, 0, SEEK_END) || (length = ftell(fp)) < 0 ||
+		fseek(fp, 0, SEEK_SET)) {
+		perror(path);
+	} else if (!length || length % DFU_PACKET_SIZE) {
+		fprintf(stderr, "%s: image size must be a multiple of %u bytes\n",
+			path, DFU_PACKET_SIZE);
+	} else if (!(image = malloc(length))) {
+		perror("malloc");
+	} else if (fread(image, 1, length, fp) != (size_t) length) {
+		fprintf(stderr, "%s: short read\n", path);
+		free(image);
+		image = NULL;
+	} else {
+		*size = length;
+	}
+	fclose(fp);
+	return image;
 }
 
-bool device_unpair(int fd, u8 device_index) {
-	struct hidpp_message msg;
-	struct val_reg_devpair cmd;
-	cmd.action = DEVPAIR_DISCONNECT;
-	cmd.device_number = device_index;
-	cmd.open_lock_timeout = 0;
-	if (!set_short_register(fd, DEVICE_RECEIVER, REG_DEVICE_PAIRING, (u8 *) &cmd, &msg)) {
+// Transfers an image to all targets in parallel, up to window packets in flight
+// per device (0 for the maximum).
+bool perform_dfu(const char *hidraw_path, const char *image_path,
+	char **targets, unsigned targets_count, unsigned window) {
+	struct dfu_session *session;
+	struct lt_request *reqs;
+	struct sigaction sa, old_sa;
+	unsigned i, j, count, failures = 0;
+	size_t size;
+	u8 *image;
+
+	image = read_image(image_path, &size);
+	if (!image) {
 		return false;
 	}
-	return true;
-}
-
-void perform_pair(int fd, u8 timeout) {
-	struct hidpp_message msg;
-	if (timeout == 0) {
-		timeout = 30;
+	session = calloc(1, sizeof *session);
+	reqs = calloc(RECEIVERS_MAX * DEVICES_MAX, sizeof *reqs);
+	if (session) {
+		session->jobs = calloc(targets_count, sizeof *session->jobs);
 	}
-	if (!pair_start(fd, timeout)) {
-		fprintf(stderr, "Failed to send pair request\n");
-		return;
+	if (!session || !reqs || !session->jobs) {
+		perror("calloc");
+		if (session) {
+			free(session->jobs);
+		}
+		free(session);
+		free(reqs);
+		free(image);
+		return false;
 	}
-	puts("Please turn your wireless device off and on to start pairing.");
-	// WARNING: mess ahead. I knew it would become messy before writing it.
-	for (;;) {
-		if (!do_read(fd, &msg, SHORT_MESSAGE, timeout * 1000 + 2000)) {
-			fprintf(stderr, "Failed to read short message\n");
-			break;
+
+	count = open_receivers(hidraw_path, session->rcvs);
+	session->receivers_count = count;
+	// device types are resolved from the device list
+	enable_notifs_all(session->rcvs, count, session->notifs, reqs);
+
+	for (i = 0; i < targets_count; i++) {
+		struct lt_dfu *dfu = &session->jobs[i];
+		if (!dfu_find_target(session, targets[i], dfu)) {
+			failures++;
+			continue;
 		}
-		if (msg.sub_id == NOTIF_RECV_LOCK_CHANGE) {
-			u8 *bytes = (u8 *) &msg.msg_short;
-			if (msg.report_id != SHORT_MESSAGE || msg.device_index != DEVICE_RECEIVER) {
-				fprintf(stderr, "Received invalid Unifying Receiver Locking Change notification (0x4A)\n");
-				continue;
-			}
-			if (bytes[0] & 1) { // locking open
-				continue;
-			} else { // locking closed
-				const char *result;
-				switch (bytes[1]) {
-				case 0x00:
-					result = "Success";
-					break;
-				case 0x01:
-					result = "Timeout";
-					break;
-				default:
-					result = "Failure";
-				}
-				printf("Pairing result: %s (%i)\n", result, bytes[1]);
+		for (j = 0; j < i; j++) {
+			if (session->jobs[j].rcv == dfu->rcv &&
+				session->jobs[j].device_index == dfu->device_index) {
+				fprintf(stderr, "%s: device selected twice\n",
+					targets[i]);
+				dfu->rcv = NULL;
+				failures++;
 				break;
 			}
-		} else if (msg.sub_id == NOTIF_DEV_CONNECT) {
-			u8 device_index;
-			bool is_new_dev;
-			if (!process_notif_dev_connect(&msg, &device_index, &is_new_dev)) {
-				// error message is already emitted
-				continue;
-			}
+		}
+	}
+	if (failures) {
+		goto out;
+	}
+	session->jobs_count = targets_count;
+	for (i = 0; i < count; i++) {
+		lt_set_notify_callback(session->rcvs[i], dfu_notif, session);
+	}
 
-			if (device_index < 1 || device_index > DEVICES_MAX) {
-				fprintf(stderr, "Invalid device index %#04x\n", device_index);
-			} else if (is_new_dev) {
-				u8 device_type = devices[device_index - 1].device_type;
-				printf("Found new device, id=%#04x %s\n",
-					device_index,
-					device_type_str(device_type));
-				break;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = handle_interrupt;
+	sigaction(SIGINT, &sa, &old_sa);
+
+	for (i = 0; i < targets_count; i++) {
+		struct lt_dfu *dfu = &session->jobs[i];
+		dfu->image = image;
+		dfu->size = size;
+		dfu->window = window;
+		dfu->done = dfu_done;
+		dfu->done_data = session;
+		if (lt_dfu_start(dfu)) {
+			session->pending++;
+		} else {
+			dfu->finished = dfu->failed = true;
+			dfu->end_time = dfu->start_time;
+		}
+	}
+	while (session->pending && !interrupted) {
+		wait_events(session->rcvs, count, 1000, &session->pending);
+		for (i = 0; i < targets_count; i++) {
+			lt_dfu_expire(&session->jobs[i]);
+		}
+	}
+	for (i = 0; i < targets_count; i++) {
+		lt_dfu_cancel(&session->jobs[i]);
+	}
+	// do not leave requests of the transfers queued
+	lt_run(session->rcvs, count, -1);
+	sigaction(SIGINT, &old_sa, NULL);
+
+	for (i = 0; i < targets_count; i++) {
+		struct lt_dfu *dfu = &session->jobs[i];
+		long long unsigned duration = dfu->end_time - dfu->start_time;
+
+		printf("%s\tidx=%u\t%u/%u packets\t%u retransmits\t%u waits\t"
+			"%.1f KiB/s\t", dfu->rcv->path, dfu->device_index,
+			dfu->acked, dfu->packets, dfu->retransmits, dfu->waits,
+			duration ? dfu->acked * DFU_PACKET_SIZE / 1.024 / duration : 0);
+		if (dfu->failed) {
+			failures++;
+			if (dfu->status) {
+				printf("failed (%s)\n",
+					lt_dfu_status_str(dfu->status));
 			} else {
-				printf("Ignoring existent device id=%#04x\n", device_index);
+				printf("failed%s\n", interrupted ?
+					" (interrupted)" : "");
 			}
+		} else {
+			printf("done\n");
 		}
 	}
-	// end of mess
-	if (!pair_cancel(fd)) {
-		fprintf(stderr, "Failed to cancel pair visibility\n");
+
+out:
+	for (i = 0; i < count; i++) {
+		lt_set_notify_callback(session->rcvs[i], NULL, NULL);
 	}
-}
-void perform_unpair(int fd, u8 device_index) {
-	struct device *dev = &devices[device_index - 1];
-	u8 dev_device_type = dev->device_type; // will be overwritten, therefore store it
-	if (!dev->device_present) {
-		printf("Device %#04x does not appear to be paired\n", device_index);
-		return;
+	restore_notifs_all(session->rcvs, count, session->notifs, reqs);
+	for (i = 0; i < count; i++) {
+		lt_receiver_close(session->rcvs[i]);
 	}
-	if (device_unpair(fd, device_index)) {
-		if (!dev->device_present) {
-			printf("Device %#04x %s successfully unpaired\n", device_index,
-				device_type_str(dev_device_type));
-		} else {
-			fprintf(stderr, "Unpairing of %#04x possibly failed\n", device_index);
+	free(session->jobs);
+	free(session);
+	free(reqs);
+	free(image);
+	return count > 0 && !failures;
+}
+
+static const char *scan_entry_str(const struct lt_scan_entry *entry,
+	bool is_long, char *buf, size_t size) {
+	unsigned i, n = 0;
+
+	switch (entry->status) {
+	case SCAN_PRESENT:
+		n = snprintf(buf, size, "present");
+		for (i = 0; i < (is_long ? 16u : 3u) && n < size; i++) {
+			n += snprintf(buf + n, size - n, " %02X", entry->value[i]);
 		}
-	} else {
-		fprintf(stderr, "Failed to send unpair %#04x request\n", device_index);
+		return buf;
+	case SCAN_INVALID_ADDRESS:
+		return "invalid address";
+	case SCAN_ERROR:
+		snprintf(buf, size, "error 0x%02X (%s)", entry->error_code,
+			hidpp10_error_str(entry->error_code));
+		return buf;
+	case SCAN_NO_RESPONSE:
+		return "no response";
+	default:
+		return "not read";
 	}
 }
 
-// triggers a notification that updates the list of paired devices
-bool get_all_devices(int fd) {
-	struct hidpp_message msg;
-	struct val_reg_connection_state cval;
-	memset(&cval, 0, sizeof cval);
-	cval.action = CONSTATE_ACTION_LIST_DEVICES;
-	if (!set_short_register(fd, DEVICE_RECEIVER, REG_CONNECTION_STATE, (u8 *) &cval, &msg)) {
-		return false;
+static void print_scan_entry(const struct lt_scan_entry *entry, unsigned reg,
+	const struct lt_scan_entry *old) {
+	const char *name = hidpp10_register_str(reg & 0xFF);
+	bool is_long = reg >= SCAN_REGISTERS;
+	char buf[2][80];
+
+	printf("%s\t0x%02X\t%s\t", is_long ? "long" : "short", reg & 0xFF,
+		name ? name : "");
+	if (old) {
+		printf("%s\t-> ", scan_entry_str(old, is_long, buf[1],
+			sizeof buf[1]));
 	}
-	return true;
+	printf("%s\n", scan_entry_str(entry, is_long, buf[0], sizeof buf[0]));
 }
-bool get_receiver_info(int fd, struct receiver_info *rinfo) {
-	struct hidpp_message msg;
-	u8 params[3] = {0};
 
-	params[0] = 0x03; // undocumented
-	if (get_long_register(fd, DEVICE_RECEIVER, REG_PAIRING_INFO, params, &msg)) {
-		struct msg_receiver_info *info = (struct msg_receiver_info *) &msg.msg_long.str;
-		uint32_t *serial_numberp;
+static const struct lt_scan_entry *scan_entry_at(const struct lt_scan *scan,
+	unsigned reg) {
+	return reg < SCAN_REGISTERS ? &scan->short_regs[reg] :
+		&scan->long_regs[reg - SCAN_REGISTERS];
+}
 
-		serial_numberp = (uint32_t *) &info->serial_number;
+// Reads all registers of the receiver or a device and prints the ones that
+// exist or fail with an error other than INVALID_ADDRESS.
+static bool perform_scan(struct lt_receiver *rcv, u8 device_index,
+	const char *snapshot) {
+	unsigned counts[SCAN_NO_RESPONSE + 1] = { 0 };
+	struct lt_scan *scan;
+	long long unsigned start;
+	unsigned reg;
+	bool ok;
+
+	scan = calloc(1, sizeof *scan);
+	if (!scan) {
+		perror("calloc");
+		return false;
+	}
+	// the serial number identifies the snapshot
+	if (device_index == DEVICE_RECEIVER) {
+		get_receiver_info(rcv, &rcv->info);
+	} else if (!rcv->devices[device_index - 1].serial_number) {
+		get_device_ext_pair_info(rcv, device_index);
+	}
 
-		rinfo->serial_number = ntohl(*serial_numberp);
-		return true;
+	start = get_timestamp_ms();
+	ok = lt_scan_registers(rcv, device_index, scan);
+	for (reg = 0; reg < 2 * SCAN_REGISTERS; reg++) {
+		const struct lt_scan_entry *entry = scan_entry_at(scan, reg);
+		counts[entry->status]++;
+		if (entry->status != SCAN_INVALID_ADDRESS) {
+			print_scan_entry(entry, reg, NULL);
+		}
 	}
-	return false;
+	printf("%u present, %u invalid address, %u other errors, "
+		"%u without response (%llu ms)\n", counts[SCAN_PRESENT],
+		counts[SCAN_INVALID_ADDRESS], counts[SCAN_ERROR],
+		counts[SCAN_NO_RESPONSE], get_timestamp_ms() - start);
+	if (ok && snapshot) {
+		ok = lt_scan_save(scan, snapshot);
+	}
+	free(scan);
+	return ok;
 }
-bool get_device_pair_info(int fd, u8 device_index) {
-	struct device *dev = &devices[device_index - 1];
-	struct hidpp_message msg;
-	u8 params[3] = {0};
 
-	params[0] = 0x20 | (device_index - 1); // 0x20..0x2F Unifying Device pairing info
-	if (get_long_register(fd, DEVICE_RECEIVER, REG_PAIRING_INFO, params, &msg)) {
-		struct msg_dev_pair_info *info = (struct msg_dev_pair_info *) &msg.msg_long.str;
+// Prints the registers that differ between two snapshots.
+static bool perform_scan_diff(const char *old_path, const char *new_path) {
+	struct lt_scan *scans;
+	unsigned reg, changes = 0;
 
-		dev->wireless_pid = (info->pid_msb << 8) | info->pid_lsb;
-		dev->device_type = info->device_type;
-		return true;
+	scans = calloc(2, sizeof *scans);
+	if (!scans) {
+		perror("calloc");
+		return false;
 	}
-	return false;
+	if (!lt_scan_load(&scans[0], old_path) ||
+		!lt_scan_load(&scans[1], new_path)) {
+		free(scans);
+		return false;
+	}
+	if (scans[0].device_index != scans[1].device_index ||
+		scans[0].serial != scans[1].serial) {
+		printf("Note: comparing device %#04x (%08X) with device %#04x "
+			"(%08X)\n", scans[0].device_index, scans[0].serial,
+			scans[1].device_index, scans[1].serial);
+	}
+	for (reg = 0; reg < 2 * SCAN_REGISTERS; reg++) {
+		const struct lt_scan_entry *a = scan_entry_at(&scans[0], reg);
+		const struct lt_scan_entry *b = scan_entry_at(&scans[1], reg);
+		if (memcmp(a, b, sizeof *a)) {
+			print_scan_entry(b, reg, a);
+			changes++;
+		}
+	}
+	printf("%u registers differ\n", changes);
+	free(scans);
+	return true;
 }
-bool get_device_ext_pair_info(int fd, u8 device_index) {
-	struct device *dev = &devices[device_index - 1];
-	struct hidpp_message msg;
-	u8 params[3] = {0};
 
-	params[0] = 0x30 | (device_index - 1); // 0x30..0x3F Unifying Device extended pairing info
-	if (get_long_register(fd, DEVICE_RECEIVER, REG_PAIRING_INFO, params, &msg)) {
-		struct msg_dev_ext_pair_info *info;
-		uint32_t *serial_numberp;
+#define SHELL_TIMEOUT	1000 // for a response to a HID++ request
+#define SHELL_LINE_MAX	1024
+
+/* Input of the shell, lines are split without stdio buffering so that the
+ * receiver can be polled while waiting for the next line. */
+struct shell_input {
+	int fd;
+	bool interactive;
+	bool eof;
+	char buf[SHELL_LINE_MAX];
+	size_t length;
+};
 
-		info = (struct msg_dev_ext_pair_info *) &msg.msg_long.str;
-		serial_numberp = (uint32_t *) &info->serial_number;
+static bool shell_at_prompt;
 
-		dev->serial_number = ntohl(*serial_numberp);
-		dev->power_switch_location = info->usability_info & 0x0F;
-		return true;
+static void shell_prompt(struct shell_input *in) {
+	if (in->interactive) {
+		printf("ltunify> ");
+		fflush(stdout);
+		shell_at_prompt = true;
 	}
-	return false;
 }
-bool get_device_name(int fd, u8 device_index) {
-	struct device *dev = &devices[device_index - 1];
-	struct hidpp_message msg;
-	u8 params[3] = {0};
 
-	params[0] = 0x40 | (device_index - 1); // 0x40..0x4F Unifying Device Name
-	if (get_long_register(fd, DEVICE_RECEIVER, REG_PAIRING_INFO, params, &msg)) {
-		struct msg_dev_name *name = (struct msg_dev_name *) &msg.msg_long.str;
-		if (name->length > DEVICE_NAME_MAXLEN) {
-			fprintf(stderr, "Invalid name length %#04x for idx=%i\n", name->length, device_index);
-			return false;
-		}
+// Decodes every report as it arrives.
+static void shell_report(struct lt_receiver *rcv, const u8 *report,
+	size_t length, void *data) {
+	(void) rcv;
+	(void) data;
 
-		memcpy(&dev->name, name->str, name->length);
-		dev->name[name->length] = 0;
-		return true;
+	if (shell_at_prompt) {
+		putchar('\n');
 	}
-	return false;
+	process_msg((struct report *) report, length);
+	if (shell_at_prompt) {
+		printf("ltunify> ");
+	}
+	fflush(stdout);
 }
 
-bool get_hidpp_version(int fd, u8 device_index, struct hidpp_version *version) {
-	struct hidpp_message msg;
-	struct msg_short *payload = &msg.msg_short;
-	u8 softwareId = 0x04; // value 1..15 - random choice for 0x4
-	u8 ping_data = 0x00; // can be any value
+// Returns the report length for report_id or 0 if it is unknown.
+static size_t shell_report_length(u8 report_id) {
+	switch (report_id) {
+	case SHORT_MESSAGE: return SHORT_MESSAGE_LEN;
+	case LONG_MESSAGE: return LONG_MESSAGE_LEN;
+	case DJ_SHORT: return DJ_SHORT_LEN;
+	case DJ_LONG: return DJ_LONG_LEN;
+	}
+	return 0;
+}
 
-	msg.report_id = SHORT_MESSAGE;
-	msg.device_index = device_index;
-	msg.sub_id = 0x00; // Root feature index
+// Looks up a name of the protocol tables for the byte at position pos: device
+// indexes (RECV, DEV1), sub IDs (GET_REG) or registers (PAIRING_INFO).
+static bool shell_mnemonic(const char *word, unsigned pos, u8 report_id,
+	u8 *value) {
+	unsigned i;
 
-	memset(payload->value, 0, sizeof payload->value);
-	payload->address = 0x10 | softwareId;
-	payload->value[2] = ping_data;
-	if (!do_write(fd, &msg)) {
-		return false;
-	}
-	for (;;) {
-		if (!do_read(fd, &msg, 0, 3000)) {
-			if (debug_enabled) {
-				fprintf(stderr, "Failed to read HID++ version, device does not respond!\n");
-			}
-			return false;
+	for (i = 0; i < 0x100; i++) {
+		const char *name;
+
+		if (pos == 1) {
+			name = device_index_str(i);
+		} else if (pos == 2) {
+			name = report_type_str(report_id, i);
+		} else {
+			name = register_str(i);
 		}
-		if (msg.sub_id == 0x8F) {
-			struct msg_error *error = (struct msg_error *) &msg.msg_error;
-			if (error->sub_id == 0x00 && error->address == (0x10 | softwareId)) {
-				// if error is ERR_INVALID_SUBID (0x01), then HID++ 1.0
-				if (error->error_code == 0x01) {
-					version->major = 1;
-					version->minor = 0;
-					return true;
-				} else if (debug_enabled) {
-					const char *err_str = error_messages[error->error_code];
-					fprintf(stderr, "Failed to retrieve version: %#04x (%s)\n",
-						error->error_code, err_str);
-				}
-				// fatal error - is device connected?
-				return false;
-			}
-			// ignore other errors
+		if (*name == '?') {
+			name++;
 		}
-		if (msg.sub_id == 0x00 && (payload->address & 0xF) == softwareId &&
-			payload->value[2] == ping_data) {
-			break; // I think we got a version
-		} else if (debug_enabled) {
-			fprintf(stderr, "Ignoring sub_id=%02x\n", msg.sub_id);
+		if (*name && !strcasecmp(word, name)) {
+			*value = i;
+			return true;
 		}
-		// ignore other messages
-	}
-
-	version->major = payload->value[0];
-	version->minor = payload->value[1];
-	return true;
-}
-
-// device_index can also be 0xFF for receiver
-bool get_device_version(int fd, u8 device_index, u8 version_type, struct val_reg_version *ver) {
-	struct hidpp_message msg;
-	// TODO: not 100% reliable for wireless devices, it may return MSG_ERR
-	// (err=SUCCESS, wtf). Perhaps we need to send another msg type=00
-	// (whatever the undocumented params are).
-
-	memset(ver, 0, sizeof *ver);
-	ver->select_field = version_type;
-	if (get_short_register(fd, device_index, REG_VERSION_INFO, (u8 *) ver, &msg)) {
-		memcpy(ver, msg.msg_short.value, sizeof *ver);
-		return true;
 	}
 	return false;
 }
 
-bool get_device_versions(int fd, u8 device_index, struct version *version) {
-	struct val_reg_version ver;
-
-	memset(version, 0, sizeof *version);
+// Resolves "@featureId" or "@FeatureName" to the feature index on the device
+// that the report is addressed to.
+static bool shell_feature(struct lt_receiver *rcv, const char *word,
+	u8 device_index, u8 *value) {
+	uint16_t featureId;
+	char *end;
+	unsigned long n = strtoul(word, &end, 16);
 
-	if (get_device_version(fd, device_index, VERSION_FIRMWARE, &ver)) {
-		version->fw_major = ver.v1;
-		version->fw_minor = ver.v2;
+	if (*word && !*end && n <= 0xFFFF) {
+		featureId = n;
 	} else {
-		// assume that other versions will fail too
+		for (n = 0; n <= 0xFFFF; n++) {
+			if (!strcasecmp(word, get_feature_name(n))) {
+				break;
+			}
+		}
+		if (n > 0xFFFF) {
+			fprintf(stderr, "Unknown feature: %s\n", word);
+			return false;
+		}
+		featureId = n;
+	}
+	if (device_index < 1 || device_index > DEVICES_MAX) {
+		fprintf(stderr, "Features require a device index\n");
 		return false;
 	}
-	if (get_device_version(fd, device_index, VERSION_FW_BUILD, &ver)) {
-		version->fw_build = (ver.v1 << 8) | ver.v2;
+	if (!hidpp20_resolve_features(rcv, device_index, &featureId, 1)) {
+		return false;
 	}
-	//if (get_device_version(fd, device_index, 3, &ver)) puts("No idea what this is useful for");
-	if (get_device_version(fd, device_index, VERSION_BOOTLOADER, &ver)) {
-		version->bl_major = ver.v1;
-		version->bl_minor = ver.v2;
+	*value = hidpp20_feature_index(rcv, device_index, featureId);
+	if (featureId != FEATURE_INDEX_IROOT && !*value) {
+		fprintf(stderr, "Feature %04X (%s) is not supported by device %u\n",
+			featureId, get_feature_name(featureId), device_index);
+		return false;
 	}
 	return true;
 }
 
-// device index is 1..6
-void gather_device_info(int fd, u8 device_index) {
-	if (get_device_pair_info(fd, device_index)) {
-		struct device *dev = &devices[device_index - 1];
+// Parses the words of a line like the hidw function of the "shell" script:
+// hexadecimal bytes, "_string" for literal characters and "xx.." to pad the
+// report with xx instead of zeroes. Names of the protocol tables and
+// "@feature" can be used in place of bytes. Returns the report length or 0.
+static size_t shell_parse(struct lt_receiver *rcv, char *line, u8 *report,
+	size_t size) {
+	char *words[SHELL_LINE_MAX / 2], *word, *save = NULL;
+	unsigned count = 0, i;
+	size_t length = 0, n;
+	u8 fill = 0;
+
+	for (word = strtok_r(line, " \t\n", &save); word;
+		word = strtok_r(NULL, " \t\n", &save)) {
+		words[count++] = word;
+	}
+	// a single argument may be separated by colons (tshark output)
+	if (count == 1 && words[0][0] != '_') {
+		save = NULL;
+		count = 0;
+		for (word = strtok_r(words[0], ":", &save); word;
+			word = strtok_r(NULL, ":", &save)) {
+			words[count++] = word;
+		}
+	}
 
-		dev->device_present = true;
+	for (i = 0; i < count; i++) {
+		char *dots;
 
-		get_hidpp_version(fd, device_index, &dev->hidpp_version);
-		get_device_ext_pair_info(fd, device_index);
-		get_device_name(fd, device_index);
-		if (dev->hidpp_version.major == 1 && dev->hidpp_version.minor == 0) {
-			if (get_device_versions(fd, device_index, &dev->version)) {
-				dev->device_available = true;
+		word = words[i];
+		fill = 0;
+		if (word[0] == '_') {
+			n = strlen(word + 1);
+			if (length + n > size) {
+				goto too_long;
 			}
-		} else {
-			// TODO: hid++20 support
+			memcpy(report + length, word + 1, n);
+			length += n;
+			continue;
 		}
-	} else {
-		// retrieve some information from notifier
-		get_all_devices(fd);
+		if (length >= size) {
+			goto too_long;
+		}
+		dots = strstr(word, "..");
+		if (dots && !dots[2]) {
+			*dots = '\0';
+		}
+		if (!strncasecmp(word, "0x", 2)) {
+			word += 2;
+		}
+		if (strlen(word) <= 2 && parse_hex_byte(word, &report[length])) {
+			/* hexadecimal byte */
+		} else if (word[0] == '@') {
+			if (!shell_feature(rcv, word + 1,
+				length > 1 ? report[1] : 0, &report[length])) {
+				return 0;
+			}
+		} else if (!shell_mnemonic(word, length, report[0],
+			&report[length])) {
+			fprintf(stderr, "Invalid argument: %s\n", words[i]);
+			return 0;
+		}
+		if (dots) {
+			fill = report[length];
+		}
+		length++;
+	}
+	if (!length) {
+		return 0;
 	}
-}
-
-void print_versions(struct version *ver) {
-	// versions are shown as hex. Probably a mistake given that the length
-	// is 3 which can fit 255 instead of FF (and 65535 instead of FF)
-	printf("Firmware version: %03x.%03x.%05x\n",
-			ver->fw_major, ver->fw_minor, ver->fw_build);
-	printf("Bootloader version: BL.%03x.%03x\n",
-			ver->bl_major, ver->bl_minor);
-}
 
-void get_and_print_recv_info(int fd) {
-	if (get_receiver_info(fd, &receiver)) {
-		printf("Serial number: %08X\n", receiver.serial_number);
+	n = shell_report_length(report[0]);
+	if (!n) {
+		fprintf(stderr, "Unknown report type %02X, not padding\n",
+			report[0]);
+		return length;
 	}
-	if (get_device_versions(fd, DEVICE_RECEIVER, &receiver.version)) {
-		print_versions(&receiver.version);
+	if (length > n) {
+		fprintf(stderr, "Too many bytes: %zu > %zu\n", length, n);
+		return 0;
 	}
+	memset(report + length, fill, n - length);
+	return n;
+
+too_long:
+	fprintf(stderr, "Report is longer than %zu bytes\n", size);
+	return 0;
 }
 
-void print_detailed_device(u8 device_index) {
-	struct device *dev = &devices[device_index - 1];
+// Sends a report. HID++ reports are submitted as request such that the next
+// line is only processed after the response (or a timeout).
+static void shell_send(struct lt_receiver *rcv, const u8 *report,
+	size_t length) {
+	struct lt_request req;
 
-	if (!dev->device_present) {
-		printf("Device %i is not paired\n", device_index);
+	if (length != SHORT_MESSAGE_LEN && length != LONG_MESSAGE_LEN) {
+		lt_write_report(rcv, report, length);
 		return;
 	}
-
-	if (dev->hidpp_version.major) {
-		printf("HID++ version: %i.%i\n", dev->hidpp_version.major, dev->hidpp_version.minor);
-	} else {
-		puts("HID++ version: unknown");
-	}
-	printf("Device index %i\n", device_index);
-	printf("%s\n", device_type_str(dev->device_type));
-	printf("Name: %s\n", dev->name);
-	printf("Wireless Product ID: %04X\n", dev->wireless_pid);
-	printf("Serial number: %08X\n", dev->serial_number);
-	if (dev->device_available) {
-		print_versions(&dev->version);
-	} else {
-		puts("Device was unavailable, version information not available.");
+	memset(&req, 0, sizeof req);
+	memcpy(&req.msg, report, length);
+	if (lt_submit(rcv, &req, SHELL_TIMEOUT, NULL, NULL)) {
+		lt_run(&rcv, 1, -1);
+		if (!req.done) {
+			printf("No response\n");
+		}
 	}
 }
-void get_device_names(int fd) {
-	u8 i;
 
-	for (i=0; i<DEVICES_MAX; i++) {
-		struct device *dev = &devices[i];
-		if (!dev->device_present) {
-			continue;
+// Returns the next line or NULL at the end of the input or on interruption.
+// Reports that arrive in the meantime are processed.
+static char *shell_read_line(struct lt_receiver *rcv, struct shell_input *in) {
+	static char line[SHELL_LINE_MAX];
+
+	while (!interrupted) {
+		struct pollfd pollfds[2];
+		char *nl = memchr(in->buf, '\n', in->length);
+		ssize_t r;
+
+		if (nl || (in->eof && in->length)) {
+			size_t n = nl ? (size_t) (nl - in->buf) + 1 : in->length;
+			memcpy(line, in->buf, n);
+			line[nl ? n - 1 : n] = '\0';
+			in->length -= n;
+			memmove(in->buf, in->buf + n, in->length);
+			shell_at_prompt = false;
+			return line;
+		} else if (in->eof) {
+			return NULL;
+		} else if (in->length == sizeof in->buf) {
+			fprintf(stderr, "Line too long\n");
+			in->length = 0;
 		}
 
-		if (!get_device_name(fd, i + 1)) {
-			fprintf(stderr, "Failed to read device name for idx=%i\n", i + 1);
+		pollfds[0].fd = in->fd;
+		pollfds[0].events = POLLIN;
+		pollfds[1].fd = lt_receiver_fd(rcv);
+		pollfds[1].events = POLLIN;
+		if (poll(pollfds, 2, lt_next_timeout(rcv)) < 0) {
+			if (errno != EINTR) {
+				perror("poll");
+				return NULL;
+			}
+			continue;
 		}
-	}
-}
-
-static void print_version(void) {
-	fprintf(stderr,
-"Logitech Unifying tool version " PACKAGE_VERSION "\n"
-"Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>\n");
-}
-
-void print_all_devices(void) {
-	unsigned i;
-	puts("Connected devices:");
-	for (i=0; i<DEVICES_MAX; i++) {
-		struct device *dev = &devices[i];
-		if (!dev->device_present) {
+		lt_process_events(rcv);
+		if (!pollfds[0].revents) {
 			continue;
 		}
-
-		printf("idx=%i\t%s\t%s\n", i + 1,
-			device_type_str(dev->device_type), dev->name);
+		r = read(in->fd, in->buf + in->length,
+			sizeof in->buf - in->length);
+		if (r < 0 && errno != EINTR) {
+			perror("read");
+			return NULL;
+		} else if (r == 0) {
+			in->eof = true;
+		} else if (r > 0) {
+			in->length += r;
+		}
 	}
+	return NULL;
 }
 
-static void print_usage(const char *program_name) {
-	fprintf(stderr, "Usage: %s [options] cmd [cmd options]\n",
-		program_name);
-	print_version();
-	fprintf(stderr,
-"\n"
-"Generic options:\n"
-"  -d, --device path Bypass detection, specify custom hidraw device.\n"
-"  -D                Print debugging information\n"
-"  -h, --help        Show this help message\n"
-"\n"
-"Commands:\n"
-"  list            - show all paired devices\n"
-"  pair [timeout]  - Try to pair within \"timeout\" seconds (1 to 255,\n"
-"                    default 0 which is an alias for 30s)\n"
-"  unpair idx      - Unpair device\n"
-"  info idx        - Show more detailed information for a device\n"
-"  receiver-info   - Show information about the receiver\n"
-"In the above lines, \"idx\" refers to the device number shown in the\n"
-" first column of the list command (between 1 and 6). Alternatively, you\n"
-" can use the following names (case-insensitive):\n");
-	print_device_types();
+static void shell_help(void) {
+	puts("Reports are written as hexadecimal bytes (0x prefix is optional),\n"
+	"missing bytes are zeroes. End with xx.. to pad with xx instead.\n"
+	"_string is replaced by the characters of string. A single word may\n"
+	"use colons as separator (10:ff:81:b5..).\n"
+	"Device indexes (RECV, DEV1), sub IDs (GET_REG, GET_LONG_REG) and\n"
+	"registers (PAIRING_INFO) can be written by name, @feature is the\n"
+	"index of a HID++ 2.0 feature (@0005 or @DeviceName) on the device.\n"
+	"\n"
+	"Commands:\n"
+	"  wait [ms]  - show notifications for ms milliseconds (default 1000)\n"
+	"  help       - show this help\n"
+	"  quit       - leave the shell\n"
+	"Lines starting with # are ignored.");
 }
 
-static bool is_numeric_device_index(const char *str) {
-	char *end;
-	unsigned long device_index = strtoul(str, &end, 0);
-
-	// if a number was found, there must be no other characters thereafter
-	return !*end &&
-		device_index >= 1 && device_index <= DEVICES_MAX;
-}
+// Reads reports from stdin or a script and prints all reports that are
+// received, decoded like the hidraw program.
+static bool perform_shell(struct lt_receiver *rcv, const char *script) {
+	struct sigaction sa, old_sa;
+	struct shell_input in;
+	char *line;
+
+	memset(&in, 0, sizeof in);
+	if (script) {
+		in.fd = open(script, O_RDONLY);
+		if (in.fd < 0) {
+			perror(script);
+			return false;
+		}
+	} else {
+		in.interactive = isatty(STDIN_FILENO);
+	}
 
-// Return number of commands and command arguments, -1 on error. If the program
-// should not run (--help), then 0 is returned and args is NULL.
-static int validate_args(int argc, char **argv, char ***argsp, char **hidraw_path) {
-	int args_count;
-	char *cmd;
-	int opt;
-	char **args;
-	struct option longopts[] = {
-		{ "device",     1, NULL, 'd' },
-		{ "help",       0, NULL, 'h' },
-		{ "version",	0, NULL, 'V' },
-		{ 0, 0, 0, 0 },
-	};
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = handle_interrupt;
+	sigaction(SIGINT, &sa, &old_sa);
+	lt_set_report_callback(rcv, shell_report, NULL);
 
-	*argsp = NULL;
+	if (in.interactive) {
+		puts("Type \"help\" for the syntax, \"quit\" to leave.");
+	}
+	for (shell_prompt(&in); (line = shell_read_line(rcv, &in));
+		shell_prompt(&in)) {
+		u8 report[DJ_LONG_LEN];
+		char *cmd = line + strspn(line, " \t");
+		size_t length;
 
-	while ((opt = getopt_long(argc, argv, "+Dd:hV", longopts, NULL)) != -1) {
-		switch (opt) {
-		case 'D':
-			debug_enabled = true;
-			break;
-		case 'd':
-			*hidraw_path = optarg;
+		if (!*cmd || *cmd == '#') {
+			continue;
+		} else if (!strncmp(cmd, "wait", 4) && (!cmd[4] || cmd[4] == ' ')) {
+			int ms = cmd[4] ? strtol(cmd + 5, NULL, 0) : 1000;
+			wait_events(&rcv, 1, ms, NULL);
+		} else if (!strcmp(cmd, "help")) {
+			shell_help();
+		} else if (!strcmp(cmd, "quit") || !strcmp(cmd, "exit")) {
 			break;
-		case 'V':
-			print_version();
-			return 0;
-		case 'h':
-			print_usage(*argv);
-			return 0;
-		default:
-			return -1;
+		} else if ((length = shell_parse(rcv, cmd, report, sizeof report))) {
+			shell_send(rcv, report, length);
 		}
 	}
-
-	if (optind >= argc) {
-		// missing command
-		print_usage(*argv);
-		return -1;
+	if (in.interactive && !line) {
+		putchar('\n');
 	}
-	*argsp = args = &argv[optind];
-	args_count = argc - optind - 1;
 
-	cmd = args[0];
-	if (!strcmp(cmd, "list") || !strcmp(cmd, "receiver-info")) {
-		/* nothing to check */
-	} else if (!strcmp(cmd, "pair")) {
-		if (args_count >= 1) {
-			char *end;
-			unsigned long int n;
-			n = strtoul(args[1], &end, 0);
-			if (*end != '\0' || n > 0xFF) {
-				fprintf(stderr, "Timeout must be a number between 0 and 255\n");
-				return -1;
-			}
-		}
-	} else if (!strcmp(cmd, "unpair") || !strcmp(cmd, "info")) {
-		if (args_count < 1) {
-			fprintf(stderr, "%s requires a device index\n", cmd);
-			return -1;
-		}
-		if (!is_numeric_device_index(args[1]) &&
-			device_type_from_str(args[1]) == -1) {
-			fprintf(stderr, "Invalid device type, must be a numeric index or:\n");
-			print_device_types();
-			return -1;
-		}
-	} else {
-		fprintf(stderr, "Unrecognized command: %s\n", cmd);
-		return -1;
+	lt_set_report_callback(rcv, NULL, NULL);
+	sigaction(SIGINT, &old_sa, NULL);
+	if (script) {
+		close(in.fd);
 	}
-	return args_count;
+	return true;
 }
 
-#define RECEIVER_NAME "logitech-djreceiver"
-int open_hidraw(void) {
-	int fd = -1;
-	glob_t matches;
-	char hiddev_name[32] = {0};
-
-	if (!glob("/sys/class/hidraw/hidraw*/device/driver", 0, NULL, &matches)) {
-		size_t i;
-		char buf[1024];
-		for (i = 0; i < matches.gl_pathc; i++) {
-			ssize_t r;
-			char *name = matches.gl_pathv[i];
-			const char *last_comp;
-			char *dev_name;
-
-			r = readlink(name, buf, (sizeof buf) - 1);
-			if (r < 0) {
-				perror(name);
-				continue;
-			}
+#define BENCH_WINDOW	8 // requests in flight per receiver
 
-			buf[r] = 0; /* readlink does not NUL-terminate */
-			last_comp = basename(buf);
+struct bench_receiver {
+	struct lt_receiver *rcv;
+	unsigned requests, submitted, failed;
+	struct lt_request reqs[BENCH_WINDOW];
+};
 
-			/* retrieve 'hidrawX' name */
-			dev_name = name + sizeof "/sys/class/hidraw";
-			*(strchr(dev_name, '/')) = 0;
+static void bench_done(struct lt_receiver *rcv, struct lt_request *req,
+	void *data);
 
-			if (!strcmp(last_comp, RECEIVER_NAME)) {
-				/* Logitech receiver c52b and c532 - pass */
-			} else if (!strcmp(last_comp, "hid-generic")) {
-				/* need to test for older nano receiver c52f */
-				FILE *fp;
-				uint32_t vid = 0, pid = 0;
+static void bench_submit(struct bench_receiver *br, struct lt_request *req) {
+	if (br->submitted >= br->requests) {
+		return;
+	}
+	br->submitted++;
+	init_register_req(req, DEVICE_RECEIVER, SUB_GET_REGISTER,
+		REG_CONNECTION_STATE, NULL);
+	lt_submit(br->rcv, req, 1000, bench_done, br);
+}
 
-				// Assume that the first match is the receiver. Devices bound to the
-				// same receiver may have the same modalias.
-				snprintf(buf, sizeof buf, "/sys/class/hidraw/%s/device/modalias", dev_name);
-				if ((fp = fopen(buf, "r"))) {
-					int m = fscanf(fp, "hid:b%*04Xg%*04Xv%08Xp%08X", &vid, &pid);
-					if (m != 2) {
-						pid = 0;
-					}
-					fclose(fp);
-				}
+static void bench_done(struct lt_receiver *rcv, struct lt_request *req,
+	void *data) {
+	struct bench_receiver *br = data;
 
-				if (vid != VID_LOGITECH || pid != PID_NANO_RECEIVER) {
-					continue;
-				}
-			} else { /* unknown driver */
-				continue;
-			}
+	(void) rcv;
+	if (!req->done || req->error_type) {
+		br->failed++;
+	}
+	bench_submit(br, req);
+}
 
-			snprintf(hiddev_name, sizeof hiddev_name, "/dev/%s", dev_name);
-			fd = open(hiddev_name, O_RDWR);
-			if (fd < 0) {
-				perror(hiddev_name);
-			} else {
-				break;
-			}
+static long long unsigned cpu_time_us(void) {
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+// Reads a register of every receiver "requests" times with BENCH_WINDOW
+// requests in flight, first with poll and read/write, then with io_uring.
+static bool perform_bench(const char *hidraw_path, unsigned requests) {
+	struct lt_receiver *rcvs[RECEIVERS_MAX];
+	struct bench_receiver *brs;
+	unsigned count, i, pass;
+
+	count = open_receivers(hidraw_path, rcvs);
+	if (!count) {
+		fprintf(stderr, "No receivers found\n");
+		return false;
+	}
+	if (rcvs[0]->uring) {
+		lt_uring_free(rcvs[0]->uring);
+	}
+	brs = calloc(count, sizeof *brs);
+	if (!brs) {
+		perror("calloc");
+		for (i = 0; i < count; i++) {
+			lt_receiver_close(rcvs[i]);
 		}
+		return false;
 	}
 
-	if (fd < 0) {
-		if (*hiddev_name) {
-			fprintf(stderr, "Logitech Unifying Receiver device is not accessible.\n"
-				"Try running this program as root or enable read/write permissions\n"
-				"for %s\n", hiddev_name);
-		} else {
-			fprintf(stderr, "No Logitech Unifying Receiver device found\n");
-			if (access("/sys/class/hidraw", R_OK)) {
-				fputs("The kernel must have CONFIG_HIDRAW enabled.\n",
-					stderr);
+	printf("backend\treceivers\treports\tsyscalls\tsyscalls/report\t"
+		"CPU ms/1000 reports\twall ms\tfailed\n");
+	for (pass = 0; pass < 2; pass++) {
+		struct lt_uring *uring = NULL;
+		struct lt_io_stats stats;
+		long long unsigned start, cpu, failed = 0;
+		unsigned j;
+
+		if (pass == 1) {
+			uring = lt_uring_new(rcvs, count);
+			if (!uring) {
+				printf("io_uring\tnot available\n");
+				break;
 			}
-			if (access("/sys/module/hid_logitech_dj", F_OK)) {
-				fprintf(stderr, "Driver is not loaded, try:"
-						"   sudo modprobe hid-logitech-dj\n");
+		}
+		lt_get_io_stats(&stats, true);
+		start = get_timestamp_ms();
+		cpu = cpu_time_us();
+		for (i = 0; i < count; i++) {
+			memset(&brs[i], 0, sizeof brs[i]);
+			brs[i].rcv = rcvs[i];
+			brs[i].requests = requests;
+			for (j = 0; j < BENCH_WINDOW; j++) {
+				bench_submit(&brs[i], &brs[i].reqs[j]);
 			}
 		}
+		lt_run(rcvs, count, -1);
+		cpu = cpu_time_us() - cpu;
+		lt_get_io_stats(&stats, true);
+		for (i = 0; i < count; i++) {
+			failed += brs[i].failed;
+		}
+		printf("%s\t%u\t%llu\t%llu\t%.2f\t%.2f\t%llu\t%llu\n",
+			uring ? "io_uring" : "poll", count, stats.reports,
+			stats.syscalls, stats.reports ?
+			(double) stats.syscalls / stats.reports : 0,
+			stats.reports ? cpu / (double) stats.reports : 0,
+			get_timestamp_ms() - start, failed);
+		lt_uring_free(uring);
 	}
-	globfree(&matches);
 
-	return fd;
+	for (i = 0; i < count; i++) {
+		lt_receiver_close(rcvs[i]);
+	}
+	free(brs);
+	return true;
 }
 
-// returns device index starting at 1 or 0 on failure
-static u8 find_device_index_for_type(int fd, const char *str, bool *fetched_devices) {
-	char *end;
-	u8 device_index;
-
-	device_index = strtoul(str, &end, 0);
-	if (*end == '\0') {
-		return device_index;
+/* Receiver state that a command of main needs, set up only when needed. */
+#define SESSION_NOTIFS	0x01 // wireless notifications (pairing, device list)
+
+static unsigned command_session(const char *cmd, char **args, int args_count) {
+	// devices given by type are looked up in the device list
+	bool by_type = args_count >= 1 && !is_numeric_device_index(args[1]) &&
+		!parse_serial_spec(args[1], NULL) &&
+		strcasecmp(args[1], "receiver");
+
+	if (!strcmp(cmd, "pair") || !strcmp(cmd, "unpair") ||
+		!strcmp(cmd, "list") || !strcmp(cmd, "shell")) {
+		return SESSION_NOTIFS;
+	} else if (!strcmp(cmd, "info") || !strcmp(cmd, "feature") ||
+		!strcmp(cmd, "scan")) {
+		return by_type ? SESSION_NOTIFS : 0;
 	}
+	return 0; // receiver-info only reads registers
+}
 
-	if (get_all_devices(fd)) {
-		u8 i;
-		int device_type_n;
-
-		device_type_n = device_type_from_str(str);
-		if (fetched_devices) {
-			*fetched_devices = true;
+// Enables wireless notifications if they are off, restore tells whether they
+// were written and have to be disabled afterwards. write_failed is set if the
+// receiver did not take the new flags, notifs is then not its state.
+static bool enable_notifs(struct lt_receiver *rcv,
+	struct msg_enable_notifs *notifs, bool *restore, bool *write_failed) {
+	if (debug_enabled) {
+		if (!get_and_print_notifications(rcv, DEVICE_RECEIVER, notifs)) {
+			return false;
 		}
+	} else {
+		if (!get_notifications(rcv, DEVICE_RECEIVER, notifs)) {
+			fprintf(stderr, "Failed to retrieve notification state\n");
+			return false;
+		}
+	}
 
-		for (i = 0; i < DEVICES_MAX; i++) {
-			if (devices[i].device_type == device_type_n) {
-				return i + 1;
+	if (!notifs->reporting_flags_receiver) {
+		notifs->reporting_flags_receiver |= 1;
+		if (set_notifications(rcv, DEVICE_RECEIVER, notifs)) {
+			*restore = true;
+			if (debug_enabled) {
+				puts("Successfully enabled notifications");
 			}
+		} else {
+			*write_failed = true;
+			fprintf(stderr, "Failed to set HID++ Notification status\n");
 		}
-	} else {
-		fprintf(stderr, "Unable to request a list of paired devices");
 	}
-	return 0;
+	return true;
 }
 
 int main(int argc, char **argv) {
-        int fd;
+	struct lt_receiver *rcv;
+	struct sigaction sa;
 	struct msg_enable_notifs notifs;
 	char *cmd, **args;
 	int args_count;
 	char *hidraw_path = NULL;
 	bool disable_notifs = false;
+	bool notifs_failed = false;
+	unsigned session;
+	uint32_t serial;
+	int ret = 0;
 
 	args_count = validate_args(argc, argv, &args, &hidraw_path);
         if (args_count < 0) {
@@ -1269,39 +3520,98 @@ int main(int argc, char **argv) {
 	}
 	cmd = args[0];
 
-	if (hidraw_path) {
-		fd = open(hidraw_path, O_RDWR);
-		if (fd < 0) {
-			perror(hidraw_path);
-		}
-	} else {
-		fd = open_hidraw();
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = handle_dump_ring;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	if (!strcmp(cmd, "import-usbmon")) {
+		return lt_trace_import_usbmon(args[1], args[2]) ? 0 : 1;
+	} else if (!strcmp(cmd, "scan") && !strcmp(args[1], "--diff")) {
+		return perform_scan_diff(args[2], args[3]) ? 0 : 1;
+	} else if (!strcmp(cmd, "rate") && args_count >= 1 &&
+		(!strcmp(args[1], "--trace") || !strcmp(args[1], "--usbmon"))) {
+		return perform_rate_capture(args[1], args[2]) ? 0 : 1;
 	}
-        if (fd < 0) {
-                return 1;
-        }
 
-	if (debug_enabled) {
-		if (!get_and_print_notifications(fd, DEVICE_RECEIVER, &notifs)) {
-			goto end_close;
+	// a replay or simulation must not change the index of the real receivers
+	serial_index = lt_serial_index_open(NULL,
+		replay_path != NULL || simulate_count);
+
+	if (!strcmp(cmd, "battery")) {
+		// manages the notification state of every receiver itself
+		ret = perform_battery_sweep(hidraw_path) ? 0 : 1;
+		goto end_save;
+	} else if (!strcmp(cmd, "activity")) {
+		unsigned interval = 1, samples = 0;
+		if (args_count >= 1) {
+			interval = strtoul(args[1], NULL, 0);
 		}
-	} else {
-		if (!get_notifications(fd, DEVICE_RECEIVER, &notifs)) {
-			fprintf(stderr, "Failed to retrieve notification state\n");
-			goto end_close;
+		if (args_count >= 2) {
+			samples = strtoul(args[2], NULL, 0);
+		}
+		ret = perform_activity_sampler(hidraw_path, interval, samples) ? 0 : 1;
+		goto end_save;
+	} else if (!strcmp(cmd, "rate")) {
+		unsigned seconds = 10;
+		if (args_count >= 1) {
+			seconds = strtoul(args[1], NULL, 0);
 		}
+		ret = perform_rate(hidraw_path, seconds) ? 0 : 1;
+		goto end_save;
+	} else if (!strcmp(cmd, "bench")) {
+		unsigned requests = 1000;
+		if (args_count >= 1) {
+			requests = strtoul(args[1], NULL, 0);
+		}
+		ret = perform_bench(hidraw_path, requests) ? 0 : 1;
+		goto end_save;
+	} else if (!strcmp(cmd, "apply")) {
+		bool dry_run = !strcmp(args[1], "--dry-run");
+		ret = perform_apply(hidraw_path, args[dry_run ? 2 : 1], dry_run) ?
+			0 : 1;
+		goto end_save;
+	} else if (!strcmp(cmd, "dfu")) {
+		unsigned window = 0;
+		if (!simulate_count && !replay_path) {
+			fprintf(stderr, "dfu only implements the transfer format of "
+				"the simulator, use --simulate\n");
+			ret = 1;
+			goto end_save;
+		}
+		if (!strcmp(args[1], "--window")) {
+			window = strtoul(args[2], NULL, 0);
+			args += 2;
+			args_count -= 2;
+		}
+		ret = perform_dfu(hidraw_path, args[1], &args[2], args_count - 1,
+			window) ? 0 : 1;
+		goto end_save;
+	} else if (!strcmp(cmd, "unpair") && !strcmp(args[1], "all")) {
+		ret = perform_unpair_sweep(hidraw_path, NULL, 0) ? 0 : 1;
+		goto end_save;
+	} else if (!strcmp(cmd, "unpair") && !strcmp(args[1], "--serial")) {
+		static uint32_t serials[SERIALS_MAX];
+		int n = parse_serials(args[2], serials, SERIALS_MAX);
+		ret = perform_unpair_sweep(hidraw_path, serials, n) ? 0 : 1;
+		goto end_save;
 	}
 
-	if (!notifs.reporting_flags_receiver) {
-		disable_notifs = true;
-		notifs.reporting_flags_receiver |= 1;
-		if (set_notifications(fd, DEVICE_RECEIVER, &notifs)) {
-			if (debug_enabled) {
-				puts("Successfully enabled notifications");
-			}
-		} else {
-			fprintf(stderr, "Failed to set HID++ Notification status\n");
-		}
+	session = command_session(cmd, args, args_count);
+	if (args_count >= 1 && parse_serial_spec(args[1], &serial)) {
+		rcv = open_receiver_for_serial(hidraw_path, serial);
+	} else {
+		rcv = open_receiver(hidraw_path);
+	}
+	if (!rcv) {
+		ret = 1;
+		goto end_save;
+	}
+
+	if ((session & SESSION_NOTIFS) &&
+		!enable_notifs(rcv, &notifs, &disable_notifs, &notifs_failed)) {
+		ret = 1;
+		goto end_close;
 	}
 
 	if (!strcmp(cmd, "pair")) {
@@ -1309,71 +3619,114 @@ int main(int argc, char **argv) {
 		if (args_count >= 1) {
 			timeout = (u8) strtoul(args[1], NULL, 0);
 		}
-		perform_pair(fd, timeout);
+		perform_pair(rcv, timeout);
 	} else if (!strcmp(cmd, "unpair")) {
 		bool fetched_devices = false;
 		u8 device_index;
-		device_index = find_device_index_for_type(fd, args[1], &fetched_devices);
-		if (!fetched_devices && !get_all_devices(fd)) {
+		device_index = find_device_index_for_type(rcv, args[1], &fetched_devices);
+		if (!fetched_devices && !get_all_devices(rcv)) {
 			fprintf(stderr, "Unable to request a list of paired devices\n");
 		}
 		if (device_index) {
-			perform_unpair(fd, device_index);
+			perform_unpair(rcv, device_index);
 		} else {
 			fprintf(stderr, "Device %s not found\n", args[1]);
 		}
+	} else if (!strcmp(cmd, "list") && fields_count) {
+		print_all_device_fields(rcv);
 	} else if (!strcmp(cmd, "list")) {
 		u8 device_count;
-		if (get_connected_devices(fd, &device_count)) {
+		if (get_connected_devices(rcv, &device_count)) {
 			printf("Devices count: %i\n", device_count);
 		} else {
 			fprintf(stderr, "Failed to get connected devices count\n");
 		}
 
-		if (get_all_devices(fd)) {
-			get_device_names(fd);
-			print_all_devices();
+		if (get_all_devices(rcv)) {
+			get_device_names(rcv);
+			print_all_devices(rcv);
 		} else {
 			fprintf(stderr, "Unable to request a list of paired devices\n");
 		}
 	} else if (!strcmp(cmd, "info")) {
 		u8 device_index;
 
-		device_index = find_device_index_for_type(fd, args[1], NULL);
-		if (device_index) {
-			struct device *dev = &devices[device_index - 1];
-			gather_device_info(fd, device_index);
-			print_detailed_device(device_index);
-			if (dev->hidpp_version.major == 2 && dev->hidpp_version.minor == 0) {
+		device_index = find_device_index_for_type(rcv, args[1], NULL);
+		if (device_index && fields_count) {
+			print_device_fields(rcv, device_index);
+		} else if (device_index) {
+			struct device *dev = &rcv->devices[device_index - 1];
+			gather_device_info(rcv, device_index);
+			print_detailed_device(rcv, device_index);
+			if (HIDPP_VERSION_IS_20(&dev->hidpp_version)) {
 				// TODO: separate fetch/print
-				hidpp20_print_features(fd, device_index);
+				hidpp20_print_features(rcv, device_index);
 			}
 		} else {
 			fprintf(stderr, "Device %s not found\n", args[1]);
 		}
+	} else if (!strcmp(cmd, "feature")) {
+		u8 device_index, params[16];
+		int i;
+
+		device_index = find_device_index_for_type(rcv, args[1], NULL);
+		for (i = 4; i <= args_count; i++) {
+			parse_hex_byte(args[i], &params[i - 4]);
+		}
+		if (device_index) {
+			hidpp20_print_call(rcv, device_index,
+				strtoul(args[2], NULL, 16), strtoul(args[3], NULL, 0),
+				params, args_count - 3);
+		} else {
+			fprintf(stderr, "Device %s not found\n", args[1]);
+		}
 	} else if (!strcmp(cmd, "receiver-info")) {
-		get_and_print_recv_info(fd);
+		get_and_print_recv_info(rcv);
+	} else if (!strcmp(cmd, "shell")) {
+		ret = perform_shell(rcv, args_count >= 1 ? args[1] : NULL) ? 0 : 1;
+	} else if (!strcmp(cmd, "scan")) {
+		u8 device_index = DEVICE_RECEIVER;
+
+		if (strcasecmp(args[1], "receiver")) {
+			device_index = find_device_index_for_type(rcv, args[1], NULL);
+		}
+		if (device_index) {
+			ret = perform_scan(rcv, device_index,
+				args_count >= 2 ? args[2] : NULL) ? 0 : 1;
+		} else {
+			fprintf(stderr, "Device %s not found\n", args[1]);
+			ret = 1;
+		}
 	} else {
 		fprintf(stderr, "Unhandled command: %s\n", cmd);
 	}
 
-	if (disable_notifs) {
+	if (disable_notifs && !keep_notifs) {
 		notifs.reporting_flags_receiver &= ~1;
-		if (set_notifications(fd, DEVICE_RECEIVER, &notifs)) {
+		if (set_notifications(rcv, DEVICE_RECEIVER, &notifs)) {
 			if (debug_enabled) {
 				puts("Successfully disabled notifications");
 			}
 		} else {
+			notifs_failed = true;
 			fprintf(stderr, "Failed to set HID++ Notification status\n");
 		}
 	}
-
-	if (debug_enabled) {
-		get_and_print_notifications(fd, DEVICE_RECEIVER, &notifs);
+	if (debug_enabled && (session & SESSION_NOTIFS)) {
+		if (notifs_failed) {
+			puts("Notification state unknown, a write failed");
+		} else {
+			// as written, no need to read it back
+			print_notifications(&notifs);
+		}
 	}
 
 end_close:
-        close(fd);
-
-        return 0;
+	lt_receiver_close(rcv);
+end_save:
+	if (serial_index) {
+		lt_serial_index_save(serial_index);
+		lt_serial_index_free(serial_index);
+	}
+	return ret;
 }
@@ -0,0 +1,39 @@
+/*
+ * Protocol tables, generated from protocol.def by gen-tables.awk.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LTUNIFY_PROTOCOL_H
+#define LTUNIFY_PROTOCOL_H
+
+#include <stdint.h>
+
+/* Entries are NULL for unknown codes. */
+extern const char *const proto_report_types[0x100]; // HID++ sub IDs
+extern const char *const proto_dj_report_types[0x100];
+extern const char *const proto_hidpp10_errors[0x100];
+extern const char *const proto_hidpp20_errors[0x100];
+extern const char *const proto_registers[0x100];
+extern const char *const proto_device_types[0x10];
+extern const char *const proto_device_indexes[0x100];
+extern const char *const proto_battery_status[0x08];
+extern const char *const proto_dfu_status[0x100];
+
+// Returns the name of a HID++ 2.0 feature or NULL if unknown.
+const char *proto_feature_name(uint16_t featureId);
+
+#endif /* LTUNIFY_PROTOCOL_H */
@@ -0,0 +1,207 @@
+/*
+ * Input report rate and jitter analyzer for libltunify.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * DJ input reports (0x20/0x21 with an RF report type below 0x40) are counted
+ * per device index and the time between consecutive reports is kept. Pauses
+ * longer than RATE_IDLE_MS are the device being idle (a mouse that is not
+ * moved sends nothing) and are left out. The other intervals are compared with
+ * the report interval from the pairing information (register 0xB5, 0x2n),
+ * which is either set with lt_rate_set_interval or taken from a pairing
+ * information response that passes by.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+#define RATE_IDLE_MS	100 // longer pauses are idle time, not jitter
+#define RATE_MIN_REPORTS	20 // fewer intervals give no useful verdict
+
+struct rate_device {
+	unsigned reports;
+	unsigned interval_ms; // configured, 0 if unknown
+	long long unsigned last_us;
+	unsigned idle; // pauses longer than RATE_IDLE_MS
+	// microseconds between reports, idle pauses excluded
+	uint32_t *deltas;
+	unsigned count, alloc;
+};
+
+struct lt_rate {
+	struct rate_device devices[DEVICES_MAX];
+};
+
+struct lt_rate *lt_rate_new(void) {
+	return calloc(1, sizeof (struct lt_rate));
+}
+
+void lt_rate_free(struct lt_rate *rate) {
+	unsigned i;
+
+	if (!rate) {
+		return;
+	}
+	for (i = 0; i < DEVICES_MAX; i++) {
+		free(rate->devices[i].deltas);
+	}
+	free(rate);
+}
+
+void lt_rate_set_interval(struct lt_rate *rate, u8 device_index,
+	unsigned interval_ms) {
+	if (device_index >= 1 && device_index <= DEVICES_MAX) {
+		rate->devices[device_index - 1].interval_ms = interval_ms;
+	}
+}
+
+static void add_delta(struct rate_device *dev, uint32_t delta) {
+	if (dev->count == dev->alloc) {
+		unsigned alloc = dev->alloc ? 2 * dev->alloc : 1024;
+		uint32_t *deltas = realloc(dev->deltas, alloc * sizeof *deltas);
+
+		if (!deltas) {
+			return;
+		}
+		dev->deltas = deltas;
+		dev->alloc = alloc;
+	}
+	dev->deltas[dev->count++] = delta;
+}
+
+// Accounts a report that was read, time_us is in microseconds.
+void lt_rate_add(struct lt_rate *rate, const u8 *report, size_t length,
+	long long unsigned time_us) {
+	struct rate_device *dev;
+	long long unsigned delta;
+
+	// 11 FF 83 B5 2n <dest id> <report interval> ... (pairing information)
+	if (length >= LONG_MESSAGE_LEN && report[0] == LONG_MESSAGE &&
+		report[1] == DEVICE_RECEIVER &&
+		report[2] == SUB_GET_LONG_REGISTER &&
+		report[3] == REG_PAIRING_INFO && (report[4] & 0xF0) == 0x20) {
+		lt_rate_set_interval(rate, (report[4] & 0x0F) + 1, report[6]);
+		return;
+	}
+
+	if (length < 3 || (report[0] != 0x20 && report[0] != 0x21) ||
+		report[1] < 1 || report[1] > DEVICES_MAX || report[2] >= 0x40) {
+		return;
+	}
+	dev = &rate->devices[report[1] - 1];
+	if (dev->reports++ && time_us >= dev->last_us) {
+		delta = time_us - dev->last_us;
+		if (delta > RATE_IDLE_MS * 1000) {
+			dev->idle++;
+		} else {
+			add_delta(dev, delta);
+		}
+	}
+	dev->last_us = time_us;
+}
+
+static int compare_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint32_t *sorted, unsigned count,
+	unsigned pct) {
+	return sorted[(count - 1) * pct / 100] / 1000.0;
+}
+
+static const char *verdict(const struct rate_device *dev,
+	const uint32_t *sorted, unsigned gaps) {
+	long long unsigned interval_us = dev->interval_ms * 1000ULL;
+
+	if (dev->count < RATE_MIN_REPORTS) {
+		return "too few reports";
+	} else if (!interval_us) {
+		return "interval unknown";
+	} else if (sorted[dev->count / 2] > interval_us * 3 / 2) {
+		return "slower than configured";
+	} else if (gaps * 100 > dev->count) {
+		return "drops reports";
+	} else if (sorted[dev->count / 10] < interval_us / 2) {
+		// the radio cannot deliver faster, the host delayed a batch
+		return "bunched (host side delay)";
+	}
+	return "ok";
+}
+
+// Prints a line per device that sent input reports. Gaps are intervals
+// longer than twice the configured one (a missed report) that are no idle
+// pause.
+void lt_rate_print(const struct lt_rate *rate, const char *source) {
+	unsigned i, j, devices = 0;
+
+	for (i = 0; i < DEVICES_MAX; i++) {
+		const struct rate_device *dev = &rate->devices[i];
+		long long unsigned active_us = 0;
+		unsigned gaps = 0;
+		uint32_t *sorted;
+
+		if (!dev->reports) {
+			continue;
+		}
+		devices++;
+		printf("%s\tidx=%u\treports=%u\t", source, i + 1, dev->reports);
+		if (dev->interval_ms) {
+			printf("interval=%ums\t", dev->interval_ms);
+		} else {
+			printf("interval=?\t");
+		}
+		if (!dev->count) {
+			printf("idle=%u\t%s\n", dev->idle, "too few reports");
+			continue;
+		}
+
+		sorted = malloc(dev->count * sizeof *sorted);
+		if (!sorted) {
+			perror("malloc");
+			return;
+		}
+		memcpy(sorted, dev->deltas, dev->count * sizeof *sorted);
+		qsort(sorted, dev->count, sizeof *sorted, compare_u32);
+		for (j = 0; j < dev->count; j++) {
+			active_us += sorted[j];
+			if (dev->interval_ms &&
+				sorted[j] > dev->interval_ms * 2000U) {
+				gaps++;
+			}
+		}
+
+		printf("rate=%.1f/s\t", active_us ?
+			dev->count * 1000000.0 / active_us : 0.0);
+		printf("p50=%.1fms\tp90=%.1fms\tp99=%.1fms\tmax=%.1fms\t",
+			percentile_ms(sorted, dev->count, 50),
+			percentile_ms(sorted, dev->count, 90),
+			percentile_ms(sorted, dev->count, 99),
+			sorted[dev->count - 1] / 1000.0);
+		printf("gaps=%u\tidle=%u\t%s\n", gaps, dev->idle,
+			verdict(dev, sorted, gaps));
+		free(sorted);
+	}
+	if (!devices) {
+		printf("%s\tno input reports\n", source);
+	}
+}
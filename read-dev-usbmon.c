@@ -1,7 +1,6 @@
 /*
  * Tool for reading usbmon messages and writing non-empty data to stdout.
- * Because of limitations of a single output stream, there is currently a hack
- * that directly includes hidraw.c.
+ * Reports are decoded by the same code as hidraw (decode.c).
  *
  * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
  *
@@ -27,8 +26,14 @@
 #include <stdint.h>
 #include <stdlib.h> /* getenv */
 #include <errno.h>
-#include <sys/time.h> /* gettimeofday */
 #include <time.h> /* localtime */
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 typedef uint16_t u16;
 typedef int32_t s32;
@@ -70,104 +75,787 @@ struct mon_get_arg {
 	size_t alloc;           /* Length of data (can be zero) */
 };
 
+struct mon_bin_stats {
+	uint32_t queued;
+	uint32_t dropped;
+};
+
 #define MON_IOC_MAGIC		0x92
 #define MON_IOCQ_URB_LEN	_IO(MON_IOC_MAGIC, 1)
+#define MON_IOCG_STATS		_IOR(MON_IOC_MAGIC, 3, struct mon_bin_stats)
 #define MON_IOCX_GET		_IOW(MON_IOC_MAGIC, 6, struct mon_get_arg)
 
-#define NO_MAIN
-// HACK - otherwise there is no easy wat to tell whether a packet is read or
-// written from the usbmon
-#include "hidraw.c"
-#undef NO_MAIN
+#include "decode.h"
+#include "capture.h"
+
+#define OUT_SIZE	(64 * 1024)
+
+// output of decoded captures, written when full
+static struct fmt_buf out;
+
+static volatile sig_atomic_t stop;
+
+static void handle_stop(int sig) {
+	(void) sig;
+	stop = 1;
+}
+
+static bool use_hex;
+
+static bool print_record(const struct capture_record *rec, void *data) {
+	(void) data;
+	capture_fmt_record(&out, rec, use_hex);
+	return true;
+}
+
+// Decodes a capture that was written by "read-dev-usbmon /dev/usbmonX file".
+static int read_capture(const char *path) {
+	FILE *fp = fopen(path, "rb");
+	bool ok;
+
+	if (!fp) {
+		perror(path);
+		return 1;
+	}
+	ok = capture_read(fp, print_record, NULL);
+	fclose(fp);
+	return fmt_flush(&out) && ok ? 0 : 1;
+}
+
+/* Records selected by a query, -1 matches any. */
+struct query {
+	int busnum, devnum, device_index, sub_id;
+	long long unsigned from_us, to_us; // to is exclusive
+};
+
+// Parses [YYYY-MM-DDT]HH:MM[:SS], the date defaults to that of day_us.
+static bool parse_time(const char *str, long long unsigned day_us,
+	long long unsigned *us) {
+	time_t day = day_us / 1000000;
+	int year, mon, mday, hour, min, n;
+	struct tm tm;
+
+	localtime_r(&day, &tm);
+	if (sscanf(str, "%d-%d-%dT%d:%d%n", &year, &mon, &mday, &hour, &min,
+		&n) == 5) {
+		tm.tm_year = year - 1900;
+		tm.tm_mon = mon - 1;
+		tm.tm_mday = mday;
+	} else if (sscanf(str, "%d:%d%n", &hour, &min, &n) != 2) {
+		return false;
+	}
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_sec = 0;
+	str += n;
+	if (*str && (sscanf(str, ":%d%n", &tm.tm_sec, &n) != 1 || str[n])) {
+		return false;
+	}
+	tm.tm_isdst = -1;
+	*us = mktime(&tm) * 1000000ULL;
+	return true;
+}
+
+static bool parse_query(char **args, int count, long long unsigned start_us,
+	struct query *q) {
+	int i;
+
+	q->busnum = q->devnum = q->device_index = q->sub_id = -1;
+	q->from_us = 0;
+	q->to_us = ~0ULL;
+	for (i = 0; i < count; i++) {
+		char *value = strchr(args[i], '=');
+		bool ok = false;
+
+		if (value) {
+			*value++ = 0;
+			if (!strcmp(args[i], "receiver")) {
+				ok = sscanf(value, "%d:%d", &q->busnum, &q->devnum) == 2;
+			} else if (!strcmp(args[i], "device")) {
+				ok = sscanf(value, "%i", &q->device_index) == 1;
+			} else if (!strcmp(args[i], "type")) {
+				ok = sscanf(value, "%x", (unsigned *) &q->sub_id) == 1;
+			} else if (!strcmp(args[i], "from")) {
+				ok = parse_time(value, start_us, &q->from_us);
+			} else if (!strcmp(args[i], "to")) {
+				ok = parse_time(value, start_us, &q->to_us);
+			}
+		}
+		if (!ok) {
+			fprintf(stderr, "Invalid filter: %s\n", args[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool query_key_matches(const struct query *q, const struct capture_index_key *k) {
+	return (q->busnum < 0 || (k->busnum == q->busnum &&
+		k->devnum == q->devnum)) &&
+		(q->device_index < 0 || k->device_index == q->device_index) &&
+		(q->sub_id < 0 || k->sub_id == q->sub_id);
+}
+
+static bool query_record(const struct capture_record *rec, void *data) {
+	const struct query *q = data;
+	struct capture_index_key k;
+
+	k.busnum = rec->busnum;
+	k.devnum = rec->devnum;
+	k.device_index = rec->length > 1 ? rec->data[1] : 0;
+	k.sub_id = rec->length > 2 ? rec->data[2] : 0;
+	if (rec->time_us >= q->from_us && rec->time_us < q->to_us &&
+		query_key_matches(q, &k)) {
+		capture_fmt_record(&out, rec, use_hex);
+	}
+	return true;
+}
+
+// Decodes only the blocks of a capture that contain the records selected by
+// args, found with the index.
+static int query_capture(const char *path, char **args, int count) {
+	struct capture_index idx;
+	const struct capture_index_block *blocks;
+	struct query q;
+	struct stat st;
+	u8 *map, *selected;
+	unsigned i, lo, hi, nblocks;
+	int fd, ret = 1;
+
+	if (!capture_index_open(path, &idx)) {
+		return 1;
+	}
+	blocks = idx.blocks;
+	nblocks = idx.hdr->blocks;
+	if (!nblocks) {
+		capture_index_close(&idx);
+		return 0;
+	}
+	if (!parse_query(args, count, blocks[0].first_us, &q)) {
+		capture_index_close(&idx);
+		return 1;
+	}
+
+	selected = calloc(nblocks, 1);
+	fd = open(path, O_RDONLY);
+	if (!selected || fd < 0 || fstat(fd, &st)) {
+		perror(path);
+		goto out;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror(path);
+		goto out;
+	}
+	for (i = 0; i < idx.hdr->keys; i++) {
+		const struct capture_index_key *k = &idx.keys[i];
+		unsigned j;
+		if (!query_key_matches(&q, k)) {
+			continue;
+		}
+		for (j = 0; j < k->count; j++) {
+			selected[idx.postings[k->first + j]] = 1;
+		}
+	}
+
+	// first block that ends at or after from
+	for (lo = 0, hi = nblocks; lo < hi; ) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (blocks[mid].last_us < q.from_us) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	for (i = lo; i < nblocks && blocks[i].first_us < q.to_us; i++) {
+		struct capture_block blk;
+		const u8 *p = map + blocks[i].offset;
+
+		if (!selected[i]) {
+			continue;
+		}
+		if (!capture_parse_block_header(p, &blk) ||
+			!capture_decode_block(&blk, p + CAPTURE_BLOCK_HEADER_LEN,
+				query_record, &q)) {
+			fprintf(stderr, "%s: invalid block at %llu\n", path,
+				(long long unsigned) blocks[i].offset);
+			break;
+		}
+	}
+	if (fmt_flush(&out) && (i >= nblocks || blocks[i].first_us >= q.to_us)) {
+		ret = 0;
+	}
+	munmap(map, st.st_size);
+out:
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(selected);
+	capture_index_close(&idx);
+	return ret;
+}
+
+/*
+ * Live capture runs as a pipeline. The main thread only fetches URBs into a
+ * ring of batches, decode threads format whole batches in parallel and the
+ * writer thread writes them (or adds them to a capture file) in the order they
+ * were fetched. Slow output fills the ring instead of stalling usbmon. Batches
+ * change hands through their atomic state, semaphores only wake idle threads.
+ */
+#define BATCH_PACKETS	256
+#define BATCH_COUNT	64 // ring of 16384 URBs
+#define DECODE_THREADS_MAX	8
+
+enum { BATCH_FREE, BATCH_FILLED, BATCH_DONE };
+
+struct batch {
+	atomic_int state;
+	unsigned count;
+	struct capture_record recs[BATCH_PACKETS];
+	struct fmt_buf out;
+	char out_data[BATCH_PACKETS * FMT_LINE_MAX];
+};
+
+static struct {
+	struct batch *batches; // BATCH_COUNT
+	unsigned head; // next batch to fill (main thread)
+	unsigned tail; // next batch to write (writer thread)
+	atomic_uint next_decode; // next batch to claim by a decode thread
+	atomic_uint end; // batches filled after stopping, UINT_MAX before
+	sem_t filled, decoded, freed;
+	unsigned threads;
+	pthread_t decoders[DECODE_THREADS_MAX], writer_thread;
+	struct capture_writer *writer;
+	bool write_failed;
+} pl;
+
+static void *decode_thread(void *arg) {
+	(void) arg;
+	for (;;) {
+		struct batch *b;
+		unsigned n, i;
+
+		while (sem_wait(&pl.filled)) {
+			;
+		}
+		n = atomic_fetch_add(&pl.next_decode, 1);
+		if (n >= atomic_load(&pl.end)) {
+			return NULL;
+		}
+		b = &pl.batches[n % BATCH_COUNT];
+		fmt_init(&b->out, -1, b->out_data, sizeof b->out_data);
+		for (i = 0; !pl.writer && i < b->count; i++) {
+			capture_fmt_record(&b->out, &b->recs[i], use_hex);
+		}
+		atomic_store(&b->state, BATCH_DONE);
+		sem_post(&pl.decoded);
+	}
+}
+
+static void *writer_thread(void *arg) {
+	(void) arg;
+	while (pl.tail != atomic_load(&pl.end)) {
+		struct batch *b = &pl.batches[pl.tail % BATCH_COUNT];
+		unsigned i;
+
+		if (atomic_load(&b->state) != BATCH_DONE) {
+			while (sem_wait(&pl.decoded)) {
+				;
+			}
+			continue;
+		}
+		for (i = 0; pl.writer && !pl.write_failed && i < b->count; i++) {
+			pl.write_failed = !capture_add(pl.writer, &b->recs[i]);
+		}
+		b->out.fd = STDOUT_FILENO;
+		if (!pl.write_failed && !fmt_flush(&b->out)) {
+			perror("write");
+			pl.write_failed = true;
+		}
+		if (pl.write_failed) {
+			stop = 1; // keep freeing batches until the capture stops
+		}
+		b->count = 0;
+		atomic_store(&b->state, BATCH_FREE);
+		pl.tail++;
+		sem_post(&pl.freed);
+	}
+	return NULL;
+}
+
+// Starts the decode and writer threads, signals are left to the main thread.
+static bool pipeline_start(struct capture_writer *writer) {
+	sigset_t set, old;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned i;
+
+	pl.batches = calloc(BATCH_COUNT, sizeof *pl.batches);
+	if (!pl.batches) {
+		perror("calloc");
+		return false;
+	}
+	pl.writer = writer;
+	atomic_store(&pl.end, ~0U);
+	sem_init(&pl.filled, 0, 0);
+	sem_init(&pl.decoded, 0, 0);
+	sem_init(&pl.freed, 0, 0);
+	// capture files are compressed in order by the writer
+	pl.threads = writer ? 1 : cpus > 3 ? cpus - 2 : 1;
+	if (pl.threads > DECODE_THREADS_MAX) {
+		pl.threads = DECODE_THREADS_MAX;
+	}
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	for (i = 0; i < pl.threads; i++) {
+		pthread_create(&pl.decoders[i], NULL, decode_thread, NULL);
+	}
+	pthread_create(&pl.writer_thread, NULL, writer_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return true;
+}
+
+// Hands the current batch to the decode threads.
+static void pipeline_publish(void) {
+	struct batch *b = &pl.batches[pl.head % BATCH_COUNT];
+
+	if (!b->count || atomic_load(&b->state) != BATCH_FREE) {
+		return;
+	}
+	atomic_store(&b->state, BATCH_FILLED);
+	sem_post(&pl.filled);
+	pl.head++;
+}
+
+// Returns the batch to fill, waiting while the ring is full. NULL if stopped.
+static struct batch *pipeline_batch(void) {
+	struct batch *b = &pl.batches[pl.head % BATCH_COUNT];
+
+	while (atomic_load(&b->state) != BATCH_FREE) {
+		if (stop) {
+			return NULL;
+		}
+		sem_wait(&pl.freed);
+	}
+	return b;
+}
+
+// Writes everything that was fetched and stops the threads.
+static void pipeline_stop(void) {
+	unsigned i;
+
+	pipeline_publish();
+	atomic_store(&pl.end, pl.head);
+	for (i = 0; i < pl.threads; i++) {
+		sem_post(&pl.filled);
+	}
+	sem_post(&pl.decoded);
+	for (i = 0; i < pl.threads; i++) {
+		pthread_join(pl.decoders[i], NULL);
+	}
+	pthread_join(pl.writer_thread, NULL);
+	sem_destroy(&pl.filled);
+	sem_destroy(&pl.decoded);
+	sem_destroy(&pl.freed);
+	free(pl.batches);
+}
+
+/*
+ * Flight recorder: URBs are only kept in a ring in memory, nothing is decoded
+ * or written until a trigger fires. The ring is then written to a capture
+ * file, from window seconds before the trigger up to after seconds past it
+ * (triggers within that time extend the dump). The copy is compressed by a
+ * separate thread so that fetching continues.
+ */
+#define FLIGHT_WINDOW_S		60
+#define FLIGHT_AFTER_S		10
+#define FLIGHT_SIZE_MB		16
+
+enum {
+	TRIGGER_ERROR = 1, // HID++ 1.0 error (0x8F)
+	TRIGGER_ERROR20 = 2, // HID++ 2.0 error (0xFF)
+	TRIGGER_DISCONNECT = 4, // 0x40 notification
+	TRIGGER_PAIRING_FAILED = 8, // lock closed with an error (0x4A)
+};
+
+static struct {
+	const char *prefix;
+	unsigned triggers;
+	int error, error20; // error code to match, -1 for any
+	long long unsigned window_us, after_us;
+	struct capture_record *ring;
+	size_t size; // records in the ring
+	long long unsigned head; // records fetched
+	long long unsigned trigger_us, until_us; // of a pending dump, 0 if none
+	const char *reason;
+	pthread_t dump_thread;
+	bool dumping;
+} fr;
+
+static volatile sig_atomic_t dump_requested;
+
+static void handle_dump(int sig) {
+	(void) sig;
+	dump_requested = 1;
+}
+
+static bool parse_flight(char **args, int count) {
+	unsigned size_mb = FLIGHT_SIZE_MB, window_s = FLIGHT_WINDOW_S,
+		 after_s = FLIGHT_AFTER_S;
+	int i;
+
+	fr.error = fr.error20 = -1;
+	for (i = 0; i < count; i++) {
+		char *value = strchr(args[i], '=');
+		size_t len = value ? (size_t) (value++ - args[i]) : strlen(args[i]);
+		bool ok = true;
+
+#define ARG_IS(name) (len == sizeof (name) - 1 && !strncmp(args[i], name, len))
+		if (ARG_IS("window") && value) {
+			ok = sscanf(value, "%u", &window_s) == 1;
+		} else if (ARG_IS("after") && value) {
+			ok = sscanf(value, "%u", &after_s) == 1;
+		} else if (ARG_IS("size") && value) {
+			ok = sscanf(value, "%u", &size_mb) == 1 && size_mb;
+		} else if (ARG_IS("error")) {
+			fr.triggers |= TRIGGER_ERROR;
+			ok = !value || sscanf(value, "%x", (unsigned *) &fr.error) == 1;
+		} else if (ARG_IS("error20")) {
+			fr.triggers |= TRIGGER_ERROR20;
+			ok = !value || sscanf(value, "%x", (unsigned *) &fr.error20) == 1;
+		} else if (ARG_IS("disconnect") && !value) {
+			fr.triggers |= TRIGGER_DISCONNECT;
+		} else if (ARG_IS("pairing-failed") && !value) {
+			fr.triggers |= TRIGGER_PAIRING_FAILED;
+		} else {
+			ok = false;
+		}
+#undef ARG_IS
+		if (!ok) {
+			fprintf(stderr, "Invalid flight recorder option: %s\n", args[i]);
+			return false;
+		}
+	}
+	if (!fr.triggers) {
+		fr.triggers = TRIGGER_ERROR | TRIGGER_ERROR20 |
+			TRIGGER_DISCONNECT | TRIGGER_PAIRING_FAILED;
+	}
+	fr.window_us = window_s * 1000000ULL;
+	fr.after_us = after_s * 1000000ULL;
+	fr.size = size_mb * 1024 * 1024 / sizeof (struct capture_record);
+	return true;
+}
+
+// Returns the reason if a received report fires a trigger, NULL otherwise.
+static const char *flight_trigger(const struct capture_record *rec) {
+	const u8 *d = rec->data;
+
+	if (rec->is_write || rec->length < SHORT_MSG_LEN) {
+		return NULL;
+	}
+	if ((d[0] == SHORT_MSG || d[0] == LONG_MSG) && d[2] == 0x8F &&
+		(fr.triggers & TRIGGER_ERROR) &&
+		(fr.error < 0 || d[5] == fr.error)) {
+		return "HID++ 1.0 error"; // 10 idx 8F sub_id address error
+	}
+	if ((d[0] == SHORT_MSG || d[0] == LONG_MSG) && d[2] == 0xFF &&
+		(fr.triggers & TRIGGER_ERROR20) &&
+		(fr.error20 < 0 || d[5] == fr.error20)) {
+		return "HID++ 2.0 error"; // 11 idx FF feature function error
+	}
+	if ((d[0] == SHORT_MSG || d[0] == DJ_SHORT) && d[2] == 0x40 &&
+		(fr.triggers & TRIGGER_DISCONNECT)) {
+		return "disconnect";
+	}
+	// 10 FF 4A <lock open bit> <error> (Receiver Locking Change)
+	if (d[0] == SHORT_MSG && d[1] == 0xFF && d[2] == 0x4A &&
+		!(d[3] & 1) && d[4] && (fr.triggers & TRIGGER_PAIRING_FAILED)) {
+		return "pairing failed";
+	}
+	return NULL;
+}
+
+struct flight_dump {
+	char path[256];
+	struct capture_record *recs;
+	size_t count;
+};
+
+static void *flight_dump_thread(void *arg) {
+	struct flight_dump *dump = arg;
+	struct capture_writer *w = capture_create(dump->path);
+	size_t i;
+
+	for (i = 0; w && i < dump->count; i++) {
+		if (!capture_add(w, &dump->recs[i])) {
+			break;
+		}
+	}
+	if (w && capture_close(w)) {
+		fprintf(stderr, "Wrote %zu reports to %s\n", dump->count,
+			dump->path);
+	}
+	free(dump->recs);
+	free(dump);
+	return NULL;
+}
 
-void print_time(void) {
-	struct timeval tval;
-	struct tm *tm;
+// Copies the window around the pending trigger out of the ring and writes it
+// in the background.
+static void flight_dump(void) {
+	long long unsigned first = fr.head > fr.size ? fr.head - fr.size : 0;
+	long long unsigned from_us = fr.trigger_us > fr.window_us ?
+		fr.trigger_us - fr.window_us : 0;
+	struct flight_dump *dump;
+	time_t sec = fr.trigger_us / 1000000;
+	sigset_t set, old;
+	struct tm tm;
+	size_t i;
 
-	if (gettimeofday(&tval, NULL)) {
-		perror("gettimeofday");
+	if (fr.dumping) {
+		pthread_join(fr.dump_thread, NULL);
+		fr.dumping = false;
+	}
+	dump = calloc(1, sizeof *dump);
+	if (dump) {
+		dump->recs = malloc((fr.head - first) * sizeof *dump->recs);
+	}
+	if (!dump || !dump->recs) {
+		perror("malloc");
+		free(dump);
+		fr.trigger_us = fr.until_us = 0;
 		return;
 	}
-	tm = localtime(&tval.tv_sec);
-	printf("%02d:%02d:%02d.%03ld ",
-		tm->tm_hour, tm->tm_min, tm->tm_sec,
-		tval.tv_usec / 1000);
+	for (; first < fr.head; first++) {
+		const struct capture_record *rec = &fr.ring[first % fr.size];
+		if (rec->time_us >= from_us) {
+			dump->recs[dump->count++] = *rec;
+		}
+	}
+	localtime_r(&sec, &tm);
+	i = snprintf(dump->path, sizeof dump->path, "%s", fr.prefix);
+	strftime(dump->path + i, sizeof dump->path - i, "-%Y%m%d-%H%M%S.ltcap",
+		&tm);
+	fprintf(stderr, "Trigger: %s\n", fr.reason);
+	fr.trigger_us = fr.until_us = 0;
+	if (!dump->count) {
+		free(dump->recs);
+		free(dump);
+		return;
+	}
+	// signals must interrupt the poll of the main thread
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	fr.dumping = !pthread_create(&fr.dump_thread, NULL, flight_dump_thread,
+		dump);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (!fr.dumping) {
+		free(dump->recs);
+		free(dump);
+	}
+}
+
+static void flight_fire(const char *reason, long long unsigned time_us) {
+	if (!fr.trigger_us) {
+		fr.trigger_us = time_us;
+		fr.reason = reason;
+	}
+	fr.until_us = time_us + fr.after_us;
+}
+
+static long long unsigned now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts); // the clock of usbmon timestamps
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int flight_record(int fd, const char *prefix, char **args, int count) {
+	struct usbmon_packet hdr;
+	struct mon_get_arg event;
+	int r;
+
+	fr.prefix = prefix;
+	if (!parse_flight(args, count)) {
+		return 1;
+	}
+	fr.ring = malloc(fr.size * sizeof *fr.ring);
+	if (!fr.ring) {
+		perror("malloc");
+		return 1;
+	}
+	fprintf(stderr, "Recording %zu reports or %llu seconds, "
+		"kill -USR1 %d to dump\n", fr.size, fr.window_us / 1000000,
+		(int) getpid());
+
+	memset(&hdr, 0, sizeof hdr);
+	event.hdr = &hdr;
+	while (!stop) {
+		struct capture_record *rec = &fr.ring[fr.head % fr.size];
+		const char *reason;
+
+		if (dump_requested) {
+			dump_requested = 0;
+			flight_fire("signal", now_us());
+		}
+		if (fr.until_us && now_us() >= fr.until_us) {
+			flight_dump();
+		}
+
+		event.data = rec->data;
+		event.alloc = sizeof rec->data;
+		r = ioctl(fd, MON_IOCX_GET, &event);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		}
+		if (r == -1 && errno == EAGAIN) {
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+			int timeout = -1;
+
+			if (fr.until_us) {
+				long long unsigned now = now_us();
+				timeout = now < fr.until_us ?
+					(fr.until_us - now) / 1000 + 1 : 0;
+			}
+			poll(&pfd, 1, timeout);
+			continue;
+		}
+		if (r < 0) {
+			perror("ioctl");
+			break;
+		}
+
+		if (!hdr.len_cap || (hdr.type != 'S' && hdr.type != 'C')) {
+			continue;
+		}
+		rec->time_us = hdr.ts_sec * 1000000ULL + hdr.ts_usec;
+		rec->busnum = hdr.busnum;
+		rec->devnum = hdr.devnum;
+		rec->is_write = hdr.type == 'S';
+		rec->length = hdr.len_cap < CAPTURE_REPORT_MAX ?
+			hdr.len_cap : CAPTURE_REPORT_MAX;
+		fr.head++;
+		if ((reason = flight_trigger(rec))) {
+			flight_fire(reason, rec->time_us);
+		}
+	}
+
+	if (fr.until_us) {
+		flight_dump();
+	}
+	if (fr.dumping) {
+		pthread_join(fr.dump_thread, NULL);
+	}
+	free(fr.ring);
+	return 0;
 }
 
 int main(int argc, char ** argv) {
-	unsigned char data[1024];
+	static char out_data[OUT_SIZE];
 	struct usbmon_packet hdr;
 	struct mon_get_arg event;
+	struct mon_bin_stats stats;
+	struct capture_writer *writer = NULL;
+	struct sigaction sa;
+	struct batch *b;
 	int fd, r;
 
 	if (argc < 2) {
-		fprintf(stderr, "Usage: %s /dev/usbmonX\n", argv[0]);
+		fprintf(stderr, "Usage: %s /dev/usbmonX [capture]\n"
+			"       %s /dev/usbmonX flight=PREFIX [window=SECONDS] "
+			"[after=SECONDS] [size=MB]\n"
+			"         [error[=XX]] [error20[=XX]] [disconnect] "
+			"[pairing-failed]\n"
+			"       %s capture [receiver=BUS:ADDR] [device=N] "
+			"[type=XX] [from=TIME] [to=TIME]\n",
+			argv[0], argv[0], argv[0]);
 		return 1;
 	}
+	fmt_init(&out, STDOUT_FILENO, out_data, sizeof out_data);
+	use_hex = getenv("HEX") != NULL;
+	if (capture_is_capture(argv[1]) && argc >= 3) {
+		return query_capture(argv[1], &argv[2], argc - 2);
+	} else if (capture_is_capture(argv[1])) {
+		return read_capture(argv[1]);
+	}
 
-	fd = open(argv[1], O_RDONLY);
+	fd = open(argv[1], O_RDONLY | O_NONBLOCK);
 	if (fd < 0) {
 		perror(argv[1]);
 		return 1;
 	}
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = handle_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	if (argc >= 3 && !strncmp(argv[2], "flight=", 7)) {
+		sa.sa_handler = handle_dump;
+		sigaction(SIGUSR1, &sa, NULL);
+		r = flight_record(fd, argv[2] + 7, &argv[3], argc - 3);
+		close(fd);
+		return r;
+	} else if (argc >= 3) {
+		// store the URBs compressed instead of printing them
+		writer = capture_create(argv[2]);
+		if (!writer) {
+			close(fd);
+			return 1;
+		}
+	}
+	if (!pipeline_start(writer)) {
+		close(fd);
+		return 1;
+	}
 
 	memset(&hdr, 0, sizeof hdr);
-	event.hdr = &hdr; // hopefully it is OK to use stack for this
-	event.data = &data;
-	event.alloc = sizeof data;
+	event.hdr = &hdr;
+	// URBs are fetched into the next free record, cut off at its size
+	while (!stop && (b = pipeline_batch())) {
+		struct capture_record *rec = &b->recs[b->count];
 
-	//r = ioctl(fd, MON_IOCQ_URB_LEN);
-	//printf("%i\n", r);
-	for (;;) {
-		memset(&data, 0xCC, sizeof data); // for debugging purposes
+		event.data = rec->data;
+		event.alloc = sizeof rec->data;
 		r = ioctl(fd, MON_IOCX_GET, &event);
 		if (r == -1 && errno == EINTR) {
 			continue;
 		}
+		if (r == -1 && errno == EAGAIN) {
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+			pipeline_publish();
+			poll(&pfd, 1, -1);
+			continue;
+		}
 		if (r < 0) {
 			perror("ioctl");
 			break;
 		}
 
 		// ignore non-data packets
-		if (hdr.len_cap) {
-			if (getenv("HEX")) {
-				unsigned int i;
-				printf("Type=%c\n", hdr.type);
-				for (i=0; i<hdr.len_cap; i++) {
-					printf("%02X%c", data[i],
-						i + 1 == hdr.len_cap ? '\n' : ' ');
-				}
-			} else if (hdr.len_cap > sizeof (struct report)) {
-				fprintf(stderr, "Discarding too large packet of length %u!\n", hdr.len_cap);
-			} else {
-				struct report *report = (struct report *)&data;
-				if (hdr.len_cap < 3) {
-					fprintf(stderr, "Short data len: %i\n", hdr.len_cap);
-					continue;
-				}
-#define COLOR(c, cstr) "\033[" c "m" cstr "\033[m"
-				print_time();
-				if (hdr.type == 'C') {
-					printf(COLOR("1;32", "Recv\t"));
-				} else if (hdr.type == 'S') {
-					printf(COLOR("1;31", "Send\t"));
-				} else {
-					printf(COLOR("1;35", "Type=%c\t") "\n", hdr.type);
-				}
-				process_msg(report, hdr.len_cap);
-				fflush(NULL);
-#if 0
-				if (write(STDOUT_FILENO, &data, hdr.len_cap) < 0) {
-					perror("write");
-					break;
-				}
-#endif
-			}
+		if (!hdr.len_cap || (hdr.type != 'S' && hdr.type != 'C')) {
+			continue;
+		}
+		rec->time_us = hdr.ts_sec * 1000000ULL + hdr.ts_usec;
+		rec->busnum = hdr.busnum;
+		rec->devnum = hdr.devnum;
+		rec->is_write = hdr.type == 'S';
+		rec->length = hdr.len_cap < CAPTURE_REPORT_MAX ?
+			hdr.len_cap : CAPTURE_REPORT_MAX;
+		if (++b->count == BATCH_PACKETS) {
+			pipeline_publish();
 		}
 	}
 
+	pipeline_stop();
+	if (!ioctl(fd, MON_IOCG_STATS, &stats) && stats.dropped) {
+		fprintf(stderr, "%u URBs dropped by usbmon\n", stats.dropped);
+	}
 	close(fd);
+	if (writer && !capture_close(writer)) {
+		return 1;
+	}
 
-	return 0;
+	return pl.write_failed;
 }
@@ -0,0 +1,228 @@
+/*
+ * Tool for reading the text usbmon interface (/sys/kernel/debug/usb/usbmon/Nu)
+ * where /dev/usbmonX is not available. The output is that of read-dev-usbmon,
+ * reports are decoded by decode.c.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A line of the text interface looks like (see Documentation/usb/usbmon.txt):
+ *
+ *   ffff8800b8f0a0c0 1406276145 C Ii:3:002:2 0:8 7 = 10ff4a01 000000
+ *
+ * tag, timestamp (us), event type, address, status, length and, if data
+ * follows, "=" and the data in words of four bytes. Lines are split in
+ * place, input is read in large blocks and the output of a block is written
+ * at once.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h> /* getenv */
+#include <sys/time.h> /* gettimeofday */
+#include <time.h> /* localtime */
+
+#include "decode.h"
+
+#define BUF_SIZE	(64 * 1024)
+#define TIMESTAMP_WRAP	4096000000ULL // the kernel keeps seconds modulo 4096
+
+static const signed char hex_values[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+}; // value + 1, 0 for no hex digit
+
+static bool use_color, use_hex;
+static struct fmt_buf out;
+
+/* Maps usbmon timestamps to the wall-clock time of the first line. */
+static struct {
+	bool valid;
+	long long unsigned start_ms; // ms since midnight
+	long long unsigned first_us, last_us, wrap_us;
+} clock_map;
+
+#define COLOR(c, cstr) "\033[" c "m" cstr "\033[m"
+
+static void print_time(long long unsigned stamp_us) {
+	long long unsigned ms;
+
+	if (!clock_map.valid) {
+		struct timeval tval;
+		struct tm *tm;
+
+		gettimeofday(&tval, NULL);
+		tm = localtime(&tval.tv_sec);
+		clock_map.start_ms = ((tm->tm_hour * 60 + tm->tm_min) * 60 +
+			tm->tm_sec) * 1000ULL + tval.tv_usec / 1000;
+		clock_map.first_us = clock_map.last_us = stamp_us;
+		clock_map.valid = true;
+	}
+	if (stamp_us < clock_map.last_us) {
+		clock_map.wrap_us += TIMESTAMP_WRAP;
+	}
+	clock_map.last_us = stamp_us;
+	ms = clock_map.start_ms + (stamp_us + clock_map.wrap_us -
+		clock_map.first_us) / 1000;
+	fmt_dec(&out, ms / 3600000 % 24, 2);
+	fmt_char(&out, ':');
+	fmt_dec(&out, ms / 60000 % 60, 2);
+	fmt_char(&out, ':');
+	fmt_dec(&out, ms / 1000 % 60, 2);
+	fmt_char(&out, '.');
+	fmt_dec(&out, ms % 1000, 3);
+	fmt_char(&out, ' ');
+}
+
+// Returns the next space-separated token and terminates it.
+static char *next_token(char **p) {
+	char *s = *p, *start;
+
+	while (*s == ' ') {
+		s++;
+	}
+	if (!*s) {
+		return NULL;
+	}
+	start = s;
+	while (*s && *s != ' ') {
+		s++;
+	}
+	if (*s) {
+		*s++ = 0;
+	}
+	*p = s;
+	return start;
+}
+
+static void process_line(char *line) {
+	unsigned char data[DJ_LONG_LEN];
+	long long unsigned stamp_us = 0;
+	char *p = line, *tok, type;
+	unsigned length = 0;
+
+	if (!next_token(&p) || !(tok = next_token(&p))) {
+		return;
+	}
+	for (; *tok >= '0' && *tok <= '9'; tok++) {
+		stamp_us = stamp_us * 10 + (*tok - '0');
+	}
+	if (!(tok = next_token(&p))) {
+		return;
+	}
+	type = *tok;
+	// skip address, status or setup and length up to the data
+	while ((tok = next_token(&p)) && strcmp(tok, "=")) {
+		;
+	}
+	if (!tok) {
+		return; // no data
+	}
+	for (; *p && length < sizeof data; p++) {
+		int hi = hex_values[(u8) p[0]], lo;
+
+		if (!hi) {
+			continue;
+		}
+		lo = hex_values[(u8) p[1]];
+		if (!lo) {
+			break;
+		}
+		data[length++] = (hi - 1) << 4 | (lo - 1);
+		p++;
+	}
+	if (!length) {
+		return;
+	}
+
+	if (use_hex) {
+		fmt_str(&out, "Type=");
+		fmt_char(&out, type);
+		fmt_char(&out, '\n');
+		fmt_hex_bytes(&out, data, length);
+		fmt_char(&out, '\n');
+		return;
+	}
+	if (length < 3) {
+		fprintf(stderr, "Short data len: %u\n", length);
+		return;
+	}
+	print_time(stamp_us);
+	if (type == 'C') {
+		fmt_str(&out, use_color ? COLOR("1;32", "Recv\t") : "Recv\t");
+	} else if (type == 'S') {
+		fmt_str(&out, use_color ? COLOR("1;31", "Send\t") : "Send\t");
+	} else {
+		fmt_str(&out, use_color ? "\033[1;35mType=" : "Type=");
+		fmt_char(&out, type);
+		fmt_str(&out, use_color ? "\t\033[m\n" : "\t\n");
+	}
+	fmt_msg(&out, (struct report *) data, length);
+}
+
+int main(int argc, char **argv) {
+	static char buf[BUF_SIZE + 1], out_data[BUF_SIZE];
+	size_t fill = 0;
+	int fd = STDIN_FILENO;
+	ssize_t r;
+
+	if (argc >= 2 && (fd = open(argv[1], O_RDONLY)) < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	use_hex = getenv("HEX") != NULL;
+	use_color = !getenv("NO_COLOR");
+	fmt_init(&out, STDOUT_FILENO, out_data, sizeof out_data);
+
+	while ((r = read(fd, buf + fill, BUF_SIZE - fill)) > 0) {
+		char *line = buf, *end;
+
+		fill += r;
+		buf[fill] = 0;
+		while ((end = memchr(line, '\n', buf + fill - line))) {
+			*end = 0;
+			process_line(line);
+			line = end + 1;
+		}
+		fill -= line - buf;
+		if (fill == BUF_SIZE) {
+			// no newline in a full buffer, not usbmon output
+			fill = 0;
+		}
+		memmove(buf, line, fill);
+		if (!fmt_flush(&out)) {
+			perror("write");
+			break;
+		}
+	}
+	if (r < 0) {
+		perror("read");
+	}
+	if (fill) {
+		buf[fill] = 0;
+		process_line(buf);
+	}
+	fmt_flush(&out);
+
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,706 @@
+/*
+ * Receiver context, transport and event loop of libltunify.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <glob.h> /* for /dev/hidrawX discovery */
+#include <poll.h>
+#include <sys/wait.h> /* waitpid for replayed receivers */
+#include <libgen.h> /* for basename, used during discovery */
+#include <time.h> /* needs -lrt, for clock_gettime as timeout helper */
+
+#include "internal.h"
+
+struct lt_io_stats lt_io_stats;
+
+long long unsigned get_timestamp_ms(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+// Writes a report directly or through the io_uring of the receiver.
+static bool write_report(struct lt_receiver *rcv, const void *report,
+	size_t length) {
+	ssize_t r;
+
+	lt_ring_add(rcv->ring, RING_WRITE, report, length);
+	if (rcv->trace) {
+		lt_trace_add(rcv->trace, true, report, length);
+	}
+	if (rcv->uring) {
+		return lt_uring_write(rcv, report, length);
+	}
+	lt_io_stats.syscalls++;
+	lt_io_stats.reports++;
+	r = write(rcv->fd, report, length);
+	if (r < 0) {
+		perror("write");
+	}
+	return r == (ssize_t) length;
+}
+
+static ssize_t do_write(struct lt_receiver *rcv, struct hidpp_message *msg) {
+	ssize_t payload_size = SHORT_MESSAGE_LEN;
+
+	if (msg->report_id == LONG_MESSAGE) {
+		payload_size = LONG_MESSAGE_LEN;
+	}
+	return write_report(rcv, msg, payload_size) ? payload_size : 0;
+}
+
+struct lt_receiver *lt_receiver_new(int fd, const char *path) {
+	struct lt_receiver *rcv = calloc(1, sizeof *rcv);
+
+	if (!rcv) {
+		perror("calloc");
+		return NULL;
+	}
+	rcv->fd = fd;
+	snprintf(rcv->path, sizeof rcv->path, "%s", path ? path : "");
+	rcv->ring = lt_ring_new(rcv);
+	return rcv;
+}
+
+struct lt_receiver *lt_receiver_open(const char *path) {
+	struct lt_receiver *rcv;
+	int fd;
+
+	if (!path) {
+		if (!lt_receiver_open_all(&rcv, 1)) {
+			return NULL;
+		}
+		return rcv;
+	}
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+	rcv = lt_receiver_new(fd, path);
+	if (!rcv) {
+		close(fd);
+	}
+	return rcv;
+}
+
+#define RECEIVER_NAME "logitech-djreceiver"
+// Opens up to max_rcvs receivers, returns the number of opened receivers.
+unsigned lt_receiver_open_all(struct lt_receiver **rcvs, unsigned max_rcvs) {
+	unsigned count = 0;
+	glob_t matches;
+	char hiddev_name[32] = {0};
+
+	if (!glob("/sys/class/hidraw/hidraw*/device/driver", 0, NULL, &matches)) {
+		size_t i;
+		char buf[1024];
+		for (i = 0; i < matches.gl_pathc && count < max_rcvs; i++) {
+			ssize_t r;
+			char *name = matches.gl_pathv[i];
+			const char *last_comp;
+			char *dev_name;
+			int fd;
+
+			r = readlink(name, buf, (sizeof buf) - 1);
+			if (r < 0) {
+				perror(name);
+				continue;
+			}
+
+			buf[r] = 0; /* readlink does not NUL-terminate */
+			last_comp = basename(buf);
+
+			/* retrieve 'hidrawX' name */
+			dev_name = name + sizeof "/sys/class/hidraw";
+			*(strchr(dev_name, '/')) = 0;
+
+			if (!strcmp(last_comp, RECEIVER_NAME)) {
+				/* Logitech receiver c52b and c532 - pass */
+			} else if (!strcmp(last_comp, "hid-generic")) {
+				/* need to test for older nano receiver c52f */
+				FILE *fp;
+				uint32_t vid = 0, pid = 0;
+
+				// Assume that the first match is the receiver. Devices bound to the
+				// same receiver may have the same modalias.
+				snprintf(buf, sizeof buf, "/sys/class/hidraw/%s/device/modalias", dev_name);
+				if ((fp = fopen(buf, "r"))) {
+					int m = fscanf(fp, "hid:b%*04Xg%*04Xv%08Xp%08X", &vid, &pid);
+					if (m != 2) {
+						pid = 0;
+					}
+					fclose(fp);
+				}
+
+				if (vid != VID_LOGITECH || pid != PID_NANO_RECEIVER) {
+					continue;
+				}
+			} else { /* unknown driver */
+				continue;
+			}
+
+			snprintf(hiddev_name, sizeof hiddev_name, "/dev/%s", dev_name);
+			fd = open(hiddev_name, O_RDWR);
+			if (fd < 0) {
+				perror(hiddev_name);
+			} else if ((rcvs[count] = lt_receiver_new(fd, hiddev_name))) {
+				count++;
+			} else {
+				close(fd);
+			}
+		}
+	}
+
+	if (count == 0) {
+		if (*hiddev_name) {
+			fprintf(stderr, "Logitech Unifying Receiver device is not accessible.\n"
+				"Try running this program as root or enable read/write permissions\n"
+				"for %s\n", hiddev_name);
+		} else {
+			fprintf(stderr, "No Logitech Unifying Receiver device found\n");
+			if (access("/sys/class/hidraw", R_OK)) {
+				fputs("The kernel must have CONFIG_HIDRAW enabled.\n",
+					stderr);
+			}
+			if (access("/sys/module/hid_logitech_dj", F_OK)) {
+				fprintf(stderr, "Driver is not loaded, try:"
+						"   sudo modprobe hid-logitech-dj\n");
+			}
+		}
+	}
+	globfree(&matches);
+
+	return count;
+}
+
+// Completes pending requests without response and releases the receiver.
+void lt_receiver_close(struct lt_receiver *rcv) {
+	if (!rcv) {
+		return;
+	}
+	while (rcv->queue) {
+		struct lt_request *req = rcv->queue;
+		rcv->queue = req->next;
+		if (req->callback) {
+			req->callback(rcv, req, req->data);
+		}
+	}
+	lt_uring_detach(rcv);
+	close(rcv->fd);
+	if (rcv->debug) {
+		lt_ring_dump(rcv, STDERR_FILENO);
+	}
+	// unregisters the ring (SIGUSR1 blocked), rcv is not dumped anymore
+	lt_ring_free(rcv->ring);
+	lt_trace_close(rcv->trace);
+	if (rcv->child_pid > 0) {
+		waitpid(rcv->child_pid, NULL, 0);
+	}
+	free(rcv);
+}
+
+// The descriptor to poll for POLLIN, see lt_process_events.
+int lt_receiver_fd(struct lt_receiver *rcv) {
+	return rcv->uring ? lt_uring_fd(rcv->uring) : rcv->fd;
+}
+
+// Sets a function that is called for every report which is no response to a
+// request. The device list is updated before the function is called.
+void lt_set_notify_callback(struct lt_receiver *rcv, lt_notify_callback notify,
+	void *data) {
+	rcv->notify = notify;
+	rcv->notify_data = data;
+}
+
+// Sets a function that is called for every report before it is processed.
+void lt_set_report_callback(struct lt_receiver *rcv, lt_report_callback hook,
+	void *data) {
+	rcv->report_hook = hook;
+	rcv->report_data = data;
+}
+
+// Writes a report of any type as-is, no response is expected.
+bool lt_write_report(struct lt_receiver *rcv, const u8 *report, size_t length) {
+	return write_report(rcv, report, length);
+}
+
+bool process_notif_dev_connect(struct lt_receiver *rcv,
+	struct hidpp_message *msg, u8 *device_index, bool *is_new_device) {
+	u8 dev_idx = msg->device_index;
+	struct notif_devcon *dcon = (struct notif_devcon *) &msg->msg_short;
+	struct device *dev;
+	if (msg->sub_id != NOTIF_DEV_CONNECT) {
+		fprintf(stderr, "Invalid msg type %#0x, expected dev conn notif\n",
+			msg->sub_id);
+		return false;
+	}
+	if (msg->report_id != SHORT_MESSAGE) {
+		fprintf(stderr, "Dev conn notif is expected to be short, got "
+			"%#04x instead\n", msg->report_id);
+		return false;
+	}
+	if (dcon->prot_type != DEVCON_PROT_UNIFYING) {
+		fprintf(stderr, "Unknown protocol %#04x in devcon notif\n",
+			dcon->prot_type);
+		return false;
+	}
+	if (dev_idx < 1 || dev_idx > DEVICES_MAX) {
+		fprintf(stderr, "Disallowed device index %#04x\n", dev_idx);
+		return false;
+	}
+
+	dev = &rcv->devices[dev_idx - 1];
+	if (device_index) *device_index = dev_idx;
+	if (is_new_device) *is_new_device = !dev->device_present;
+
+	memset(dev, 0, sizeof *dev);
+	dev->device_type = dcon->device_info & DEVCON_DEV_TYPE_MASK;
+	dev->wireless_pid = (dcon->pid_msb << 8) | dcon->pid_lsb;
+	dev->device_present = true;
+	dev->device_available = !(dcon->device_info & DEVCON_LINK_STATUS_FLAG);
+	return true;
+}
+
+// Updates the device list for 0x40, 0x41 and 0x4A notifications.
+void lt_process_notification(struct lt_receiver *rcv, struct hidpp_message *msg) {
+	lt_serial_index_process_notification(rcv, msg);
+	if (msg->sub_id == NOTIF_DEV_CONNECT) {
+		process_notif_dev_connect(rcv, msg, NULL, NULL);
+	} else if (msg->sub_id == NOTIF_DEV_DISCONNECT) {
+		u8 device_index = msg->device_index;
+		u8 disconnect_type = *(u8 *) &msg->msg_short;
+		if (device_index < 1 || device_index > DEVICES_MAX) {
+			fprintf(stderr, "Invalid device index %#04x\n", device_index);
+		} else if (disconnect_type & 0x02) {
+			memset(&rcv->devices[device_index - 1], 0, sizeof *rcv->devices);
+		} else {
+			fprintf(stderr, "Unexpected disconnection type %#04x\n", disconnect_type);
+		}
+	} else if (msg->sub_id == NOTIF_RECV_LOCK_CHANGE) {
+		if (msg->report_id != SHORT_MESSAGE || msg->device_index != DEVICE_RECEIVER) {
+			fprintf(stderr, "Received invalid Unifying Receiver Locking Change notification (0x4A)\n");
+			return;
+		}
+		DPRINTF(rcv, "Receiver lock state is now %s\n",
+			(*(u8 *)&msg->msg_short) & 1 ? "open" : "closed");
+	} else if (msg->report_id == LONG_MESSAGE &&
+		msg->sub_id == HIDPP20_ERROR_MSG) {
+		// requests of other programs can also trigger errors
+		DPRINTF(rcv, "Ignoring HID++ 2.0 error %#04x\n",
+			msg->msg_error.error_code);
+	}
+}
+
+// Returns the next HID++ 2.0 software ID (1..15, 0 is used by notifications).
+// Every process starts at a different point, so concurrent programs are
+// unlikely to use the same swId for their requests at the same time.
+static u8 next_software_id(struct lt_receiver *rcv) {
+	if (!rcv->next_swId) {
+		rcv->next_swId = getpid() % 15 + 1;
+	}
+	rcv->next_swId = rcv->next_swId % 15 + 1;
+	return rcv->next_swId;
+}
+
+// Returns a software ID that is not used by an outstanding request for the
+// same device or 0 if all of them are in use.
+static u8 alloc_software_id(struct lt_receiver *rcv, struct lt_request *req) {
+	struct lt_request *r;
+	uint16_t in_use = 1;
+	unsigned i;
+
+	for (r = rcv->queue; r; r = r->next) {
+		if (r->hidpp20 && r->sent &&
+			r->msg.device_index == req->msg.device_index) {
+			in_use |= 1 << (r->msg.msg_short.address & 0x0F);
+		}
+	}
+	for (i = 0; i < 15; i++) {
+		u8 swId = next_software_id(rcv);
+		if (!(in_use & (1 << swId))) {
+			return swId;
+		}
+	}
+	return 0;
+}
+
+static void remove_request(struct lt_receiver *rcv, struct lt_request *req) {
+	struct lt_request **p;
+
+	for (p = &rcv->queue; *p; p = &(*p)->next) {
+		if (*p == req) {
+			*p = req->next;
+			req->next = NULL;
+			rcv->queue_length--;
+			return;
+		}
+	}
+}
+
+static void complete_request(struct lt_receiver *rcv, struct lt_request *req) {
+	remove_request(rcv, req);
+	if (req->callback) {
+		req->callback(rcv, req, req->data);
+	}
+}
+
+// Writes queued requests. HID++ 2.0 requests are held back while all software
+// IDs for the device are in use. Requests that cannot be written complete
+// without response.
+static void send_queued(struct lt_receiver *rcv) {
+	struct lt_request *req, *next;
+
+	for (req = rcv->queue; req; req = next) {
+		next = req->next;
+		if (req->sent) {
+			continue;
+		}
+		if (req->hidpp20) {
+			u8 swId = alloc_software_id(rcv, req);
+			if (!swId) {
+				continue;
+			}
+			req->msg.msg_short.address &= 0xF0;
+			req->msg.msg_short.address |= swId;
+		}
+		if (do_write(rcv, &req->msg)) {
+			req->sent = true;
+		} else {
+			complete_request(rcv, req);
+			// the callback may have changed the queue
+			next = rcv->queue;
+		}
+	}
+}
+
+// Queues a request and writes it if possible. The callback (if non-NULL) is
+// invoked from lt_process_events when a response or error arrives, or when
+// there was no response within timeout milliseconds. Every outstanding HID++
+// 2.0 request to a device gets its own swId, responses and errors are matched
+// by (device index, feature index, function, swId). A device answers in order,
+// so identical HID++ 1.0 requests receive their responses in the order they
+// were sent.
+bool lt_submit(struct lt_receiver *rcv, struct lt_request *req, int timeout,
+	lt_callback callback, void *data) {
+	struct lt_request **p;
+
+	req->done = req->sent = false;
+	req->error_type = 0;
+	req->error_code = 0;
+	req->callback = callback;
+	req->data = data;
+	req->deadline = get_timestamp_ms() + timeout;
+	req->next = NULL;
+
+	for (p = &rcv->queue; *p; p = &(*p)->next)
+		;
+	*p = req;
+	rcv->queue_length++;
+	send_queued(rcv);
+	return true;
+}
+
+// Returns the first unanswered request that matches a response. The sub ID
+// and address are the feature index and function/software ID for HID++ 2.0.
+static struct lt_request *find_request(struct lt_receiver *rcv, u8 device_index,
+	u8 sub_id, u8 address) {
+	struct lt_request *req;
+
+	for (req = rcv->queue; req; req = req->next) {
+		struct hidpp_message *msg = &req->msg;
+		if (req->sent && msg->device_index == device_index &&
+			msg->sub_id == sub_id && msg->msg_short.address == address) {
+			return req;
+		}
+	}
+	return NULL;
+}
+
+static void process_message(struct lt_receiver *rcv, struct hidpp_message *msg) {
+	struct lt_request *req;
+
+	if (msg->sub_id == SUB_ERROR_MSG ||
+		(msg->report_id == LONG_MESSAGE && msg->sub_id == HIDPP20_ERROR_MSG)) {
+		// both error types have the same layout
+		req = find_request(rcv, msg->device_index, msg->msg_error.sub_id,
+			msg->msg_error.address);
+		if (req) {
+			req->error_type = msg->sub_id;
+			req->error_code = msg->msg_error.error_code;
+			lt_ring_mark(rcv->ring, RING_ERROR);
+		}
+	} else {
+		req = find_request(rcv, msg->device_index, msg->sub_id,
+			msg->msg_short.address);
+		if (req) {
+			memcpy(&req->msg, msg, sizeof *msg);
+			lt_ring_mark(rcv->ring, RING_RESPONSE);
+		}
+	}
+
+	if (req) {
+		req->done = true;
+		complete_request(rcv, req);
+		// a swId became available
+		send_queued(rcv);
+		return;
+	}
+
+	lt_ring_mark(rcv->ring, RING_NOTIFICATION);
+	lt_process_notification(rcv, msg);
+	if (rcv->notify) {
+		rcv->notify(rcv, msg, rcv->notify_data);
+	}
+}
+
+// Handles a report that was read from the receiver.
+void lt_process_report(struct lt_receiver *rcv, const void *data, size_t length) {
+	union {
+		struct hidpp_message msg;
+		u8 raw[32]; // DJ long reports
+	} report;
+
+	if (length > sizeof report) {
+		length = sizeof report;
+	}
+	memset(&report, 0, sizeof report);
+	memcpy(&report, data, length);
+	lt_io_stats.reports++;
+	lt_ring_add(rcv->ring, RING_READ, &report, length);
+	if (rcv->trace) {
+		lt_trace_add(rcv->trace, false, &report, length);
+	}
+	if (rcv->report_hook) {
+		rcv->report_hook(rcv, report.raw, length, rcv->report_data);
+	}
+	/* ignore non-HID++ reports (e.g. DJ reports) */
+	if (report.msg.report_id != SHORT_MESSAGE &&
+		report.msg.report_id != LONG_MESSAGE) {
+		lt_ring_mark(rcv->ring, RING_IGNORED);
+		return;
+	}
+	process_message(rcv, &report.msg);
+}
+
+// Completes the requests whose timeout passed.
+void lt_expire_requests(struct lt_receiver *rcv) {
+	struct lt_request *req, *next;
+	long long unsigned now = get_timestamp_ms();
+
+	for (req = rcv->queue; req; req = next) {
+		next = req->next;
+		if (req->deadline <= now) {
+			lt_ring_add(rcv->ring, RING_TIMEOUT, &req->msg,
+				req->msg.report_id == LONG_MESSAGE ?
+				LONG_MESSAGE_LEN : SHORT_MESSAGE_LEN);
+			complete_request(rcv, req);
+			next = rcv->queue;
+		}
+	}
+}
+
+// Reads all available reports without blocking, completes the requests they
+// answer and expires requests whose timeout passed.
+void lt_process_events(struct lt_receiver *rcv) {
+	if (rcv->uring) {
+		lt_uring_process(rcv->uring, 0);
+		return;
+	}
+
+	for (;;) {
+		struct pollfd pollfd;
+		u8 report[32];
+		ssize_t r;
+
+		pollfd.fd = rcv->fd;
+		pollfd.events = POLLIN;
+		lt_io_stats.syscalls++;
+		if (poll(&pollfd, 1, 0) <= 0 || !(pollfd.revents & POLLIN)) {
+			break;
+		}
+
+		lt_io_stats.syscalls++;
+		r = read(rcv->fd, report, sizeof report);
+		if (r < 0) {
+			if (errno != EINTR && errno != EAGAIN) {
+				perror("read");
+			}
+			break;
+		} else if (r == 0) {
+			break;
+		}
+		lt_process_report(rcv, report, r);
+	}
+	lt_expire_requests(rcv);
+}
+
+// Copies the transport counters of all receivers, optionally resetting them.
+void lt_get_io_stats(struct lt_io_stats *stats, bool reset) {
+	*stats = lt_io_stats;
+	if (reset) {
+		memset(&lt_io_stats, 0, sizeof lt_io_stats);
+	}
+}
+
+// Returns the time in milliseconds until the next request expires (to be used
+// as poll timeout) or -1 if there are no pending requests.
+int lt_next_timeout(struct lt_receiver *rcv) {
+	struct lt_request *req;
+	long long unsigned now = get_timestamp_ms();
+	int timeout = -1;
+
+	for (req = rcv->queue; req; req = req->next) {
+		int t = req->deadline > now ? (int) (req->deadline - now) : 0;
+		if (timeout < 0 || t < timeout) {
+			timeout = t;
+		}
+	}
+	return timeout;
+}
+
+// Waits at most timeout milliseconds for reports and processes them. Returns
+// false if polling failed.
+bool lt_poll(struct lt_receiver *rcv, int timeout) {
+	struct pollfd pollfd;
+	int next = lt_next_timeout(rcv);
+
+	if (next >= 0 && next < timeout) {
+		timeout = next;
+	}
+	if (rcv->uring) {
+		return lt_uring_process(rcv->uring, timeout);
+	}
+	pollfd.fd = rcv->fd;
+	pollfd.events = POLLIN;
+	lt_io_stats.syscalls++;
+	if (poll(&pollfd, 1, timeout) < 0 && errno != EINTR) {
+		perror("poll");
+		return false;
+	}
+	lt_process_events(rcv);
+	return true;
+}
+
+static bool any_pending(struct lt_receiver **rcvs, unsigned count) {
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		if (rcvs[i]->queue) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Runs the event loop for several receivers until no requests are pending or
+// timeout milliseconds passed (no limit if negative, requests still expire).
+// Returns true if no requests are pending.
+bool lt_run(struct lt_receiver **rcvs, unsigned count, int timeout) {
+	struct pollfd *pollfds;
+	long long unsigned deadline = get_timestamp_ms() + timeout;
+	struct lt_uring *uring = count ? rcvs[0]->uring : NULL;
+	unsigned i;
+
+	if (timeout < 0) {
+		deadline = -1;
+	}
+
+	if (!any_pending(rcvs, count)) {
+		return true;
+	}
+
+	pollfds = calloc(count, sizeof *pollfds);
+	if (!pollfds) {
+		perror("calloc");
+		return false;
+	}
+	for (i = 0; i < count; i++) {
+		pollfds[i].fd = lt_receiver_fd(rcvs[i]);
+		pollfds[i].events = POLLIN;
+		// a shared io_uring waits for all receivers at once
+		if (rcvs[i]->uring != uring) {
+			uring = NULL;
+		}
+	}
+
+	do {
+		long long unsigned now = get_timestamp_ms();
+		int wait = timeout < 0 ? -1 :
+			now < deadline ? (int) (deadline - now) : 0;
+
+		for (i = 0; i < count; i++) {
+			int t = lt_next_timeout(rcvs[i]);
+			if (t >= 0 && (wait < 0 || t < wait)) {
+				wait = t;
+			}
+		}
+
+		if (uring) {
+			if (!lt_uring_process(uring, wait)) {
+				break;
+			}
+			continue;
+		}
+		lt_io_stats.syscalls++;
+		if (poll(pollfds, count, wait) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+		for (i = 0; i < count; i++) {
+			lt_process_events(rcvs[i]);
+		}
+	} while (any_pending(rcvs, count) && get_timestamp_ms() < deadline);
+
+	free(pollfds);
+	return !any_pending(rcvs, count);
+}
+
+static bool is_queued(struct lt_receiver *rcv, struct lt_request *req) {
+	struct lt_request *r;
+
+	for (r = rcv->queue; r; r = r->next) {
+		if (r == req) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Runs the event loop until the submitted request completes. Returns true if
+// a response (or error) was received.
+bool lt_wait(struct lt_receiver *rcv, struct lt_request *req) {
+	while (is_queued(rcv, req)) {
+		if (!lt_poll(rcv, lt_next_timeout(rcv))) {
+			return false;
+		}
+	}
+	return req->done;
+}
+
+// Submits a request and waits for its completion.
+bool lt_execute(struct lt_receiver *rcv, struct lt_request *req, int timeout) {
+	return lt_submit(rcv, req, timeout, NULL, NULL) && lt_wait(rcv, req);
+}
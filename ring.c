@@ -0,0 +1,212 @@
+/*
+ * In-memory ring of recent reports for debugging libltunify.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every receiver records the reports that are written and read, what was
+ * done with them and request timeouts in a fixed-size ring. Recording only
+ * copies the report, nothing is formatted or written, so the timing does not
+ * change when debugging. The ring is decoded on demand by lt_ring_dump()
+ * which formats with decode.c (no stdio) and only uses write(2), so it can
+ * be called from a signal handler. RING_DUMP_SIGNAL is blocked while rings
+ * are added or removed, so a handler that calls lt_ring_dump_all never sees a
+ * ring (or receiver) that is being freed.
+ */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "internal.h"
+#include "decode.h"
+
+#define RING_ENTRIES	1024 // power of two
+#define RING_DATA_MAX	32 // DJ long report
+#define RINGS_MAX	64 // rings that lt_ring_dump_all can reach
+#define RING_LINE_MAX	160 // formatted entry
+#define RING_DUMP_SIGNAL	SIGUSR1 // see ltunify.c
+
+struct lt_ring_entry {
+	long long unsigned time_us;
+	u8 kind; // enum lt_ring_kind
+	u8 length;
+	u8 data[RING_DATA_MAX];
+};
+
+struct lt_ring {
+	struct lt_receiver *rcv;
+	long long unsigned start_us;
+	unsigned next; // total number of entries ever added
+	struct lt_ring_entry entries[RING_ENTRIES];
+};
+
+static struct lt_ring *rings[RINGS_MAX];
+
+static const char *const ring_kinds[] = {
+	[RING_WRITE] = "wr",
+	[RING_READ] = "rd",
+	[RING_RESPONSE] = "rd",
+	[RING_ERROR] = "rd",
+	[RING_NOTIFICATION] = "rd",
+	[RING_IGNORED] = "rd",
+	[RING_TIMEOUT] = "timeout",
+};
+
+// what was done with a report that was read
+static const char *const ring_decisions[] = {
+	[RING_RESPONSE] = "response",
+	[RING_ERROR] = "error response",
+	[RING_NOTIFICATION] = "notification",
+	[RING_IGNORED] = "ignored",
+};
+
+static long long unsigned now_us(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1000000ULL + tp.tv_nsec / 1000;
+}
+
+// Keeps lt_ring_dump_all (in a signal handler) out while rings[] changes.
+static void block_dump(sigset_t *old) {
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, RING_DUMP_SIGNAL);
+	sigprocmask(SIG_BLOCK, &set, old);
+}
+
+struct lt_ring *lt_ring_new(struct lt_receiver *rcv) {
+	struct lt_ring *ring = calloc(1, sizeof *ring);
+	sigset_t old;
+	unsigned i;
+
+	if (!ring) {
+		return NULL;
+	}
+	ring->rcv = rcv;
+	ring->start_us = now_us();
+	block_dump(&old);
+	for (i = 0; i < RINGS_MAX; i++) {
+		if (!rings[i]) {
+			rings[i] = ring;
+			break;
+		}
+	}
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	return ring;
+}
+
+// Called before the receiver is freed, after this it is no longer dumped.
+void lt_ring_free(struct lt_ring *ring) {
+	sigset_t old;
+	unsigned i;
+
+	block_dump(&old);
+	for (i = 0; i < RINGS_MAX; i++) {
+		if (rings[i] == ring) {
+			rings[i] = NULL;
+		}
+	}
+	free(ring);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+void lt_ring_add(struct lt_ring *ring, enum lt_ring_kind kind,
+	const void *data, size_t length) {
+	struct lt_ring_entry *entry;
+
+	if (!ring) {
+		return;
+	}
+	entry = &ring->entries[ring->next++ % RING_ENTRIES];
+	entry->time_us = now_us();
+	entry->kind = kind;
+	if (length > RING_DATA_MAX) {
+		length = RING_DATA_MAX;
+	}
+	entry->length = length;
+	memcpy(entry->data, data, length);
+}
+
+// Records what happened to the report that was read last.
+void lt_ring_mark(struct lt_ring *ring, enum lt_ring_kind kind) {
+	struct lt_ring_entry *entry;
+
+	if (!ring || !ring->next) {
+		return;
+	}
+	entry = &ring->entries[(ring->next - 1) % RING_ENTRIES];
+	if (entry->kind == RING_READ) {
+		entry->kind = kind;
+	}
+}
+
+// Writes the recorded entries of a receiver, oldest first, to fd.
+void lt_ring_dump(struct lt_receiver *rcv, int fd) {
+	struct lt_ring *ring = rcv->ring;
+	char data[RING_LINE_MAX * 4];
+	struct fmt_buf b;
+	unsigned i;
+
+	if (!ring) {
+		return;
+	}
+	fmt_init(&b, fd, data, sizeof data);
+	fmt_str(&b, "Recent reports of ");
+	fmt_str(&b, rcv->path);
+	fmt_str(&b, " (");
+	fmt_dec(&b, ring->next, 0);
+	fmt_str(&b, " recorded)\n");
+
+	i = ring->next > RING_ENTRIES ? ring->next - RING_ENTRIES : 0;
+	for (; i < ring->next; i++) {
+		const struct lt_ring_entry *entry =
+			&ring->entries[i % RING_ENTRIES];
+		long long unsigned t = entry->time_us - ring->start_us;
+
+		if (b.length + RING_LINE_MAX > b.size) {
+			fmt_flush(&b);
+		}
+		fmt_dec(&b, t / 1000000, 0);
+		fmt_char(&b, '.');
+		fmt_dec(&b, t % 1000000, 6);
+		fmt_char(&b, ' ');
+		fmt_str(&b, ring_kinds[entry->kind]);
+		fmt_char(&b, ' ');
+		fmt_hex_bytes(&b, entry->data, entry->length);
+		if (entry->kind < ARRAY_SIZE(ring_decisions) &&
+			ring_decisions[entry->kind]) {
+			fmt_str(&b, "  ");
+			fmt_str(&b, ring_decisions[entry->kind]);
+		}
+		fmt_char(&b, '\n');
+	}
+	fmt_flush(&b);
+}
+
+// Dumps the rings of all open receivers, see lt_ring_dump.
+void lt_ring_dump_all(int fd) {
+	unsigned i;
+
+	for (i = 0; i < RINGS_MAX; i++) {
+		if (rings[i]) {
+			lt_ring_dump(rings[i]->rcv, fd);
+		}
+	}
+}
@@ -0,0 +1,186 @@
+/*
+ * HID++ 1.0 register space scanner for libltunify.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A scan reads every short (0x81) and long (0x83) register with zeroed
+ * parameters, nothing is written. Snapshots are stored as:
+ *
+ *   "LTSCAN1\n", device index, 3 zero bytes, serial number (u32 BE)
+ *   512 entries (short registers 00..FF, then long registers 00..FF) of
+ *   status, error code and 16 value bytes (3 for short registers, zero-padded)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "internal.h"
+
+#define SCAN_WINDOW	8 // requests in flight
+#define SCAN_TIMEOUT	1000
+
+static const char scan_magic[8] = "LTSCAN1\n";
+
+struct scan_state {
+	struct lt_receiver *rcv;
+	struct lt_scan *scan;
+	unsigned next; // next register, long registers start at 0x100
+	struct lt_request reqs[SCAN_WINDOW];
+	unsigned req_reg[SCAN_WINDOW];
+};
+
+static struct lt_scan_entry *scan_entry(struct lt_scan *scan, unsigned reg) {
+	return reg < SCAN_REGISTERS ? &scan->short_regs[reg] :
+		&scan->long_regs[reg - SCAN_REGISTERS];
+}
+
+static void scan_done(struct lt_receiver *rcv, struct lt_request *req,
+	void *data);
+
+static void scan_submit(struct scan_state *st, unsigned slot) {
+	unsigned reg = st->next;
+
+	if (reg >= 2 * SCAN_REGISTERS) {
+		return;
+	}
+	st->next++;
+	st->req_reg[slot] = reg;
+	init_register_req(&st->reqs[slot], st->scan->device_index,
+		reg < SCAN_REGISTERS ? SUB_GET_REGISTER : SUB_GET_LONG_REGISTER,
+		reg & 0xFF, NULL);
+	lt_submit(st->rcv, &st->reqs[slot], SCAN_TIMEOUT, scan_done, st);
+}
+
+static void scan_done(struct lt_receiver *rcv, struct lt_request *req,
+	void *data) {
+	struct scan_state *st = data;
+	unsigned slot = req - st->reqs;
+	unsigned reg = st->req_reg[slot];
+	struct lt_scan_entry *entry = scan_entry(st->scan, reg);
+
+	(void) rcv;
+	if (!req->done) {
+		entry->status = SCAN_NO_RESPONSE;
+	} else if (req->error_type == SUB_ERROR_MSG &&
+		req->error_code == 0x02) {
+		entry->status = SCAN_INVALID_ADDRESS;
+	} else if (req->error_type) {
+		entry->status = SCAN_ERROR;
+		entry->error_code = req->error_code;
+	} else {
+		entry->status = SCAN_PRESENT;
+		if (reg < SCAN_REGISTERS) {
+			memcpy(entry->value, req->msg.msg_short.value, 3);
+		} else {
+			memcpy(entry->value, req->msg.msg_long.str, 16);
+		}
+	}
+	scan_submit(st, slot);
+}
+
+// Reads all short and long registers of the receiver (DEVICE_RECEIVER) or a
+// device with SCAN_WINDOW requests in flight.
+bool lt_scan_registers(struct lt_receiver *rcv, u8 device_index,
+	struct lt_scan *scan) {
+	struct scan_state st;
+	unsigned i;
+
+	memset(scan, 0, sizeof *scan);
+	scan->device_index = device_index;
+	if (device_index == DEVICE_RECEIVER) {
+		scan->serial = rcv->info.serial_number;
+	} else if (device_index >= 1 && device_index <= DEVICES_MAX) {
+		scan->serial = rcv->devices[device_index - 1].serial_number;
+	}
+
+	memset(&st, 0, sizeof st);
+	st.rcv = rcv;
+	st.scan = scan;
+	for (i = 0; i < SCAN_WINDOW; i++) {
+		scan_submit(&st, i);
+	}
+	return lt_run(&rcv, 1, -1);
+}
+
+static void put_u32(u8 *p, uint32_t value) {
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static uint32_t get_u32(const u8 *p) {
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+bool lt_scan_save(const struct lt_scan *scan, const char *path) {
+	u8 header[16] = { 0 };
+	FILE *fp;
+	unsigned i;
+
+	fp = fopen(path, "wb");
+	if (!fp) {
+		perror(path);
+		return false;
+	}
+	memcpy(header, scan_magic, sizeof scan_magic);
+	header[8] = scan->device_index;
+	put_u32(&header[12], scan->serial);
+	fwrite(header, sizeof header, 1, fp);
+	for (i = 0; i < 2 * SCAN_REGISTERS; i++) {
+		const struct lt_scan_entry *entry =
+			scan_entry((struct lt_scan *) scan, i);
+		fwrite(entry, sizeof *entry, 1, fp);
+	}
+	if (ferror(fp) | fclose(fp)) {
+		perror(path);
+		return false;
+	}
+	return true;
+}
+
+bool lt_scan_load(struct lt_scan *scan, const char *path) {
+	u8 header[16];
+	FILE *fp;
+	unsigned i;
+	bool ok;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		perror(path);
+		return false;
+	}
+	memset(scan, 0, sizeof *scan);
+	ok = fread(header, sizeof header, 1, fp) == 1 &&
+		!memcmp(header, scan_magic, sizeof scan_magic);
+	for (i = 0; ok && i < 2 * SCAN_REGISTERS; i++) {
+		struct lt_scan_entry *entry = scan_entry(scan, i);
+		ok = fread(entry, sizeof *entry, 1, fp) == 1 &&
+			entry->status <= SCAN_NO_RESPONSE;
+	}
+	fclose(fp);
+	if (!ok) {
+		fprintf(stderr, "%s: not a register snapshot\n", path);
+		return false;
+	}
+	scan->device_index = header[8];
+	scan->serial = get_u32(&header[12]);
+	return true;
+}
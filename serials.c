@@ -0,0 +1,296 @@
+/*
+ * Persistent index of device serial numbers for libltunify.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The index maps the serial number of a device to the receiver and slot it is
+ * paired with. It is stored as text, one device per line:
+ *
+ *   device-serial receiver-serial slot wireless-pid hidraw-path
+ *
+ * Entries are added whenever the extended pairing information of a device is
+ * read and dropped when a 0x40 (unpaired) or a 0x41 notification for a
+ * different device in the same slot arrives. The index is only a hint, users
+ * must verify the serial number of the slot before acting on it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+struct lt_serial_index {
+	char path[1024];
+	bool readonly;
+	bool dirty;
+	unsigned count;
+	unsigned alloc;
+	struct lt_serial_entry *entries;
+};
+
+// $XDG_CACHE_HOME/ltunify/serials, falling back to ~/.cache
+static bool default_path(char *buf, size_t size) {
+	const char *dir = getenv("XDG_CACHE_HOME");
+	int r;
+
+	if (dir && *dir) {
+		r = snprintf(buf, size, "%s/ltunify/serials", dir);
+	} else if ((dir = getenv("HOME")) && *dir) {
+		r = snprintf(buf, size, "%s/.cache/ltunify/serials", dir);
+	} else {
+		return false;
+	}
+	return r > 0 && (size_t) r < size;
+}
+
+static void load(struct lt_serial_index *idx, FILE *fp) {
+	char line[128];
+
+	while (fgets(line, sizeof line, fp)) {
+		struct lt_serial_entry e;
+		unsigned slot, wpid;
+
+		memset(&e, 0, sizeof e);
+		if (sscanf(line, "%x %x %u %x %31s", &e.serial,
+			&e.receiver_serial, &slot, &wpid, e.path) != 5 ||
+			slot < 1 || slot > DEVICES_MAX) {
+			continue;
+		}
+		if (!strcmp(e.path, "-")) {
+			*e.path = 0;
+		}
+		e.device_index = slot;
+		e.wireless_pid = wpid;
+		lt_serial_index_set(idx, &e);
+	}
+	idx->dirty = false;
+}
+
+// Opens the index at path (the default cache location if NULL). A missing file
+// yields an empty index. Changes to a readonly index are not saved (replays).
+struct lt_serial_index *lt_serial_index_open(const char *path, bool readonly) {
+	struct lt_serial_index *idx = calloc(1, sizeof *idx);
+	FILE *fp;
+
+	if (!idx) {
+		perror("calloc");
+		return NULL;
+	}
+	idx->readonly = readonly;
+	if (path) {
+		snprintf(idx->path, sizeof idx->path, "%s", path);
+	} else if (!default_path(idx->path, sizeof idx->path)) {
+		return idx;
+	}
+	fp = fopen(idx->path, "r");
+	if (fp) {
+		load(idx, fp);
+		fclose(fp);
+	} else if (errno != ENOENT) {
+		perror(idx->path);
+	}
+	return idx;
+}
+
+// Creates the parent directories of path.
+static bool make_parents(char *path) {
+	char *p;
+
+	for (p = path + 1; (p = strchr(p, '/')); p++) {
+		*p = 0;
+		if (mkdir(path, 0700) && errno != EEXIST) {
+			perror(path);
+			*p = '/';
+			return false;
+		}
+		*p = '/';
+	}
+	return true;
+}
+
+// Writes the index if it changed. The file is replaced atomically.
+bool lt_serial_index_save(struct lt_serial_index *idx) {
+	char tmp[sizeof idx->path + 4];
+	FILE *fp;
+	unsigned i;
+
+	if (!idx->dirty || idx->readonly || !*idx->path) {
+		return true;
+	}
+	if (!make_parents(idx->path)) {
+		return false;
+	}
+	snprintf(tmp, sizeof tmp, "%s.new", idx->path);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		perror(tmp);
+		return false;
+	}
+	for (i = 0; i < idx->count; i++) {
+		struct lt_serial_entry *e = &idx->entries[i];
+		fprintf(fp, "%08X %08X %u %04X %s\n", e->serial,
+			e->receiver_serial, e->device_index, e->wireless_pid,
+			*e->path ? e->path : "-");
+	}
+	if (fclose(fp) || rename(tmp, idx->path)) {
+		perror(idx->path);
+		unlink(tmp);
+		return false;
+	}
+	idx->dirty = false;
+	return true;
+}
+
+void lt_serial_index_free(struct lt_serial_index *idx) {
+	if (idx) {
+		free(idx->entries);
+		free(idx);
+	}
+}
+
+const struct lt_serial_entry *lt_serial_index_find(struct lt_serial_index *idx,
+	uint32_t serial) {
+	unsigned i;
+
+	for (i = 0; i < idx->count; i++) {
+		if (idx->entries[i].serial == serial) {
+			return &idx->entries[i];
+		}
+	}
+	return NULL;
+}
+
+static void remove_entry(struct lt_serial_index *idx, unsigned i) {
+	idx->entries[i] = idx->entries[--idx->count];
+	idx->dirty = true;
+}
+
+// Whether an entry refers to the slot of a receiver. Receivers are identified
+// by serial number, the hidraw path may change between boots.
+static bool same_slot(const struct lt_serial_entry *a,
+	const struct lt_serial_entry *b) {
+	if (a->device_index != b->device_index) {
+		return false;
+	}
+	if (a->receiver_serial && b->receiver_serial) {
+		return a->receiver_serial == b->receiver_serial;
+	}
+	return !strcmp(a->path, b->path);
+}
+
+// Adds or replaces the entry for a device, a slot holds a single device.
+void lt_serial_index_set(struct lt_serial_index *idx,
+	const struct lt_serial_entry *entry) {
+	unsigned i;
+
+	for (i = 0; i < idx->count; ) {
+		struct lt_serial_entry *e = &idx->entries[i];
+		if (e->serial == entry->serial || same_slot(e, entry)) {
+			if (!memcmp(e, entry, sizeof *e)) {
+				return; // unchanged
+			}
+			remove_entry(idx, i);
+		} else {
+			i++;
+		}
+	}
+	if (idx->count == idx->alloc) {
+		unsigned alloc = idx->alloc ? 2 * idx->alloc : 16;
+		void *p = realloc(idx->entries, alloc * sizeof *idx->entries);
+		if (!p) {
+			perror("realloc");
+			return;
+		}
+		idx->entries = p;
+		idx->alloc = alloc;
+	}
+	idx->entries[idx->count++] = *entry;
+	idx->dirty = true;
+}
+
+static void init_entry(struct lt_receiver *rcv, u8 device_index,
+	struct lt_serial_entry *entry) {
+	memset(entry, 0, sizeof *entry);
+	entry->receiver_serial = rcv->info.serial_number;
+	entry->device_index = device_index;
+	snprintf(entry->path, sizeof entry->path, "%s", rcv->path);
+}
+
+// Keeps the index up to date with the devices of a receiver, see
+// lt_serial_index_update and lt_serial_index_process_notification.
+void lt_serial_index_track(struct lt_receiver *rcv, struct lt_serial_index *idx) {
+	rcv->serials = idx;
+}
+
+// Records the serial number of a device (read from its extended pairing
+// information). The serial number of the receiver is read if not yet known.
+void lt_serial_index_update(struct lt_receiver *rcv, u8 device_index,
+	uint32_t serial) {
+	struct lt_serial_entry entry;
+
+	if (!rcv->serials || device_index < 1 || device_index > DEVICES_MAX) {
+		return;
+	}
+	if (!rcv->info.serial_number) {
+		get_receiver_info(rcv, &rcv->info);
+	}
+	init_entry(rcv, device_index, &entry);
+	entry.serial = serial;
+	entry.wireless_pid = rcv->devices[device_index - 1].wireless_pid;
+	lt_serial_index_set(rcv->serials, &entry);
+}
+
+// Drops entries of slots that were unpaired or now hold another device.
+void lt_serial_index_process_notification(struct lt_receiver *rcv,
+	struct hidpp_message *msg) {
+	struct lt_serial_index *idx = rcv->serials;
+	struct lt_serial_entry slot;
+	uint16_t wpid = 0;
+	unsigned i;
+
+	if (!idx || msg->device_index < 1 || msg->device_index > DEVICES_MAX ||
+		(msg->sub_id != NOTIF_DEV_DISCONNECT &&
+		msg->sub_id != NOTIF_DEV_CONNECT)) {
+		return;
+	}
+	if (msg->sub_id == NOTIF_DEV_DISCONNECT) {
+		// only the "unpaired" type frees the slot
+		if (!(*(u8 *) &msg->msg_short & 0x02)) {
+			return;
+		}
+	} else {
+		struct notif_devcon *dcon = (struct notif_devcon *) &msg->msg_short;
+		wpid = (dcon->pid_msb << 8) | dcon->pid_lsb;
+	}
+	init_entry(rcv, msg->device_index, &slot);
+	for (i = 0; i < idx->count; ) {
+		struct lt_serial_entry *e = &idx->entries[i];
+		if (same_slot(e, &slot) && (msg->sub_id == NOTIF_DEV_DISCONNECT ||
+			(e->wireless_pid && e->wireless_pid != wpid))) {
+			remove_entry(idx, i);
+		} else {
+			i++;
+		}
+	}
+}
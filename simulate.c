@@ -0,0 +1,479 @@
+/*
+ * Simulated receiver with DFU-capable devices for libltunify.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The simulator runs in a child process connected through a socketpair, like
+ * a replay (see trace.c). It implements the receiver registers used by
+ * ltunify and two HID++ 4.5 devices with the Root, FeatureSet, DeviceName and
+ * DFU (see dfu.c) features. The keyboard also has FnInversion and the mouse
+ * HiResScrolling, both kept in a single setting bit. Responses are delayed by a radio latency and a
+ * device handles one report at a time. Every SIM_PAGE_PACKETS packets the
+ * device "erases flash" and answers with "wait for event".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "internal.h"
+
+#define SIM_DEVICES		2
+#define SIM_LATENCY_US		4000 // radio round-trip
+#define SIM_REPORT_US		500 // processing time of a report
+#define SIM_ERASE_US		20000
+#define SIM_PAGE_PACKETS	64 // 1 KiB flash pages
+#define SIM_IMAGE_MAX		(1024 * 1024)
+#define SIM_QUEUE_MAX		64
+
+#define SIM_FEATURES		5
+
+static const uint16_t sim_features[SIM_DEVICES][SIM_FEATURES] = {
+	{ 0x0000, FID_IFEATURESET, FID_DEVICE_NAME, FID_DFU, FID_FN_INVERSION },
+	{ 0x0000, FID_IFEATURESET, FID_DEVICE_NAME, FID_DFU, FID_HIRES_SCROLLING },
+};
+
+struct sim_device {
+	const char *name;
+	u8 device_type;
+	uint16_t wireless_pid;
+	uint32_t serial;
+	u8 setting; // FnInversion or HiResScrolling mode
+	long long unsigned busy_until; // radio and processing
+	// DFU state
+	bool dfu_started;
+	long long unsigned erase_until;
+	uint32_t dfu_size, dfu_crc;
+	unsigned dfu_packet; // next expected packet
+	u8 *image;
+	unsigned packets_rejected;
+};
+
+struct sim_report {
+	long long unsigned due;
+	u8 data[LONG_MESSAGE_LEN];
+	size_t length;
+};
+
+struct sim_state {
+	int fd;
+	bool debug;
+	uint32_t serial;
+	u8 notifs[3];
+	struct sim_device devices[SIM_DEVICES];
+	unsigned queue_length;
+	struct sim_report queue[SIM_QUEUE_MAX];
+	unsigned images_ok, images_bad;
+};
+
+static long long unsigned now_us(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1000000ULL + tp.tv_nsec / 1000;
+}
+
+// Queues a report to be sent at due (microseconds), ordered by time.
+static void sim_send_at(struct sim_state *st, long long unsigned due,
+	const u8 *data, size_t length) {
+	struct sim_report *r;
+	unsigned i;
+
+	if (st->queue_length == SIM_QUEUE_MAX) {
+		fprintf(stderr, "simulator: output queue full\n");
+		return;
+	}
+	for (i = st->queue_length; i > 0 && st->queue[i - 1].due > due; i--) {
+		st->queue[i] = st->queue[i - 1];
+	}
+	r = &st->queue[i];
+	r->due = due;
+	memset(r->data, 0, sizeof r->data);
+	memcpy(r->data, data, length);
+	r->length = data[0] == SHORT_MESSAGE ? SHORT_MESSAGE_LEN : LONG_MESSAGE_LEN;
+	st->queue_length++;
+}
+
+// Answers after the latency of the receiver (device NULL) or a device.
+static void sim_reply(struct sim_state *st, struct sim_device *dev,
+	const u8 *data, size_t length) {
+	long long unsigned due = now_us() + SIM_LATENCY_US;
+
+	if (dev) {
+		if (dev->busy_until + SIM_REPORT_US > due) {
+			due = dev->busy_until + SIM_REPORT_US;
+		}
+		dev->busy_until = due;
+	}
+	sim_send_at(st, due, data, length);
+}
+
+static void sim_error10(struct sim_state *st, const u8 *req, u8 error) {
+	u8 rsp[7] = { SHORT_MESSAGE, req[1], SUB_ERROR_MSG, req[2], req[3], error };
+	sim_reply(st, NULL, rsp, sizeof rsp);
+}
+
+static void put_u32(u8 *p, uint32_t value) {
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static uint32_t get_u32(const u8 *p) {
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// HID++ 1.0 registers of the receiver
+static void sim_receiver(struct sim_state *st, const u8 *req) {
+	u8 rsp[LONG_MESSAGE_LEN] = { SHORT_MESSAGE, DEVICE_RECEIVER, req[2], req[3] };
+	unsigned i;
+
+	switch ((req[2] << 8) | req[3]) {
+	case (SUB_GET_REGISTER << 8) | REG_ENABLED_NOTIFS:
+		memcpy(&rsp[4], st->notifs, 3);
+		break;
+	case (SUB_SET_REGISTER << 8) | REG_ENABLED_NOTIFS:
+		memcpy(st->notifs, &req[4], 3);
+		break;
+	case (SUB_GET_REGISTER << 8) | REG_CONNECTION_STATE:
+		rsp[5] = SIM_DEVICES;
+		break;
+	case (SUB_SET_REGISTER << 8) | REG_CONNECTION_STATE:
+		for (i = 0; i < SIM_DEVICES; i++) {
+			struct sim_device *dev = &st->devices[i];
+			u8 notif[7] = { SHORT_MESSAGE, i + 1, NOTIF_DEV_CONNECT,
+				DEVCON_PROT_UNIFYING, dev->device_type,
+				dev->wireless_pid & 0xFF, dev->wireless_pid >> 8 };
+			sim_reply(st, NULL, notif, sizeof notif);
+		}
+		break;
+	case (SUB_GET_LONG_REGISTER << 8) | REG_DEVICE_ACTIVITY:
+		rsp[0] = LONG_MESSAGE;
+		for (i = 0; i < SIM_DEVICES; i++) {
+			rsp[4 + i] = now_us() / 100000 * (i + 1);
+		}
+		break;
+	case (SUB_GET_LONG_REGISTER << 8) | REG_PAIRING_INFO: {
+		u8 field = req[4] & 0xF0, slot = req[4] & 0x0F;
+		struct sim_device *dev = &st->devices[slot];
+
+		rsp[0] = LONG_MESSAGE;
+		rsp[4] = req[4];
+		if (req[4] == 0x03) {
+			put_u32(&rsp[5], st->serial);
+			rsp[10] = DEVICES_MAX;
+			break;
+		} else if (slot >= SIM_DEVICES) {
+			sim_error10(st, req, 0x02); // INVALID_ADDRESS
+			return;
+		} else if (field == 0x20) {
+			rsp[6] = 8; // report interval (ms)
+			rsp[7] = dev->wireless_pid >> 8;
+			rsp[8] = dev->wireless_pid & 0xFF;
+			rsp[11] = dev->device_type;
+		} else if (field == 0x30) {
+			put_u32(&rsp[5], dev->serial);
+		} else if (field == 0x40) {
+			rsp[5] = strlen(dev->name);
+			memcpy(&rsp[6], dev->name, rsp[5]);
+		} else {
+			sim_error10(st, req, 0x03); // INVALID_VALUE
+			return;
+		}
+		break;
+	}
+	default:
+		sim_error10(st, req, 0x02); // INVALID_ADDRESS
+		return;
+	}
+	sim_reply(st, NULL, rsp, rsp[0] == SHORT_MESSAGE ?
+		SHORT_MESSAGE_LEN : LONG_MESSAGE_LEN);
+}
+
+static void sim_dfu_status(struct sim_state *st, struct sim_device *dev,
+	u8 *rsp, unsigned packet, u8 status) {
+	put_u32(&rsp[4], packet);
+	rsp[8] = status;
+	sim_reply(st, dev, rsp, LONG_MESSAGE_LEN);
+}
+
+// Status of a complete image: compares the CRC-32 from dfuStart
+static u8 sim_dfu_check(struct sim_state *st, struct sim_device *dev) {
+	dev->dfu_started = false;
+	if (lt_dfu_crc32(dev->image, dev->dfu_size) == dev->dfu_crc) {
+		st->images_ok++;
+		return DFU_STATUS_SUCCESS;
+	}
+	st->images_bad++;
+	return 0x20; // firmware check failure
+}
+
+static void sim_dfu(struct sim_state *st, struct sim_device *dev, u8 index,
+	const u8 *req) {
+	u8 rsp[LONG_MESSAGE_LEN] = { LONG_MESSAGE, req[1], index, req[3] };
+	u8 func = req[3] >> 4;
+	const u8 *params = &req[4];
+	unsigned packet = dev->dfu_packet;
+
+	if (func == 4) { // dfuStart
+		uint32_t size = get_u32(&params[1]);
+		if (req[0] != LONG_MESSAGE || !size || size > SIM_IMAGE_MAX ||
+			size % DFU_PACKET_SIZE) {
+			sim_dfu_status(st, dev, rsp, 0, 0x1A); // bad size
+			return;
+		}
+		free(dev->image);
+		dev->image = calloc(1, size);
+		dev->dfu_started = dev->image != NULL;
+		dev->dfu_size = size;
+		dev->dfu_crc = get_u32(&params[5]);
+		dev->dfu_packet = 0;
+		sim_dfu_status(st, dev, rsp, 0, dev->dfu_started ?
+			DFU_STATUS_PACKET_SUCCESS : 0x04);
+		return;
+	} else if (func == 5) { // restart
+		sim_reply(st, dev, rsp, LONG_MESSAGE_LEN);
+		return;
+	} else if (func > 5) {
+		u8 err[LONG_MESSAGE_LEN] = { LONG_MESSAGE, req[1],
+			HIDPP20_ERROR_MSG, index, req[3], 0x07 }; // INVALID_FUNCTION_ID
+		sim_reply(st, dev, err, sizeof err);
+		return;
+	}
+
+	// dfuCmdData0..3
+	if (!dev->dfu_started) {
+		sim_dfu_status(st, dev, rsp, packet, 0x14); // DFU not started
+	} else if (now_us() < dev->erase_until) {
+		dev->packets_rejected++;
+		sim_dfu_status(st, dev, rsp, packet, DFU_STATUS_BUSY);
+	} else if (func != packet % 4 || req[0] != LONG_MESSAGE) {
+		sim_dfu_status(st, dev, rsp, packet, 0x15); // bad sequence number
+	} else {
+		bool last;
+		memcpy(dev->image + packet * DFU_PACKET_SIZE, params,
+			DFU_PACKET_SIZE);
+		dev->dfu_packet++;
+		last = dev->dfu_packet * DFU_PACKET_SIZE == dev->dfu_size;
+		if (dev->dfu_packet % SIM_PAGE_PACKETS == 0) {
+			u8 event[LONG_MESSAGE_LEN] = { LONG_MESSAGE, req[1], index, 0 };
+			sim_dfu_status(st, dev, rsp, packet, DFU_STATUS_WAIT);
+			put_u32(&event[4], packet);
+			event[8] = last ? sim_dfu_check(st, dev) :
+				DFU_STATUS_PACKET_SUCCESS;
+			dev->erase_until = dev->busy_until + SIM_ERASE_US;
+			sim_send_at(st, dev->erase_until, event, sizeof event);
+		} else {
+			sim_dfu_status(st, dev, rsp, packet, last ?
+				sim_dfu_check(st, dev) : DFU_STATUS_PACKET_SUCCESS);
+		}
+	}
+}
+
+// HID++ 2.0 requests to a device
+static void sim_device(struct sim_state *st, struct sim_device *dev,
+	const u8 *req) {
+	u8 rsp[LONG_MESSAGE_LEN] = { LONG_MESSAGE, req[1], req[2], req[3] };
+	const uint16_t *features = sim_features[dev - st->devices];
+	u8 index = req[2], func = req[3] >> 4;
+	unsigned i;
+
+	if (index >= SIM_FEATURES) {
+		u8 err[LONG_MESSAGE_LEN] = { LONG_MESSAGE, req[1],
+			HIDPP20_ERROR_MSG, index, req[3], 0x06 }; // INVALID_FEATURE_INDEX
+		sim_reply(st, dev, err, sizeof err);
+		return;
+	}
+	switch (features[index]) {
+	case 0x0000:
+		if (func == 0) { // GetFeature
+			uint16_t featureId = (req[4] << 8) | req[5];
+			for (i = 0; i < SIM_FEATURES; i++) {
+				if (features[i] == featureId) {
+					rsp[4] = i;
+				}
+			}
+		} else if (func == 1) { // Ping
+			rsp[0] = req[0];
+			rsp[4] = 4;
+			rsp[5] = 5;
+			rsp[6] = req[6];
+		}
+		break;
+	case FID_IFEATURESET:
+		if (func == 0) {
+			rsp[4] = SIM_FEATURES - 1;
+		} else if (req[4] < SIM_FEATURES) {
+			rsp[4] = features[req[4]] >> 8;
+			rsp[5] = features[req[4]] & 0xFF;
+		}
+		break;
+	case FID_FN_INVERSION:
+		if (func == 1) { // setGlobalFnInversion
+			dev->setting = req[4] & 1;
+		}
+		rsp[4] = dev->setting;
+		break;
+	case FID_HIRES_SCROLLING:
+		if (func == 0) { // getHighResolutionScrollingInfo
+			rsp[4] = 0x08; // has resolution switching
+			rsp[5] = 8; // multiplier
+			break;
+		} else if (func == 2) { // setHighResolutionScrollingMode
+			dev->setting = req[4] & 1;
+		}
+		rsp[4] = dev->setting;
+		break;
+	case FID_DEVICE_NAME:
+		if (func == 0) {
+			rsp[4] = strlen(dev->name);
+		} else if (req[4] < strlen(dev->name)) {
+			size_t n = strlen(dev->name + req[4]);
+			memcpy(&rsp[4], dev->name + req[4], n < 16 ? n : 16);
+		}
+		break;
+	case FID_DFU:
+		sim_dfu(st, dev, index, req);
+		return;
+	}
+	sim_reply(st, dev, rsp, rsp[0] == SHORT_MESSAGE ?
+		SHORT_MESSAGE_LEN : LONG_MESSAGE_LEN);
+}
+
+static void sim_request(struct sim_state *st, const u8 *req, ssize_t length) {
+	u8 index = req[1];
+
+	if (length < SHORT_MESSAGE_LEN ||
+		(req[0] != SHORT_MESSAGE && req[0] != LONG_MESSAGE)) {
+		return;
+	}
+	if (index == DEVICE_RECEIVER) {
+		sim_receiver(st, req);
+	} else if (index >= 1 && index <= SIM_DEVICES) {
+		sim_device(st, &st->devices[index - 1], req);
+	} else {
+		sim_error10(st, req, 0x08); // UNKNOWN_DEVICE
+	}
+}
+
+static void sim_run(struct sim_state *st) {
+	for (;;) {
+		struct pollfd pollfd = { .fd = st->fd, .events = POLLIN };
+		long long unsigned now = now_us();
+		int timeout = -1;
+
+		while (st->queue_length && st->queue[0].due <= now) {
+			struct sim_report *r = &st->queue[0];
+			if (write(st->fd, r->data, r->length) < 0) {
+				return;
+			}
+			st->queue_length--;
+			memmove(&st->queue[0], &st->queue[1],
+				st->queue_length * sizeof *st->queue);
+		}
+		if (st->queue_length) {
+			timeout = (st->queue[0].due - now + 999) / 1000;
+		}
+		if (poll(&pollfd, 1, timeout) < 0 && errno != EINTR) {
+			return;
+		}
+		if (pollfd.revents & (POLLIN | POLLHUP)) {
+			u8 req[64];
+			ssize_t r = read(st->fd, req, sizeof req);
+			if (r <= 0) {
+				return;
+			}
+			sim_request(st, req, r);
+		}
+	}
+}
+
+// Starts a simulated receiver. Serial numbers are derived from number, so
+// several simulated receivers can be told apart.
+struct lt_receiver *lt_receiver_simulate(unsigned number, bool debug) {
+	struct lt_receiver *rcv;
+	char path[32];
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+		perror("socketpair");
+		return NULL;
+	}
+
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(sv[0]);
+		close(sv[1]);
+		return NULL;
+	} else if (pid == 0) {
+		static struct sim_state st;
+		long fd, fd_max = sysconf(_SC_OPEN_MAX);
+		unsigned i;
+
+		// Ctrl-C is for the parent, which ends the transfers
+		signal(SIGINT, SIG_IGN);
+		// the sockets of other receivers must reach EOF when the parent
+		// closes them
+		for (fd = 3; fd < fd_max && fd < 1024; fd++) {
+			if (fd != sv[1]) {
+				close(fd);
+			}
+		}
+		st.fd = sv[1];
+		st.debug = debug;
+		st.serial = 0x53000000 | number << 8;
+		for (i = 0; i < SIM_DEVICES; i++) {
+			struct sim_device *dev = &st.devices[i];
+			dev->name = i == 0 ? "Sim Keyboard" : "Sim Mouse";
+			dev->device_type = i == 0 ? 0x01 : 0x02;
+			dev->wireless_pid = 0x5000 + i;
+			dev->serial = 0x51000000 | number << 8 | (i + 1);
+		}
+		sim_run(&st);
+		if (debug) {
+			fprintf(stderr, "simulator %u: %u images verified, %u bad\n",
+				number, st.images_ok, st.images_bad);
+		}
+		_exit(st.images_bad ? 1 : 0);
+	}
+
+	close(sv[1]);
+	snprintf(path, sizeof path, "sim%u", number);
+	rcv = lt_receiver_new(sv[0], path);
+	if (!rcv) {
+		close(sv[0]);
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return NULL;
+	}
+	rcv->child_pid = pid;
+	return rcv;
+}
@@ -0,0 +1,635 @@
+/*
+ * Recording and replaying the reports of a receiver for libltunify.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Trace format: the magic "LTTR", a version byte and three reserved bytes,
+ * followed by one record per report:
+ *
+ *   u8 direction ('w' written by the host, 'r' read from the receiver)
+ *   u8 length of the report
+ *   u32 time since the previous record in microseconds (network order)
+ *   report (length bytes)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h> /* htonl, ntohl */
+
+#include "internal.h"
+
+#define TRACE_MAGIC	"LTTR"
+#define TRACE_VERSION	1
+#define TRACE_HEADER_LEN	8
+#define TRACE_RECORD_LEN	6
+#define TRACE_REPORT_MAX	64
+
+struct lt_trace {
+	FILE *fp;
+	long long unsigned last_us;
+};
+
+struct trace_record {
+	bool is_write;
+	u8 length;
+	long long unsigned time_us; // since the start of the trace
+	u8 data[TRACE_REPORT_MAX];
+};
+
+static long long unsigned get_timestamp_us(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1000000ULL + tp.tv_nsec / 1000;
+}
+
+static bool write_header(FILE *fp) {
+	u8 header[TRACE_HEADER_LEN] = TRACE_MAGIC;
+
+	header[4] = TRACE_VERSION;
+	return fwrite(header, sizeof header, 1, fp) == 1;
+}
+
+static bool write_record(FILE *fp, bool is_write, const void *data,
+	size_t length, long long unsigned delta_us) {
+	u8 rec[TRACE_RECORD_LEN];
+	uint32_t delta;
+
+	if (length > TRACE_REPORT_MAX) {
+		length = TRACE_REPORT_MAX;
+	}
+	if (delta_us > UINT32_MAX) {
+		delta_us = UINT32_MAX;
+	}
+	delta = htonl(delta_us);
+	rec[0] = is_write ? 'w' : 'r';
+	rec[1] = length;
+	memcpy(&rec[2], &delta, sizeof delta);
+	return fwrite(rec, sizeof rec, 1, fp) == 1 &&
+		fwrite(data, length, 1, fp) == 1;
+}
+
+// Starts recording all reports of the receiver to path.
+bool lt_trace_record(struct lt_receiver *rcv, const char *path) {
+	struct lt_trace *trace = calloc(1, sizeof *trace);
+
+	if (!trace) {
+		perror("calloc");
+		return false;
+	}
+	trace->fp = fopen(path, "wb");
+	if (!trace->fp) {
+		perror(path);
+		free(trace);
+		return false;
+	}
+	if (!write_header(trace->fp)) {
+		perror(path);
+		fclose(trace->fp);
+		free(trace);
+		return false;
+	}
+	trace->last_us = get_timestamp_us();
+	lt_trace_close(rcv->trace);
+	rcv->trace = trace;
+	return true;
+}
+
+void lt_trace_add(struct lt_trace *trace, bool is_write, const void *data,
+	size_t length) {
+	long long unsigned now = get_timestamp_us();
+
+	if (!write_record(trace->fp, is_write, data, length,
+		now - trace->last_us)) {
+		perror("trace");
+	}
+	trace->last_us = now;
+}
+
+void lt_trace_close(struct lt_trace *trace) {
+	if (trace) {
+		fclose(trace->fp);
+		free(trace);
+	}
+}
+
+// Loads all records of a trace, returns NULL on failure.
+static struct trace_record *load_trace(const char *path, unsigned *countp) {
+	struct trace_record *recs = NULL;
+	unsigned count = 0, alloc = 0;
+	long long unsigned time_us = 0;
+	u8 header[TRACE_HEADER_LEN];
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		perror(path);
+		return NULL;
+	}
+	if (fread(header, sizeof header, 1, fp) != 1 ||
+		memcmp(header, TRACE_MAGIC, 4) || header[4] != TRACE_VERSION) {
+		fprintf(stderr, "%s: not a trace file\n", path);
+		fclose(fp);
+		return NULL;
+	}
+
+	for (;;) {
+		u8 rec[TRACE_RECORD_LEN];
+		struct trace_record *r;
+		uint32_t delta;
+
+		if (fread(rec, sizeof rec, 1, fp) != 1) {
+			break;
+		}
+		if (count == alloc) {
+			struct trace_record *p;
+			alloc = alloc ? alloc * 2 : 64;
+			p = realloc(recs, alloc * sizeof *recs);
+			if (!p) {
+				perror("realloc");
+				free(recs);
+				fclose(fp);
+				return NULL;
+			}
+			recs = p;
+		}
+		r = &recs[count];
+		memcpy(&delta, &rec[2], sizeof delta);
+		time_us += ntohl(delta);
+		r->is_write = rec[0] == 'w';
+		r->length = rec[1] < TRACE_REPORT_MAX ? rec[1] : TRACE_REPORT_MAX;
+		r->time_us = time_us;
+		if (fread(r->data, r->length, 1, fp) != 1) {
+			fprintf(stderr, "%s: truncated record %u\n", path, count);
+			break;
+		}
+		count++;
+	}
+	fclose(fp);
+
+	if (!recs) {
+		recs = calloc(1, sizeof *recs);
+	}
+	*countp = count;
+	return recs;
+}
+
+static bool is_hidpp(const u8 *data, size_t length) {
+	return length >= 5 && (data[0] == SHORT_MESSAGE || data[0] == LONG_MESSAGE);
+}
+
+// HID++ 2.0 requests carry a swId in the low nibble of the fourth byte which
+// differs between runs. (HID++ 1.0 requests have a sub ID >= 0x80.)
+static bool has_swId(const u8 *data, size_t length) {
+	return is_hidpp(data, length) && data[2] < 0x80;
+}
+
+/* Maps the swId of recorded requests to the one actually used. */
+struct swId_map {
+	u8 device_index;
+	u8 feature_index;
+	u8 recorded;
+	u8 actual;
+};
+#define SWID_MAP_MAX	64
+
+struct replay_state {
+	int fd;
+	bool realtime;
+	struct swId_map map[SWID_MAP_MAX];
+	unsigned map_next;
+	unsigned writes, mismatches, unexpected;
+};
+
+static void swId_map_store(struct replay_state *st, const u8 *rec,
+	u8 actual) {
+	struct swId_map *m = &st->map[st->map_next++ % SWID_MAP_MAX];
+
+	m->device_index = rec[1];
+	m->feature_index = rec[2];
+	m->recorded = rec[3];
+	m->actual = actual;
+}
+
+static void swId_map_apply(struct replay_state *st, u8 device_index,
+	u8 feature_index, u8 *func_swId) {
+	unsigned i;
+
+	// newest mappings first
+	for (i = 1; i <= SWID_MAP_MAX && i <= st->map_next; i++) {
+		struct swId_map *m = &st->map[(st->map_next - i) % SWID_MAP_MAX];
+		if (m->device_index == device_index &&
+			m->feature_index == feature_index &&
+			m->recorded == *func_swId) {
+			*func_swId = m->actual;
+			return;
+		}
+	}
+}
+
+// Waits for a report from the client and compares it with the recorded one.
+// Returns false if the client closed the connection.
+static bool replay_write(struct replay_state *st, struct trace_record *rec,
+	unsigned index) {
+	u8 buf[TRACE_REPORT_MAX], actual_swId;
+	ssize_t r;
+
+	do {
+		r = read(st->fd, buf, sizeof buf);
+	} while (r < 0 && errno == EINTR);
+	if (r <= 0) {
+		return false;
+	}
+	st->writes++;
+	actual_swId = r > 3 ? buf[3] : 0;
+
+	if (has_swId(buf, r)) {
+		// the swId is assigned at runtime, compare func only
+		buf[3] = (buf[3] & 0xF0) | (rec->data[3] & 0x0F);
+	}
+	if ((size_t) r != rec->length || memcmp(buf, rec->data, r)) {
+		fprintf(stderr, "replay: request %u differs from the trace\n",
+			index);
+		st->mismatches++;
+	} else if (has_swId(rec->data, r)) {
+		swId_map_store(st, rec->data, actual_swId);
+	}
+	return true;
+}
+
+static void replay_read(struct replay_state *st, struct trace_record *rec) {
+	u8 buf[TRACE_REPORT_MAX];
+
+	memcpy(buf, rec->data, rec->length);
+	if (is_hidpp(buf, rec->length)) {
+		if (buf[2] == SUB_ERROR_MSG || buf[2] == HIDPP20_ERROR_MSG) {
+			// both error types have the same layout
+			swId_map_apply(st, buf[1], buf[3], &buf[4]);
+		} else if (buf[2] < 0x80) {
+			swId_map_apply(st, buf[1], buf[2], &buf[3]);
+		}
+	}
+	if (send(st->fd, buf, rec->length, 0) < 0) {
+		perror("replay");
+	}
+}
+
+static void sleep_until_us(long long unsigned deadline) {
+	long long unsigned now = get_timestamp_us();
+
+	if (deadline > now) {
+		struct timespec ts;
+		ts.tv_sec = (deadline - now) / 1000000;
+		ts.tv_nsec = (deadline - now) % 1000000 * 1000;
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+	}
+}
+
+// Serves the recorded reports in order. Reports that were read from the
+// receiver are sent after the preceding request arrived, keeping the recorded
+// latency if realtime is set.
+static void replay_run(struct replay_state *st, struct trace_record *recs,
+	unsigned count, bool debug) {
+	long long unsigned base_actual = get_timestamp_us(), base_recorded = 0;
+	unsigned i, expected = 0;
+	u8 buf[TRACE_REPORT_MAX];
+
+	for (i = 0; i < count; i++) {
+		struct trace_record *rec = &recs[i];
+
+		if (rec->is_write) {
+			expected++;
+			if (!replay_write(st, rec, expected)) {
+				break;
+			}
+			base_actual = get_timestamp_us();
+			base_recorded = rec->time_us;
+		} else {
+			if (st->realtime) {
+				sleep_until_us(base_actual +
+					(rec->time_us - base_recorded));
+			}
+			replay_read(st, rec);
+		}
+	}
+	for (; i < count; i++) {
+		if (recs[i].is_write) {
+			expected++;
+		}
+	}
+
+	// drain requests that are not part of the trace until the client quits
+	while (read(st->fd, buf, sizeof buf) > 0) {
+		st->unexpected++;
+	}
+
+	if (debug || st->mismatches || st->unexpected || st->writes < expected) {
+		fprintf(stderr, "replay: %u of %u requests sent, %u differ, "
+			"%u not in trace\n", st->writes, expected,
+			st->mismatches, st->unexpected);
+	}
+}
+
+// Returns a receiver whose reports are served from a recorded trace. A child
+// process plays the part of the receiver at the other end of a socket pair
+// (SOCK_SEQPACKET keeps the report boundaries like hidraw does).
+struct lt_receiver *lt_receiver_replay(const char *path, bool realtime,
+	bool debug) {
+	struct trace_record *recs;
+	struct lt_receiver *rcv;
+	unsigned count;
+	int sv[2];
+	pid_t pid;
+
+	recs = load_trace(path, &count);
+	if (!recs) {
+		return NULL;
+	}
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+		perror("socketpair");
+		free(recs);
+		return NULL;
+	}
+
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(sv[0]);
+		close(sv[1]);
+		free(recs);
+		return NULL;
+	} else if (pid == 0) {
+		struct replay_state st;
+
+		close(sv[0]);
+		memset(&st, 0, sizeof st);
+		st.fd = sv[1];
+		st.realtime = realtime;
+		replay_run(&st, recs, count, debug);
+		_exit(st.mismatches || st.unexpected ? 1 : 0);
+	}
+
+	close(sv[1]);
+	free(recs);
+	rcv = lt_receiver_new(sv[0], path);
+	if (!rcv) {
+		close(sv[0]);
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return NULL;
+	}
+	rcv->child_pid = pid;
+	return rcv;
+}
+
+static size_t report_length(u8 report_id) {
+	switch (report_id) {
+	case SHORT_MESSAGE: return SHORT_MESSAGE_LEN;
+	case LONG_MESSAGE: return LONG_MESSAGE_LEN;
+	case 0x20: return 15; // DJ short
+	case 0x21: return 32; // DJ long
+	default: return 0;
+	}
+}
+
+static bool parse_hex(const char *str, unsigned *value) {
+	char *end;
+
+	*value = strtoul(str, &end, 16);
+	return *str && !*end;
+}
+
+// Parses a report decoded by hidraw.c ("report_id=10 device=FF type=81 ...")
+// back into bytes. Returns the report length or 0 if the line is no report.
+static size_t parse_decoded_report(char *line, u8 *data) {
+	size_t length = 0;
+	bool in_params = false;
+	unsigned func = 0;
+	char *tok, *saveptr;
+
+	for (tok = strtok_r(line, " \t", &saveptr); tok;
+		tok = strtok_r(NULL, " \t", &saveptr)) {
+		char *value = strchr(tok, '=');
+		unsigned n;
+
+		if (!value) {
+			if (in_params && strlen(tok) == 2 && parse_hex(tok, &n) &&
+				length < TRACE_REPORT_MAX) {
+				data[length++] = n;
+			}
+			continue;
+		}
+		*value++ = 0;
+		if (!parse_hex(value, &n) || length >= TRACE_REPORT_MAX) {
+			continue;
+		}
+		if (!strcmp(tok, "func")) {
+			func = n;
+		} else if (!strcmp(tok, "swId")) {
+			data[length++] = (func << 4) | n;
+		} else if (!strcmp(tok, "report_id") || !strcmp(tok, "device") ||
+			!strcmp(tok, "type") || !strcmp(tok, "feat") ||
+			!strcmp(tok, "SubID") || !strcmp(tok, "reg") ||
+			!strcmp(tok, "err")) {
+			data[length++] = n;
+		} else if (!strcmp(tok, "params")) {
+			data[length++] = n;
+			in_params = true;
+		}
+	}
+	if (length < 3) {
+		return 0;
+	}
+	// padding bytes are not shown in the decoded output
+	if (report_length(data[0]) > length) {
+		memset(data + length, 0, report_length(data[0]) - length);
+		length = report_length(data[0]);
+	}
+	return length;
+}
+
+static size_t parse_hex_report(const char *line, u8 *data) {
+	size_t length = 0;
+	unsigned n;
+	int off;
+
+	while (length < TRACE_REPORT_MAX && sscanf(line, "%2x%n", &n, &off) == 1) {
+		data[length++] = n;
+		line += off;
+	}
+	return length;
+}
+
+// removes terminal color sequences as emitted by read-dev-usbmon
+static void strip_colors(char *line) {
+	char *src = line, *dst = line;
+
+	while (*src) {
+		if (*src == '\033') {
+			while (*src && *src != 'm') {
+				src++;
+			}
+			if (*src) {
+				src++;
+			}
+		} else {
+			*dst++ = *src++;
+		}
+	}
+	*dst = 0;
+}
+
+// Reads the reports from the output of read-dev-usbmon (decoded, or with
+// HEX=1) and calls fn for each. Times are relative to the first report and
+// always 0 in HEX mode, which has no timestamps. Returns the number of
+// reports or -1 if the capture cannot be read.
+int lt_usbmon_read(const char *capture, lt_capture_callback fn, void *data) {
+	FILE *in;
+	char line[1024];
+	int hex_type = 0, count = 0;
+	bool have_time = false;
+	long long unsigned first_us = 0, last_us = 0;
+
+	in = fopen(capture, "r");
+	if (!in) {
+		perror(capture);
+		return -1;
+	}
+	while (fgets(line, sizeof line, in)) {
+		u8 report[TRACE_REPORT_MAX];
+		size_t length;
+		long long unsigned time_us = last_us;
+		int hh, mm, ss, ms;
+		bool is_write;
+		char *p;
+
+		strip_colors(line);
+		if (!strncmp(line, "Type=", 5)) {
+			hex_type = line[5];
+			continue;
+		}
+		if (hex_type) {
+			is_write = hex_type == 'S';
+			hex_type = 0;
+			length = parse_hex_report(line, report);
+		} else {
+			if (sscanf(line, "%d:%d:%d.%d", &hh, &mm, &ss, &ms) == 4) {
+				time_us = ((hh * 60 + mm) * 60 + ss) * 1000000ULL +
+					ms * 1000ULL;
+				if (have_time && time_us < last_us) {
+					// passed midnight
+					time_us += 24 * 3600 * 1000000ULL;
+				}
+			}
+			if ((p = strstr(line, "Send\t"))) {
+				is_write = true;
+			} else if ((p = strstr(line, "Recv\t"))) {
+				is_write = false;
+			} else {
+				continue;
+			}
+			length = parse_decoded_report(p + 5, report);
+		}
+		if (!length) {
+			continue;
+		}
+		if (!have_time) {
+			first_us = last_us = time_us;
+			have_time = true;
+		}
+		fn(is_write, report, length, time_us - first_us, data);
+		last_us = time_us;
+		count++;
+	}
+	if (ferror(in)) {
+		perror(capture);
+		count = -1;
+	}
+	fclose(in);
+	return count;
+}
+
+struct import_state {
+	FILE *out;
+	long long unsigned last_us;
+	bool failed;
+};
+
+static void import_report(bool is_write, const u8 *report, size_t length,
+	long long unsigned time_us, void *data) {
+	struct import_state *st = data;
+
+	if (!st->failed && !write_record(st->out, is_write, report, length,
+		time_us - st->last_us)) {
+		st->failed = true;
+	}
+	st->last_us = time_us;
+}
+
+// Converts the output of read-dev-usbmon into a trace. Sent reports become
+// requests, received reports responses. Captures in HEX mode carry no
+// timestamps, their reports are replayed immediately.
+bool lt_trace_import_usbmon(const char *capture, const char *path) {
+	struct import_state st;
+	int count;
+
+	memset(&st, 0, sizeof st);
+	st.out = fopen(path, "wb");
+	if (!st.out) {
+		perror(path);
+		return false;
+	}
+	st.failed = !write_header(st.out);
+	count = lt_usbmon_read(capture, import_report, &st);
+	if (fclose(st.out) || st.failed) {
+		perror(path);
+		return false;
+	}
+	if (!count) {
+		fprintf(stderr, "%s: no reports found\n", capture);
+	}
+	return count > 0;
+}
+
+// Calls fn for every report of a trace. Returns false if it cannot be read.
+bool lt_trace_read(const char *path, lt_capture_callback fn, void *data) {
+	struct trace_record *recs;
+	unsigned count, i;
+
+	recs = load_trace(path, &count);
+	if (!recs) {
+		return false;
+	}
+	for (i = 0; i < count; i++) {
+		fn(recs[i].is_write, recs[i].data, recs[i].length,
+			recs[i].time_us, data);
+	}
+	free(recs);
+	return true;
+}
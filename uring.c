@@ -0,0 +1,538 @@
+/*
+ * io_uring transport for libltunify.
+ *
+ * Copyright (C) 2013 Peter Wu <lekensteyn@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Several receivers share one ring. A read stays armed on every receiver:
+ * a multishot read (Linux 6.7+) that picks a buffer from a provided buffer
+ * group, or a single read that is re-armed when it completes on older
+ * kernels. Writes are copied into a buffer and queued. Writes made while
+ * completions are dispatched (from request callbacks) are submitted
+ * together with the re-armed reads and returned buffers in the single
+ * io_uring_enter call that also waits for the next completion. Other
+ * writes are submitted at once.
+ *
+ * No liburing is needed, the rings are set up with the raw system calls.
+ * lt_uring_new returns NULL if io_uring is not available, the receivers then
+ * keep using poll and read/write.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+#if defined(__linux__) && defined(__has_include)
+#	if __has_include(<linux/io_uring.h>)
+#		define HAVE_IO_URING
+#	endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef IORING_OP_READ_MULTISHOT
+#	define IORING_OP_READ_MULTISHOT	49 // Linux 6.7
+#endif
+
+#define URING_ENTRIES	64 // submission queue, completions get four times more
+#define URING_BUFFERS	256 // provided buffers for reads
+#define URING_WRITES	64 // write buffers
+#define URING_REPORT_MAX	32
+#define URING_BGID	0 // buffer group
+
+// user_data is the operation in the upper 32 bits and a slot or buffer below
+enum uring_op {
+	URING_READ = 1,
+	URING_WRITE,
+	URING_PROVIDE,
+	URING_CANCEL,
+};
+#define USER_DATA(op, n)	((uint64_t) (op) << 32 | (n))
+
+struct lt_uring {
+	int fd;
+	bool multishot;
+	bool dispatching; // defer submissions until the next wait
+	bool freeing;
+	unsigned to_submit;
+	struct lt_receiver *rcvs[URING_RECEIVERS_MAX];
+	bool armed[URING_RECEIVERS_MAX];
+	// mapped rings
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe *sqes;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned sq_entries;
+	// buffers
+	u8 reads[URING_BUFFERS][URING_REPORT_MAX];
+	u8 writes[URING_WRITES][URING_REPORT_MAX];
+	unsigned free_writes[URING_WRITES];
+	unsigned free_writes_count;
+};
+
+static int uring_enter(struct lt_uring *u, unsigned to_submit,
+	unsigned min_complete, int timeout) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int r;
+
+	memset(&arg, 0, sizeof arg);
+	if (min_complete && timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+	}
+	flags |= IORING_ENTER_EXT_ARG;
+	lt_io_stats.syscalls++;
+	r = syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete, flags,
+		&arg, sizeof arg);
+	if (r < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+		perror("io_uring_enter");
+	}
+	return r;
+}
+
+static void uring_flush(struct lt_uring *u, unsigned min_complete,
+	int timeout) {
+	int r;
+
+	if (!u->to_submit && !min_complete) {
+		return;
+	}
+	r = uring_enter(u, u->to_submit, min_complete, timeout);
+	if (r > 0) {
+		u->to_submit -= (unsigned) r < u->to_submit ? (unsigned) r :
+			u->to_submit;
+	}
+}
+
+// Returns a zeroed submission queue entry, submitting queued ones if full.
+static struct io_uring_sqe *uring_get_sqe(struct lt_uring *u) {
+	unsigned tail = *u->sq_tail, index;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+		u->sq_entries) {
+		uring_flush(u, 0, 0);
+	}
+	index = tail & *u->sq_mask;
+	sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof *sqe);
+	u->sq_array[index] = index;
+	return sqe;
+}
+
+static void uring_queue_sqe(struct lt_uring *u) {
+	__atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+	if (!u->dispatching) {
+		uring_flush(u, 0, 0);
+	}
+}
+
+static void uring_provide(struct lt_uring *u, unsigned bid, unsigned count) {
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = count;
+	sqe->addr = (uint64_t) (uintptr_t) u->reads[bid];
+	sqe->len = URING_REPORT_MAX;
+	sqe->off = bid;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = USER_DATA(URING_PROVIDE, bid);
+	uring_queue_sqe(u);
+}
+
+static void uring_arm(struct lt_uring *u, unsigned slot) {
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+	sqe->opcode = u->multishot ? IORING_OP_READ_MULTISHOT : IORING_OP_READ;
+	sqe->fd = u->rcvs[slot]->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->len = u->multishot ? 0 : URING_REPORT_MAX;
+	sqe->off = -1; // current position, hidraw is not seekable
+	sqe->user_data = USER_DATA(URING_READ, slot);
+	u->armed[slot] = true;
+	uring_queue_sqe(u);
+}
+
+// Checks with IORING_REGISTER_PROBE whether multishot reads are available.
+static bool uring_probe_multishot(int fd) {
+	struct io_uring_probe *probe;
+	size_t size = sizeof *probe + 256 * sizeof probe->ops[0];
+	bool supported = false;
+
+	probe = calloc(1, size);
+	if (!probe) {
+		return false;
+	}
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+		256) == 0 && probe->last_op >= IORING_OP_READ_MULTISHOT) {
+		supported = probe->ops[IORING_OP_READ_MULTISHOT].flags &
+			IO_URING_OP_SUPPORTED;
+	}
+	free(probe);
+	return supported;
+}
+
+static bool uring_map(struct lt_uring *u, struct io_uring_params *p) {
+	u->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP &&
+		u->cq_ring_size > u->sq_ring_size) {
+		u->sq_ring_size = u->cq_ring_size;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		return false;
+	}
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			return false;
+		}
+	}
+	u->sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+		IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		return false;
+	}
+	u->sq_head = (unsigned *) ((char *) u->sq_ring + p->sq_off.head);
+	u->sq_tail = (unsigned *) ((char *) u->sq_ring + p->sq_off.tail);
+	u->sq_mask = (unsigned *) ((char *) u->sq_ring + p->sq_off.ring_mask);
+	u->sq_array = (unsigned *) ((char *) u->sq_ring + p->sq_off.array);
+	u->cq_head = (unsigned *) ((char *) u->cq_ring + p->cq_off.head);
+	u->cq_tail = (unsigned *) ((char *) u->cq_ring + p->cq_off.tail);
+	u->cq_mask = (unsigned *) ((char *) u->cq_ring + p->cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ring +
+		p->cq_off.cqes);
+	u->sq_entries = p->sq_entries;
+	return true;
+}
+
+// Moves count receivers to a new io_uring. Returns NULL if io_uring is not
+// available, the receivers are not changed then.
+struct lt_uring *lt_uring_new(struct lt_receiver **rcvs, unsigned count) {
+	struct io_uring_params params;
+	struct lt_uring *u;
+	unsigned i;
+
+	if (count > URING_RECEIVERS_MAX) {
+		fprintf(stderr, "At most %u receivers can share an io_uring\n",
+			URING_RECEIVERS_MAX);
+		return NULL;
+	}
+	u = calloc(1, sizeof *u);
+	if (!u) {
+		perror("calloc");
+		return NULL;
+	}
+	memset(&params, 0, sizeof params);
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = 4 * URING_ENTRIES;
+	u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (u->fd < 0) {
+		free(u);
+		return NULL;
+	}
+	// NODROP keeps completions when the queue overflows, EXT_ARG is
+	// needed for timeouts
+	if (!(params.features & IORING_FEAT_NODROP) ||
+		!(params.features & IORING_FEAT_EXT_ARG) || !uring_map(u, &params)) {
+		lt_uring_free(u);
+		return NULL;
+	}
+	u->multishot = uring_probe_multishot(u->fd);
+	for (i = 0; i < URING_WRITES; i++) {
+		u->free_writes[u->free_writes_count++] = i;
+	}
+
+	u->dispatching = true;
+	uring_provide(u, 0, URING_BUFFERS);
+	for (i = 0; i < count; i++) {
+		u->rcvs[i] = rcvs[i];
+		rcvs[i]->uring = u;
+		rcvs[i]->uring_slot = i;
+		uring_arm(u, i);
+	}
+	u->dispatching = false;
+	uring_flush(u, 0, 0);
+	return u;
+}
+
+static void uring_complete_write(struct lt_uring *u, unsigned bid, int res) {
+	if (res < 0) {
+		errno = -res;
+		perror("write");
+	}
+	u->free_writes[u->free_writes_count++] = bid;
+}
+
+// Handles completions that are available. Returns the number of reports.
+static unsigned uring_reap(struct lt_uring *u) {
+	unsigned head, reports = 0;
+
+	while ((head = *u->cq_head) !=
+		__atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe cqe = u->cqes[head & *u->cq_mask];
+		unsigned op = cqe.user_data >> 32, n = (uint32_t) cqe.user_data;
+
+		// free the slot before callbacks can queue new entries
+		__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+		if (op == URING_WRITE) {
+			uring_complete_write(u, n, cqe.res);
+		} else if (op == URING_READ && n < URING_RECEIVERS_MAX) {
+			bool more = cqe.flags & IORING_CQE_F_MORE;
+
+			if (cqe.flags & IORING_CQE_F_BUFFER) {
+				unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+				// the receiver is NULL after lt_uring_detach
+				if (cqe.res > 0 && u->rcvs[n]) {
+					lt_process_report(u->rcvs[n], u->reads[bid],
+						cqe.res);
+					reports++;
+				}
+				uring_provide(u, bid, 1);
+			} else if (cqe.res < 0 && cqe.res != -ENOBUFS &&
+				cqe.res != -ECANCELED && cqe.res != -EINTR) {
+				errno = -cqe.res;
+				perror("read");
+			}
+			if (!more) {
+				u->armed[n] = false;
+				// a result of 0 is EOF, the receiver is gone
+				if (u->rcvs[n] && cqe.res != 0 &&
+					cqe.res != -ECANCELED) {
+					uring_arm(u, n);
+				}
+			}
+		}
+	}
+	return reports;
+}
+
+// Submits the queued entries and waits at most timeout milliseconds (no
+// limit if negative) for completions. Completions are processed and the
+// requests of all receivers on the ring are expired. Returns false if
+// waiting failed.
+bool lt_uring_process(struct lt_uring *u, int timeout) {
+	unsigned i;
+	int r;
+
+	if (*u->cq_head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		if (timeout != 0 || u->to_submit) {
+			r = uring_enter(u, u->to_submit, timeout != 0, timeout);
+			if (r < 0 && errno != ETIME && errno != EINTR &&
+				errno != EBUSY) {
+				return false;
+			}
+			if (r > 0) {
+				u->to_submit -= (unsigned) r < u->to_submit ?
+					(unsigned) r : u->to_submit;
+			}
+		}
+	}
+
+	u->dispatching = true;
+	while (uring_reap(u)) {
+		/* callbacks may have caused more reports */
+	}
+	for (i = 0; i < URING_RECEIVERS_MAX; i++) {
+		if (u->rcvs[i]) {
+			lt_expire_requests(u->rcvs[i]);
+		}
+	}
+	u->dispatching = false;
+	// writes from callbacks are submitted with the next wait, unless
+	// nobody may wait (an external event loop or no pending requests)
+	for (i = 0; i < URING_RECEIVERS_MAX && timeout; i++) {
+		if (u->rcvs[i] && u->rcvs[i]->queue) {
+			return true;
+		}
+	}
+	uring_flush(u, 0, 0);
+	return true;
+}
+
+// Queues a write, see the top of this file for when it is submitted.
+bool lt_uring_write(struct lt_receiver *rcv, const void *report,
+	size_t length) {
+	struct lt_uring *u = rcv->uring;
+	struct io_uring_sqe *sqe;
+	unsigned bid;
+
+	if (length > URING_REPORT_MAX) {
+		return false;
+	}
+	if (!u->free_writes_count) {
+		// all write buffers are in flight, completions cannot be
+		// reaped here as this may be called from a completion
+		ssize_t r;
+
+		lt_io_stats.syscalls++;
+		lt_io_stats.reports++;
+		r = write(rcv->fd, report, length);
+		if (r < 0) {
+			perror("write");
+		}
+		return r == (ssize_t) length;
+	}
+	bid = u->free_writes[--u->free_writes_count];
+	memcpy(u->writes[bid], report, length);
+	sqe = uring_get_sqe(u);
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = rcv->fd;
+	sqe->addr = (uint64_t) (uintptr_t) u->writes[bid];
+	sqe->len = length;
+	sqe->off = -1;
+	sqe->user_data = USER_DATA(URING_WRITE, bid);
+	lt_io_stats.reports++;
+	uring_queue_sqe(u);
+	return true;
+}
+
+// Cancels the read of a receiver that is about to be closed. The ring is
+// released with its last receiver.
+void lt_uring_detach(struct lt_receiver *rcv) {
+	struct lt_uring *u = rcv->uring;
+	unsigned slot = rcv->uring_slot, i;
+	struct io_uring_sqe *sqe;
+
+	if (!u) {
+		return;
+	}
+	u->rcvs[slot] = NULL;
+	rcv->uring = NULL;
+	if (u->armed[slot]) {
+		sqe = uring_get_sqe(u);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = USER_DATA(URING_READ, slot);
+		sqe->user_data = USER_DATA(URING_CANCEL, slot);
+		u->to_submit++;
+		__atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+		uring_flush(u, 0, 0);
+		// the receiver's file must be released before it is closed
+		while (u->armed[slot]) {
+			if (uring_enter(u, 0, 1, 1000) < 0 && errno == ETIME) {
+				break;
+			}
+			uring_reap(u);
+		}
+	}
+	for (i = 0; i < URING_RECEIVERS_MAX; i++) {
+		if (u->rcvs[i]) {
+			return;
+		}
+	}
+	if (!u->freeing) {
+		lt_uring_free(u);
+	}
+}
+
+int lt_uring_fd(struct lt_uring *u) {
+	return u->fd;
+}
+
+// Releases the ring, remaining receivers go back to poll and read/write.
+void lt_uring_free(struct lt_uring *u) {
+	unsigned i;
+
+	if (!u) {
+		return;
+	}
+	u->freeing = true;
+	for (i = 0; i < URING_RECEIVERS_MAX; i++) {
+		if (u->rcvs[i]) {
+			lt_uring_detach(u->rcvs[i]);
+		}
+	}
+	// writes that are still in flight
+	while (u->sqes && u->free_writes_count < URING_WRITES &&
+		uring_enter(u, u->to_submit, 1, 1000) >= 0) {
+		u->to_submit = 0;
+		uring_reap(u);
+	}
+	if (u->sqes) {
+		munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+	}
+	if (u->cq_ring && u->cq_ring != u->sq_ring) {
+		munmap(u->cq_ring, u->cq_ring_size);
+	}
+	if (u->sq_ring) {
+		munmap(u->sq_ring, u->sq_ring_size);
+	}
+	close(u->fd);
+	free(u);
+}
+
+#else /* !HAVE_IO_URING */
+
+struct lt_uring *lt_uring_new(struct lt_receiver **rcvs, unsigned count) {
+	(void) rcvs;
+	(void) count;
+	return NULL;
+}
+
+void lt_uring_free(struct lt_uring *u) {
+	(void) u;
+}
+
+bool lt_uring_process(struct lt_uring *u, int timeout) {
+	(void) u;
+	(void) timeout;
+	return false;
+}
+
+bool lt_uring_write(struct lt_receiver *rcv, const void *report,
+	size_t length) {
+	(void) rcv;
+	(void) report;
+	(void) length;
+	return false;
+}
+
+void lt_uring_detach(struct lt_receiver *rcv) {
+	(void) rcv;
+}
+
+int lt_uring_fd(struct lt_uring *u) {
+	(void) u;
+	return -1;
+}
+
+#endif /* !HAVE_IO_URING */